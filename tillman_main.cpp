@@ -237,9 +237,40 @@ bool write_image(string filename, const vector<vector<Pixel>> &image)
 //***************************************************************************************************//
 //                                DO NOT MODIFY THE SECTION ABOVE                                    //
 //***************************************************************************************************//
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+
+#include <cerrno>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 namespace cli_utils
 {
@@ -248,7 +279,9 @@ namespace cli_utils
  * Displays the main image processing menu to the console.
  *
  * Prints a formatted menu showing all available image processing options
- * (numbered 0-10) along with the currently selected image filename.
+ * (numbered 0-24, plus lettered utilities) along with the currently selected image filename.
+ * Processing options apply to the current version in the edit history, so steps can be chained,
+ * undone and redone without going back to the file.
  * The menu prompts the user to enter a selection or 'Q' to quit.
  *
  * @param current_filename The name of the currently selected image file,
@@ -270,6 +303,25 @@ void print_menu(const string &current_filename)
     cout << "9) Darken" << endl;
     cout << "10) Black, white, red, green, blue" << endl;
     cout << "11) Rotate by arbitrary angle" << endl;
+    cout << "12) Auto levels" << endl;
+    cout << "13) High contrast (automatic threshold)" << endl;
+    cout << "14) High contrast (adaptive threshold)" << endl;
+    cout << "15) Gaussian blur" << endl;
+    cout << "16) Sharpen (unsharp mask)" << endl;
+    cout << "17) Edge detection (Sobel)" << endl;
+    cout << "18) Box blur" << endl;
+    cout << "19) Saturation" << endl;
+    cout << "20) Hue shift" << endl;
+    cout << "21) Exposure" << endl;
+    cout << "22) Blend / watermark" << endl;
+    cout << "23) Thumbnail pyramid" << endl;
+    cout << "24) Compare with a reference image" << endl;
+    cout << "S) Image statistics" << endl;
+    cout << "P) Buffer pool statistics" << endl;
+    cout << "U) Undo" << endl;
+    cout << "R) Redo" << endl;
+    cout << "H) Edit history" << endl;
+    cout << "W) Write the current version to a file" << endl;
     cout << endl;
     cout << "Enter menu selection (Q to quit): ";
 }
@@ -482,668 +534,10546 @@ void print_exit_message()
     cout << "Quitting..." << endl;
 }
 
-} // namespace cli_utils
-
 /**
- * @namespace image_processing
- * @brief Contains functions for applying various image processing filters and effects.
- *
- * The image_processing namespace provides a collection of functions that take an input image
- * (represented as a 2D vector of Pixel structs) and return a new image with different operations applied.
- * These operations include effects such as vignetting, color filters, rotations, resizing, grayscale,
- * high contrast, lightening, darkening, and posterization to primary colors or black/white.
+ * Prints the command line usage for the non-interactive batch mode.
  *
- * Each function is self-contained, does not modify its input, and returns a new processed image.
+ * Lists the accepted options and the operation specs, which use the same numbering
+ * as the interactive menu.
  */
-namespace image_processing
+void print_usage()
 {
+    cout << "Usage: main                                      (interactive menu)" << endl;
+    cout << "       main [options] <input.bmp> <output.bmp> <op> [<op> ...]" << endl;
+    cout << "       main --stats <input.bmp>" << endl;
+    cout << "       main --pyramid <input.bmp> <output prefix> <levels>  (writes <prefix>_1.bmp, ...)" << endl;
+    cout << "       main --fan-out <input.bmp> <output prefix> <op> [<op> ...]  (one pass, one file per op)" << endl;
+    cout << "       main --serve <socket> [--workers <n>] [--memory-budget <mb>] [cache options]  (processing daemon)" << endl;
+    cout << "       main --request <socket> '<json request>'" << endl;
+    cout << "       main --self-test [--samples <dir>] [--runs <n>] [--timings <file.csv>]" << endl;
+    cout << "                        [--budget-scale <x>] [--fail-slow]  (golden-output and timing checks)" << endl;
+    cout << "       main --rotation-benchmark [--runs <n>] [<size> ...]  (bilinear vs three-shear 11)" << endl;
+    cout << "       main --profile [--copy] [--json <file>|-] <input> <output> <op> [<op> ...]" << endl;
+    cout << "                        (hardware counters per read, operation and write)" << endl;
+    cout << "       main --compare <image|dir> <reference|dir> [--heatmap <file|dir>] [--ssim-radius <n>]" << endl;
+    cout << "                        [--max-diff <n>] [--min-psnr <db>] [--min-ssim <x>]  (PSNR, SSIM, max diff)" << endl;
+    cout << endl;
+    cout << "Operations are applied left to right, written as <name>[:<param>,...]:" << endl;
+    cout << "  1            Vignette" << endl;
+    cout << "  2:<scale>    Clarendon (scale 0.0 - 1.0)" << endl;
+    cout << "  3[:<luma>]   Grayscale (luma: average, 601 or 709; default average)" << endl;
+    cout << "  4            Rotate 90 degrees" << endl;
+    cout << "  5:<turns>    Rotate multiple 90 degrees" << endl;
+    cout << "  6:<x>,<y>    Enlarge" << endl;
+    cout << "  7[:<luma>,<dither>] High contrast (luma as for 3; dither: none, bayer or fs)" << endl;
+    cout << "  8:<scale>    Lighten (scale 0.0 - 10.0)" << endl;
+    cout << "  9:<scale>    Darken (scale 0.0 - 10.0)" << endl;
+    cout << "  10[:<dither>] Black, white, red, green, blue (dither as for 7)" << endl;
+    cout << "  11:<degrees>[,<method>]" << endl;
+    cout << "               Rotate by arbitrary angle (1 - 359); bilinear (default) or shear" << endl;
+    cout << "  12[:<clip>]  Auto levels (clip percent per end, default 0.5)" << endl;
+    cout << "  13[:<method>] High contrast with automatic threshold (mean or otsu, default mean)" << endl;
+    cout << "  14:<radius>[,<offset>] High contrast with local adaptive threshold" << endl;
+    cout << "  15:<sigma>   Gaussian blur" << endl;
+    cout << "  16:<sigma>[,<amount>] Sharpen with an unsharp mask (amount default 1.0)" << endl;
+    cout << "  17           Edge detection (Sobel)" << endl;
+    cout << "  18:<radius>  Box blur" << endl;
+    cout << "  19:<factor>  Saturation (0 = gray, 1 = unchanged, up to 10)" << endl;
+    cout << "  20:<degrees> Hue rotation (-360 - 360)" << endl;
+    cout << "  21:<stops>   Exposure (-10 - 10 stops)" << endl;
+    cout << "  22:<layer.bmp>,<mode>[,<opacity>[,<x>,<y>]]" << endl;
+    cout << "               Composite a layer (32-bit BMPs keep their alpha); mode: normal, multiply," << endl;
+    cout << "               screen or overlay; opacity 0.0 - 1.0 (default 1.0); x, y place the layer" << endl;
+    cout << "Consecutive 19, 20 and 21 operations are applied together in a single pass." << endl;
+    cout << "Consecutive 4, 5, 6 and bilinear 11 operations are combined and resampled once." << endl;
+    cout << "Inputs may also be binary PPM or PGM files, and \"-\" reads the input from standard input" << endl;
+    cout << "or writes the output to standard output." << endl;
+    cout << "Any operation that keeps the image size can be limited to a rectangle by appending" << endl;
+    cout << "@<x>,<y>,<width>,<height> (e.g. 9:0.5@0,0,200,40 darkens only the top left corner)." << endl;
+    cout << "  gray[:<luma>] Grayscale; as the last operation, writes an 8-bit single-channel BMP" << endl;
+    cout << "  23:<levels>  Downscale by 2^levels (2x2 box filter per level)" << endl;
+    cout << "  crop@<x>,<y>,<w>,<h> Crop to a rectangle" << endl;
+    cout << "  stats        Print image statistics (image passes through unchanged)" << endl;
+    cout << "  compare:<reference>[,<heatmap>] Print max diff, PSNR and SSIM against a reference image" << endl;
+    cout << "               and optionally write a difference heatmap (image passes through unchanged)" << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "  --copy                 Run filters that support it on a copy instead of in place" << endl;
+    cout << "  --tiled                Evaluate the chain lazily in 64x64 tiles (bounded intermediates)" << endl;
+    cout << "  --memory-budget <mb>   Estimate peak memory first; stream the output or refuse over budget" << endl;
+    cout << "  --memory-report        Print the estimated and the actual peak memory" << endl;
+    cout << "  --raw-size <w>x<h>     Size of headerless RGB8 input (any input without a BMP/PPM/PGM signature)" << endl;
+    cout << "  --output-format <f>    Write bmp, ppm, pgm or raw whatever the extension (default: by extension;" << endl;
+    cout << "                         .ppm, .pnm, .pgm, .rgb, .raw, else BMP; ppm for \"-\")" << endl;
+    cout << "  --stats                Print the statistics of an image and exit" << endl;
+    cout << "  --cache-dir <dir>      Reuse results cached on disk (content-addressed, LRU)" << endl;
+    cout << "  --cache-mb <n>         Memory cache budget in MB (default 256)" << endl;
+    cout << "  --cache-disk-mb <n>    Disk cache budget in MB (default 1024)" << endl;
+    cout << "  --cache                Enable the cache with the default budgets" << endl;
+    cout << "  --help                 Show this message" << endl;
+    cout << endl;
+    cout << "Server requests are one JSON object per line, for example:" << endl;
+    cout << "  {\"input\": \"in.bmp\", \"ops\": [\"2:0.3\", \"3\"], \"output\": \"out.bmp\"}" << endl;
+    cout << "  {\"metrics\": true}      {\"shutdown\": true}" << endl;
+}
+
+} // namespace cli_utils
+
 /**
- * Applies a vignette effect to the input image.
- *
- * For each pixel, its color values are scaled down based on its distance from the
- * image center, creating a darkening effect toward the corners.
+ * @namespace buffer_pool
+ * @brief Recycles image row buffers between operations to avoid repeated heap allocations.
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @return A new image as a 2D vector of Pixels with the vignette effect applied.
+ * Every process_N produces a brand-new 2D vector of Pixels. When many images are processed
+ * back to back, most of those rows have the same width as rows that were just freed. The pool
+ * keeps released rows grouped by size class (width rounded up to a power of two) and hands them
+ * back out to the next image that needs rows of a compatible width.
  */
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+namespace buffer_pool
 {
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
-    double center_x = width / 2.0;
-    double center_y = height / 2.0;
 
-    for (int row = 0; row < height; ++row)
-    {
-        for (int col = 0; col < width; ++col)
-        {
-            const Pixel &p = image[row][col];
-            // Find the distance to the center
-            double dx = col - center_x;
-            double dy = row - center_y;
-            double distance = sqrt(dx * dx + dy * dy);
-            double scaling_factor = (height - distance) / height;
-            if (scaling_factor < 0)
-                scaling_factor = 0; // Avoid negative values for extreme corners
-
-            Pixel new_pixel;
-            new_pixel.red = static_cast<int>(p.red * scaling_factor);
-            new_pixel.green = static_cast<int>(p.green * scaling_factor);
-            new_pixel.blue = static_cast<int>(p.blue * scaling_factor);
-
-            // Clamp values just in case (0-255)
-            new_pixel.red = max(0, min(255, new_pixel.red));
-            new_pixel.green = max(0, min(255, new_pixel.green));
-            new_pixel.blue = max(0, min(255, new_pixel.blue));
-
-            new_image[row][col] = new_pixel;
-        }
-    }
-    return new_image;
-}
+/**
+ * Counters describing how effective the pool has been since the program started.
+ */
+struct PoolStats
+{
+    size_t rows_allocated = 0; // rows that had to be freshly allocated
+    size_t rows_reused = 0;    // rows served from the pool (allocations avoided)
+    size_t rows_released = 0;  // rows handed back to the pool and kept
+    size_t rows_discarded = 0; // rows handed back but dropped because the pool was full
+    size_t bytes_reused = 0;   // bytes of row storage served from the pool
+};
 
 /**
- * Applies the Clarendon filter effect to the input image.
+ * A thread-safe, size-classed pool of Pixel rows.
  *
- * This effect increases contrast in the image by applying a scaling factor to
- * the pixel color values depending on their brightness:
- *   - For bright pixels (average >= 170), RGB values are increased toward 255.
- *   - For dark pixels (average < 90), RGB values are reduced by the scaling factor.
- *   - For mid-tone pixels (average between 90 and 170), original values are preserved.
- *
- * The scaling_factor parameter controls the strength of the effect (e.g., typical values: 0.5, 0.7).
- *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param scaling_factor How strongly to adjust light and dark pixels; should be in [0, 1].
- * @return A new image as a 2D vector of Pixels with the Clarendon effect applied.
+ * Rows are stored with a capacity equal to their size class so that any row in a class can be
+ * resized to any width in that class without reallocating. The total number of bytes held by the
+ * pool is capped so a single huge image cannot pin memory forever.
  */
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+class ImageBufferPool
 {
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+  public:
+    /**
+     * @param max_pooled_bytes Upper bound on the row storage kept in the pool.
+     */
+    explicit ImageBufferPool(size_t max_pooled_bytes) : max_pooled_bytes_(max_pooled_bytes), pooled_bytes_(0)
+    {
+    }
 
-    for (int row = 0; row < height; ++row)
+    /**
+     * Returns a height x width image whose rows come from the pool when possible.
+     *
+     * The pixel contents of the returned image are unspecified; callers are expected to write
+     * every pixel (as all the process_N functions do).
+     *
+     * @param height Number of rows in the image.
+     * @param width  Number of columns in the image.
+     * @return An image of the requested dimensions.
+     */
+    vector<vector<Pixel>> acquire(int height, int width)
     {
-        for (int col = 0; col < width; ++col)
-        {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-            // average those values
-            double average_value = (red_value + green_value + blue_value) / 3.0;
+        vector<vector<Pixel>> image;
+        if (height <= 0 || width <= 0)
+            return image;
 
-            int newred, newgreen, newblue;
-            if (average_value >= 170)
-            {
-                newred = static_cast<int>(255 - (255 - red_value) * scaling_factor);
-                newgreen = static_cast<int>(255 - (255 - green_value) * scaling_factor);
-                newblue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
-            }
-            else if (average_value < 90)
+        image.resize(height);
+        size_t row_class = size_class(width);
+        int from_pool = 0;
+        {
+            lock_guard<mutex> lock(mutex_);
+            vector<vector<Pixel>> &free_rows = free_rows_[row_class];
+            while (from_pool < height && !free_rows.empty())
             {
-                newred = static_cast<int>(red_value * scaling_factor);
-                newgreen = static_cast<int>(green_value * scaling_factor);
-                newblue = static_cast<int>(blue_value * scaling_factor);
+                image[from_pool].swap(free_rows.back());
+                free_rows.pop_back();
+                ++from_pool;
             }
-            else
+            pooled_bytes_ -= from_pool * row_class * sizeof(Pixel);
+            stats_.rows_reused += from_pool;
+            stats_.rows_allocated += height - from_pool;
+            stats_.bytes_reused += from_pool * row_class * sizeof(Pixel);
+        }
+
+        for (int row = 0; row < height; ++row)
+        {
+            if (row >= from_pool)
+                image[row].reserve(row_class);
+            image[row].resize(width);
+        }
+        return image;
+    }
+
+    /**
+     * Hands the rows of an image back to the pool and leaves the image empty.
+     *
+     * Rows that would push the pool over its byte budget are simply freed.
+     *
+     * @param image The image to recycle; it is cleared by this call.
+     */
+    void release(vector<vector<Pixel>> &image)
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (size_t row = 0; row < image.size(); ++row)
+        {
+            size_t capacity = image[row].capacity();
+            // Only rows whose capacity is exactly a size class can serve every width in that class
+            if (capacity == 0 || capacity != size_class(capacity) ||
+                pooled_bytes_ + capacity * sizeof(Pixel) > max_pooled_bytes_)
             {
-                newred = red_value;
-                newgreen = green_value;
-                newblue = blue_value;
+                ++stats_.rows_discarded;
+                continue;
             }
-            // Clamp values for safety
-            newred = max(0, min(255, newred));
-            newgreen = max(0, min(255, newgreen));
-            newblue = max(0, min(255, newblue));
+            pooled_bytes_ += capacity * sizeof(Pixel);
+            free_rows_[capacity].push_back(vector<Pixel>());
+            free_rows_[capacity].back().swap(image[row]);
+            ++stats_.rows_released;
+        }
+        image.clear();
+    }
 
-            Pixel new_pixel;
-            new_pixel.red = newred;
-            new_pixel.green = newgreen;
-            new_pixel.blue = newblue;
+    /**
+     * @return A snapshot of the pool counters.
+     */
+    PoolStats stats() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return stats_;
+    }
 
-            new_image[row][col] = new_pixel;
-        }
+    /**
+     * @return The number of bytes of row storage currently held by the pool.
+     */
+    size_t pooled_bytes() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return pooled_bytes_;
     }
-    return new_image;
+
+  private:
+    /**
+     * Rounds a row width up to the next power of two (minimum 16 pixels).
+     */
+    static size_t size_class(size_t width)
+    {
+        size_t row_class = 16;
+        while (row_class < width)
+            row_class *= 2;
+        return row_class;
+    }
+
+    size_t max_pooled_bytes_;
+    size_t pooled_bytes_;
+    PoolStats stats_;
+    map<size_t, vector<vector<Pixel>>> free_rows_;
+    mutable mutex mutex_;
+};
+
+const size_t MAX_POOLED_BYTES = 256u * 1024u * 1024u; // Cap of the global pool
+
+/**
+ * @return The process-wide pool used by every process_N function (capped at 256 MB).
+ */
+ImageBufferPool &global_pool()
+{
+    static ImageBufferPool pool(MAX_POOLED_BYTES);
+    return pool;
 }
 
 /**
- * Applies a grayscale filter to the input image by averaging the red, green, and blue
- * color values of each pixel. The resulting image consists of pixels where all three
- * color channels are set to this average, producing a grayscale effect.
+ * Estimates the resident memory of an image: the pixels of every row plus its vector and
+ * allocator headers. Pooled rows reserve up to their size class, but the unused tail of a row is
+ * never written, so it costs address space rather than memory.
  *
- * @param image The input image represented as a 2D vector of Pixel structs.
- * @return A new 2D vector of Pixels where each pixel is the grayscale equivalent of the original.
+ * @param height Number of rows.
+ * @param width  Number of columns.
+ * @return The estimate in bytes.
  */
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image)
+size_t image_bytes(size_t height, size_t width)
 {
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
+    if (height == 0 || width == 0)
+        return 0;
+    return height * (width * sizeof(Pixel) + sizeof(vector<Pixel>) + 16) + sizeof(vector<vector<Pixel>>);
+}
 
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+/**
+ * Allocates an image from the global pool. See ImageBufferPool::acquire.
+ */
+vector<vector<Pixel>> acquire_image(int height, int width)
+{
+    return global_pool().acquire(height, width);
+}
 
-    for (int row = 0; row < height; ++row)
-    {
-        for (int col = 0; col < width; ++col)
-        {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
+/**
+ * Returns an image's rows to the global pool. See ImageBufferPool::release.
+ */
+void release_image(vector<vector<Pixel>> &image)
+{
+    global_pool().release(image);
+}
 
-            // Calculate gray value as the average of the RGB components
-            int gray_value = static_cast<int>((red_value + green_value + blue_value) / 3.0 + 0.5);
+/**
+ * Prints the global pool counters to standard output.
+ */
+void print_stats()
+{
+    PoolStats stats = global_pool().stats();
+    size_t requested = stats.rows_allocated + stats.rows_reused;
+    cout << "BUFFER POOL STATISTICS" << endl;
+    cout << "Rows requested:        " << requested << endl;
+    cout << "Rows allocated:        " << stats.rows_allocated << endl;
+    cout << "Allocations avoided:   " << stats.rows_reused << endl;
+    cout << "Bytes reused:          " << stats.bytes_reused << endl;
+    cout << "Rows returned to pool: " << stats.rows_released << endl;
+    cout << "Rows discarded:        " << stats.rows_discarded << endl;
+    cout << "Bytes currently pooled: " << global_pool().pooled_bytes() << endl;
+}
 
-            // Set new pixel to grayscale
-            Pixel new_pixel;
-            new_pixel.red = gray_value;
-            new_pixel.green = gray_value;
-            new_pixel.blue = gray_value;
+} // namespace buffer_pool
 
-            new_image[row][col] = new_pixel;
-        }
-    }
-    return new_image;
+/**
+ * @namespace parallel_utils
+ * @brief Splits row loops across the available hardware threads.
+ *
+ * The work is divided into contiguous chunks of rows so every thread streams through its own
+ * part of the image. Small inputs run on the calling thread to avoid paying thread start-up costs.
+ */
+namespace parallel_utils
+{
+
+/**
+ * @return A reference to the configured worker count (0 means "use the hardware concurrency").
+ */
+unsigned &configured_threads()
+{
+    static unsigned threads = 0;
+    return threads;
 }
 
 /**
- * Rotates the input image 90 degrees clockwise.
+ * Overrides the number of threads used by parallel_for (0 restores the hardware default).
  *
- * The output image will have its dimensions transposed: if the input
- * image is height x width, the output will be width x height. Each pixel in the
- * original image at position (row, col) is moved to position (col, height-1-row)
- * in the rotated image.
- *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @return A new image as a 2D vector of Pixels, rotated 90 degrees clockwise.
+ * @param threads The number of threads to use.
  */
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+void set_thread_count(unsigned threads)
 {
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
+    configured_threads() = threads;
+}
 
-    // Rotate 90 degrees clockwise: output is [width][height]
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
+/**
+ * @return The number of threads parallel_for will use (at least 1).
+ */
+unsigned thread_count()
+{
+    unsigned threads = configured_threads();
+    if (threads == 0)
+        threads = thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
 
-    for (int row = 0; row < height; ++row)
-    {
-        for (int col = 0; col < width; ++col)
-        {
-            // Place pixel at new position: (height-1-row, col)
-            new_image[col][height - 1 - row] = image[row][col];
-        }
-    }
-    return new_image;
+/**
+ * @return A per-thread flag that is set while the thread runs a parallel_for chunk. Nested
+ *         parallel_for calls (e.g. a filter run on one tile by a tile worker) stay on that thread
+ *         instead of starting threads of their own.
+ */
+bool &inside_worker()
+{
+    static thread_local bool inside = false;
+    return inside;
 }
+
 /**
- * Rotates the input image by a multiple of 90 degrees clockwise.
- *
- * The image is rotated 'number' times by 90 degrees. Negative numbers will rotate counterclockwise.
- * Each 90-degree rotation clockwise transposes the image and reverses the order of its rows.
- *
- * For example:
- *  - number = 1 rotates 90 degrees clockwise,
- *  - number = 2 rotates 180 degrees,
- *  - number = 3 rotates 270 degrees clockwise (or 90 degrees counterclockwise),
- *  - number = 4 (or any multiple of 4) results in the same orientation as the original image.
+ * Computes how many chunks parallel_for will split a range into.
+ * Callers use this to size per-chunk scratch buffers (e.g. per-thread histograms).
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param number The number of times to rotate the image by 90 degrees clockwise (can be negative).
- * @return A new image as a 2D vector of Pixels, rotated accordingly.
+ * @param count         The number of items in the range.
+ * @param min_per_chunk The smallest number of items worth giving to one thread.
+ * @return The chunk count, between 1 and thread_count().
  */
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int number)
+int chunk_count(int count, int min_per_chunk)
 {
-    // process_5: Rotate image clockwise by (number * 90) degrees
-    int angle = number * 90;
-    // Normalize number of 90-degree rotations (clockwise)
-    int rotations = ((number % 4) + 4) % 4; // Handles negative and >4
+    if (count <= 0 || inside_worker())
+        return 1;
+    int chunks = (count + min_per_chunk - 1) / max(1, min_per_chunk);
+    return max(1, min(chunks, static_cast<int>(thread_count())));
+}
 
-    vector<vector<Pixel>> rotated = image;
+/**
+ * Runs fn(chunk_begin, chunk_end, chunk_index) over [begin, end) split into chunk_count() pieces,
+ * one per thread. The calling thread processes the first chunk itself.
+ *
+ * @param begin         First index of the range.
+ * @param end           One past the last index of the range.
+ * @param fn            The work to run for each chunk.
+ * @param min_per_chunk The smallest number of items worth giving to one thread.
+ */
+template <typename Function> void parallel_for(int begin, int end, Function fn, int min_per_chunk = 16)
+{
+    int count = end - begin;
+    if (count <= 0)
+        return;
+    int chunks = chunk_count(count, min_per_chunk);
+    if (chunks == 1)
+    {
+        fn(begin, end, 0);
+        return;
+    }
 
-    for (int i = 0; i < rotations; ++i)
+    vector<thread> workers;
+    workers.reserve(chunks - 1);
+    for (int chunk = 1; chunk < chunks; ++chunk)
     {
-        int h = rotated.size();
-        int w = h ? rotated[0].size() : 0;
-        vector<vector<Pixel>> temp(w, vector<Pixel>(h));
-        for (int r = 0; r < h; ++r)
-        {
-            for (int c = 0; c < w; ++c)
-            {
-                temp[c][h - 1 - r] = rotated[r][c];
-            }
-        }
-        rotated = std::move(temp);
+        int chunk_begin = begin + static_cast<int>(static_cast<long long>(count) * chunk / chunks);
+        int chunk_end = begin + static_cast<int>(static_cast<long long>(count) * (chunk + 1) / chunks);
+        workers.push_back(thread([&fn, chunk_begin, chunk_end, chunk]() {
+            inside_worker() = true;
+            fn(chunk_begin, chunk_end, chunk);
+        }));
     }
-    return rotated;
+    inside_worker() = true;
+    fn(begin, begin + count / chunks, 0);
+    inside_worker() = false;
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
 }
 
+} // namespace parallel_utils
+
 /**
- * Enlarges the input image by the specified x and y scaling factors.
- *
- * Each pixel in the original image is multiplied into a block of size
- * x_scale by y_scale in the resulting image, producing a "pixelated"
- * enlargement effect.
+ * @namespace image_stats
+ * @brief Computes histograms and summary statistics of an image in a single pass.
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param x_scale The scale factor for the width (columns); must be > 0.
- * @param y_scale The scale factor for the height (rows); must be > 0.
- * @return A new image as a 2D vector of Pixels with enlarged dimensions, or an
- *         empty vector if the scale factors or input are invalid.
+ * The red, green, blue and luma histograms are gathered together while walking the pixels once.
+ * Each thread fills its own histograms for a band of rows and the bands are merged at the end,
+ * so there is no sharing between threads during the pass. The mean, min/max and percentiles are
+ * then derived exactly from the merged histograms.
  */
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+namespace image_stats
 {
-    int height = image.size();
-    if (height == 0 || x_scale <= 0 || y_scale <= 0)
-        return {};
 
-    int width = image[0].size();
-    int new_width = x_scale * width;
-    int new_height = y_scale * height;
+/**
+ * The channels tracked by the statistics engine.
+ * LUMA is the same (red + green + blue) / 3 brightness used by process_7.
+ */
+enum Channel
+{
+    RED = 0,
+    GREEN = 1,
+    BLUE = 2,
+    LUMA = 3,
+    CHANNEL_COUNT = 4
+};
 
-    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
+/**
+ * Histogram and summary values for one channel.
+ */
+struct ChannelStats
+{
+    unsigned long long histogram[256];
+    double mean;
+    int min;
+    int max;
 
-    // Iterate through the enlarged image
-    for (int row = 0; row < new_height; ++row)
+    /**
+     * Returns the smallest value at or below which the given percentage of pixels fall.
+     *
+     * @param percent The percentile to compute, in [0, 100].
+     * @return The channel value (0-255) for that percentile.
+     */
+    int percentile(double percent) const
     {
-        for (int col = 0; col < new_width; ++col)
+        unsigned long long total = 0;
+        for (int value = 0; value < 256; ++value)
+            total += histogram[value];
+        if (total == 0)
+            return 0;
+
+        double target = std::max(0.0, std::min(100.0, percent)) / 100.0 * total;
+        unsigned long long cumulative = 0;
+        for (int value = 0; value < 256; ++value)
         {
-            // Map each pixel in the enlarged image back to the original image
-            int orig_col = col / x_scale;
-            int orig_row = row / y_scale;
-            new_image[row][col] = image[orig_row][orig_col];
+            cumulative += histogram[value];
+            if (cumulative > 0 && cumulative >= target)
+                return value;
         }
+        return 255;
     }
-    return new_image;
-}
+};
 
 /**
- * Converts the input image to high contrast (pure black and white).
+ * Statistics for every channel of an image.
+ */
+struct ImageStats
+{
+    long long pixel_count;
+    ChannelStats channels[CHANNEL_COUNT];
+};
+
+/**
+ * Computes the brightness used by the statistics engine and the high contrast filters.
  *
- * This function processes each pixel and sets it to either black (0,0,0)
- * or white (255,255,255), depending on whether the average brightness of
- * the pixel is below or above a threshold (128).
+ * @param p The pixel.
+ * @return The integer average of the three channels.
+ */
+inline int luma_value(const Pixel &p)
+{
+    return (p.red + p.green + p.blue) / 3;
+}
+
+/**
+ * Computes the statistics of an image in one multithreaded pass.
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @return A new image as a 2D vector of Pixels in high contrast (black and white).
+ * @param image The image to analyze (row-major order).
+ * @return The per-channel histograms, mean, min/max; all zero for an empty image.
  */
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image)
+ImageStats compute_stats(const vector<vector<Pixel>> &image)
 {
-    // process_7: Convert image to high contrast (black and white only)
+    ImageStats stats;
+    stats.pixel_count = 0;
+    for (int channel = 0; channel < CHANNEL_COUNT; ++channel)
+    {
+        fill(stats.channels[channel].histogram, stats.channels[channel].histogram + 256, 0ULL);
+        stats.channels[channel].mean = 0.0;
+        stats.channels[channel].min = 0;
+        stats.channels[channel].max = 0;
+    }
+
     int height = image.size();
-    if (height == 0)
-        return {};
+    if (height == 0 || image[0].empty())
+        return stats;
     int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
 
-    for (int row = 0; row < height; ++row)
-    {
-        for (int col = 0; col < width; ++col)
-        {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
+    // One set of histograms per chunk of rows; merged once every thread is done
+    const int min_rows = 8;
+    int chunks = parallel_utils::chunk_count(height, min_rows);
+    vector<unsigned long long> partial(static_cast<size_t>(chunks) * CHANNEL_COUNT * 256, 0ULL);
 
-            int gray_value = (red_value + green_value + blue_value) / 3;
+    parallel_utils::parallel_for(
+        0, height,
+        [&](int row_begin, int row_end, int chunk) {
+            unsigned long long *red = &partial[static_cast<size_t>(chunk) * CHANNEL_COUNT * 256];
+            unsigned long long *green = red + 256;
+            unsigned long long *blue = green + 256;
+            unsigned long long *luma = blue + 256;
+            vector<unsigned char> channel_row[CHANNEL_COUNT];
+            for (int channel = 0; channel < CHANNEL_COUNT; ++channel)
+                channel_row[channel].resize(width);
 
-            int newred, newgreen, newblue;
-            if (gray_value >= 128)
-            {
-                newred = 255;
-                newgreen = 255;
-                newblue = 255;
-            }
-            else
+            for (int row = row_begin; row < row_end; ++row)
             {
-                newred = 0;
-                newgreen = 0;
-                newblue = 0;
+                const Pixel *pixels = image[row].data();
+                // Narrow the row to 8-bit channel values first; this loop has no dependencies
+                // between pixels so the compiler can vectorize it
+                for (int col = 0; col < width; ++col)
+                {
+                    int r = max(0, min(255, pixels[col].red));
+                    int g = max(0, min(255, pixels[col].green));
+                    int b = max(0, min(255, pixels[col].blue));
+                    channel_row[RED][col] = static_cast<unsigned char>(r);
+                    channel_row[GREEN][col] = static_cast<unsigned char>(g);
+                    channel_row[BLUE][col] = static_cast<unsigned char>(b);
+                    channel_row[LUMA][col] = static_cast<unsigned char>((r + g + b) / 3);
+                }
+                for (int col = 0; col < width; ++col)
+                {
+                    ++red[channel_row[RED][col]];
+                    ++green[channel_row[GREEN][col]];
+                    ++blue[channel_row[BLUE][col]];
+                    ++luma[channel_row[LUMA][col]];
+                }
             }
+        },
+        min_rows);
+
+    // Merge the per-chunk histograms and derive the summary values
+    stats.pixel_count = static_cast<long long>(height) * width;
+    for (int channel = 0; channel < CHANNEL_COUNT; ++channel)
+    {
+        ChannelStats &channel_stats = stats.channels[channel];
+        for (int chunk = 0; chunk < chunks; ++chunk)
+        {
+            const unsigned long long *histogram = &partial[(static_cast<size_t>(chunk) * CHANNEL_COUNT + channel) * 256];
+            for (int value = 0; value < 256; ++value)
+                channel_stats.histogram[value] += histogram[value];
+        }
 
-            new_image[row][col] = Pixel{newred, newgreen, newblue};
+        double sum = 0.0;
+        channel_stats.min = -1;
+        for (int value = 0; value < 256; ++value)
+        {
+            if (channel_stats.histogram[value] == 0)
+                continue;
+            if (channel_stats.min < 0)
+                channel_stats.min = value;
+            channel_stats.max = value;
+            sum += static_cast<double>(value) * channel_stats.histogram[value];
         }
+        channel_stats.mean = sum / stats.pixel_count;
     }
-    return new_image;
+    return stats;
 }
 
 /**
- * Lightens the input image by a given scaling factor.
+ * Prints a summary table of the statistics to standard output.
  *
- * For each pixel, this function increases the brightness by moving each color channel
- * (red, green, blue) toward 255 (white) according to the provided scaling_factor.
- * The scaling_factor should be >= 0, where:
- *   - Values closer to 1.0 result in a lighter image (values approach 255)
- *   - Values closer to 0.0 result in less lightening (values stay closer to original)
+ * @param stats The statistics to print.
+ */
+void print_stats(const ImageStats &stats)
+{
+    const char *names[CHANNEL_COUNT] = {"Red", "Green", "Blue", "Luma"};
+    cout << "IMAGE STATISTICS (" << stats.pixel_count << " pixels)" << endl;
+    cout << "Channel    Mean   Min   Max    P1    P5   P50   P95   P99" << endl;
+    for (int channel = 0; channel < CHANNEL_COUNT; ++channel)
+    {
+        const ChannelStats &channel_stats = stats.channels[channel];
+        cout << left << setw(7) << names[channel] << right << fixed << setprecision(2) << setw(8)
+             << channel_stats.mean << setw(6) << channel_stats.min << setw(6) << channel_stats.max;
+        const double percents[5] = {1, 5, 50, 95, 99};
+        for (int i = 0; i < 5; ++i)
+            cout << setw(6) << channel_stats.percentile(percents[i]);
+        cout << endl;
+    }
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+} // namespace image_stats
+
+/**
+ * @namespace luma
+ * @brief Brightness weightings for the grayscale filters and the 8-bit single-channel image format.
  *
- * The formula for each new color channel is:
- *   new_value = 255 - (255 - original_value) * scaling_factor
+ * Three weightings are supported: the plain channel average the original filters use, and the
+ * Rec.601 and Rec.709 luma coefficients, which weight green most heavily the way the eye does.
+ * All of them are evaluated in 16-bit fixed point (multiply, add, shift), so the per-pixel work
+ * is integer only and the row loops vectorize. The average uses 21846 / 65536 for 1/3, which is
+ * exact for every possible channel sum, so grayscale and high contrast output is unchanged.
  *
- * This operation moves pixel values toward white, producing a lighter image.
+ * A GrayImage holds one byte per pixel instead of a Pixel's three ints, and is written as an
+ * 8-bit palettized BMP, a third of the size of the 24-bit file.
+ */
+namespace luma
+{
+
+/**
+ * Selectable brightness weightings.
+ */
+enum Weighting
+{
+    LUMA_AVERAGE = 1, // (r + g + b) / 3
+    LUMA_REC601 = 2,  // 0.299 r + 0.587 g + 0.114 b (SD video, JPEG)
+    LUMA_REC709 = 3   // 0.2126 r + 0.7152 g + 0.0722 b (HD video, sRGB)
+};
+
+const int FIXED_SHIFT = 16; // Weights are scaled by 2^16
+
+/**
+ * Fixed-point channel weights plus the bias added before the shift.
+ */
+struct Weights
+{
+    int red;
+    int green;
+    int blue;
+    int bias;
+};
+
+/**
+ * Returns the fixed-point weights for a weighting.
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param scaling_factor Value >= 0 that controls how much to lighten each pixel.
- * @return A new image as a 2D vector of Pixels lightened by the scaling factor.
+ * @param weighting The weighting to use.
+ * @param rounded   Round to the nearest gray level (grayscale) instead of truncating (thresholds).
+ * @return The weights; each triple sums to 2^16 (2^16 + 2 for the average).
  */
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
+constexpr Weights fixed_point_weights(Weighting weighting, bool rounded = true)
+{
+    // A single expression so the weights can also be computed at compile time (see kernels).
+    // For the average, rounding (sum / 3.0 + 0.5) is the same as truncating (sum + 1) / 3.
+    return weighting == LUMA_REC601   ? Weights{19595, 38470, 7471, rounded ? 1 << (FIXED_SHIFT - 1) : 0}
+           : weighting == LUMA_REC709 ? Weights{13933, 46871, 4732, rounded ? 1 << (FIXED_SHIFT - 1) : 0}
+                                      : Weights{21846, 21846, 21846, rounded ? 21846 : 0};
+}
+
+/**
+ * Computes the gray level of a pixel.
+ *
+ * @param p       The pixel (channels in [0, 255]).
+ * @param weights Weights from fixed_point_weights().
+ * @return The gray level in [0, 255].
+ */
+inline int weighted_value(const Pixel &p, const Weights &weights)
+{
+    return (p.red * weights.red + p.green * weights.green + p.blue * weights.blue + weights.bias) >> FIXED_SHIFT;
+}
+
+/**
+ * Parses a weighting name as used by the batch operations.
+ *
+ * @param name      "average", "601" or "709".
+ * @param weighting Receives the weighting.
+ * @return True if the name is known, false otherwise.
+ */
+bool parse_weighting(const string &name, Weighting &weighting)
+{
+    if (name == "average")
+        weighting = LUMA_AVERAGE;
+    else if (name == "601")
+        weighting = LUMA_REC601;
+    else if (name == "709")
+        weighting = LUMA_REC709;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * A single-channel 8-bit image, stored row-major without padding.
+ */
+struct GrayImage
+{
+    int width = 0;
+    int height = 0;
+    vector<unsigned char> pixels;
+
+    bool empty() const
+    {
+        return pixels.empty();
+    }
+};
+
+/**
+ * Converts an image to a single-channel gray image (multithreaded by rows).
+ *
+ * @param image     The input image (row-major order).
+ * @param weighting How to weight the channels.
+ * @return The gray image; empty for an empty input.
+ */
+GrayImage to_gray(const vector<vector<Pixel>> &image, Weighting weighting)
+{
+    GrayImage gray;
+    if (image.empty())
+        return gray;
+    gray.height = image.size();
+    gray.width = image[0].size();
+    gray.pixels.resize(static_cast<size_t>(gray.width) * gray.height);
+
+    Weights weights = fixed_point_weights(weighting);
+    parallel_utils::parallel_for(0, gray.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const Pixel *source = image[row].data();
+            unsigned char *target = &gray.pixels[static_cast<size_t>(row) * gray.width];
+            for (int col = 0; col < gray.width; ++col)
+                target[col] = static_cast<unsigned char>(weighted_value(source[col], weights));
+        }
+    });
+    return gray;
+}
+
+/**
+ * Expands a gray image back to three equal channels.
+ *
+ * @param gray The gray image.
+ * @return The image as Pixels, drawn from the buffer pool.
+ */
+vector<vector<Pixel>> from_gray(const GrayImage &gray)
+{
+    if (gray.empty())
+        return {};
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(gray.height, gray.width);
+    for (int row = 0; row < gray.height; ++row)
+    {
+        const unsigned char *source = &gray.pixels[static_cast<size_t>(row) * gray.width];
+        for (int col = 0; col < gray.width; ++col)
+            image[row][col] = Pixel{source[col], source[col], source[col]};
+    }
+    return image;
+}
+
+/**
+ * Reports whether a file is an 8 bits per pixel BMP, which read_image() does not decode.
+ *
+ * @param filename The BMP file to check.
+ * @return True for an 8-bit BMP, false otherwise (including unreadable files).
+ */
+bool is_gray_bmp(const string &filename)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+        return false;
+    return get_int(stream, 0, 2) == ('B' | 'M' << 8) && get_int(stream, 28, 2) == 8;
+}
+
+/**
+ * Reads an 8-bit palettized BMP. Each palette entry is reduced to its channel average, so a
+ * gray palette (as written by write_gray_bmp()) round-trips exactly.
+ *
+ * @param filename The BMP file to read.
+ * @return The gray image, or an empty image if the file is not a valid uncompressed 8-bit BMP.
+ */
+GrayImage read_gray_bmp(const string &filename)
+{
+    GrayImage gray;
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+        return gray;
+
+    int file_size = get_int(stream, 2, 4);
+    int start = get_int(stream, 10, 4);
+    int dib_size = get_int(stream, 14, 4);
+    int width = get_int(stream, 18, 4);
+    int height = get_int(stream, 22, 4);
+    int bits_per_pixel = get_int(stream, 28, 2);
+    int compression = get_int(stream, 30, 4);
+    int colors = get_int(stream, 46, 4);
+    if (colors == 0)
+        colors = 256;
+
+    int stride = (width + 3) & ~3;
+    if (bits_per_pixel != 8 || compression != 0 || width <= 0 || height <= 0 || colors > 256 ||
+        file_size != start + stride * height)
+        return gray;
+
+    unsigned char palette[256] = {0};
+    unsigned char entry[4];
+    stream.seekg(14 + dib_size);
+    for (int i = 0; i < colors && stream.read(reinterpret_cast<char *>(entry), 4); ++i)
+        palette[i] = static_cast<unsigned char>((entry[0] + entry[1] + entry[2]) / 3);
+
+    gray.width = width;
+    gray.height = height;
+    gray.pixels.resize(static_cast<size_t>(width) * height);
+    vector<unsigned char> scanline(stride);
+    stream.seekg(start);
+    // BMP files store rows from bottom to top
+    for (int row = height - 1; row >= 0; --row)
+    {
+        if (!stream.read(reinterpret_cast<char *>(scanline.data()), stride))
+            return GrayImage();
+        unsigned char *target = &gray.pixels[static_cast<size_t>(row) * width];
+        for (int col = 0; col < width; ++col)
+            target[col] = palette[scanline[col]];
+    }
+    return gray;
+}
+
+/**
+ * Writes a gray image as an 8-bit BMP with an identity gray palette.
+ *
+ * @param filename The BMP file name to save the image to.
+ * @param gray     The image to save.
+ * @return True if successful and false otherwise.
+ */
+bool write_gray_bmp(const string &filename, const GrayImage &gray)
+{
+    if (gray.empty())
+        return false;
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    const int PALETTE_SIZE = 256 * 4;
+    int stride = (gray.width + 3) & ~3;
+    int array_bytes = stride * gray.height;
+    int start = BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE;
+
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE] = {0};
+    set_bytes(header, 0, 1, 'B');
+    set_bytes(header, 1, 1, 'M');
+    set_bytes(header, 2, 4, start + array_bytes); // Size of BMP file
+    set_bytes(header, 10, 4, start);              // Pixel array offset
+    set_bytes(header, 14, 4, DIB_HEADER_SIZE);    // DIB header size
+    set_bytes(header, 18, 4, gray.width);         // Width of bitmap in pixels
+    set_bytes(header, 22, 4, gray.height);        // Height of bitmap in pixels
+    set_bytes(header, 26, 2, 1);                  // Number of color planes
+    set_bytes(header, 28, 2, 8);                  // Number of bits per pixel
+    set_bytes(header, 34, 4, array_bytes);        // Size of raw bitmap data (including padding)
+    set_bytes(header, 38, 4, 2835);               // Print resolution of image (2835 pixels/meter)
+    set_bytes(header, 42, 4, 2835);               // Print resolution of image (2835 pixels/meter)
+    set_bytes(header, 46, 4, 256);                // Number of colors in palette
+    for (int i = 0; i < 256; ++i)
+        set_bytes(header, BMP_HEADER_SIZE + DIB_HEADER_SIZE + i * 4, 3, i * 0x010101); // Gray entry i
+
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+        return false;
+    stream.write(reinterpret_cast<char *>(header), sizeof(header));
+
+    vector<unsigned char> scanline(stride, 0);
+    for (int row = gray.height - 1; row >= 0; --row)
+    {
+        copy(gray.pixels.begin() + static_cast<size_t>(row) * gray.width,
+             gray.pixels.begin() + static_cast<size_t>(row + 1) * gray.width, scanline.begin());
+        stream.write(reinterpret_cast<char *>(scanline.data()), stride);
+    }
+    stream.close();
+    return !stream.fail();
+}
+
+} // namespace luma
+
+/**
+ * @namespace kernels
+ * @brief Compile-time specialized per-pixel kernels and the generic driver loops that run them.
+ *
+ * A kernel is a small function object mapping one Pixel to another. The fixed parameters of a
+ * filter (Clarendon's 90/170 brightness bands, posterize's 150/550 channel sums, the luma
+ * weighting) are template arguments, so each instantiation sees them as constants:
+ *   - Threshold decisions on a channel sum are looked up in 766-entry tables generated at
+ *     compile time (constexpr, through a C++11 index sequence), instead of compared at runtime.
+ *   - Fixed-point luma weights are constant-folded into the multiply-adds.
+ *   - Runtime parameters that only depend on a channel value (scaling factors) are turned into
+ *     256-entry tables once per call.
+ *
+ * The drivers own the loops: map() and map_in_place() walk a Pixel image with rows split across
+ * threads, and map_packed() walks a packed 8-bit buffer whose byte layout (RGB8, BGR8, BGRA8)
+ * is another template argument. Every point filter runs through the same two loops instead of
+ * its own hand-written double loop.
+ */
+namespace kernels
+{
+
+// C++11 has no std::index_sequence; this one is built by doubling so long sequences stay shallow
+template <size_t... I> struct index_sequence
+{
+    typedef index_sequence type;
+};
+
+template <typename First, typename Second> struct concat_sequence;
+template <size_t... First, size_t... Second>
+struct concat_sequence<index_sequence<First...>, index_sequence<Second...>>
+    : index_sequence<First..., (sizeof...(First) + Second)...>
+{
+};
+
+template <size_t N>
+struct make_index_sequence
+    : concat_sequence<typename make_index_sequence<N / 2>::type, typename make_index_sequence<N - N / 2>::type>::type
+{
+};
+template <> struct make_index_sequence<0> : index_sequence<>
+{
+};
+template <> struct make_index_sequence<1> : index_sequence<0>
+{
+};
+
+/**
+ * A fixed-size lookup table that can be built at compile time.
+ */
+template <size_t N> struct Lut
+{
+    unsigned char values[N];
+};
+
+template <typename Generator, size_t... I> constexpr Lut<sizeof...(I)> make_lut(index_sequence<I...>)
+{
+    return Lut<sizeof...(I)>{{Generator::value(I)...}};
+}
+
+const size_t SUM_COUNT = 3 * 255 + 1; // Possible values of red + green + blue
+
+/**
+ * Classifies a channel sum into bands: 0 below Low, 2 at or above High, 1 in between.
+ */
+template <int Low, int High> struct SumBands
+{
+    static constexpr unsigned char value(size_t sum)
+    {
+        return static_cast<int>(sum) < Low ? 0 : (static_cast<int>(sum) >= High ? 2 : 1);
+    }
+    static constexpr Lut<SUM_COUNT> table = make_lut<SumBands>(make_index_sequence<SUM_COUNT>());
+};
+template <int Low, int High> constexpr Lut<SUM_COUNT> SumBands<Low, High>::table;
+
+/**
+ * Builds a 256-entry table mapping a channel value through f, clamped to [0, 255].
+ */
+template <typename Function> void fill_channel_lut(unsigned char lut[256], Function f)
+{
+    for (int value = 0; value < 256; ++value)
+        lut[value] = static_cast<unsigned char>(max(0, min(255, f(value))));
+}
+
+inline int clamp_index(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/**
+ * Applies one 256-entry table to every channel.
+ */
+struct ToneLutKernel
+{
+    unsigned char lut[256];
+
+    Pixel operator()(const Pixel &p) const
+    {
+        return Pixel{lut[clamp_index(p.red)], lut[clamp_index(p.green)], lut[clamp_index(p.blue)]};
+    }
+};
+
+/**
+ * Applies a separate 256-entry table to each channel.
+ */
+struct ChannelLutKernel
+{
+    unsigned char lut[3][256];
+
+    Pixel operator()(const Pixel &p) const
+    {
+        return Pixel{lut[0][clamp_index(p.red)], lut[1][clamp_index(p.green)], lut[2][clamp_index(p.blue)]};
+    }
+};
+
+/**
+ * Clarendon: pixels whose average is at least BrightFrom move toward white, pixels whose
+ * average is below DarkBelow move toward black, the rest are unchanged.
+ */
+template <int DarkBelow, int BrightFrom> struct ClarendonKernel
+{
+    unsigned char dark[256];
+    unsigned char bright[256];
+
+    explicit ClarendonKernel(double scaling_factor)
+    {
+        fill_channel_lut(dark, [&](int value) { return static_cast<int>(value * scaling_factor); });
+        fill_channel_lut(bright, [&](int value) { return static_cast<int>(255 - (255 - value) * scaling_factor); });
+    }
+
+    Pixel operator()(const Pixel &p) const
+    {
+        // average >= BrightFrom is exactly sum >= 3 * BrightFrom, and likewise for DarkBelow
+        int red = clamp_index(p.red), green = clamp_index(p.green), blue = clamp_index(p.blue);
+        int band = SumBands<3 * DarkBelow, 3 * BrightFrom>::table.values[red + green + blue];
+        if (band == 1)
+            return p;
+        const unsigned char *lut = band == 0 ? dark : bright;
+        return Pixel{lut[red], lut[green], lut[blue]};
+    }
+};
+
+/**
+ * Grayscale with a compile-time luma weighting.
+ */
+template <luma::Weighting Weighting> struct GrayscaleKernel
+{
+    Pixel operator()(const Pixel &p) const
+    {
+        constexpr luma::Weights weights = luma::fixed_point_weights(Weighting, true);
+        int gray_value = luma::weighted_value(p, weights);
+        return Pixel{gray_value, gray_value, gray_value};
+    }
+};
+
+/**
+ * Black or white depending on a compile-time weighted (truncated) brightness.
+ */
+template <luma::Weighting Weighting> struct HighContrastKernel
+{
+    int threshold;
+
+    explicit HighContrastKernel(int threshold = 128) : threshold(threshold)
+    {
+    }
+
+    Pixel operator()(const Pixel &p) const
+    {
+        constexpr luma::Weights weights = luma::fixed_point_weights(Weighting, false);
+        int value = luma::weighted_value(p, weights) >= threshold ? 255 : 0;
+        return Pixel{value, value, value};
+    }
+};
+
+/**
+ * Posterize to black (sum at or below BlackAtOrBelow), white (sum at or above WhiteFrom), or the
+ * strongest primary color.
+ */
+template <int BlackAtOrBelow, int WhiteFrom> struct PrimaryColorKernel
+{
+    Pixel operator()(const Pixel &p) const
+    {
+        int band = SumBands<BlackAtOrBelow + 1, WhiteFrom>::table.values[clamp_index(p.red) + clamp_index(p.green) +
+                                                                          clamp_index(p.blue)];
+        if (band != 1)
+            return band == 0 ? Pixel{0, 0, 0} : Pixel{255, 255, 255};
+        int max_color = max(p.red, max(p.green, p.blue));
+        if (max_color == p.red)
+            return Pixel{255, 0, 0};
+        return max_color == p.green ? Pixel{0, 255, 0} : Pixel{0, 0, 255};
+    }
+};
+
+/**
+ * Byte layout of a packed 8-bit pixel: the offsets of red, green and blue and the pixel size.
+ */
+template <int Red, int Green, int Blue, int Bytes> struct PackedFormat
+{
+    static const int BYTES_PER_PIXEL = Bytes;
+
+    static Pixel load(const unsigned char *p)
+    {
+        return Pixel{p[Red], p[Green], p[Blue]};
+    }
+
+    static void store(unsigned char *p, const Pixel &value)
+    {
+        p[Red] = static_cast<unsigned char>(value.red);
+        p[Green] = static_cast<unsigned char>(value.green);
+        p[Blue] = static_cast<unsigned char>(value.blue);
+    }
+};
+
+typedef PackedFormat<0, 1, 2, 3> Rgb8;  // PPM and raw RGB
+typedef PackedFormat<2, 1, 0, 3> Bgr8;  // 24-bit BMP rows
+typedef PackedFormat<2, 1, 0, 4> Bgra8; // 32-bit BMP rows; alpha (offset 3) passes through
+
+/**
+ * Runs a kernel over every pixel of the image, overwriting it.
+ */
+template <typename Kernel> void map_in_place(vector<vector<Pixel>> &image, const Kernel &kernel)
+{
+    parallel_utils::parallel_for(0, static_cast<int>(image.size()), [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            Pixel *pixels = image[row].data();
+            int width = image[row].size();
+            for (int col = 0; col < width; ++col)
+                pixels[col] = kernel(pixels[col]);
+        }
+    });
+}
+
+/**
+ * Runs a kernel over every pixel of the input image.
+ *
+ * @return A new image drawn from the buffer pool.
+ */
+template <typename Kernel> vector<vector<Pixel>> map(const vector<vector<Pixel>> &image, const Kernel &kernel)
 {
-    // process_8: Lighten by a scaling factor
     int height = image.size();
     if (height == 0)
         return {};
     int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, width);
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const Pixel *source = image[row].data();
+            Pixel *target = new_image[row].data();
+            for (int col = 0; col < width; ++col)
+                target[col] = kernel(source[col]);
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Runs a kernel over a packed 8-bit buffer in place.
+ *
+ * @param data   First byte of the first row.
+ * @param width  Pixels per row.
+ * @param height Number of rows.
+ * @param stride Bytes from one row to the next (including any padding).
+ * @param kernel The kernel to run.
+ */
+template <typename Format, typename Kernel>
+void map_packed(unsigned char *data, int width, int height, size_t stride, const Kernel &kernel)
+{
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            unsigned char *pixel = data + row * stride;
+            for (int col = 0; col < width; ++col, pixel += Format::BYTES_PER_PIXEL)
+                Format::store(pixel, kernel(Format::load(pixel)));
+        }
+    });
+}
+
+} // namespace kernels
+
+/**
+ * @namespace bmp_io
+ * @brief Decodes and encodes 24/32-bit BMP files with threads working on separate row ranges.
+ *
+ * Every scanline of a BMP sits at a fixed offset (start + file_row * stride, counted from the
+ * bottom row), so the pixel array can be split into row ranges that are read and written
+ * independently. Each thread pread()s or pwrite()s its own range in blocks of about a megabyte
+ * and does the BGR swizzle and padding for it, so no stream or lock is shared between threads
+ * and the storage, not one core, limits throughput. write_rows() also serves the other file
+ * formats (see image_io), and falls back to ordered blocks when the output is a pipe.
+ *
+ * The results match read_image() and write_image() byte for byte; those stay the reference
+ * implementations.
+ */
+namespace bmp_io
+{
+
+const size_t BLOCK_BYTES = 1u << 20; // Bytes a thread reads or writes in one call
+
+/**
+ * The fields of a BMP header the pixel array layout depends on.
+ */
+struct Layout
+{
+    int width = 0;
+    int height = 0;
+    int bytes_per_pixel = 0;
+    long long start = 0;  // Offset of the pixel array
+    long long stride = 0; // Bytes per scanline including padding
+
+    /**
+     * @return The file offset of an image row (BMP files store rows from bottom to top).
+     */
+    long long row_offset(int row) const
+    {
+        return start + static_cast<long long>(height - 1 - row) * stride;
+    }
+};
+
+/**
+ * Reads exactly size bytes at offset, retrying short reads.
+ */
+bool read_fully(int fd, unsigned char *data, size_t size, long long offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pread(fd, data, size, offset);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+/**
+ * Writes exactly size bytes at offset, retrying short writes.
+ */
+bool write_fully(int fd, const unsigned char *data, size_t size, long long offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pwrite(fd, data, size, offset);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+/**
+ * Checks the header of an uncompressed 24 or 32-bit BMP with bottom-up rows, with the same file
+ * size check as read_image().
+ *
+ * @param header    The first 54 bytes of the file.
+ * @param file_size The actual size of the file, or -1 to trust the size field.
+ * @param layout    Receives the pixel array layout.
+ * @return True if the file has a pixel array this namespace can decode.
+ */
+bool parse_layout(const unsigned char header[54], long long file_size, Layout &layout)
+{
+    if (header[0] != 'B' || header[1] != 'M')
+        return false;
+    auto field = [&](int offset, int bytes) {
+        long long value = 0;
+        for (int i = bytes - 1; i >= 0; --i)
+            value = value * 256 + header[offset + i];
+        return value;
+    };
+    long long width = field(18, 4), height = field(22, 4);
+    int bits_per_pixel = static_cast<int>(field(28, 2));
+    if ((bits_per_pixel != 24 && bits_per_pixel != 32) || field(30, 4) != 0 || width <= 0 || height <= 0 ||
+        width > numeric_limits<int>::max() / 4 || height > numeric_limits<int>::max())
+        return false;
+    layout.width = static_cast<int>(width);
+    layout.height = static_cast<int>(height);
+    layout.bytes_per_pixel = bits_per_pixel / 8;
+    layout.start = field(10, 4);
+    layout.stride = (width * layout.bytes_per_pixel + 3) & ~3LL;
+    long long expected = layout.start + layout.stride * height;
+    return field(2, 4) == expected && (file_size < 0 || file_size >= expected);
+}
+
+/**
+ * Reads and checks the header of a BMP file (see parse_layout()).
+ */
+bool read_layout(int fd, Layout &layout)
+{
+    unsigned char header[54];
+    return read_fully(fd, header, sizeof(header), 0) && parse_layout(header, -1, layout);
+}
+
+/**
+ * Decodes the rows [row_begin, row_end) of the image from the file, a block at a time. The rows
+ * of a range are contiguous in the file, bottom row first.
+ */
+template <typename Format>
+bool decode_rows(int fd, const Layout &layout, vector<vector<Pixel>> &image, int row_begin, int row_end)
+{
+    int rows_per_block = max(1, static_cast<int>(BLOCK_BYTES / layout.stride));
+    vector<unsigned char> block(static_cast<size_t>(min(rows_per_block, row_end - row_begin)) * layout.stride);
+    for (int block_end = row_end; block_end > row_begin; block_end -= rows_per_block)
+    {
+        int block_begin = max(row_begin, block_end - rows_per_block);
+        int rows = block_end - block_begin;
+        if (!read_fully(fd, block.data(), static_cast<size_t>(rows) * layout.stride, layout.row_offset(block_end - 1)))
+            return false;
+        for (int i = 0; i < rows; ++i)
+        {
+            const unsigned char *source = &block[static_cast<size_t>(rows - 1 - i) * layout.stride];
+            Pixel *target = image[block_begin + i].data();
+            for (int col = 0; col < layout.width; ++col, source += Format::BYTES_PER_PIXEL)
+                target[col] = Format::load(source);
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a 24 or 32-bit BMP, splitting the rows across threads.
+ *
+ * @param filename The BMP file to read.
+ * @return The image (from the buffer pool), or an empty image if the file could not be read.
+ */
+vector<vector<Pixel>> read(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return {};
+    Layout layout;
+    if (!read_layout(fd, layout))
+    {
+        close(fd);
+        return {};
+    }
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(layout.height, layout.width);
+    int min_rows = max(1, static_cast<int>(BLOCK_BYTES / layout.stride));
+    atomic<bool> ok(true);
+    parallel_utils::parallel_for(
+        0, layout.height,
+        [&](int row_begin, int row_end, int) {
+            bool decoded = layout.bytes_per_pixel == 3
+                               ? decode_rows<kernels::Bgr8>(fd, layout, image, row_begin, row_end)
+                               : decode_rows<kernels::Bgra8>(fd, layout, image, row_begin, row_end);
+            if (!decoded)
+                ok = false;
+        },
+        min_rows);
+    close(fd);
+    if (!ok)
+        buffer_pool::release_image(image);
+    return image;
+}
+
+/**
+ * Builds the headers of an uncompressed bottom-up BMP, plus the gray palette for 8-bit files.
+ *
+ * @param width  Image width in pixels.
+ * @param height Image height in pixels.
+ * @param gray   Whether the file holds 8-bit gray levels instead of 24-bit colors.
+ * @return The bytes before the pixel array.
+ */
+vector<unsigned char> make_header(int width, int height, bool gray)
+{
+    int start = 54 + (gray ? 1024 : 0);
+    long long stride = gray ? (width + 3LL) & ~3LL : (width * 3LL + 3) & ~3LL;
+    long long array_bytes = stride * height;
+    vector<unsigned char> header(start, 0);
+    set_bytes(header.data(), 0, 1, 'B');
+    set_bytes(header.data(), 1, 1, 'M');
+    set_bytes(header.data(), 2, 4, static_cast<int>(start + array_bytes)); // Size of BMP file
+    set_bytes(header.data(), 10, 4, start);                                // Pixel array offset
+    set_bytes(header.data(), 14, 4, 40);                                   // DIB header size
+    set_bytes(header.data(), 18, 4, width);                                // Width of bitmap in pixels
+    set_bytes(header.data(), 22, 4, height);                               // Height of bitmap in pixels
+    set_bytes(header.data(), 26, 2, 1);                                    // Number of color planes
+    set_bytes(header.data(), 28, 2, gray ? 8 : 24);                        // Number of bits per pixel
+    set_bytes(header.data(), 34, 4, static_cast<int>(array_bytes)); // Size of raw bitmap data (including padding)
+    set_bytes(header.data(), 38, 4, 2835);                          // Print resolution of image (2835 pixels/meter)
+    set_bytes(header.data(), 42, 4, 2835);                          // Print resolution of image (2835 pixels/meter)
+    set_bytes(header.data(), 46, 4, gray ? 256 : 0);                // Number of colors in palette
+    for (int i = 0; gray && i < 256; ++i)
+        set_bytes(header.data(), 54 + i * 4, 3, i * 0x010101); // Gray entry i
+    return header;
+}
+
+/**
+ * Writes exactly size bytes at the current position of a pipe or file, retrying short writes.
+ */
+bool append_fully(int fd, const unsigned char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = ::write(fd, data, size);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+/**
+ * Writes a file made of a header and equally sized rows, encoding the rows on all threads.
+ *
+ * A regular file is sized up front and every thread pwrite()s its own rows at their offsets,
+ * counted from the current file offset (standard output may already hold other data). A pipe, or
+ * a file opened for appending, can only be appended to, so there the rows go out in blocks: each
+ * block is encoded by all threads, then written in file order.
+ *
+ * @param fd        The open output.
+ * @param header    The bytes before the first row.
+ * @param stride    Bytes per row in the file; the encoder may leave trailing padding untouched,
+ *                  it is zero.
+ * @param height    Number of rows.
+ * @param bottom_up Whether the file stores the last image row first (BMP).
+ * @param encode    encode(row, target) writes image row `row` into one file row.
+ * @return True if everything was written.
+ */
+bool write_rows(int fd, const vector<unsigned char> &header, long long stride, int height, bool bottom_up,
+                const function<void(int, unsigned char *)> &encode)
+{
+    struct stat info;
+    int flags = fcntl(fd, F_GETFL);
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    bool positioned = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && flags >= 0 && !(flags & O_APPEND) && base >= 0;
+    long long total = static_cast<long long>(header.size()) + stride * height;
+    int rows_per_block = max(1, static_cast<int>(BLOCK_BYTES / max(1LL, stride)));
+    if (!positioned)
+    {
+        if (!append_fully(fd, header.data(), header.size()))
+            return false;
+        int block_rows = rows_per_block * static_cast<int>(parallel_utils::thread_count());
+        vector<unsigned char> block;
+        for (int file_begin = 0; file_begin < height; file_begin += block_rows)
+        {
+            int rows = min(block_rows, height - file_begin);
+            block.assign(static_cast<size_t>(rows) * stride, 0);
+            parallel_utils::parallel_for(0, rows, [&](int begin, int end, int) {
+                for (int i = begin; i < end; ++i)
+                {
+                    int file_row = file_begin + i;
+                    encode(bottom_up ? height - 1 - file_row : file_row, &block[static_cast<size_t>(i) * stride]);
+                }
+            });
+            if (!append_fully(fd, block.data(), block.size()))
+                return false;
+        }
+        return true;
+    }
+
+    // Only ever grow the file; like a sequential write, anything past the image is left alone
+    if ((info.st_size < base + total && ftruncate(fd, base + total) != 0) ||
+        !write_fully(fd, header.data(), header.size(), base))
+        return false;
+    atomic<bool> ok(true);
+    parallel_utils::parallel_for(
+        0, height,
+        [&](int file_begin, int file_end, int) {
+            // Zero-filled, so the padding at the end of every row stays zero
+            vector<unsigned char> block(static_cast<size_t>(min(rows_per_block, file_end - file_begin)) * stride, 0);
+            for (int block_begin = file_begin; block_begin < file_end && ok; block_begin += rows_per_block)
+            {
+                int rows = min(rows_per_block, file_end - block_begin);
+                for (int i = 0; i < rows; ++i)
+                {
+                    int file_row = block_begin + i;
+                    encode(bottom_up ? height - 1 - file_row : file_row, &block[static_cast<size_t>(i) * stride]);
+                }
+                if (!write_fully(fd, block.data(), static_cast<size_t>(rows) * stride,
+                                 base + static_cast<long long>(header.size()) + block_begin * stride))
+                    ok = false;
+            }
+        },
+        rows_per_block);
+    // pwrite() leaves the offset alone; move it past the image as a sequential write would
+    return ok && lseek(fd, base + total, SEEK_SET) == base + total;
+}
+
+/**
+ * Writes an image as a 24-bit BMP, splitting the rows across threads (see write_rows()).
+ *
+ * @param filename The BMP file name to save the image to.
+ * @param image    The image to save.
+ * @return True if successful and false otherwise.
+ */
+bool write(const string &filename, const vector<vector<Pixel>> &image)
+{
+    if (image.empty() || image[0].empty())
+        return false;
+    int width = image[0].size(), height = image.size();
+    long long stride = (width * 3LL + 3) & ~3LL;
+    if (54 + stride * height > 0xFFFFFFFFLL)
+        return false; // The file size field is 32 bits
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write_rows(fd, make_header(width, height, false), stride, height, true,
+                         [&](int row, unsigned char *target) {
+                             const Pixel *source = image[row].data();
+                             for (int col = 0; col < width; ++col, target += 3)
+                                 kernels::Bgr8::store(target, source[col]);
+                         });
+    return close(fd) == 0 && ok;
+}
+
+} // namespace bmp_io
+
+/**
+ * @namespace image_io
+ * @brief Reads and writes images as BMP, binary PPM (P6), binary PGM (P5) or headerless RGB8.
+ *
+ * The format of an input is taken from its first bytes ("BM", "P6", "P5"), and raw RGB8 (with
+ * its size given by --raw-size) is assumed when there is no signature. Outputs are written in
+ * the format named by --output-format, or else the one their extension names (.ppm, .pnm,
+ * .pgm, .rgb, .raw, anything else BMP).
+ *
+ * BMP files keep the pread path of bmp_io. The other formats are memory-mapped and their rows
+ * decoded in parallel straight from the mapping; every format is written through
+ * bmp_io::write_rows(). A file name of "-" reads the whole input from standard input, or writes
+ * the output to standard output (PPM unless --output-format says otherwise), so the tool can sit
+ * in a pipe without temporary files.
+ */
+namespace image_io
+{
+
+enum FileFormat
+{
+    FORMAT_BMP = 1,
+    FORMAT_PPM = 2,
+    FORMAT_PGM = 3,
+    FORMAT_RAW = 4
+};
+
+/**
+ * Format choices from the command line, shared by every read and write of a run.
+ */
+struct Settings
+{
+    int raw_width = 0;  // Size of headerless RGB8 input (--raw-size)
+    int raw_height = 0;
+    bool has_output_format = false; // Whether --output-format overrides the extension
+    FileFormat output_format = FORMAT_BMP;
+};
+
+/**
+ * @return The settings of this run.
+ */
+Settings &settings()
+{
+    static Settings current;
+    return current;
+}
+
+/**
+ * Parses a format name as used by --output-format.
+ *
+ * @param name   "bmp", "ppm", "pgm" or "raw".
+ * @param format Receives the format.
+ * @return True if the name is known, false otherwise.
+ */
+bool parse_format(const string &name, FileFormat &format)
+{
+    if (name == "bmp")
+        format = FORMAT_BMP;
+    else if (name == "ppm")
+        format = FORMAT_PPM;
+    else if (name == "pgm")
+        format = FORMAT_PGM;
+    else if (name == "raw" || name == "rgb")
+        format = FORMAT_RAW;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Parses "<width>x<height>" as used by --raw-size.
+ *
+ * @return True if both numbers are positive and their product fits an image.
+ */
+bool parse_size(const string &text, int &width, int &height)
+{
+    long long w = 0, h = 0;
+    char separator = 0, extra = 0;
+    if (sscanf(text.c_str(), "%lld%c%lld%c", &w, &separator, &h, &extra) != 3 || separator != 'x' || w <= 0 ||
+        h <= 0 || w * h > numeric_limits<int>::max())
+        return false;
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    return true;
+}
+
+/**
+ * @return The format a file name's extension names, or fallback if it names none.
+ */
+FileFormat format_from_extension(const string &filename, FileFormat fallback)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == string::npos || filename.find('/', dot) != string::npos)
+        return fallback;
+    string extension = filename.substr(dot + 1);
+    for (size_t i = 0; i < extension.size(); ++i)
+        extension[i] = static_cast<char>(tolower(static_cast<unsigned char>(extension[i])));
+    FileFormat format = fallback;
+    if (extension == "pnm")
+        return FORMAT_PPM;
+    return parse_format(extension, format) ? format : fallback;
+}
+
+/**
+ * @return The format an output is written in.
+ */
+FileFormat output_format(const string &filename)
+{
+    if (settings().has_output_format)
+        return settings().output_format;
+    return filename == "-" ? FORMAT_PPM : format_from_extension(filename, FORMAT_BMP);
+}
+
+/**
+ * The whole content of an input: a read-only mapping of a file, or the bytes read from
+ * standard input.
+ */
+class InputBytes
+{
+  public:
+    explicit InputBytes(const string &filename)
+    {
+        if (filename == "-")
+        {
+            unsigned char chunk[1 << 16];
+            ssize_t count;
+            while ((count = ::read(0, chunk, sizeof(chunk))) != 0)
+            {
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0)
+                    return;
+                buffer_.insert(buffer_.end(), chunk, chunk + count);
+            }
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+            ok_ = true;
+            return;
+        }
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        size_ = info.st_size;
+        if (size_ > 0)
+        {
+            void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                mapping_ = mapping;
+                data_ = static_cast<const unsigned char *>(mapping);
+                madvise(mapping, size_, MADV_WILLNEED);
+            }
+        }
+        close(fd);
+        ok_ = size_ == 0 || mapping_ != nullptr;
+    }
+
+    ~InputBytes()
+    {
+        if (mapping_)
+            munmap(mapping_, size_);
+    }
+
+    InputBytes(const InputBytes &) = delete;
+    InputBytes &operator=(const InputBytes &) = delete;
+
+    bool ok() const
+    {
+        return ok_;
+    }
+    const unsigned char *data() const
+    {
+        return data_;
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+
+  private:
+    vector<unsigned char> buffer_;
+    void *mapping_ = nullptr;
+    const unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+    bool ok_ = false;
+};
+
+/**
+ * Size and sample layout of a PPM or PGM file.
+ */
+struct NetpbmHeader
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0; // 3 for PPM, 1 for PGM
+    int maxval = 0;
+    size_t offset = 0; // Where the samples start
+};
+
+/**
+ * Parses the header of a binary PPM (P6) or PGM (P5): the magic number, then width, height and
+ * maximum sample value separated by whitespace and "#" comments, then one whitespace byte.
+ *
+ * @param data   The file content.
+ * @param size   Its size in bytes.
+ * @param header Receives the fields.
+ * @param error  Receives a message if the header is invalid or unsupported.
+ * @return True if the header is valid and the file holds every sample.
+ */
+bool parse_netpbm_header(const unsigned char *data, size_t size, NetpbmHeader &header, string &error)
+{
+    if (size < 2 || data[0] != 'P' || (data[1] != '6' && data[1] != '5'))
+    {
+        error = "Not a binary PPM or PGM file";
+        return false;
+    }
+    header.channels = data[1] == '6' ? 3 : 1;
+    size_t pos = 2;
+    long long fields[3];
+    for (int field = 0; field < 3; ++field)
+    {
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#'))
+        {
+            if (data[pos] == '#')
+                while (pos < size && data[pos] != '\n')
+                    ++pos;
+            else
+                ++pos;
+        }
+        if (pos >= size || !isdigit(data[pos]))
+        {
+            error = "Malformed PPM/PGM header";
+            return false;
+        }
+        fields[field] = 0;
+        while (pos < size && isdigit(data[pos]) && fields[field] <= numeric_limits<int>::max())
+            fields[field] = fields[field] * 10 + (data[pos++] - '0');
+    }
+    if (pos >= size || !isspace(data[pos]) || fields[0] <= 0 || fields[1] <= 0 ||
+        fields[0] * fields[1] > numeric_limits<int>::max())
+    {
+        error = "Malformed PPM/PGM header";
+        return false;
+    }
+    if (fields[2] < 1 || fields[2] > 255)
+    {
+        error = "Only 8-bit PPM/PGM samples (maximum value 1 - 255) are supported";
+        return false;
+    }
+    header.width = static_cast<int>(fields[0]);
+    header.height = static_cast<int>(fields[1]);
+    header.maxval = static_cast<int>(fields[2]);
+    header.offset = pos + 1;
+    if (size - header.offset < static_cast<size_t>(header.width) * header.height * header.channels)
+    {
+        error = "PPM/PGM file is shorter than its header says";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Decodes rows of 8-bit samples (RGB or gray) into an image, rows split across threads.
+ *
+ * @param samples  The first sample of the first row.
+ * @param channels 3 for RGB, 1 for gray.
+ * @param maxval   The sample value that means full intensity (scaled to 255).
+ * @param width    Image width.
+ * @param height   Image height.
+ * @return The image, drawn from the buffer pool.
+ */
+vector<vector<Pixel>> decode_samples(const unsigned char *samples, int channels, int maxval, int width, int height)
+{
+    unsigned char scale[256];
+    for (int value = 0; value < 256; ++value)
+        scale[value] = static_cast<unsigned char>(min(255, (value * 255 + maxval / 2) / maxval));
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(height, width);
+    size_t row_bytes = static_cast<size_t>(width) * channels;
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const unsigned char *source = samples + row * row_bytes;
+            Pixel *target = image[row].data();
+            for (int col = 0; col < width; ++col)
+            {
+                if (channels == 1)
+                {
+                    int value = scale[source[col]];
+                    target[col] = Pixel{value, value, value};
+                }
+                else
+                {
+                    Pixel p = kernels::Rgb8::load(source + 3 * col);
+                    target[col] = Pixel{scale[p.red], scale[p.green], scale[p.blue]};
+                }
+            }
+        }
+    });
+    return image;
+}
+
+/**
+ * Decodes a 24 or 32-bit BMP held in memory (one read from standard input).
+ */
+vector<vector<Pixel>> decode_bmp(const unsigned char *data, size_t size, string &error)
+{
+    bmp_io::Layout layout;
+    if (size < 54 || !bmp_io::parse_layout(data, size, layout))
+    {
+        error = "Only 24 and 32-bit BMP input can be read from standard input";
+        return {};
+    }
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(layout.height, layout.width);
+    parallel_utils::parallel_for(0, layout.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const unsigned char *source = data + layout.row_offset(row);
+            Pixel *target = image[row].data();
+            for (int col = 0; col < layout.width; ++col, source += layout.bytes_per_pixel)
+                target[col] = kernels::Bgr8::load(source);
+        }
+    });
+    return image;
+}
+
+/**
+ * Reports the size of a PPM, PGM or raw RGB8 file without decoding it.
+ *
+ * @param filename The image file (not standard input, which can only be read once).
+ * @param width    Receives the width.
+ * @param height   Receives the height.
+ * @return True if the file is a valid PPM or PGM, or raw RGB8 of the size set by --raw-size.
+ */
+bool read_size(const string &filename, int &width, int &height)
+{
+    if (filename == "-")
+        return false;
+    InputBytes input(filename);
+    if (!input.ok() || input.size() < 2 || (input.data()[0] == 'B' && input.data()[1] == 'M'))
+        return false;
+    string error;
+    NetpbmHeader header;
+    if (input.data()[0] == 'P')
+    {
+        if (!parse_netpbm_header(input.data(), input.size(), header, error))
+            return false;
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+    width = settings().raw_width;
+    height = settings().raw_height;
+    return width > 0 && input.size() == static_cast<size_t>(width) * height * 3;
+}
+
+/**
+ * Reads an image in any supported format.
+ *
+ * @param filename The file, or "-" for standard input.
+ * @param error    Receives a message describing the problem on failure (may stay empty when
+ *                 the file simply could not be opened or is not a valid BMP).
+ * @return The image, or an empty image on failure.
+ */
+vector<vector<Pixel>> read(const string &filename, string &error)
+{
+    if (filename != "-")
+    {
+        // BMP files keep their own pread path (and 8-bit support)
+        unsigned char magic[2] = {0, 0};
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "Failed to open: " + filename + " (" + strerror(errno) + ")";
+            return {};
+        }
+        bool bmp = bmp_io::read_fully(fd, magic, 2, 0) && magic[0] == 'B' && magic[1] == 'M';
+        close(fd);
+        if (bmp)
+        {
+            vector<vector<Pixel>> image =
+                luma::is_gray_bmp(filename) ? luma::from_gray(luma::read_gray_bmp(filename)) : bmp_io::read(filename);
+            if (image.empty())
+                error = "Unsupported or truncated BMP file: " + filename;
+            return image;
+        }
+    }
+
+    InputBytes input(filename);
+    if (!input.ok())
+    {
+        error = filename == "-" ? "Could not read standard input" : "Failed to read: " + filename;
+        return {};
+    }
+    const unsigned char *data = input.data();
+    size_t size = input.size();
+    if (size >= 2 && data[0] == 'B' && data[1] == 'M')
+        return decode_bmp(data, size, error);
+    if (size >= 2 && data[0] == 'P' && (data[1] == '6' || data[1] == '5'))
+    {
+        NetpbmHeader header;
+        if (!parse_netpbm_header(data, size, header, error))
+            return {};
+        return decode_samples(data + header.offset, header.channels, header.maxval, header.width, header.height);
+    }
+
+    const Settings &current = settings();
+    if (current.raw_width <= 0)
+    {
+        error = "Unknown image format; give --raw-size <width>x<height> for headerless RGB8 input";
+        return {};
+    }
+    size_t expected = static_cast<size_t>(current.raw_width) * current.raw_height * 3;
+    if (size != expected)
+    {
+        error = "Raw RGB8 input is " + std::to_string(size) + " bytes, expected " + std::to_string(expected) + " for " +
+                std::to_string(current.raw_width) + "x" + std::to_string(current.raw_height);
+        return {};
+    }
+    return decode_samples(data, 3, 255, current.raw_width, current.raw_height);
+}
+
+/**
+ * Writes an image in the format output_format() picks for the file name.
+ *
+ * @param filename  The file, or "-" for standard output.
+ * @param image     The image to save.
+ * @param gray      Whether to store gray levels: an 8-bit BMP, or equal channels in PPM and raw
+ *                  output. PGM output is always gray.
+ * @param weighting The luma weighting for gray levels.
+ * @return True if successful and false otherwise.
+ */
+bool write(const string &filename, const vector<vector<Pixel>> &image, bool gray = false,
+           luma::Weighting weighting = luma::LUMA_AVERAGE)
+{
+    if (image.empty() || image[0].empty())
+        return false;
+    int width = image[0].size(), height = image.size();
+    FileFormat format = output_format(filename);
+    luma::Weights weights = luma::fixed_point_weights(weighting);
+    gray = gray || format == FORMAT_PGM;
+
+    vector<unsigned char> header;
+    long long stride = static_cast<long long>(width) * (gray && format != FORMAT_PPM && format != FORMAT_RAW ? 1 : 3);
+    if (format == FORMAT_BMP)
+    {
+        stride = (stride + 3) & ~3LL;
+        if (54 + 1024 + stride * height > 0xFFFFFFFFLL)
+            return false; // The file size field is 32 bits
+        header = bmp_io::make_header(width, height, gray);
+    }
+    else if (format != FORMAT_RAW)
+    {
+        string text = string(format == FORMAT_PGM ? "P5" : "P6") + "\n" + std::to_string(width) + " " +
+                      std::to_string(height) + "\n255\n";
+        header.assign(text.begin(), text.end());
+    }
+
+    bool bgr = format == FORMAT_BMP;
+    bool one_channel = gray && (format == FORMAT_BMP || format == FORMAT_PGM);
+    auto encode = [&](int row, unsigned char *target) {
+        const Pixel *source = image[row].data();
+        for (int col = 0; col < width; ++col)
+        {
+            if (one_channel)
+                target[col] = static_cast<unsigned char>(luma::weighted_value(source[col], weights));
+            else if (gray)
+                memset(target + 3 * col, luma::weighted_value(source[col], weights), 3);
+            else if (bgr)
+                kernels::Bgr8::store(target + 3 * col, source[col]);
+            else
+                kernels::Rgb8::store(target + 3 * col, source[col]);
+        }
+    };
+
+    if (filename == "-")
+        return bmp_io::write_rows(1, header, stride, height, format == FORMAT_BMP, encode);
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = bmp_io::write_rows(fd, header, stride, height, format == FORMAT_BMP, encode);
+    return close(fd) == 0 && ok;
+}
+
+} // namespace image_io
+
+/**
+ * @namespace metrics
+ * @brief Full-reference image comparison: max-abs-diff, PSNR, SSIM and a difference heatmap.
+ *
+ * Used to check optimized kernels and production output against reference images, so it has
+ * to be fast enough for whole corpora:
+ *   - The difference statistics (per-channel max, squared error and differing pixels) are one
+ *     pass over rows split across threads, with per-chunk totals merged at the end. The inner
+ *     loops only use integer arithmetic with no dependencies between pixels, so they vectorize.
+ *   - SSIM is computed on Rec.601 luma with a (2 * radius + 1) square window that is clipped at
+ *     the image edges. The window sums of a, b, a^2, b^2 and ab come from integral images, so
+ *     each pixel costs a few lookups at any window size. The integral images are built one band
+ *     of rows (plus the window halo) at a time, which keeps the scratch memory independent of
+ *     the image height.
+ */
+namespace metrics
+{
+
+const int SSIM_BAND_ROWS = 64;
+const int DEFAULT_SSIM_RADIUS = 3; // 7x7 window
+
+/**
+ * The results of comparing an image against a reference of the same size.
+ */
+struct Report
+{
+    int width = 0;
+    int height = 0;
+    int max_diff = 0;                 // Largest absolute difference over all channels
+    int channel_max_diff[3] = {0, 0, 0};
+    double channel_mse[3] = {0.0, 0.0, 0.0};
+    double mse = 0.0;                 // Mean over all three channels
+    double psnr = 0.0;                // In dB; infinite for identical images
+    double ssim = 1.0;                // Mean SSIM over every window position
+    unsigned long long differing_pixels = 0;
+};
+
+/**
+ * @return The PSNR in dB of a mean squared error of 8-bit samples (infinite for 0).
+ */
+double psnr_from_mse(double mse)
+{
+    if (mse <= 0.0)
+        return numeric_limits<double>::infinity();
+    return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+/**
+ * Window sums of one integral image entry.
+ */
+struct Sums
+{
+    long long a = 0;
+    long long b = 0;
+    long long aa = 0;
+    long long bb = 0;
+    long long ab = 0;
+};
+
+/**
+ * Computes the mean SSIM of two gray images of the same size.
+ *
+ * @param a      The first image.
+ * @param b      The second image.
+ * @param radius Half the window size; must be >= 1.
+ * @return The mean of the SSIM index over every pixel's window.
+ */
+double mean_ssim(const luma::GrayImage &a, const luma::GrayImage &b, int radius)
+{
+    int width = a.width;
+    int height = a.height;
+    size_t stride = width + 1;
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+
+    int chunks = parallel_utils::chunk_count(height, SSIM_BAND_ROWS);
+    vector<double> partial(chunks, 0.0);
+    parallel_utils::parallel_for(
+        0, height,
+        [&](int row_begin, int row_end, int chunk) {
+            vector<Sums> integral;
+            double total = 0.0;
+            for (int band_begin = row_begin; band_begin < row_end; band_begin += SSIM_BAND_ROWS)
+            {
+                int band_end = min(row_end, band_begin + SSIM_BAND_ROWS);
+                // Rows of the integral image: first and last are the rows the windows reach
+                int first = max(0, band_begin - radius);
+                int last = min(height, band_end + radius);
+                integral.assign(stride * (last - first + 1), Sums());
+                for (int row = first; row < last; ++row)
+                {
+                    const unsigned char *pa = &a.pixels[static_cast<size_t>(row) * width];
+                    const unsigned char *pb = &b.pixels[static_cast<size_t>(row) * width];
+                    const Sums *above = &integral[(row - first) * stride];
+                    Sums *out = &integral[(row - first + 1) * stride];
+                    Sums running;
+                    for (int col = 0; col < width; ++col)
+                    {
+                        int va = pa[col], vb = pb[col];
+                        running.a += va;
+                        running.b += vb;
+                        running.aa += va * va;
+                        running.bb += vb * vb;
+                        running.ab += va * vb;
+                        out[col + 1].a = above[col + 1].a + running.a;
+                        out[col + 1].b = above[col + 1].b + running.b;
+                        out[col + 1].aa = above[col + 1].aa + running.aa;
+                        out[col + 1].bb = above[col + 1].bb + running.bb;
+                        out[col + 1].ab = above[col + 1].ab + running.ab;
+                    }
+                }
+
+                for (int row = band_begin; row < band_end; ++row)
+                {
+                    int top = max(0, row - radius);
+                    int bottom = min(height, row + radius + 1);
+                    const Sums *upper = &integral[(top - first) * stride];
+                    const Sums *lower = &integral[(bottom - first) * stride];
+                    for (int col = 0; col < width; ++col)
+                    {
+                        int left = max(0, col - radius);
+                        int right = min(width, col + radius + 1);
+                        double area = static_cast<double>(bottom - top) * (right - left);
+                        const Sums &ul = upper[left], &ur = upper[right], &ll = lower[left], &lr = lower[right];
+                        double mean_a = (lr.a - ll.a - ur.a + ul.a) / area;
+                        double mean_b = (lr.b - ll.b - ur.b + ul.b) / area;
+                        double var_a = (lr.aa - ll.aa - ur.aa + ul.aa) / area - mean_a * mean_a;
+                        double var_b = (lr.bb - ll.bb - ur.bb + ul.bb) / area - mean_b * mean_b;
+                        double covariance = (lr.ab - ll.ab - ur.ab + ul.ab) / area - mean_a * mean_b;
+                        total += ((2.0 * mean_a * mean_b + c1) * (2.0 * covariance + c2)) /
+                                 ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+                    }
+                }
+            }
+            partial[chunk] = total;
+        },
+        SSIM_BAND_ROWS);
+
+    double total = 0.0;
+    for (int chunk = 0; chunk < chunks; ++chunk)
+        total += partial[chunk];
+    return total / (static_cast<double>(width) * height);
+}
+
+/**
+ * Compares an image against a reference.
+ *
+ * @param actual      The image to check.
+ * @param reference   The expected image; must have the same size.
+ * @param ssim_radius Half the SSIM window size (>= 1).
+ * @param report      Receives the results.
+ * @param error       Receives a message describing the problem on failure.
+ * @return True if the images could be compared, false otherwise.
+ */
+bool compare(const vector<vector<Pixel>> &actual, const vector<vector<Pixel>> &reference, int ssim_radius,
+             Report &report, string &error)
+{
+    if (actual.empty() || actual[0].empty() || reference.empty() || reference[0].empty())
+    {
+        error = "Cannot compare an empty image";
+        return false;
+    }
+    if (actual.size() != reference.size() || actual[0].size() != reference[0].size())
+    {
+        error = "The images differ in size: " + to_string(actual[0].size()) + "x" + to_string(actual.size()) +
+                " and " + to_string(reference[0].size()) + "x" + to_string(reference.size());
+        return false;
+    }
+    report = Report();
+    report.width = actual[0].size();
+    report.height = actual.size();
+
+    // Per chunk: three squared error sums, three maxima and the differing pixel count
+    const int FIELDS = 7;
+    int chunks = parallel_utils::chunk_count(report.height, 8);
+    vector<unsigned long long> partial(static_cast<size_t>(chunks) * FIELDS, 0ULL);
+    parallel_utils::parallel_for(
+        0, report.height,
+        [&](int row_begin, int row_end, int chunk) {
+            unsigned long long *totals = &partial[static_cast<size_t>(chunk) * FIELDS];
+            for (int row = row_begin; row < row_end; ++row)
+            {
+                const Pixel *pa = actual[row].data();
+                const Pixel *pb = reference[row].data();
+                // Row sums stay well inside 64 bits; max and count loops carry no dependencies
+                long long squared[3] = {0, 0, 0};
+                int maxima[3] = {0, 0, 0};
+                unsigned long long differing = 0;
+                for (int col = 0; col < report.width; ++col)
+                {
+                    int dr = abs(pa[col].red - pb[col].red);
+                    int dg = abs(pa[col].green - pb[col].green);
+                    int db = abs(pa[col].blue - pb[col].blue);
+                    squared[0] += dr * dr;
+                    squared[1] += dg * dg;
+                    squared[2] += db * db;
+                    maxima[0] = max(maxima[0], dr);
+                    maxima[1] = max(maxima[1], dg);
+                    maxima[2] = max(maxima[2], db);
+                    differing += (dr | dg | db) != 0;
+                }
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    totals[channel] += squared[channel];
+                    totals[3 + channel] = max<unsigned long long>(totals[3 + channel], maxima[channel]);
+                }
+                totals[6] += differing;
+            }
+        },
+        8);
+
+    double pixels = static_cast<double>(report.width) * report.height;
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        const unsigned long long *totals = &partial[static_cast<size_t>(chunk) * FIELDS];
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            report.channel_mse[channel] += totals[channel] / pixels;
+            report.channel_max_diff[channel] =
+                max(report.channel_max_diff[channel], static_cast<int>(totals[3 + channel]));
+        }
+        report.differing_pixels += totals[6];
+    }
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        report.mse += report.channel_mse[channel] / 3.0;
+        report.max_diff = max(report.max_diff, report.channel_max_diff[channel]);
+    }
+    report.psnr = psnr_from_mse(report.mse);
+
+    // Identical images need no windows: every SSIM term is exactly 1
+    if (report.differing_pixels > 0)
+        report.ssim = mean_ssim(luma::to_gray(actual, luma::LUMA_REC601), luma::to_gray(reference, luma::LUMA_REC601),
+                                max(1, ssim_radius));
+    return true;
+}
+
+/**
+ * Draws where two images differ: each pixel's largest channel difference, scaled so the
+ * largest difference in the image is white, on a black, red, yellow, white ramp. Identical
+ * pixels stay black, so even off-by-one differences are visible.
+ *
+ * @param actual    The image to check.
+ * @param reference The expected image; must have the same size.
+ * @param max_diff  The largest difference (Report::max_diff); 0 gives an all black image.
+ * @return The heatmap, drawn from the buffer pool.
+ */
+vector<vector<Pixel>> heatmap(const vector<vector<Pixel>> &actual, const vector<vector<Pixel>> &reference,
+                              int max_diff)
+{
+    int height = actual.size();
+    int width = actual[0].size();
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(height, width);
+    int scale = max(1, max_diff);
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const Pixel *pa = actual[row].data();
+            const Pixel *pb = reference[row].data();
+            Pixel *target = image[row].data();
+            for (int col = 0; col < width; ++col)
+            {
+                int diff = max(abs(pa[col].red - pb[col].red),
+                               max(abs(pa[col].green - pb[col].green), abs(pa[col].blue - pb[col].blue)));
+                int level = min(765, diff * 765 / scale); // Three ramp segments of 255
+                target[col] = Pixel{min(255, level), max(0, min(255, level - 255)), max(0, level - 510)};
+            }
+        }
+    });
+    return image;
+}
+
+/**
+ * @return The PSNR as text ("inf" for identical images).
+ */
+string format_psnr(double psnr)
+{
+    if (std::isinf(psnr))
+        return "inf";
+    ostringstream out;
+    out << fixed << setprecision(2) << psnr;
+    return out.str();
+}
+
+/**
+ * Prints a comparison report as a small table.
+ */
+void print_report(const Report &report)
+{
+    const char *names[3] = {"Red", "Green", "Blue"};
+    cout << "Compared " << report.width << "x" << report.height << " pixels" << endl;
+    cout << "Channel  MaxDiff       MSE   PSNR(dB)" << endl;
+    for (int channel = 0; channel < 3; ++channel)
+        cout << left << setw(7) << names[channel] << right << setw(9) << report.channel_max_diff[channel]
+             << setw(10) << fixed << setprecision(3) << report.channel_mse[channel] << setw(11)
+             << format_psnr(psnr_from_mse(report.channel_mse[channel])) << endl;
+    cout << left << setw(7) << "All" << right << setw(9) << report.max_diff << setw(10) << report.mse << setw(11)
+         << format_psnr(report.psnr) << endl;
+    cout << "SSIM:             " << setprecision(6) << report.ssim << endl;
+    cout << "Differing pixels: " << report.differing_pixels << " ("
+         << setprecision(3) << 100.0 * report.differing_pixels / (static_cast<double>(report.width) * report.height)
+         << "%)" << endl;
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+/**
+ * Reads two images and compares them, optionally writing the heatmap.
+ *
+ * @param actual_file    The image to check.
+ * @param reference_file The expected image.
+ * @param heatmap_file   Where to write the heatmap (empty for none).
+ * @param ssim_radius    Half the SSIM window size.
+ * @param report         Receives the results.
+ * @param error          Receives a message describing the problem on failure.
+ * @return True if the images were compared (and the heatmap written), false otherwise.
+ */
+bool compare_files(const string &actual_file, const string &reference_file, const string &heatmap_file,
+                   int ssim_radius, Report &report, string &error)
+{
+    vector<vector<Pixel>> actual = image_io::read(actual_file, error);
+    if (actual.empty())
+        return false;
+    vector<vector<Pixel>> reference = image_io::read(reference_file, error);
+    bool ok = !reference.empty() && compare(actual, reference, ssim_radius, report, error);
+    if (ok && !heatmap_file.empty())
+    {
+        vector<vector<Pixel>> map = heatmap(actual, reference, report.max_diff);
+        ok = image_io::write(heatmap_file, map);
+        if (!ok)
+            error = "Failed to write output image: " + heatmap_file;
+        buffer_pool::release_image(map);
+    }
+    buffer_pool::release_image(actual);
+    buffer_pool::release_image(reference);
+    return ok;
+}
+
+/**
+ * @return True if the path names a directory.
+ */
+bool is_directory(const string &path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+/**
+ * Entry point of "main --compare": compares one image against a reference, or every image of
+ * a directory against the file of the same name in a reference directory.
+ *
+ * Options: --heatmap <file|dir> (a directory when comparing directories), --ssim-radius <n>,
+ * and the pass criteria --max-diff <n>, --min-psnr <db> and --min-ssim <x>.
+ *
+ * @return 0 if every comparison ran and met the criteria, 1 otherwise.
+ */
+int run(int argc, char *argv[])
+{
+    vector<string> paths;
+    string heatmap_path;
+    int ssim_radius = DEFAULT_SSIM_RADIUS;
+    int max_diff = 255;
+    double min_psnr = 0.0, min_ssim = -1.0;
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--heatmap" && has_value)
+            heatmap_path = argv[++i];
+        else if (arg == "--ssim-radius" && has_value)
+            ssim_radius = atoi(argv[++i]);
+        else if (arg == "--max-diff" && has_value)
+            max_diff = atoi(argv[++i]);
+        else if (arg == "--min-psnr" && has_value)
+            min_psnr = atof(argv[++i]);
+        else if (arg == "--min-ssim" && has_value)
+            min_ssim = atof(argv[++i]);
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            cli_utils::print_error("Unknown option: " + arg);
+            return 1;
+        }
+        else
+            paths.push_back(arg);
+    }
+    if (paths.size() != 2 || ssim_radius < 1)
+    {
+        cli_utils::print_usage();
+        return 1;
+    }
+
+    auto passes = [&](const Report &report) {
+        return report.max_diff <= max_diff && report.psnr >= min_psnr && report.ssim >= min_ssim;
+    };
+
+    if (!is_directory(paths[0]))
+    {
+        Report report;
+        string error;
+        if (!compare_files(paths[0], paths[1], heatmap_path, ssim_radius, report, error))
+        {
+            cli_utils::print_error(error);
+            return 1;
+        }
+        print_report(report);
+        if (!passes(report))
+        {
+            cli_utils::print_error("The image does not meet the comparison criteria");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Directories: one line per image, in name order so nightly logs diff cleanly
+    vector<string> names;
+    DIR *dir = opendir(paths[0].c_str());
+    if (dir == nullptr)
+    {
+        cli_utils::print_error("Failed to open directory: " + paths[0]);
+        return 1;
+    }
+    while (dirent *entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        if (name != "." && name != ".." && !is_directory(paths[0] + "/" + name))
+            names.push_back(name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    size_t failures = 0;
+    cout << left << setw(32) << "Image" << right << setw(8) << "MaxDiff" << setw(10) << "PSNR(dB)" << setw(10)
+         << "SSIM" << "  Result" << endl;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        Report report;
+        string error;
+        string heatmap_file = heatmap_path.empty() ? "" : heatmap_path + "/" + names[i];
+        bool ok = compare_files(paths[0] + "/" + names[i], paths[1] + "/" + names[i], heatmap_file, ssim_radius,
+                                report, error);
+        cout << left << setw(32) << names[i] << right;
+        if (!ok)
+            cout << "  " << error << endl;
+        else
+            cout << setw(8) << report.max_diff << setw(10) << format_psnr(report.psnr) << setw(10) << fixed
+                 << setprecision(6) << report.ssim << (passes(report) ? "  PASS" : "  FAIL") << endl;
+        cout.unsetf(ios::fixed);
+        failures += !ok || !passes(report);
+    }
+    cout << names.size() - failures << " of " << names.size() << " images passed" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+} // namespace metrics
+
+/**
+ * @namespace dither
+ * @brief Ordered (Bayer) and error-diffusion (Floyd-Steinberg) dithering around any quantizer.
+ *
+ * The quantizing filters (high contrast, five-color posterize) map every pixel to a tiny palette,
+ * which turns smooth gradients into hard bands. Dithering trades the bands for fine noise:
+ *   - Ordered dithering adds a fixed 8x8 Bayer pattern before quantizing. Each pixel only
+ *     depends on itself and its position, so rows are simply split across threads.
+ *   - Floyd-Steinberg pushes each pixel's quantization error onto its unprocessed neighbours
+ *     (7/16 right, 3/16 below left, 5/16 below, 1/16 below right). Pixel (r, c) therefore has to
+ *     wait for pixel (r - 1, c + 1), which rules out splitting rows. Instead rows are dealt out
+ *     round-robin and pipelined: the thread on row r follows the thread on row r - 1 a couple of
+ *     columns behind, so all threads sweep the image together as a diagonal wavefront. The
+ *     result is identical to the serial scan.
+ *
+ * The quantizer is any callable taking a Pixel (channels in [0, 255]) and returning the palette
+ * color, so both filters share one implementation.
+ */
+namespace dither
+{
+
+/**
+ * Dithering methods for the quantizing filters.
+ */
+enum Mode
+{
+    DITHER_NONE = 0,           // Hard thresholds
+    DITHER_BAYER = 1,          // 8x8 ordered dithering
+    DITHER_FLOYD_STEINBERG = 2 // Error diffusion
+};
+
+const int WAVEFRONT_BLOCK = 64; // Columns processed between progress updates
+
+/**
+ * Parses a dithering mode name as used by the batch operations.
+ *
+ * @param name "none", "bayer" or "fs".
+ * @param mode Receives the mode.
+ * @return True if the name is known, false otherwise.
+ */
+bool parse_mode(const string &name, Mode &mode)
+{
+    if (name == "none")
+        mode = DITHER_NONE;
+    else if (name == "bayer")
+        mode = DITHER_BAYER;
+    else if (name == "fs")
+        mode = DITHER_FLOYD_STEINBERG;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @return The 8x8 Bayer threshold at (row, col), in [0, 64).
+ */
+inline int bayer_index(int row, int col)
+{
+    static const unsigned char BAYER_8X8[8][8] = {
+        {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26}, {12, 44, 4, 36, 14, 46, 6, 38},
+        {60, 28, 52, 20, 62, 30, 54, 22}, {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47, 7, 39, 13, 45, 5, 37},  {63, 31, 55, 23, 61, 29, 53, 21}};
+    return BAYER_8X8[row & 7][col & 7];
+}
+
+inline int clamp_channel(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/**
+ * Quantizes the image with an 8x8 ordered dither pattern, overwriting it.
+ *
+ * @param image     The image to modify (row-major order).
+ * @param quantize  Maps a Pixel to its palette color.
+ * @param amplitude Peak-to-peak strength of the pattern in channel levels; roughly the distance
+ *                  between neighbouring palette levels.
+ */
+template <typename Quantize> void ordered_in_place(vector<vector<Pixel>> &image, Quantize quantize, int amplitude)
+{
+    // Pattern offsets centred on zero, precomputed per cell so the pixel loop is integer only
+    int offsets[64];
+    for (int i = 0; i < 64; ++i)
+        offsets[i] = static_cast<int>(((i + 0.5) / 64.0 - 0.5) * amplitude);
+
+    parallel_utils::parallel_for(0, static_cast<int>(image.size()), [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            for (size_t col = 0; col < image[row].size(); ++col)
+            {
+                Pixel &p = image[row][col];
+                int offset = offsets[bayer_index(row, col)];
+                p = quantize(Pixel{clamp_channel(p.red + offset), clamp_channel(p.green + offset),
+                                   clamp_channel(p.blue + offset)});
+            }
+        }
+    });
+}
+
+/**
+ * Quantizes the image with Floyd-Steinberg error diffusion, overwriting it.
+ *
+ * Rows are processed by a pipeline of threads (see the namespace notes). Each row's incoming
+ * error lives in a small ring of buffers rather than a full-size float image.
+ *
+ * @param image    The image to modify (row-major order).
+ * @param quantize Maps a Pixel to its palette color.
+ */
+template <typename Quantize> void error_diffusion_in_place(vector<vector<Pixel>> &image, Quantize quantize)
+{
+    int height = image.size();
+    if (height == 0)
+        return;
+    int width = image[0].size();
+
+    int workers = parallel_utils::chunk_count(height, 1);
+    int ring = 2 * workers + 2;
+    // Error carried into each row, 3 floats per pixel plus one spare pixel at each end
+    vector<vector<float>> errors(ring, vector<float>((width + 2) * 3, 0.0f));
+    // progress[r] = number of columns of row r that are final
+    unique_ptr<atomic<int>[]> progress(new atomic<int>[height]);
+    for (int row = 0; row < height; ++row)
+        progress[row].store(0);
+
+    auto wait_for = [&](int row, int columns) {
+        while (progress[row].load(memory_order_acquire) < columns)
+            this_thread::yield();
+    };
+
+    parallel_utils::parallel_for(
+        0, workers,
+        [&](int worker_begin, int, int) {
+            for (int row = worker_begin; row < height; row += workers)
+            {
+                vector<float> &current = errors[row % ring];
+                vector<float> &below = errors[(row + 1) % ring];
+                // The buffer for the next row was last used by row + 1 - ring, which must be finished
+                if (row + 1 - ring >= 0)
+                    wait_for(row + 1 - ring, width);
+                fill(below.begin(), below.end(), 0.0f);
+
+                for (int block = 0; block < width; block += WAVEFRONT_BLOCK)
+                {
+                    int block_end = min(width, block + WAVEFRONT_BLOCK);
+                    // Pixel (r, c) receives error from (r - 1, c + 1); staying one more column
+                    // behind also keeps the two rows from adding into the same error slot at once
+                    if (row > 0)
+                        wait_for(row - 1, min(width, block_end + 2));
+
+                    for (int col = block; col < block_end; ++col)
+                    {
+                        Pixel &p = image[row][col];
+                        float *carried = &current[(col + 1) * 3];
+                        int value[3] = {clamp_channel(static_cast<int>(lround(p.red + carried[0]))),
+                                        clamp_channel(static_cast<int>(lround(p.green + carried[1]))),
+                                        clamp_channel(static_cast<int>(lround(p.blue + carried[2])))};
+                        Pixel q = quantize(Pixel{value[0], value[1], value[2]});
+                        float error[3] = {static_cast<float>(value[0] - q.red), static_cast<float>(value[1] - q.green),
+                                          static_cast<float>(value[2] - q.blue)};
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            carried[3 + c] += error[c] * (7.0f / 16.0f);
+                            below[col * 3 + c] += error[c] * (3.0f / 16.0f);
+                            below[(col + 1) * 3 + c] += error[c] * (5.0f / 16.0f);
+                            below[(col + 2) * 3 + c] += error[c] * (1.0f / 16.0f);
+                        }
+                        p = q;
+                    }
+                    progress[row].store(block_end, memory_order_release);
+                }
+            }
+        },
+        1);
+}
+
+/**
+ * Quantizes the image with the given method, overwriting it.
+ *
+ * @param image     The image to modify (row-major order).
+ * @param quantize  Maps a Pixel to its palette color.
+ * @param mode      The dithering method.
+ * @param amplitude Pattern strength for ordered dithering (see ordered_in_place()).
+ */
+template <typename Quantize>
+void quantize_in_place(vector<vector<Pixel>> &image, Quantize quantize, Mode mode, int amplitude)
+{
+    if (mode == DITHER_BAYER)
+        ordered_in_place(image, quantize, amplitude);
+    else if (mode == DITHER_FLOYD_STEINBERG)
+        error_diffusion_in_place(image, quantize);
+    else
+        kernels::map_in_place(image, quantize);
+}
+
+} // namespace dither
+
+/**
+ * @namespace threshold
+ * @brief Chooses black/white cutoffs for the high contrast filters.
+ *
+ * Two strategies are provided on top of the fixed cutoff used by process_7:
+ *   - Global Otsu thresholding, which picks the single cutoff that best separates the luma
+ *     histogram into two classes. It only needs the histogram from image_stats.
+ *   - Local adaptive thresholding, which compares every pixel against the mean brightness of the
+ *     window around it. The window sums come from an integral image, so the cost per pixel is
+ *     four lookups no matter how large the window is.
+ */
+namespace threshold
+{
+
+/**
+ * Computes Otsu's threshold for a 256-bin histogram.
+ *
+ * @param histogram The brightness histogram.
+ * @return The brightness at and above which a pixel should become white, in [1, 255].
+ */
+int otsu_threshold(const unsigned long long histogram[256])
+{
+    double total = 0.0;
+    double weighted_total = 0.0;
+    for (int value = 0; value < 256; ++value)
+    {
+        total += histogram[value];
+        weighted_total += static_cast<double>(value) * histogram[value];
+    }
+    if (total == 0.0)
+        return 128;
+
+    // Find the split that maximizes the variance between the dark and the light class
+    double dark_count = 0.0;
+    double dark_weighted = 0.0;
+    double best_variance = -1.0;
+    int best_split = 127;
+    for (int split = 0; split < 255; ++split)
+    {
+        dark_count += histogram[split];
+        dark_weighted += static_cast<double>(split) * histogram[split];
+        double light_count = total - dark_count;
+        if (dark_count == 0.0 || light_count == 0.0)
+            continue;
+        double dark_mean = dark_weighted / dark_count;
+        double light_mean = (weighted_total - dark_weighted) / light_count;
+        double variance = dark_count * light_count * (dark_mean - light_mean) * (dark_mean - light_mean);
+        if (variance > best_variance)
+        {
+            best_variance = variance;
+            best_split = split;
+        }
+    }
+    // Pixels above the split belong to the light class
+    return best_split + 1;
+}
+
+/**
+ * Builds the integral image of the pixel brightness.
+ *
+ * The result has (height + 1) x (width + 1) entries stored row by row; entry (r, c) holds the sum
+ * of the brightness of every pixel above and to the left of (r, c). Rows are prefix-summed in
+ * parallel first, then the columns are accumulated in parallel bands of columns.
+ *
+ * @param image The image to summarize (row-major order).
+ * @return The integral image, or an empty vector for an empty image.
+ */
+vector<long long> integral_image(const vector<vector<Pixel>> &image)
+{
+    int height = image.size();
+    if (height == 0 || image[0].empty())
+        return {};
+    int width = image[0].size();
+    size_t stride = width + 1;
+    vector<long long> integral(stride * (height + 1), 0);
+
+    // Horizontal prefix sums, one row at a time
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            long long *out = &integral[(row + 1) * stride];
+            long long running = 0;
+            for (int col = 0; col < width; ++col)
+            {
+                running += image_stats::luma_value(image[row][col]);
+                out[col + 1] = running;
+            }
+        }
+    });
+
+    // Vertical accumulation; each thread owns a band of columns and walks down the rows so the
+    // inner loop runs over contiguous memory
+    parallel_utils::parallel_for(
+        1, width + 1,
+        [&](int col_begin, int col_end, int) {
+            for (int row = 2; row <= height; ++row)
+            {
+                long long *out = &integral[row * stride];
+                const long long *above = &integral[(row - 1) * stride];
+                for (int col = col_begin; col < col_end; ++col)
+                    out[col] += above[col];
+            }
+        },
+        64);
+    return integral;
+}
+
+/**
+ * Applies local adaptive thresholding, overwriting the image with black and white pixels.
+ *
+ * A pixel becomes white when its brightness is at least the mean brightness of the
+ * (2 * radius + 1) square window around it (clipped at the image edges) minus offset.
+ *
+ * @param image  The image to modify (row-major order).
+ * @param radius Half the window size in pixels; must be >= 1.
+ * @param offset Amount subtracted from the local mean; positive values favor white.
+ */
+void adaptive_threshold_in_place(vector<vector<Pixel>> &image, int radius, int offset)
+{
+    int height = image.size();
+    if (height == 0 || image[0].empty() || radius < 1)
+        return;
+    int width = image[0].size();
+    size_t stride = width + 1;
+    vector<long long> integral = integral_image(image);
+
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            int top = max(0, row - radius);
+            int bottom = min(height, row + radius + 1);
+            const long long *upper = &integral[top * stride];
+            const long long *lower = &integral[bottom * stride];
+            for (int col = 0; col < width; ++col)
+            {
+                int left = max(0, col - radius);
+                int right = min(width, col + radius + 1);
+                long long area = static_cast<long long>(bottom - top) * (right - left);
+                long long sum = lower[right] - lower[left] - upper[right] + upper[left];
+                // Compare luma >= sum / area - offset without dividing
+                long long luma = image_stats::luma_value(image[row][col]);
+                int value = (luma + offset) * area >= sum ? 255 : 0;
+                image[row][col] = Pixel{value, value, value};
+            }
+        }
+    });
+}
+
+} // namespace threshold
+
+/**
+ * @namespace convolution
+ * @brief Blur, sharpen and edge detection built from fast 1D passes.
+ *
+ * Images are converted to three float planes (one per channel) so every pass runs over
+ * contiguous memory with simple loops the compiler can vectorize. Every kernel used here is
+ * separable, so a 2D filter is applied as a horizontal pass followed by a vertical pass:
+ *   - The horizontal pass copies each row into a scratch buffer with a clamped halo on both
+ *     sides, then accumulates one kernel tap at a time across the whole row.
+ *   - The vertical pass works on cache-sized tiles of columns, accumulating whole tile-wide
+ *     strips of the rows above and below; rows past the image edge are clamped.
+ * Large Gaussian blurs are approximated by three box blurs, whose running sums cost the same
+ * per pixel no matter how large the radius is.
+ */
+namespace convolution
+{
+
+/**
+ * An image stored as one float plane per color channel (red, green, blue).
+ */
+struct PlanarImage
+{
+    int width = 0;
+    int height = 0;
+    vector<float> planes[3];
+};
+
+/**
+ * Columns processed together by the vertical pass; 512 floats keep each strip within L1 cache.
+ */
+const int TILE_COLUMNS = 512;
+
+/**
+ * Gaussian kernels wider than this radius switch to the running-sum box approximation.
+ */
+const int MAX_GAUSSIAN_RADIUS = 24;
+
+/**
+ * Converts an image into float planes.
+ *
+ * @param image The image to convert (row-major order).
+ * @return The planar copy of the image.
+ */
+PlanarImage to_planar(const vector<vector<Pixel>> &image)
+{
+    PlanarImage planar;
+    planar.height = image.size();
+    planar.width = planar.height == 0 ? 0 : image[0].size();
+    size_t size = static_cast<size_t>(planar.width) * planar.height;
+    for (int channel = 0; channel < 3; ++channel)
+        planar.planes[channel].resize(size);
+
+    parallel_utils::parallel_for(0, planar.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            size_t offset = static_cast<size_t>(row) * planar.width;
+            for (int col = 0; col < planar.width; ++col)
+            {
+                planar.planes[0][offset + col] = image[row][col].red;
+                planar.planes[1][offset + col] = image[row][col].green;
+                planar.planes[2][offset + col] = image[row][col].blue;
+            }
+        }
+    });
+    return planar;
+}
+
+/**
+ * Converts float planes back into an image drawn from the buffer pool, rounding and clamping
+ * every value to [0, 255].
+ *
+ * @param planar The planes to convert.
+ * @return The image as a 2D vector of Pixels.
+ */
+vector<vector<Pixel>> from_planar(const PlanarImage &planar)
+{
+    vector<vector<Pixel>> image = buffer_pool::acquire_image(planar.height, planar.width);
+    parallel_utils::parallel_for(0, planar.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            size_t offset = static_cast<size_t>(row) * planar.width;
+            for (int col = 0; col < planar.width; ++col)
+            {
+                image[row][col].red = max(0, min(255, static_cast<int>(planar.planes[0][offset + col] + 0.5f)));
+                image[row][col].green = max(0, min(255, static_cast<int>(planar.planes[1][offset + col] + 0.5f)));
+                image[row][col].blue = max(0, min(255, static_cast<int>(planar.planes[2][offset + col] + 0.5f)));
+            }
+        }
+    });
+    return image;
+}
+
+/**
+ * Builds a normalized 1D Gaussian kernel covering +/- 3 sigma.
+ *
+ * @param sigma The standard deviation in pixels; must be > 0.
+ * @return The kernel weights (odd length, centered).
+ */
+vector<float> gaussian_kernel(double sigma)
+{
+    int radius = max(1, static_cast<int>(ceil(3.0 * sigma)));
+    vector<float> kernel(2 * radius + 1);
+    double sum = 0.0;
+    for (int i = -radius; i <= radius; ++i)
+    {
+        double weight = exp(-(i * i) / (2.0 * sigma * sigma));
+        kernel[i + radius] = static_cast<float>(weight);
+        sum += weight;
+    }
+    for (size_t i = 0; i < kernel.size(); ++i)
+        kernel[i] = static_cast<float>(kernel[i] / sum);
+    return kernel;
+}
+
+/**
+ * Convolves every row of a plane with a centered 1D kernel (edges clamped).
+ *
+ * @param plane  The input plane.
+ * @param width  Plane width in pixels.
+ * @param height Plane height in pixels.
+ * @param kernel The kernel weights (odd length).
+ * @return The filtered plane.
+ */
+vector<float> convolve_rows(const vector<float> &plane, int width, int height, const vector<float> &kernel)
+{
+    int radius = kernel.size() / 2;
+    vector<float> output(plane.size());
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        vector<float> padded(width + 2 * radius);
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const float *in = &plane[static_cast<size_t>(row) * width];
+            float *out = &output[static_cast<size_t>(row) * width];
+
+            // Copy the row into the scratch buffer with a clamped halo on each side
+            for (int i = 0; i < radius; ++i)
+            {
+                padded[i] = in[0];
+                padded[radius + width + i] = in[width - 1];
+            }
+            copy(in, in + width, padded.begin() + radius);
+
+            // Accumulate one tap at a time across the row so the inner loop is a plain
+            // multiply-add over contiguous floats
+            fill(out, out + width, 0.0f);
+            for (size_t tap = 0; tap < kernel.size(); ++tap)
+            {
+                const float weight = kernel[tap];
+                const float *source = &padded[tap];
+                for (int col = 0; col < width; ++col)
+                    out[col] += weight * source[col];
+            }
+        }
+    });
+    return output;
+}
+
+/**
+ * Convolves every column of a plane with a centered 1D kernel (edges clamped).
+ * The columns are processed in TILE_COLUMNS wide strips so the accumulator stays in cache.
+ *
+ * @param plane  The input plane.
+ * @param width  Plane width in pixels.
+ * @param height Plane height in pixels.
+ * @param kernel The kernel weights (odd length).
+ * @return The filtered plane.
+ */
+vector<float> convolve_columns(const vector<float> &plane, int width, int height, const vector<float> &kernel)
+{
+    int radius = kernel.size() / 2;
+    vector<float> output(plane.size());
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int tile = 0; tile < width; tile += TILE_COLUMNS)
+        {
+            int tile_width = min(TILE_COLUMNS, width - tile);
+            for (int row = row_begin; row < row_end; ++row)
+            {
+                float *out = &output[static_cast<size_t>(row) * width + tile];
+                fill(out, out + tile_width, 0.0f);
+                for (int tap = -radius; tap <= radius; ++tap)
+                {
+                    // Rows in the halo above and below the image repeat the edge rows
+                    int source_row = max(0, min(height - 1, row + tap));
+                    const float weight = kernel[tap + radius];
+                    const float *source = &plane[static_cast<size_t>(source_row) * width + tile];
+                    for (int col = 0; col < tile_width; ++col)
+                        out[col] += weight * source[col];
+                }
+            }
+        }
+    });
+    return output;
+}
+
+/**
+ * Box blurs every row of a plane using a running sum (edges clamped).
+ * Each output pixel costs one add and one subtract regardless of the radius.
+ */
+vector<float> box_rows(const vector<float> &plane, int width, int height, int radius)
+{
+    vector<float> output(plane.size());
+    const float scale = 1.0f / (2 * radius + 1);
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const float *in = &plane[static_cast<size_t>(row) * width];
+            float *out = &output[static_cast<size_t>(row) * width];
+            double sum = 0.0;
+            for (int i = -radius; i <= radius; ++i)
+                sum += in[max(0, min(width - 1, i))];
+            for (int col = 0; col < width; ++col)
+            {
+                out[col] = static_cast<float>(sum * scale);
+                sum += in[min(width - 1, col + radius + 1)] - in[max(0, col - radius)];
+            }
+        }
+    });
+    return output;
+}
+
+/**
+ * Box blurs every column of a plane using running sums kept for a whole strip of columns
+ * at once, so the pass walks down the rows with contiguous loads (edges clamped).
+ * The sums are doubles, as in box_rows(), so they do not pick up rounding that depends on
+ * the row the pass starts from; a tile of the image then blurs exactly like the whole image.
+ */
+vector<float> box_columns(const vector<float> &plane, int width, int height, int radius)
+{
+    vector<float> output(plane.size());
+    const float scale = 1.0f / (2 * radius + 1);
+    parallel_utils::parallel_for(
+        0, width,
+        [&](int col_begin, int col_end, int) {
+            for (int tile = col_begin; tile < col_end; tile += TILE_COLUMNS)
+            {
+                int tile_width = min(TILE_COLUMNS, col_end - tile);
+                vector<double> sums(tile_width, 0.0);
+                for (int i = -radius; i <= radius; ++i)
+                {
+                    const float *source = &plane[static_cast<size_t>(max(0, min(height - 1, i))) * width + tile];
+                    for (int col = 0; col < tile_width; ++col)
+                        sums[col] += source[col];
+                }
+                for (int row = 0; row < height; ++row)
+                {
+                    float *out = &output[static_cast<size_t>(row) * width + tile];
+                    const float *entering = &plane[static_cast<size_t>(min(height - 1, row + radius + 1)) * width + tile];
+                    const float *leaving = &plane[static_cast<size_t>(max(0, row - radius)) * width + tile];
+                    for (int col = 0; col < tile_width; ++col)
+                    {
+                        out[col] = static_cast<float>(sums[col] * scale);
+                        sums[col] += entering[col] - leaving[col];
+                    }
+                }
+            }
+        },
+        64);
+    return output;
+}
+
+/**
+ * Applies a (2 * radius + 1) square box blur to every plane.
+ *
+ * @param planar The planes to blur in place.
+ * @param radius The blur radius in pixels; values < 1 leave the planes unchanged.
+ */
+void box_blur(PlanarImage &planar, int radius)
+{
+    if (radius < 1 || planar.width == 0)
+        return;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        vector<float> horizontal = box_rows(planar.planes[channel], planar.width, planar.height, radius);
+        planar.planes[channel] = box_columns(horizontal, planar.width, planar.height, radius);
+    }
+}
+
+/**
+ * Applies a Gaussian blur to every plane.
+ *
+ * Small sigmas use the exact separable kernel. Larger ones use three successive box blurs
+ * whose combined variance matches the Gaussian, which keeps the cost per pixel constant.
+ *
+ * @param planar The planes to blur in place.
+ * @param sigma  The standard deviation in pixels; values <= 0 leave the planes unchanged.
+ */
+void gaussian_blur(PlanarImage &planar, double sigma)
+{
+    if (sigma <= 0.0 || planar.width == 0)
+        return;
+    if (static_cast<int>(ceil(3.0 * sigma)) > MAX_GAUSSIAN_RADIUS)
+    {
+        // Three box passes of width w have variance 3 * (w * w - 1) / 12
+        int radius = max(1, static_cast<int>(floor((sqrt(4.0 * sigma * sigma + 1.0) - 1.0) / 2.0 + 0.5)));
+        for (int pass = 0; pass < 3; ++pass)
+            box_blur(planar, radius);
+        return;
+    }
+    vector<float> kernel = gaussian_kernel(sigma);
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        vector<float> horizontal = convolve_rows(planar.planes[channel], planar.width, planar.height, kernel);
+        planar.planes[channel] = convolve_columns(horizontal, planar.width, planar.height, kernel);
+    }
+}
+
+/**
+ * Sharpens an image by adding back the difference between it and a blurred copy.
+ *
+ * @param image  The input image (row-major order).
+ * @param sigma  Blur radius (standard deviation) that defines the detail being boosted.
+ * @param amount How strongly to boost the detail (e.g. 1.0 doubles it).
+ * @return The sharpened image.
+ */
+vector<vector<Pixel>> unsharp_mask(const vector<vector<Pixel>> &image, double sigma, double amount)
+{
+    PlanarImage original = to_planar(image);
+    PlanarImage blurred = original;
+    gaussian_blur(blurred, sigma);
+    const float strength = static_cast<float>(amount);
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        vector<float> &out = blurred.planes[channel];
+        const vector<float> &in = original.planes[channel];
+        for (size_t i = 0; i < out.size(); ++i)
+            out[i] = in[i] + strength * (in[i] - out[i]);
+    }
+    return from_planar(blurred);
+}
+
+/**
+ * Computes the Sobel edge magnitude of the image brightness.
+ *
+ * Both 3x3 Sobel kernels are separable into a [1 2 1] smoothing pass and a [-1 0 1]
+ * derivative pass, so each gradient costs two short 1D passes.
+ *
+ * @param image The input image (row-major order).
+ * @return A grayscale image where brighter pixels mark stronger edges.
+ */
+vector<vector<Pixel>> sobel_edges(const vector<vector<Pixel>> &image)
+{
+    PlanarImage planar = to_planar(image);
+    int width = planar.width;
+    int height = planar.height;
+    vector<float> luma(planar.planes[0].size());
+    for (size_t i = 0; i < luma.size(); ++i)
+        luma[i] = (planar.planes[0][i] + planar.planes[1][i] + planar.planes[2][i]) / 3.0f;
+
+    vector<float> smooth(3);
+    smooth[0] = 1.0f;
+    smooth[1] = 2.0f;
+    smooth[2] = 1.0f;
+    vector<float> derivative(3);
+    derivative[0] = -1.0f;
+    derivative[1] = 0.0f;
+    derivative[2] = 1.0f;
+
+    vector<float> gradient_x = convolve_columns(convolve_rows(luma, width, height, derivative), width, height, smooth);
+    vector<float> gradient_y = convolve_columns(convolve_rows(luma, width, height, smooth), width, height, derivative);
+
+    for (size_t i = 0; i < luma.size(); ++i)
+        luma[i] = sqrt(gradient_x[i] * gradient_x[i] + gradient_y[i] * gradient_y[i]);
+    for (int channel = 0; channel < 3; ++channel)
+        planar.planes[channel] = luma;
+    return from_planar(planar);
+}
+
+} // namespace convolution
+
+/**
+ * @namespace color
+ * @brief Conversions between RGB and the HSV, HSL and YCbCr color spaces, and the fused
+ *        hue / saturation / exposure adjustment built on them.
+ *
+ * The kernels convert a whole row at a time between interleaved Pixels and three planar float
+ * arrays (one per component). The per-pixel math is written without data-dependent branches
+ * (selects, min/max and fmod instead of if/else chains), so the compiler can vectorize the loops.
+ *
+ * Component ranges: RGB channels and Y, Cb, Cr are in [0, 255] (YCbCr is the full-range BT.601
+ * variant used by JPEG); hue is in degrees [0, 360); saturation, value and lightness are in [0, 1].
+ *
+ * Hue rotation, saturation scaling and exposure each touch a different HSV component, so any
+ * number of them are applied together in one pass: RGB -> HSV, adjust, HSV -> RGB per row,
+ * with no full-image intermediate.
+ */
+namespace color
+{
+
+/**
+ * A combined hue, saturation and exposure adjustment. The default is the identity.
+ */
+struct Adjustment
+{
+    double hue_degrees = 0.0;    // Added to the hue
+    double saturation = 1.0;     // Multiplies the saturation
+    double exposure_stops = 0.0; // Multiplies the value by 2^stops
+
+    /**
+     * Combines another adjustment into this one. The components are independent, so the result
+     * matches applying both in sequence except that clamping only happens once, at the end.
+     */
+    void compose(const Adjustment &other)
+    {
+        hue_degrees += other.hue_degrees;
+        saturation *= other.saturation;
+        exposure_stops += other.exposure_stops;
+    }
+};
+
+inline int to_channel(float value)
+{
+    return static_cast<int>(max(0.0f, min(255.0f, value)) + 0.5f);
+}
+
+/**
+ * Converts a row of RGB pixels to HSV planes.
+ */
+void rgb_to_hsv_row(const Pixel *source, int width, float *hue, float *saturation, float *value)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float r = source[i].red / 255.0f, g = source[i].green / 255.0f, b = source[i].blue / 255.0f;
+        float high = max(r, max(g, b));
+        float low = min(r, min(g, b));
+        float delta = high - low;
+        float safe_delta = delta > 0.0f ? delta : 1.0f;
+        float sector = high == r ? (g - b) / safe_delta : (high == g ? 2.0f + (b - r) / safe_delta
+                                                                     : 4.0f + (r - g) / safe_delta);
+        float h = delta > 0.0f ? sector * 60.0f : 0.0f;
+        hue[i] = h < 0.0f ? h + 360.0f : h;
+        saturation[i] = high > 0.0f ? delta / high : 0.0f;
+        value[i] = high;
+    }
+}
+
+/**
+ * Converts HSV planes back to a row of RGB pixels.
+ */
+void hsv_to_rgb_row(const float *hue, const float *saturation, const float *value, int width, Pixel *target)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float h = hue[i] / 60.0f, s = saturation[i], v = value[i];
+        // Channel n is v - v s max(0, min(k, 4 - k, 1)) with k = (n + h) mod 6
+        float k_red = fmod(5.0f + h, 6.0f), k_green = fmod(3.0f + h, 6.0f), k_blue = fmod(1.0f + h, 6.0f);
+        float red = v - v * s * max(0.0f, min(k_red, min(4.0f - k_red, 1.0f)));
+        float green = v - v * s * max(0.0f, min(k_green, min(4.0f - k_green, 1.0f)));
+        float blue = v - v * s * max(0.0f, min(k_blue, min(4.0f - k_blue, 1.0f)));
+        target[i] = Pixel{to_channel(red * 255.0f), to_channel(green * 255.0f), to_channel(blue * 255.0f)};
+    }
+}
+
+/**
+ * Converts a row of RGB pixels to HSL planes.
+ */
+void rgb_to_hsl_row(const Pixel *source, int width, float *hue, float *saturation, float *lightness)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float r = source[i].red / 255.0f, g = source[i].green / 255.0f, b = source[i].blue / 255.0f;
+        float high = max(r, max(g, b));
+        float low = min(r, min(g, b));
+        float delta = high - low;
+        float safe_delta = delta > 0.0f ? delta : 1.0f;
+        float sector = high == r ? (g - b) / safe_delta : (high == g ? 2.0f + (b - r) / safe_delta
+                                                                     : 4.0f + (r - g) / safe_delta);
+        float h = delta > 0.0f ? sector * 60.0f : 0.0f;
+        float l = (high + low) * 0.5f;
+        float spread = 1.0f - fabs(2.0f * l - 1.0f);
+        hue[i] = h < 0.0f ? h + 360.0f : h;
+        saturation[i] = spread > 0.0f ? delta / spread : 0.0f;
+        lightness[i] = l;
+    }
+}
+
+/**
+ * Converts HSL planes back to a row of RGB pixels.
+ */
+void hsl_to_rgb_row(const float *hue, const float *saturation, const float *lightness, int width, Pixel *target)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float h = hue[i] / 30.0f, l = lightness[i];
+        float a = saturation[i] * min(l, 1.0f - l);
+        // Channel n is l - a max(-1, min(k - 3, 9 - k, 1)) with k = (n + h) mod 12
+        float k_red = fmod(h, 12.0f), k_green = fmod(8.0f + h, 12.0f), k_blue = fmod(4.0f + h, 12.0f);
+        float red = l - a * max(-1.0f, min(k_red - 3.0f, min(9.0f - k_red, 1.0f)));
+        float green = l - a * max(-1.0f, min(k_green - 3.0f, min(9.0f - k_green, 1.0f)));
+        float blue = l - a * max(-1.0f, min(k_blue - 3.0f, min(9.0f - k_blue, 1.0f)));
+        target[i] = Pixel{to_channel(red * 255.0f), to_channel(green * 255.0f), to_channel(blue * 255.0f)};
+    }
+}
+
+/**
+ * Converts a row of RGB pixels to full-range YCbCr planes.
+ */
+void rgb_to_ycbcr_row(const Pixel *source, int width, float *luma, float *blue_diff, float *red_diff)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float r = source[i].red, g = source[i].green, b = source[i].blue;
+        luma[i] = 0.299f * r + 0.587f * g + 0.114f * b;
+        blue_diff[i] = 128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b;
+        red_diff[i] = 128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b;
+    }
+}
+
+/**
+ * Converts full-range YCbCr planes back to a row of RGB pixels.
+ */
+void ycbcr_to_rgb_row(const float *luma, const float *blue_diff, const float *red_diff, int width, Pixel *target)
+{
+    for (int i = 0; i < width; ++i)
+    {
+        float cb = blue_diff[i] - 128.0f, cr = red_diff[i] - 128.0f;
+        target[i] = Pixel{to_channel(luma[i] + 1.402f * cr), to_channel(luma[i] - 0.344136f * cb - 0.714136f * cr),
+                          to_channel(luma[i] + 1.772f * cb)};
+    }
+}
+
+/**
+ * Applies a hue, saturation and exposure adjustment in a single pass, overwriting the image.
+ * Each thread converts one row at a time into its own scratch planes.
+ *
+ * @param image      The image to modify (row-major order).
+ * @param adjustment The adjustment to apply.
+ */
+void adjust_in_place(vector<vector<Pixel>> &image, const Adjustment &adjustment)
+{
+    if (image.empty())
+        return;
+    int width = image[0].size();
+    float hue_shift = static_cast<float>(fmod(adjustment.hue_degrees, 360.0) + 360.0);
+    float saturation_scale = static_cast<float>(adjustment.saturation);
+    float gain = static_cast<float>(pow(2.0, adjustment.exposure_stops));
+
+    parallel_utils::parallel_for(0, static_cast<int>(image.size()), [&](int row_begin, int row_end, int) {
+        vector<float> hue(width), saturation(width), value(width);
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            rgb_to_hsv_row(image[row].data(), width, hue.data(), saturation.data(), value.data());
+            for (int i = 0; i < width; ++i)
+            {
+                hue[i] = fmod(hue[i] + hue_shift, 360.0f);
+                saturation[i] = min(1.0f, saturation[i] * saturation_scale);
+                value[i] = min(1.0f, value[i] * gain);
+            }
+            hsv_to_rgb_row(hue.data(), saturation.data(), value.data(), width, image[row].data());
+        }
+    });
+}
+
+} // namespace color
+
+/**
+ * @namespace region
+ * @brief Rectangles of interest: applying a filter to part of an image, and cropping.
+ *
+ * A filter is applied to a region by copying just that rectangle (plus a halo of neighbours
+ * for filters that read around each pixel) into a small image from the buffer pool, running
+ * the filter on it, and copying the inner rectangle back. Everything outside the rectangle is
+ * left alone, so the work and memory traffic scale with the region's area instead of the image's.
+ *
+ * Filters that read the whole image (vignette, auto levels, automatic threshold) see the region
+ * as their whole image: the vignette is centred on the region and the statistics are the
+ * region's own.
+ *
+ * Cropping keeps the row buffers that fall inside the rectangle and hands the others back to
+ * the pool; no pixel is copied when the crop starts at column 0, and otherwise each kept row
+ * only shifts its own pixels down.
+ */
+namespace region
+{
+
+/**
+ * An axis-aligned rectangle in pixel coordinates (x = column, y = row).
+ */
+struct Rect
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+
+/**
+ * Intersects a rectangle with the bounds of a width x height image.
+ *
+ * @return The clipped rectangle; empty if it lies completely outside.
+ */
+Rect clip(const Rect &rect, int width, int height)
+{
+    Rect clipped;
+    clipped.x = max(0, rect.x);
+    clipped.y = max(0, rect.y);
+    clipped.width = min(width, rect.x + rect.width) - clipped.x;
+    clipped.height = min(height, rect.y + rect.height) - clipped.y;
+    return clipped;
+}
+
+/**
+ * Copies a rectangle out of an image.
+ *
+ * @param image The source image (row-major order).
+ * @param rect  The rectangle to copy; must lie inside the image.
+ * @return A rect.width x rect.height image drawn from the buffer pool.
+ */
+vector<vector<Pixel>> extract(const vector<vector<Pixel>> &image, const Rect &rect)
+{
+    vector<vector<Pixel>> patch = buffer_pool::acquire_image(rect.height, rect.width);
+    for (int row = 0; row < rect.height; ++row)
+    {
+        const Pixel *source = &image[rect.y + row][rect.x];
+        copy(source, source + rect.width, patch[row].begin());
+    }
+    return patch;
+}
+
+/**
+ * Copies part of a patch into an image.
+ *
+ * @param image  The image to write into (row-major order).
+ * @param patch  The source patch.
+ * @param source The rectangle of the patch to copy.
+ * @param x      Destination column of the rectangle's left edge.
+ * @param y      Destination row of the rectangle's top edge.
+ */
+void paste(vector<vector<Pixel>> &image, const vector<vector<Pixel>> &patch, const Rect &source, int x, int y)
+{
+    for (int row = 0; row < source.height; ++row)
+    {
+        const Pixel *from = &patch[source.y + row][source.x];
+        copy(from, from + source.width, image[y + row].begin() + x);
+    }
+}
+
+/**
+ * Runs a filter on one rectangle of an image.
+ *
+ * @param image  The image to modify (row-major order).
+ * @param rect   The rectangle to change; clipped to the image.
+ * @param halo   How many pixels around the rectangle the filter reads (0 for point filters).
+ * @param filter Callable taking the extracted patch by reference and replacing it with the
+ *               filtered patch; returns false on failure.
+ * @param error  Receives a message if the region is empty or the filter changed the patch size.
+ * @return True if the region was filtered, false otherwise.
+ */
+template <typename Filter>
+bool apply_in_region(vector<vector<Pixel>> &image, const Rect &rect, int halo, Filter filter, string &error)
+{
+    int height = image.size();
+    int width = height == 0 ? 0 : image[0].size();
+    Rect target = clip(rect, width, height);
+    if (target.empty())
+    {
+        error = "The region lies outside the image";
+        return false;
+    }
+
+    Rect grown = target;
+    grown.x -= halo;
+    grown.y -= halo;
+    grown.width += 2 * halo;
+    grown.height += 2 * halo;
+    grown = clip(grown, width, height);
+
+    vector<vector<Pixel>> patch = extract(image, grown);
+    bool ok = filter(patch);
+    if (ok && (static_cast<int>(patch.size()) != grown.height || static_cast<int>(patch[0].size()) != grown.width))
+    {
+        error = "Operations that change the image size cannot be applied to a region";
+        ok = false;
+    }
+    if (ok)
+    {
+        Rect inner = target;
+        inner.x -= grown.x;
+        inner.y -= grown.y;
+        paste(image, patch, inner, target.x, target.y);
+    }
+    buffer_pool::release_image(patch);
+    return ok;
+}
+
+/**
+ * Crops an image to a rectangle without copying the rows that are kept.
+ *
+ * @param image The image to crop (row-major order); replaced by the cropped image.
+ * @param rect  The rectangle to keep; clipped to the image.
+ * @return True if the clipped rectangle is not empty, false otherwise (image unchanged).
+ */
+bool crop_in_place(vector<vector<Pixel>> &image, const Rect &rect)
+{
+    int height = image.size();
+    Rect target = clip(rect, height == 0 ? 0 : image[0].size(), height);
+    if (target.empty())
+        return false;
+
+    // Move the kept row buffers to the front and recycle the rest
+    for (int row = 0; row < target.height; ++row)
+        image[row].swap(image[target.y + row]);
+    vector<vector<Pixel>> dropped(image.size() - target.height);
+    for (size_t row = 0; row < dropped.size(); ++row)
+        dropped[row].swap(image[target.height + row]);
+    image.resize(target.height);
+    buffer_pool::release_image(dropped);
+
+    for (int row = 0; row < target.height; ++row)
+    {
+        if (target.x > 0)
+            copy(image[row].begin() + target.x, image[row].begin() + target.x + target.width, image[row].begin());
+        image[row].resize(target.width);
+    }
+    return true;
+}
+
+} // namespace region
+
+/**
+ * @namespace blend
+ * @brief Compositing one image (a layer) over another: alpha-over, multiply, screen and overlay.
+ *
+ * A layer carries an optional alpha plane, read from the fourth byte of 32-bit BGRA BMP files;
+ * 24-bit and 8-bit layers are opaque. The layer's alpha is combined with a constant opacity, and
+ * the layer can be placed at any offset over the base image (e.g. a watermark in a corner).
+ *
+ * All arithmetic is 8-bit fixed point: products of two 0-255 values are divided by 255 with the
+ * exact rounding shift trick, so no floating point is involved and the row loops vectorize.
+ * Rows of the overlap are split across threads.
+ */
+namespace blend
+{
+
+/**
+ * Blend modes. The mode picks the color the layer contributes; alpha then mixes it with the base.
+ */
+enum Mode
+{
+    BLEND_NORMAL = 1,   // The layer's color (alpha-over)
+    BLEND_MULTIPLY = 2, // Darkens: base * layer
+    BLEND_SCREEN = 3,   // Lightens: 1 - (1 - base)(1 - layer)
+    BLEND_OVERLAY = 4   // Multiply in the base's shadows, screen in its highlights
+};
+
+/**
+ * An image to composite, with an optional per-pixel alpha plane (row-major, one byte per pixel).
+ */
+struct Layer
+{
+    vector<vector<Pixel>> pixels;
+    vector<unsigned char> alpha; // Empty for a fully opaque layer
+};
+
+/**
+ * Parses a blend mode name as used by the batch operations.
+ *
+ * @param name "normal", "multiply", "screen" or "overlay".
+ * @param mode Receives the mode.
+ * @return True if the name is known, false otherwise.
+ */
+bool parse_mode(const string &name, Mode &mode)
+{
+    if (name == "normal")
+        mode = BLEND_NORMAL;
+    else if (name == "multiply")
+        mode = BLEND_MULTIPLY;
+    else if (name == "screen")
+        mode = BLEND_SCREEN;
+    else if (name == "overlay")
+        mode = BLEND_OVERLAY;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @return a * b / 255, rounded to nearest, for a and b in [0, 255].
+ */
+inline int multiply_255(int a, int b)
+{
+    int product = a * b + 128;
+    return (product + (product >> 8)) >> 8;
+}
+
+/**
+ * Computes the color a layer channel contributes over a base channel in the given mode.
+ */
+inline int blend_channel(int base, int top, Mode mode)
+{
+    switch (mode)
+    {
+    case BLEND_MULTIPLY:
+        return multiply_255(base, top);
+    case BLEND_SCREEN:
+        return 255 - multiply_255(255 - base, 255 - top);
+    case BLEND_OVERLAY:
+        return base < 128 ? 2 * multiply_255(base, top) : 255 - 2 * multiply_255(255 - base, 255 - top);
+    default:
+        return top;
+    }
+}
+
+/**
+ * @return (base * (255 - alpha) + value * alpha) / 255, rounded to nearest.
+ */
+inline int mix_channel(int base, int value, int alpha)
+{
+    int mixed = base * (255 - alpha) + value * alpha + 128;
+    return (mixed + (mixed >> 8)) >> 8;
+}
+
+/**
+ * Reads the alpha bytes of a 32 bits per pixel BMP.
+ *
+ * @param filename The BMP file to read.
+ * @param alpha    Receives one byte per pixel, row-major from the top row; left empty if the
+ *                 file is not 32-bit or its alpha bytes are all zero (an unused fourth byte).
+ */
+void read_alpha(const string &filename, vector<unsigned char> &alpha)
+{
+    alpha.clear();
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open() || get_int(stream, 28, 2) != 32)
+        return;
+    int start = get_int(stream, 10, 4);
+    int width = get_int(stream, 18, 4);
+    int height = get_int(stream, 22, 4);
+    if (width <= 0 || height <= 0)
+        return;
+
+    alpha.resize(static_cast<size_t>(width) * height);
+    vector<unsigned char> scanline(static_cast<size_t>(width) * 4);
+    bool any_alpha = false;
+    stream.seekg(start);
+    // BMP files store rows from bottom to top, 4 bytes per pixel in blue, green, red, alpha order
+    for (int row = height - 1; row >= 0; --row)
+    {
+        if (!stream.read(reinterpret_cast<char *>(scanline.data()), scanline.size()))
+        {
+            alpha.clear();
+            return;
+        }
+        unsigned char *target = &alpha[static_cast<size_t>(row) * width];
+        for (int col = 0; col < width; ++col)
+        {
+            target[col] = scanline[col * 4 + 3];
+            any_alpha = any_alpha || target[col] != 0;
+        }
+    }
+    if (!any_alpha)
+        alpha.clear();
+}
+
+/**
+ * Reads a layer from a 32-bit BGRA, 24-bit or 8-bit grayscale BMP.
+ *
+ * @param filename The BMP file to read.
+ * @param layer    Receives the pixels and, for 32-bit files with alpha, the alpha plane.
+ * @return True if the file was read, false otherwise.
+ */
+bool load_layer(const string &filename, Layer &layer)
+{
+    if (luma::is_gray_bmp(filename))
+    {
+        layer.pixels = luma::from_gray(luma::read_gray_bmp(filename));
+        layer.alpha.clear();
+    }
+    else
+    {
+        layer.pixels = bmp_io::read(filename);
+        read_alpha(filename, layer.alpha);
+    }
+    return !layer.pixels.empty();
+}
+
+/**
+ * Composites a layer over an image, overwriting the image where they overlap.
+ *
+ * @param image   The base image to modify (row-major order).
+ * @param layer   The layer to composite.
+ * @param mode    The blend mode.
+ * @param opacity Constant opacity in [0, 255], multiplied with the layer's own alpha.
+ * @param x       Column of the base image where the layer's left edge goes (may be negative).
+ * @param y       Row of the base image where the layer's top edge goes (may be negative).
+ */
+void composite_in_place(vector<vector<Pixel>> &image, const Layer &layer, Mode mode, int opacity, int x = 0, int y = 0)
+{
+    if (image.empty() || layer.pixels.empty())
+        return;
+    int layer_width = layer.pixels[0].size();
+    int col_begin = max(0, x), col_end = min(static_cast<int>(image[0].size()), x + layer_width);
+    int row_begin = max(0, y), row_end = min(static_cast<int>(image.size()), y + static_cast<int>(layer.pixels.size()));
+    if (col_begin >= col_end || row_begin >= row_end)
+        return;
+    opacity = max(0, min(255, opacity));
+
+    parallel_utils::parallel_for(row_begin, row_end, [&](int chunk_begin, int chunk_end, int) {
+        for (int row = chunk_begin; row < chunk_end; ++row)
+        {
+            Pixel *base = image[row].data();
+            const Pixel *top = layer.pixels[row - y].data() - x;
+            const unsigned char *alpha =
+                layer.alpha.empty() ? nullptr : &layer.alpha[static_cast<size_t>(row - y) * layer_width] - x;
+            for (int col = col_begin; col < col_end; ++col)
+            {
+                int a = alpha ? multiply_255(alpha[col], opacity) : opacity;
+                Pixel &p = base[col];
+                const Pixel &t = top[col];
+                p.red = mix_channel(p.red, blend_channel(p.red, t.red, mode), a);
+                p.green = mix_channel(p.green, blend_channel(p.green, t.green, mode), a);
+                p.blue = mix_channel(p.blue, blend_channel(p.blue, t.blue, mode), a);
+            }
+        }
+    });
+}
+
+} // namespace blend
+
+/**
+ * @namespace pyramid
+ * @brief Builds image pyramids (mipmaps): successive half-size, 2x2 box-filtered downscales.
+ *
+ * Each level is computed from the previous one rather than from the full image, so every level
+ * after the first reads an image a quarter the size of the one before and the whole pyramid costs
+ * about 1 + 1/4 + 1/16 + ... = 1.33 passes over the input. Each output row reads exactly two
+ * input rows front to back, so the pass streams through memory, and output rows are split across
+ * threads. Odd widths and heights repeat the last column or row.
+ */
+namespace pyramid
+{
+
+/**
+ * Halves an image in both directions by averaging each 2x2 block.
+ *
+ * @param image The input image (row-major order).
+ * @return The downscaled image, ceil(height / 2) x ceil(width / 2), drawn from the buffer pool.
+ */
+vector<vector<Pixel>> downscale_2x(const vector<vector<Pixel>> &image)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    int width = image[0].size();
+    int new_height = (height + 1) / 2;
+    int new_width = (width + 1) / 2;
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(new_height, new_width);
+
+    parallel_utils::parallel_for(0, new_height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            const Pixel *upper = image[2 * row].data();
+            const Pixel *lower = image[min(2 * row + 1, height - 1)].data();
+            Pixel *target = new_image[row].data();
+            for (int col = 0; col < new_width; ++col)
+            {
+                int left = 2 * col, right = min(2 * col + 1, width - 1);
+                target[col].red = (upper[left].red + upper[right].red + lower[left].red + lower[right].red + 2) >> 2;
+                target[col].green =
+                    (upper[left].green + upper[right].green + lower[left].green + lower[right].green + 2) >> 2;
+                target[col].blue = (upper[left].blue + upper[right].blue + lower[left].blue + lower[right].blue + 2) >> 2;
+            }
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Builds the levels of a pyramid below the input image.
+ *
+ * @param image  The full-size image (level 0, not included in the result).
+ * @param levels How many levels to build; stops early once a level is 1x1.
+ * @return Levels 1, 2, ... in order, each half the size of the one before.
+ */
+vector<vector<vector<Pixel>>> build(const vector<vector<Pixel>> &image, int levels)
+{
+    vector<vector<vector<Pixel>>> pyramid;
+    const vector<vector<Pixel>> *previous = &image;
+    for (int level = 1; level <= levels && !previous->empty(); ++level)
+    {
+        if (previous->size() == 1 && (*previous)[0].size() == 1)
+            break;
+        pyramid.push_back(downscale_2x(*previous));
+        previous = &pyramid.back();
+    }
+    return pyramid;
+}
+
+/**
+ * @return The file name for a pyramid level: "<prefix>_<level>.bmp" (a ".bmp" prefix suffix is dropped).
+ */
+string level_filename(const string &prefix, int level)
+{
+    string base = prefix;
+    if (base.size() >= 4 && (base.substr(base.size() - 4) == ".bmp" || base.substr(base.size() - 4) == ".BMP"))
+        base = base.substr(0, base.size() - 4);
+    return base + "_" + std::to_string(level) + ".bmp";
+}
+
+/**
+ * Writes every level of a pyramid, one file per level, encoding the levels in parallel.
+ *
+ * @param pyramid The levels from build().
+ * @param prefix  File name prefix (see level_filename()).
+ * @param error   Receives a message naming the first file that could not be written.
+ * @return True if every level was written, false otherwise.
+ */
+bool write_levels(const vector<vector<vector<Pixel>>> &pyramid, const string &prefix, string &error)
+{
+    vector<char> written(pyramid.size(), 0);
+    parallel_utils::parallel_for(
+        0, static_cast<int>(pyramid.size()),
+        [&](int level_begin, int level_end, int) {
+            for (int level = level_begin; level < level_end; ++level)
+                written[level] = bmp_io::write(level_filename(prefix, level + 1), pyramid[level]);
+        },
+        1);
+    for (size_t level = 0; level < written.size(); ++level)
+    {
+        if (!written[level])
+        {
+            error = "Failed to write output image: " + level_filename(prefix, level + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace pyramid
+
+/**
+ * @namespace geometry
+ * @brief Folds chains of geometric operations (rotations and enlargements) into one resample.
+ *
+ * Every geometric operation is described by a 2x3 affine matrix in continuous image
+ * coordinates, where pixel (row, col) covers [col, col + 1) x [row, row + 1) and its center
+ * is at (col + 0.5, row + 0.5). A Transform accumulates the matrices of consecutive
+ * operations (and their inverses, built analytically so no matrix is ever inverted numerically)
+ * together with the output size each step produces. resample() then makes a single pass over
+ * the output:
+ *   - If the combined matrix only permutes, flips and scales the axes by whole numbers (any mix
+ *     of 90 degree turns and enlargements), every output pixel is an exact copy of one input
+ *     pixel; the source row and column are computed once per output column and row with
+ *     integer arithmetic.
+ *   - Otherwise each output pixel center is mapped back into the input and sampled bilinearly,
+ *     so a rotate-then-enlarge chain is interpolated once instead of twice.
+ */
+namespace geometry
+{
+
+/**
+ * A 2x3 affine matrix: x' = xx * x + xy * y + x0 and y' = yx * x + yy * y + y0.
+ */
+struct Affine
+{
+    double xx, xy, x0;
+    double yx, yy, y0;
+};
+
+/**
+ * Returns the matrix that applies inner first and then outer.
+ */
+Affine compose(const Affine &outer, const Affine &inner)
+{
+    return Affine{outer.xx * inner.xx + outer.xy * inner.yx,
+                  outer.xx * inner.xy + outer.xy * inner.yy,
+                  outer.xx * inner.x0 + outer.xy * inner.y0 + outer.x0,
+                  outer.yx * inner.xx + outer.yy * inner.yx,
+                  outer.yx * inner.xy + outer.yy * inner.yy,
+                  outer.yx * inner.x0 + outer.yy * inner.y0 + outer.y0};
+}
+
+/**
+ * A chain of geometric operations applied to an image of a given size.
+ */
+struct Transform
+{
+    int source_width;
+    int source_height;
+    int width;       // Output size after the last operation
+    int height;
+    Affine forward;  // Input coordinates to output coordinates
+    Affine inverse;  // Output coordinates to input coordinates
+};
+
+/**
+ * Starts an empty chain for an image of the given size.
+ */
+Transform identity(int width, int height)
+{
+    Affine unit{1, 0, 0, 0, 1, 0};
+    return Transform{width, height, width, height, unit, unit};
+}
+
+/**
+ * Appends one operation to a chain.
+ *
+ * @param transform The chain to extend.
+ * @param forward   The operation's matrix, from its input to its output coordinates.
+ * @param inverse   The inverse of forward.
+ * @param width     The operation's output width.
+ * @param height    The operation's output height.
+ */
+void append(Transform &transform, const Affine &forward, const Affine &inverse, int width, int height)
+{
+    transform.forward = compose(forward, transform.forward);
+    transform.inverse = compose(transform.inverse, inverse);
+    transform.width = width;
+    transform.height = height;
+}
+
+/**
+ * Appends a clockwise rotation by a multiple of 90 degrees (negative turns rotate counterclockwise).
+ */
+void rotate_quarter_turns(Transform &transform, int turns)
+{
+    for (int i = ((turns % 4) + 4) % 4; i > 0; --i)
+    {
+        // (x, y) -> (height - y, x): the top row becomes the right column
+        double height = transform.height;
+        append(transform, Affine{0, -1, height, 1, 0, 0}, Affine{0, 1, 0, -1, 0, height}, transform.height,
+               transform.width);
+    }
+}
+
+/**
+ * Appends an enlargement by whole-number factors.
+ *
+ * @return False if either factor is not positive or the result would be too large.
+ */
+bool enlarge(Transform &transform, int x_scale, int y_scale)
+{
+    if (x_scale <= 0 || y_scale <= 0 || static_cast<long long>(transform.width) * x_scale > numeric_limits<int>::max() ||
+        static_cast<long long>(transform.height) * y_scale > numeric_limits<int>::max())
+        return false;
+    append(transform, Affine{static_cast<double>(x_scale), 0, 0, 0, static_cast<double>(y_scale), 0},
+           Affine{1.0 / x_scale, 0, 0, 0, 1.0 / y_scale, 0}, transform.width * x_scale, transform.height * y_scale);
+    return true;
+}
+
+/**
+ * Appends a clockwise rotation by an arbitrary angle about the image center. The output is the
+ * bounding box of the rotated image plus one pixel, as process_11 has always produced.
+ */
+void rotate_degrees(Transform &transform, int degrees)
+{
+    double angle = -degrees * M_PI / 180.0;
+    double cos_angle = cos(angle);
+    double sin_angle = sin(angle);
+    double center_x = transform.width / 2.0;
+    double center_y = transform.height / 2.0;
+
+    // Rotate the corners (relative to the center) to find the bounding box
+    double min_x = 0, max_x = 0, min_y = 0, max_y = 0;
+    for (int corner = 0; corner < 4; ++corner)
+    {
+        double x = (corner == 1 || corner == 2 ? transform.width : 0) - center_x;
+        double y = (corner >= 2 ? transform.height : 0) - center_y;
+        double rotated_x = x * cos_angle - y * sin_angle;
+        double rotated_y = x * sin_angle + y * cos_angle;
+        min_x = corner == 0 ? rotated_x : min(min_x, rotated_x);
+        max_x = corner == 0 ? rotated_x : max(max_x, rotated_x);
+        min_y = corner == 0 ? rotated_y : min(min_y, rotated_y);
+        max_y = corner == 0 ? rotated_y : max(max_y, rotated_y);
+    }
+    int new_width = static_cast<int>(ceil(max_x - min_x)) + 1;
+    int new_height = static_cast<int>(ceil(max_y - min_y)) + 1;
+
+    // Pixel (col, row) of the output samples the input at R^-1 * (col - new center) + center, in
+    // pixel-index coordinates; the half-pixel shifts convert to and from continuous coordinates
+    double new_center_x = new_width / 2.0 + 0.5;
+    double new_center_y = new_height / 2.0 + 0.5;
+    center_x += 0.5;
+    center_y += 0.5;
+    Affine forward{cos_angle,
+                   -sin_angle,
+                   new_center_x - cos_angle * center_x + sin_angle * center_y,
+                   sin_angle,
+                   cos_angle,
+                   new_center_y - sin_angle * center_x - cos_angle * center_y};
+    Affine inverse{cos_angle,
+                   sin_angle,
+                   center_x - cos_angle * new_center_x - sin_angle * new_center_y,
+                   -sin_angle,
+                   cos_angle,
+                   center_y + sin_angle * new_center_x - cos_angle * new_center_y};
+    append(transform, forward, inverse, new_width, new_height);
+}
+
+/**
+ * Rounds a matrix entry that is within rounding error of a whole number.
+ *
+ * @return True if the value is (nearly) whole.
+ */
+bool whole_number(double value, long &rounded)
+{
+    double nearest = floor(value + 0.5);
+    if (fabs(value - nearest) > 1e-9)
+        return false;
+    rounded = static_cast<long>(nearest);
+    return true;
+}
+
+/**
+ * Floor of numerator / denominator for any signs.
+ */
+long floor_divide(long numerator, long denominator)
+{
+    long quotient = numerator / denominator;
+    return (numerator % denominator != 0 && (numerator < 0) != (denominator < 0)) ? quotient - 1 : quotient;
+}
+
+/**
+ * For an axis whose forward map is x' = scale * x + offset (whole numbers), fills the source
+ * index of output indices [begin, begin + count): the input pixel whose area contains the output
+ * pixel's center. Indices outside [0, source_size) are stored as -1.
+ */
+vector<int> axis_map(int begin, int count, long scale, long offset, int source_size)
+{
+    vector<int> map(count);
+    for (int i = 0; i < count; ++i)
+    {
+        long source = floor_divide(2L * (begin + i) + 1 - 2 * offset, 2 * scale);
+        map[i] = source >= 0 && source < source_size ? static_cast<int>(source) : -1;
+    }
+    return map;
+}
+
+/**
+ * Finds the input rectangle that resampling an output rectangle reads.
+ *
+ * @param transform The accumulated chain.
+ * @param output    A rectangle of the output image.
+ * @return The input pixels the rectangle depends on, clipped to the input; may be empty.
+ */
+region::Rect source_rect(const Transform &transform, const region::Rect &output)
+{
+    const Affine &m = transform.inverse;
+    double min_x = 0, max_x = 0, min_y = 0, max_y = 0;
+    for (int corner = 0; corner < 4; ++corner)
+    {
+        // Pixel centers of the corner pixels, mapped back to pixel-index coordinates
+        double x = output.x + (corner & 1 ? output.width - 0.5 : 0.5);
+        double y = output.y + (corner & 2 ? output.height - 0.5 : 0.5);
+        double source_x = m.xx * x + m.xy * y + m.x0 - 0.5;
+        double source_y = m.yx * x + m.yy * y + m.y0 - 0.5;
+        min_x = corner == 0 ? source_x : min(min_x, source_x);
+        max_x = corner == 0 ? source_x : max(max_x, source_x);
+        min_y = corner == 0 ? source_y : min(min_y, source_y);
+        max_y = corner == 0 ? source_y : max(max_y, source_y);
+    }
+    // One extra pixel each way covers the bilinear neighbour and the nearest-pixel rounding
+    region::Rect rect;
+    rect.x = static_cast<int>(max(-1.0, floor(min_x) - 1));
+    rect.y = static_cast<int>(max(-1.0, floor(min_y) - 1));
+    rect.width = static_cast<int>(min(static_cast<double>(transform.source_width) + 1, floor(max_x) + 3)) - rect.x;
+    rect.height = static_cast<int>(min(static_cast<double>(transform.source_height) + 1, floor(max_y) + 3)) - rect.y;
+    return region::clip(rect, transform.source_width, transform.source_height);
+}
+
+/**
+ * Resamples a chain whose matrix is a whole-number permutation, flip and scale of the axes.
+ *
+ * @return True if the matrix qualified and new_image was filled.
+ */
+bool resample_exact(const vector<vector<Pixel>> &source, const region::Rect &source_area, const Transform &transform,
+                    const region::Rect &output, vector<vector<Pixel>> &new_image)
+{
+    long xx, xy, x0, yx, yy, y0;
+    const Affine &m = transform.forward;
+    if (!whole_number(m.xx, xx) || !whole_number(m.xy, xy) || !whole_number(m.x0, x0) || !whole_number(m.yx, yx) ||
+        !whole_number(m.yy, yy) || !whole_number(m.y0, y0))
+        return false;
+    bool transposed = xx == 0 && yy == 0 && xy != 0 && yx != 0;
+    if (!transposed && !(xy == 0 && yx == 0 && xx != 0 && yy != 0))
+        return false;
+
+    // Without transposition output columns follow input columns; with it they follow input rows
+    vector<int> col_map = transposed ? axis_map(output.x, output.width, xy, x0, transform.source_height)
+                                     : axis_map(output.x, output.width, xx, x0, transform.source_width);
+    vector<int> row_map = transposed ? axis_map(output.y, output.height, yx, y0, transform.source_width)
+                                     : axis_map(output.y, output.height, yy, y0, transform.source_height);
+    new_image = buffer_pool::acquire_image(output.height, output.width);
+    parallel_utils::parallel_for(0, output.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            Pixel *target = new_image[row].data();
+            int source_index = row_map[row];
+            for (int col = 0; col < output.width; ++col)
+            {
+                int other_index = col_map[col];
+                if (source_index < 0 || other_index < 0)
+                    target[col] = Pixel{0, 0, 0};
+                else if (transposed)
+                    target[col] = source[other_index - source_area.y][source_index - source_area.x];
+                else
+                    target[col] = source[source_index - source_area.y][other_index - source_area.x];
+            }
+        }
+    });
+    return true;
+}
+
+/**
+ * Samples the image bilinearly at a point given in pixel-index coordinates. Points outside the
+ * pixel centers of the image are black, as they always were for process_11.
+ *
+ * @param source      The input pixels that were fetched.
+ * @param source_area Where those pixels lie in the whole input.
+ * @param width       Width of the whole input.
+ * @param height      Height of the whole input.
+ */
+inline Pixel sample_bilinear(const vector<vector<Pixel>> &source, const region::Rect &source_area, int width,
+                             int height, double x, double y)
+{
+    // Right angles put sample points on pixel centers; keep rounding error from pushing them across
+    double nearest_x = floor(x + 0.5), nearest_y = floor(y + 0.5);
+    if (fabs(x - nearest_x) < 1e-9)
+        x = nearest_x;
+    if (fabs(y - nearest_y) < 1e-9)
+        y = nearest_y;
+    if (x < 0 || y < 0 || x > width - 1 || y > height - 1)
+        return Pixel{0, 0, 0};
+    // A point on the last row or column interpolates toward the one before it with full weight
+    int x0 = min(static_cast<int>(x), max(0, width - 2));
+    int y0 = min(static_cast<int>(y), max(0, height - 2));
+    int x1 = min(x0 + 1, width - 1);
+    int y1 = min(y0 + 1, height - 1);
+    double dx = x - x0;
+    double dy = y - y0;
+    const vector<Pixel> &top = source[y0 - source_area.y];
+    const vector<Pixel> &bottom = source[y1 - source_area.y];
+    const Pixel &p00 = top[x0 - source_area.x];
+    const Pixel &p10 = top[x1 - source_area.x];
+    const Pixel &p01 = bottom[x0 - source_area.x];
+    const Pixel &p11 = bottom[x1 - source_area.x];
+    double w00 = (1 - dx) * (1 - dy), w10 = dx * (1 - dy), w01 = (1 - dx) * dy, w11 = dx * dy;
+    double red = w00 * p00.red + w10 * p10.red + w01 * p01.red + w11 * p11.red;
+    double green = w00 * p00.green + w10 * p10.green + w01 * p01.green + w11 * p11.green;
+    double blue = w00 * p00.blue + w10 * p10.blue + w01 * p01.blue + w11 * p11.blue;
+    return Pixel{max(0, min(255, static_cast<int>(round(red)))), max(0, min(255, static_cast<int>(round(green)))),
+                 max(0, min(255, static_cast<int>(round(blue))))};
+}
+
+/**
+ * Produces one rectangle of a chain's output from part of its input.
+ *
+ * @param source      Input pixels covering at least source_rect(transform, output).
+ * @param source_area Where those pixels lie in the whole input.
+ * @param transform   The accumulated chain.
+ * @param output      The rectangle of the output to produce.
+ * @return An output.width x output.height image drawn from the buffer pool.
+ */
+vector<vector<Pixel>> resample_rect(const vector<vector<Pixel>> &source, const region::Rect &source_area,
+                                    const Transform &transform, const region::Rect &output)
+{
+    vector<vector<Pixel>> new_image;
+    if (resample_exact(source, source_area, transform, output, new_image))
+        return new_image;
+
+    new_image = buffer_pool::acquire_image(output.height, output.width);
+    const Affine &m = transform.inverse;
+    parallel_utils::parallel_for(0, output.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            double y = output.y + row + 0.5;
+            for (int col = 0; col < output.width; ++col)
+            {
+                double x = output.x + col + 0.5;
+                // Back to pixel-index coordinates, where pixel centers are whole numbers
+                new_image[row][col] =
+                    sample_bilinear(source, source_area, transform.source_width, transform.source_height,
+                                    m.xx * x + m.xy * y + m.x0 - 0.5, m.yx * x + m.yy * y + m.y0 - 0.5);
+            }
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Applies a chain of geometric operations to the image in one pass.
+ *
+ * @param image     The input image (row-major order); must be transform.source_width wide and
+ *                  transform.source_height tall.
+ * @param transform The accumulated chain.
+ * @return The transformed image, drawn from the buffer pool, or an empty image if the input
+ *         or the output size is empty.
+ */
+vector<vector<Pixel>> resample(const vector<vector<Pixel>> &image, const Transform &transform)
+{
+    if (image.empty() || transform.width <= 0 || transform.height <= 0)
+        return {};
+    region::Rect whole_input, whole_output;
+    whole_input.width = transform.source_width;
+    whole_input.height = transform.source_height;
+    whole_output.width = transform.width;
+    whole_output.height = transform.height;
+    return resample_rect(image, whole_input, transform, whole_output);
+}
+
+/**
+ * How an arbitrary rotation (process_11) is resampled.
+ */
+enum RotationMethod
+{
+    ROTATE_BILINEAR = 1, // One bilinear sample per output pixel; folds into chains
+    ROTATE_SHEAR = 2     // Three one-dimensional shears (Paeth)
+};
+
+/**
+ * Parses a rotation method name as used by the batch operations.
+ *
+ * @param name   "bilinear" or "shear".
+ * @param method Receives the method.
+ * @return True if the name is known, false otherwise.
+ */
+bool parse_rotation_method(const string &name, RotationMethod &method)
+{
+    if (name == "bilinear")
+        method = ROTATE_BILINEAR;
+    else if (name == "shear")
+        method = ROTATE_SHEAR;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Interpolation weights for shifting a row or column by a fractional offset: the Catmull-Rom
+ * cubic over the four pixels at step - 1 .. step + 2, in 16-bit fixed point summing to 65536.
+ */
+struct ShearTaps
+{
+    int step;
+    int weights[4];
+    bool whole; // The offset is a whole number, so pixel step is copied as it is
+};
+
+/**
+ * Computes the taps for one offset. Offsets within rounding error of a whole number copy pixels.
+ */
+ShearTaps shear_taps(double offset)
+{
+    ShearTaps taps;
+    double whole = floor(offset);
+    double t = offset - whole;
+    taps.step = static_cast<int>(whole);
+    if (t < 1e-9 || t > 1 - 1e-9)
+    {
+        taps.step += t > 0.5 ? 1 : 0;
+        taps.whole = true;
+        taps.weights[0] = taps.weights[2] = taps.weights[3] = 0;
+        taps.weights[1] = 65536;
+        return taps;
+    }
+    taps.whole = false;
+    double t2 = t * t, t3 = t2 * t;
+    taps.weights[0] = static_cast<int>(round(32768 * (-t3 + 2 * t2 - t)));
+    taps.weights[2] = static_cast<int>(round(32768 * (-3 * t3 + 4 * t2 + t)));
+    taps.weights[3] = static_cast<int>(round(32768 * (t3 - t2)));
+    taps.weights[1] = 65536 - taps.weights[0] - taps.weights[2] - taps.weights[3];
+    return taps;
+}
+
+/**
+ * Applies taps to four neighbouring pixels, clamping the cubic's overshoot.
+ */
+inline Pixel apply_taps(const Pixel &p0, const Pixel &p1, const Pixel &p2, const Pixel &p3, const int *w)
+{
+    int red = (p0.red * w[0] + p1.red * w[1] + p2.red * w[2] + p3.red * w[3] + 32768) >> 16;
+    int green = (p0.green * w[0] + p1.green * w[1] + p2.green * w[2] + p3.green * w[3] + 32768) >> 16;
+    int blue = (p0.blue * w[0] + p1.blue * w[1] + p2.blue * w[2] + p3.blue * w[3] + 32768) >> 16;
+    return Pixel{max(0, min(255, red)), max(0, min(255, green)), max(0, min(255, blue))};
+}
+
+/**
+ * Shifts one row by a fractional offset: target[col] samples source at col + offset, with black
+ * beyond both ends.
+ */
+void shear_row(const Pixel *source, int source_width, Pixel *target, int target_width, double offset)
+{
+    ShearTaps taps = shear_taps(offset);
+    const Pixel black{0, 0, 0};
+    // Columns whose four neighbours all lie inside the source take the fast path
+    int first = taps.whole ? 0 : 1, last = taps.whole ? 0 : 2;
+    int begin = max(0, min(target_width, first - taps.step));
+    int end = max(begin, min(target_width, source_width - last - taps.step));
+    for (int col = 0; col < target_width; ++col)
+    {
+        if (col == begin && begin < end)
+        {
+            const Pixel *from = source + begin + taps.step;
+            if (taps.whole)
+                copy(from, from + (end - begin), target + begin);
+            else
+                for (int i = 0; i < end - begin; ++i)
+                    target[begin + i] = apply_taps(from[i - 1], from[i], from[i + 1], from[i + 2], taps.weights);
+            col = end - 1;
+            continue;
+        }
+        const Pixel *neighbours[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            int index = col + taps.step - 1 + k;
+            neighbours[k] = index >= 0 && index < source_width ? source + index : &black;
+        }
+        target[col] = apply_taps(*neighbours[0], *neighbours[1], *neighbours[2], *neighbours[3], taps.weights);
+    }
+}
+
+/**
+ * Rotates the image like process_11, with the same output size and placement, but resamples
+ * with three one-dimensional shears instead of one bilinear pass (A. Paeth, "A Fast Algorithm
+ * for General Raster Rotation"): R = Sx(-tan(a / 2)) * Sy(sin(a)) * Sx(-tan(a / 2)).
+ *
+ * The image is first turned exactly by the nearest multiple of 90 degrees, so the shears never
+ * cover more than 45 degrees (right angles are only turned). Each shear moves whole rows (or
+ * columns) by a fractional offset, so it is a 4-tap Catmull-Rom shift along one axis with one
+ * set of weights per row (or column) (see ShearTaps), reading and writing rows sequentially.
+ * Pixels blend into black at the image edges rather than stopping at a hard edge.
+ *
+ * @param image   The input image (row-major order).
+ * @param degrees The angle in degrees to rotate clockwise.
+ * @return The rotated image, drawn from the buffer pool, or an empty image for an empty input.
+ */
+vector<vector<Pixel>> rotate_three_shear(const vector<vector<Pixel>> &image, int degrees)
+{
+    if (image.empty() || image[0].empty())
+        return {};
+    int width = image[0].size(), height = image.size();
+    Transform output = identity(width, height);
+    rotate_degrees(output, degrees);
+
+    // Right angles need no shears; resample() copies them exactly, just as process_11 does
+    int turns = static_cast<int>(floor(degrees / 90.0 + 0.5));
+    if (degrees == 90 * turns)
+        return resample(image, output);
+
+    // The exact turn, and where process_11's center of rotation lands in the turned image (in
+    // pixel-index coordinates, where pixel centers are whole numbers)
+    Transform turn = identity(width, height);
+    rotate_quarter_turns(turn, -turns);
+    vector<vector<Pixel>> turned;
+    if (turns % 4 != 0)
+        turned = resample(image, turn);
+    const vector<vector<Pixel>> &source = turns % 4 != 0 ? turned : image;
+    const Affine &f = turn.forward;
+    double old_center_x = width / 2.0 + 0.5, old_center_y = height / 2.0 + 0.5;
+    double center_x = f.xx * old_center_x + f.xy * old_center_y + f.x0 - 0.5;
+    double center_y = f.yx * old_center_x + f.yy * old_center_y + f.y0 - 0.5;
+    double new_center_x = output.width / 2.0, new_center_y = output.height / 2.0;
+    int source_width = turn.width, source_height = turn.height;
+
+    double angle = -(degrees - 90.0 * turns) * M_PI / 180.0;
+    double alpha = -tan(angle / 2), beta = sin(angle);
+
+    // Bounds of the image, relative to the center, after the first shear (x1 = x + alpha * y)
+    // and the second (y2 = y + beta * x1)
+    double min_x1 = 0, max_x1 = 0, min_y2 = 0, max_y2 = 0;
+    for (int corner = 0; corner < 4; ++corner)
+    {
+        double x = (corner & 1 ? source_width - 1 : 0) - center_x;
+        double y = (corner & 2 ? source_height - 1 : 0) - center_y;
+        double x1 = x + alpha * y;
+        double y2 = y + beta * x1;
+        min_x1 = corner == 0 ? x1 : min(min_x1, x1);
+        max_x1 = corner == 0 ? x1 : max(max_x1, x1);
+        min_y2 = corner == 0 ? y2 : min(min_y2, y2);
+        max_y2 = corner == 0 ? y2 : max(max_y2, y2);
+    }
+    // Intermediate column j holds x1 = j - origin_x and row i holds y2 = i - origin_y. The
+    // origins share the fractional part of the centers on either side, so a shear of zero copies
+    // whole pixels; two pixels of margin each way keep what the cubic spreads past the edges
+    double origin_x = center_x + ceil(-min_x1 - center_x) + 2;
+    double origin_y = new_center_y + ceil(-(min_y2 - 2 * fabs(beta)) - new_center_y) + 2;
+    int sheared_width = static_cast<int>(floor(max_x1 + origin_x)) + 3;
+    int sheared_height = static_cast<int>(floor(max_y2 + 2 * fabs(beta) + origin_y)) + 3;
+
+    // First shear: each source row moves horizontally
+    vector<vector<Pixel>> first = buffer_pool::acquire_image(source_height, sheared_width);
+    parallel_utils::parallel_for(0, source_height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+            shear_row(source[row].data(), source_width, first[row].data(), sheared_width,
+                      center_x - origin_x - alpha * (row - center_y));
+    });
+
+    // Second shear: each column moves vertically; the offsets are per column, so rows are still
+    // written in order and read from a few neighbouring rows
+    vector<ShearTaps> column_taps(sheared_width);
+    for (int col = 0; col < sheared_width; ++col)
+        column_taps[col] = shear_taps(center_y - origin_y - beta * (col - origin_x));
+    vector<vector<Pixel>> second = buffer_pool::acquire_image(sheared_height, sheared_width);
+    parallel_utils::parallel_for(0, sheared_height, [&](int row_begin, int row_end, int) {
+        const Pixel black{0, 0, 0};
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            Pixel *target = second[row].data();
+            for (int col = 0; col < sheared_width; ++col)
+            {
+                const ShearTaps &taps = column_taps[col];
+                int index = row + taps.step;
+                if (index >= 1 && index + 2 < source_height)
+                {
+                    target[col] = taps.whole ? first[index][col]
+                                             : apply_taps(first[index - 1][col], first[index][col],
+                                                          first[index + 1][col], first[index + 2][col], taps.weights);
+                    continue;
+                }
+                const Pixel *neighbours[4];
+                for (int k = 0; k < 4; ++k)
+                    neighbours[k] = index - 1 + k >= 0 && index - 1 + k < source_height ? &first[index - 1 + k][col]
+                                                                                       : &black;
+                target[col] = taps.whole ? *neighbours[1]
+                                         : apply_taps(*neighbours[0], *neighbours[1], *neighbours[2],
+                                                      *neighbours[3], taps.weights);
+            }
+        }
+    });
+    buffer_pool::release_image(first);
+    buffer_pool::release_image(turned);
+
+    // Third shear: each row moves horizontally again, straight into the output
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(output.height, output.width);
+    parallel_utils::parallel_for(0, output.height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            double y2 = row - new_center_y;
+            long index = lround(y2 + origin_y);
+            if (index < 0 || index >= sheared_height)
+                fill(new_image[row].begin(), new_image[row].end(), Pixel{0, 0, 0});
+            else
+                shear_row(second[index].data(), sheared_width, new_image[row].data(), output.width,
+                          origin_x - new_center_x - alpha * y2);
+        }
+    });
+    buffer_pool::release_image(second);
+    return new_image;
+}
+
+} // namespace geometry
+
+/**
+ * @namespace tiles
+ * @brief Lazy, demand-driven evaluation of a chain of operations, one tile at a time.
+ *
+ * A Graph is a chain of nodes over a source image: filters (point filters, or filters that read
+ * a fixed halo of neighbours) and geometric transforms. Nothing is computed when nodes are
+ * added. render() splits the output into square tiles (TILE_SIZE, or larger for filters with
+ * wide halos) and pulls each one from the last node; a node computes a tile by pulling just the
+ * input rectangle it needs from the node before it:
+ *   - a point filter needs the same rectangle,
+ *   - a filter with a halo needs the rectangle grown by the halo (clipped to the image, so the
+ *     pixels match filtering the whole image, as for region::apply_in_region()),
+ *   - a transform needs the bounding box of the rectangle mapped back into its input
+ *     (geometry::source_rect()).
+ * Nodes produce tiles on a fixed grid and every worker thread keeps a small least-recently-used
+ * cache of each node's tiles, so neighbouring tiles that need overlapping halos reuse the
+ * upstream tiles instead of recomputing them. Workers take contiguous bands of tile rows and walk
+ * each band in strips STRIP_TILES wide, which keeps those neighbours on the same thread and
+ * within a cache of fixed size.
+ *
+ * Only the source and the output are ever whole images; every intermediate lives in tiles, so a
+ * long chain on a large image works through cache-sized pieces with bounded memory.
+ */
+namespace tiles
+{
+
+const int TILE_SIZE = 64;
+const int STRIP_TILES = 8; // Tiles across each strip a worker walks down
+
+/**
+ * Filters a patch, replacing it with a patch of the same size. Returns false and sets the
+ * message on failure.
+ */
+typedef function<bool(vector<vector<Pixel>> &, string &)> Filter;
+
+enum NodeKind
+{
+    NODE_SOURCE = 0,
+    NODE_FILTER = 1,
+    NODE_GEOMETRY = 2
+};
+
+/**
+ * One step of the chain. Each node reads the node before it.
+ */
+struct Node
+{
+    NodeKind kind;
+    int width;
+    int height;
+    Filter filter; // NODE_FILTER
+    int halo;      // NODE_FILTER: pixels read around each output pixel
+    geometry::Transform transform; // NODE_GEOMETRY
+};
+
+/**
+ * A computed tile of one node, identified by its grid position.
+ */
+struct CachedTile
+{
+    int tile_x;
+    int tile_y;
+    unsigned long last_use;
+    vector<vector<Pixel>> pixels;
+};
+
+/**
+ * One worker's recently computed tiles of one node.
+ */
+struct TileCache
+{
+    vector<CachedTile> tiles;
+    size_t capacity = 0;
+    unsigned long clock = 0;
+};
+
+/**
+ * A lazily evaluated chain of filters and transforms over a source image.
+ */
+class Graph
+{
+  public:
+    /**
+     * @param source The image the chain starts from; must outlive the graph.
+     */
+    explicit Graph(const vector<vector<Pixel>> &source)
+        : source_(source), tile_size_(TILE_SIZE), tiles_down_(0), failed_(false), computed_(0), hits_(0)
+    {
+        Node node;
+        node.kind = NODE_SOURCE;
+        node.height = source.size();
+        node.width = source.empty() ? 0 : source[0].size();
+        node.halo = 0;
+        nodes_.push_back(node);
+    }
+
+    /**
+     * Appends a filter that keeps the image size.
+     *
+     * @param filter The filter to run on each patch.
+     * @param halo   How many pixels around each output pixel the filter reads (0 for point filters).
+     */
+    void add_filter(Filter filter, int halo)
+    {
+        Node node = nodes_.back();
+        node.kind = NODE_FILTER;
+        node.filter = filter;
+        node.halo = max(0, halo);
+        nodes_.push_back(node);
+    }
+
+    /**
+     * Appends a geometric transform; its source size must be the current output size.
+     */
+    void add_geometry(const geometry::Transform &transform)
+    {
+        Node node = nodes_.back();
+        node.kind = NODE_GEOMETRY;
+        node.filter = Filter();
+        node.halo = 0;
+        node.transform = transform;
+        node.width = transform.width;
+        node.height = transform.height;
+        nodes_.push_back(node);
+    }
+
+    /**
+     * @return The number of operations added to the chain.
+     */
+    size_t size() const
+    {
+        return nodes_.size() - 1;
+    }
+
+    int width() const
+    {
+        return nodes_.back().width;
+    }
+
+    int height() const
+    {
+        return nodes_.back().height;
+    }
+
+    /**
+     * Evaluates the chain, pulling the output tile by tile with tile rows split across threads.
+     *
+     * @param output Receives the result, drawn from the buffer pool.
+     * @param error  Receives the first filter error, if any.
+     * @return True if every tile was computed.
+     */
+    bool render(vector<vector<Pixel>> &output, string &error)
+    {
+        if (!prepare(error))
+            return false;
+        output = buffer_pool::acquire_image(height(), width());
+        if (!render_tile_rows(0, tiles_down_, output, error))
+        {
+            buffer_pool::release_image(output);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Evaluates the chain in bands of whole tile rows, top to bottom, handing each band to a sink
+     * (e.g. a file writer) before computing the next, so the output is never held in full.
+     *
+     * @param band_tile_rows How many tile rows each band holds.
+     * @param sink           Receives each band, the index of its first output row and its row
+     *                       count; returns false to stop.
+     * @param error          Receives the first filter error, if any (the sink reports its own).
+     * @return True if every band was computed and accepted.
+     */
+    bool render_streamed(int band_tile_rows, function<bool(const vector<vector<Pixel>> &, int, int)> sink,
+                         string &error)
+    {
+        if (!prepare(error))
+            return false;
+        band_tile_rows = max(1, band_tile_rows);
+        vector<vector<Pixel>> band = buffer_pool::acquire_image(min(height(), band_tile_rows * tile_size_), width());
+        bool ok = true;
+        for (int tile_row = 0; ok && tile_row < tiles_down_; tile_row += band_tile_rows)
+        {
+            int end = min(tiles_down_, tile_row + band_tile_rows);
+            int first_row = tile_row * tile_size_;
+            ok = render_tile_rows(tile_row, end, band, error) &&
+                 sink(band, first_row, min(height(), end * tile_size_) - first_row);
+        }
+        buffer_pool::release_image(band);
+        return ok;
+    }
+
+    /**
+     * @return The tile size a render of this chain uses: TILE_SIZE, or a multiple of it large
+     *         enough that the widest halo stays a small part of each tile.
+     */
+    int tile_size() const
+    {
+        int max_halo = 0;
+        for (size_t node = 0; node < nodes_.size(); ++node)
+            max_halo = max(max_halo, nodes_[node].halo);
+        return TILE_SIZE * max(1, (4 * max_halo + TILE_SIZE - 1) / TILE_SIZE);
+    }
+
+    /**
+     * @return How many tiles were computed by intermediate nodes during the last render.
+     */
+    long tiles_computed() const
+    {
+        return computed_;
+    }
+
+    /**
+     * @return How many intermediate tile requests were served from a worker's cache.
+     */
+    long cache_hits() const
+    {
+        return hits_;
+    }
+
+  private:
+    /**
+     * Chooses the tile size and sizes every node's per-worker tile cache for a render.
+     *
+     * @return False (with a message) if the chain produces an empty image.
+     */
+    bool prepare(string &error)
+    {
+        int output_width = width(), output_height = height();
+        if (output_width <= 0 || output_height <= 0)
+        {
+            error = "The operations produced an empty image";
+            return false;
+        }
+        // Tiles at least four halos wide keep the re-read border a small part of each patch, so a
+        // tile only ever reads one tile around it
+        tile_size_ = tile_size();
+        tiles_down_ = (output_height + tile_size_ - 1) / tile_size_;
+
+        // Size each node's caches to hold what one step down a strip reads from it (plus the row
+        // the next step adds): the strip's row of tiles grown by every halo downstream, and mapped
+        // through every transform downstream (a rotated row covers a taller box of its input)
+        capacities_.assign(nodes_.size(), 0);
+        double footprint_width = STRIP_TILES * tile_size_, footprint_height = tile_size_;
+        for (size_t node = nodes_.size() - 1; node-- > 0;)
+        {
+            const Node &consumer = nodes_[node + 1];
+            if (consumer.kind == NODE_GEOMETRY)
+            {
+                const geometry::Affine &m = consumer.transform.inverse;
+                double width = fabs(m.xx) * footprint_width + fabs(m.xy) * footprint_height;
+                double height = fabs(m.yx) * footprint_width + fabs(m.yy) * footprint_height;
+                footprint_width = width + 3; // geometry::source_rect() reads a pixel beyond each side
+                footprint_height = height + 3;
+            }
+            footprint_width += 2 * consumer.halo;
+            footprint_height += 2 * consumer.halo;
+            size_t across = static_cast<size_t>(ceil(footprint_width / tile_size_)) + 1;
+            size_t down = static_cast<size_t>(ceil(footprint_height / tile_size_)) + 1;
+            capacities_[node] = across * (down + 1);
+        }
+        computed_ = 0;
+        hits_ = 0;
+        return true;
+    }
+
+    /**
+     * Computes output tile rows [tile_row_begin, tile_row_end) into target, whose first row is
+     * output row tile_row_begin * tile size. Each worker takes a contiguous band of tile rows
+     * with caches of its own, which are emptied again before returning.
+     */
+    bool render_tile_rows(int tile_row_begin, int tile_row_end, vector<vector<Pixel>> &target, string &error)
+    {
+        int tiles_across = (width() + tile_size_ - 1) / tile_size_;
+        int worker_count = parallel_utils::chunk_count(tile_row_end - tile_row_begin, 1);
+        vector<vector<TileCache>> caches(worker_count, vector<TileCache>(nodes_.size()));
+        for (int worker = 0; worker < worker_count; ++worker)
+            for (size_t node = 0; node < nodes_.size(); ++node)
+                caches[worker][node].capacity = capacities_[node];
+
+        int row_offset = tile_row_begin * tile_size_;
+        parallel_utils::parallel_for(
+            tile_row_begin, tile_row_end,
+            [&](int band_begin, int band_end, int worker) {
+                // Walking down narrow strips keeps the tiles of the row above (the halo of the
+                // current row) in a cache whose size does not depend on the image width
+                vector<TileCache> &worker_caches = caches[worker];
+                for (int strip = 0; strip < tiles_across; strip += STRIP_TILES)
+                {
+                    for (int tile_y = band_begin; tile_y < band_end; ++tile_y)
+                    {
+                        for (int tile_x = strip; tile_x < min(tiles_across, strip + STRIP_TILES) && !failed_;
+                             ++tile_x)
+                        {
+                            region::Rect rect = tile_rect(nodes_.size() - 1, tile_x, tile_y);
+                            vector<vector<Pixel>> patch = compute(nodes_.size() - 1, rect, worker_caches);
+                            region::Rect whole;
+                            whole.width = rect.width;
+                            whole.height = rect.height;
+                            region::paste(target, patch, whole, rect.x, rect.y - row_offset);
+                            buffer_pool::release_image(patch);
+                        }
+                    }
+                }
+            },
+            1);
+
+        for (size_t worker = 0; worker < caches.size(); ++worker)
+            for (size_t node = 0; node < caches[worker].size(); ++node)
+                for (size_t i = 0; i < caches[worker][node].tiles.size(); ++i)
+                    buffer_pool::release_image(caches[worker][node].tiles[i].pixels);
+        if (failed_)
+        {
+            error = error_;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * The grid tile (tile_x, tile_y) of a node, clipped to its size.
+     */
+    region::Rect tile_rect(size_t node, int tile_x, int tile_y) const
+    {
+        region::Rect rect;
+        rect.x = tile_x * tile_size_;
+        rect.y = tile_y * tile_size_;
+        rect.width = min(tile_size_, nodes_[node].width - rect.x);
+        rect.height = min(tile_size_, nodes_[node].height - rect.y);
+        return rect;
+    }
+
+    /**
+     * Returns a rectangle of a node's output, assembled from its grid tiles.
+     */
+    vector<vector<Pixel>> pull(size_t node, const region::Rect &rect, vector<TileCache> &caches)
+    {
+        if (node == 0)
+            return region::extract(source_, rect);
+        // A point filter asks for exactly the tile it produces, which nothing asks for again
+        const Node &consumer = nodes_[node + 1];
+        if (consumer.kind == NODE_FILTER && consumer.halo == 0)
+            return compute(node, rect, caches);
+
+        vector<vector<Pixel>> patch = buffer_pool::acquire_image(rect.height, rect.width);
+        for (int tile_y = rect.y / tile_size_; tile_y * tile_size_ < rect.y + rect.height; ++tile_y)
+        {
+            for (int tile_x = rect.x / tile_size_; tile_x * tile_size_ < rect.x + rect.width; ++tile_x)
+            {
+                const vector<vector<Pixel>> &pixels = tile(node, tile_x, tile_y, caches);
+                region::Rect part = tile_rect(node, tile_x, tile_y);
+                int x = max(rect.x, part.x), y = max(rect.y, part.y);
+                part.width = min(rect.x + rect.width, part.x + part.width) - x;
+                part.height = min(rect.y + rect.height, part.y + part.height) - y;
+                part.x = x - part.x;
+                part.y = y - part.y;
+                region::paste(patch, pixels, part, x - rect.x, y - rect.y);
+            }
+        }
+        return patch;
+    }
+
+    /**
+     * Returns a grid tile of a node from the worker's cache, computing it on a miss.
+     * The reference stays valid until the next tile of the same node is requested.
+     */
+    const vector<vector<Pixel>> &tile(size_t node, int tile_x, int tile_y, vector<TileCache> &caches)
+    {
+        TileCache &cache = caches[node];
+        ++cache.clock;
+        size_t oldest = 0;
+        for (size_t i = 0; i < cache.tiles.size(); ++i)
+        {
+            CachedTile &cached = cache.tiles[i];
+            if (cached.tile_x == tile_x && cached.tile_y == tile_y)
+            {
+                cached.last_use = cache.clock;
+                ++hits_;
+                return cached.pixels;
+            }
+            if (cached.last_use < cache.tiles[oldest].last_use)
+                oldest = i;
+        }
+
+        // Upstream nodes have their own caches, so computing cannot disturb this one
+        vector<vector<Pixel>> pixels = compute(node, tile_rect(node, tile_x, tile_y), caches);
+        ++computed_;
+        if (cache.tiles.size() < cache.capacity)
+        {
+            cache.tiles.push_back(CachedTile{tile_x, tile_y, cache.clock, vector<vector<Pixel>>()});
+            oldest = cache.tiles.size() - 1;
+        }
+        CachedTile &slot = cache.tiles[oldest];
+        buffer_pool::release_image(slot.pixels);
+        slot.tile_x = tile_x;
+        slot.tile_y = tile_y;
+        slot.last_use = cache.clock;
+        slot.pixels.swap(pixels);
+        return slot.pixels;
+    }
+
+    /**
+     * Computes a rectangle of a node's output from the node before it.
+     */
+    vector<vector<Pixel>> compute(size_t node, const region::Rect &rect, vector<TileCache> &caches)
+    {
+        const Node &current = nodes_[node];
+        if (current.kind == NODE_SOURCE)
+            return region::extract(source_, rect);
+
+        if (current.kind == NODE_GEOMETRY)
+        {
+            region::Rect needed = geometry::source_rect(current.transform, rect);
+            if (needed.empty())
+            {
+                vector<vector<Pixel>> black = buffer_pool::acquire_image(rect.height, rect.width);
+                for (int row = 0; row < rect.height; ++row)
+                    fill(black[row].begin(), black[row].end(), Pixel{0, 0, 0});
+                return black;
+            }
+            vector<vector<Pixel>> source = pull(node - 1, needed, caches);
+            vector<vector<Pixel>> result = geometry::resample_rect(source, needed, current.transform, rect);
+            buffer_pool::release_image(source);
+            return result;
+        }
+
+        region::Rect grown = rect;
+        grown.x -= current.halo;
+        grown.y -= current.halo;
+        grown.width += 2 * current.halo;
+        grown.height += 2 * current.halo;
+        grown = region::clip(grown, current.width, current.height);
+        vector<vector<Pixel>> patch = pull(node - 1, grown, caches);
+        string message;
+        bool ok = !failed_ && current.filter(patch, message);
+        if (ok && (static_cast<int>(patch.size()) != grown.height || static_cast<int>(patch[0].size()) != grown.width))
+        {
+            message = "Operations that change the image size cannot be evaluated in tiles";
+            ok = false;
+        }
+        if (!ok)
+        {
+            fail(message);
+            buffer_pool::release_image(patch);
+            return buffer_pool::acquire_image(rect.height, rect.width);
+        }
+        if (current.halo == 0)
+            return patch;
+
+        region::Rect inner = rect;
+        inner.x -= grown.x;
+        inner.y -= grown.y;
+        vector<vector<Pixel>> result = region::extract(patch, inner);
+        buffer_pool::release_image(patch);
+        return result;
+    }
+
+    /**
+     * Records the first failure; the remaining tiles are skipped.
+     */
+    void fail(const string &message)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!failed_)
+            error_ = message;
+        failed_ = true;
+    }
+
+    const vector<vector<Pixel>> &source_;
+    vector<Node> nodes_;
+    int tile_size_;
+    int tiles_down_;            // Output tile rows of the current render
+    vector<size_t> capacities_; // Per-node tile cache capacity of the current render
+    mutex mutex_;
+    string error_;
+    atomic<bool> failed_;
+    atomic<long> computed_;
+    atomic<long> hits_;
+};
+
+} // namespace tiles
+
+/**
+ * @namespace image_processing
+ * @brief Contains functions for applying various image processing filters and effects.
+ *
+ * The image_processing namespace provides a collection of functions that take an input image
+ * (represented as a 2D vector of Pixel structs) and return a new image with different operations applied.
+ * These operations include effects such as vignetting, color filters, rotations, resizing, grayscale,
+ * high contrast, lightening, darkening, and posterization to primary colors or black/white.
+ *
+ * The functions come in two forms:
+ *   - process_N copies: it is self-contained, leaves its input untouched and returns a new image.
+ *   - process_N_in_place, available for the per-pixel filters (2, 3, 7, 8, 9, 10, 12, 13, 14 and
+ *     19-22), modifies the image it is given and returns nothing, for callers that no longer need
+ *     the original pixels. Both forms produce the same pixels.
+ */
+namespace image_processing
+{
+/**
+ * Applies the vignette to one row. Helper for process_1() and the fan-out pass.
+ *
+ * @param source The input row.
+ * @param target Receives the output row (may be the same as source).
+ * @param row    Index of the row in the image.
+ * @param width  Pixels per row.
+ * @param height Rows in the image.
+ */
+void vignette_row(const Pixel *source, Pixel *target, int row, int width, int height)
+{
+    double center_x = width / 2.0;
+    double center_y = height / 2.0;
+    for (int col = 0; col < width; ++col)
+    {
+        const Pixel &p = source[col];
+        // Find the distance to the center
+        double dx = col - center_x;
+        double dy = row - center_y;
+        double distance = sqrt(dx * dx + dy * dy);
+        double scaling_factor = (height - distance) / height;
+        if (scaling_factor < 0)
+            scaling_factor = 0; // Avoid negative values for extreme corners
+
+        Pixel new_pixel;
+        new_pixel.red = static_cast<int>(p.red * scaling_factor);
+        new_pixel.green = static_cast<int>(p.green * scaling_factor);
+        new_pixel.blue = static_cast<int>(p.blue * scaling_factor);
+
+        // Clamp values just in case (0-255)
+        new_pixel.red = max(0, min(255, new_pixel.red));
+        new_pixel.green = max(0, min(255, new_pixel.green));
+        new_pixel.blue = max(0, min(255, new_pixel.blue));
+
+        target[col] = new_pixel;
+    }
+}
+
+/**
+ * Applies a vignette effect to the input image.
+ *
+ * For each pixel, its color values are scaled down based on its distance from the
+ * image center, creating a darkening effect toward the corners.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @return A new image as a 2D vector of Pixels with the vignette effect applied.
+ */
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    int width = image[0].size();
+
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, width);
+    for (int row = 0; row < height; ++row)
+        vignette_row(image[row].data(), new_image[row].data(), row, width, height);
+    return new_image;
+}
+
+/**
+ * Applies the Clarendon filter effect to the input image.
+ *
+ * This effect increases contrast in the image by applying a scaling factor to
+ * the pixel color values depending on their brightness:
+ *   - For bright pixels (average >= 170), RGB values are increased toward 255.
+ *   - For dark pixels (average < 90), RGB values are reduced by the scaling factor.
+ *   - For mid-tone pixels (average between 90 and 170), original values are preserved.
+ *
+ * The scaling_factor parameter controls the strength of the effect (e.g., typical values: 0.5, 0.7).
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param scaling_factor How strongly to adjust light and dark pixels; should be in [0, 1].
+ * @return A new image as a 2D vector of Pixels with the Clarendon effect applied.
+ */
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    return kernels::map(image, kernels::ClarendonKernel<90, 170>(scaling_factor));
+}
+
+/**
+ * Applies the Clarendon filter effect to the image, overwriting it.
+ * Produces the same pixels as process_2() without allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param scaling_factor How strongly to adjust light and dark pixels; should be in [0, 1].
+ */
+void process_2_in_place(vector<vector<Pixel>> &image, double scaling_factor)
+{
+    kernels::map_in_place(image, kernels::ClarendonKernel<90, 170>(scaling_factor));
+}
+
+/**
+ * Applies a grayscale filter to the input image by weighting the red, green, and blue
+ * color values of each pixel. The resulting image consists of pixels where all three
+ * color channels are set to this gray level, producing a grayscale effect.
+ *
+ * @param image The input image represented as a 2D vector of Pixel structs.
+ * @param weighting How to weight the channels (the plain average by default).
+ * @return A new 2D vector of Pixels where each pixel is the grayscale equivalent of the original.
+ */
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image, luma::Weighting weighting = luma::LUMA_AVERAGE)
+{
+    switch (weighting)
+    {
+    case luma::LUMA_REC601:
+        return kernels::map(image, kernels::GrayscaleKernel<luma::LUMA_REC601>());
+    case luma::LUMA_REC709:
+        return kernels::map(image, kernels::GrayscaleKernel<luma::LUMA_REC709>());
+    default:
+        return kernels::map(image, kernels::GrayscaleKernel<luma::LUMA_AVERAGE>());
+    }
+}
+
+/**
+ * Converts the image to grayscale, overwriting it.
+ * Produces the same pixels as process_3() without allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param weighting How to weight the channels (the plain average by default).
+ */
+void process_3_in_place(vector<vector<Pixel>> &image, luma::Weighting weighting = luma::LUMA_AVERAGE)
+{
+    switch (weighting)
+    {
+    case luma::LUMA_REC601:
+        kernels::map_in_place(image, kernels::GrayscaleKernel<luma::LUMA_REC601>());
+        break;
+    case luma::LUMA_REC709:
+        kernels::map_in_place(image, kernels::GrayscaleKernel<luma::LUMA_REC709>());
+        break;
+    default:
+        kernels::map_in_place(image, kernels::GrayscaleKernel<luma::LUMA_AVERAGE>());
+    }
+}
+
+/**
+ * Rotates the input image 90 degrees clockwise.
+ *
+ * The output image will have its dimensions transposed: if the input
+ * image is height x width, the output will be width x height. Each pixel in the
+ * original image at position (row, col) is moved to position (col, height-1-row)
+ * in the rotated image.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @return A new image as a 2D vector of Pixels, rotated 90 degrees clockwise.
+ */
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    int width = image[0].size();
+
+    // Rotate 90 degrees clockwise: output is [width][height]
+    geometry::Transform transform = geometry::identity(width, height);
+    geometry::rotate_quarter_turns(transform, 1);
+    return geometry::resample(image, transform);
+}
+/**
+ * Rotates the input image by a multiple of 90 degrees clockwise.
+ *
+ * The image is rotated 'number' times by 90 degrees. Negative numbers will rotate counterclockwise.
+ * Each 90-degree rotation clockwise transposes the image and reverses the order of its rows.
+ *
+ * For example:
+ *  - number = 1 rotates 90 degrees clockwise,
+ *  - number = 2 rotates 180 degrees,
+ *  - number = 3 rotates 270 degrees clockwise (or 90 degrees counterclockwise),
+ *  - number = 4 (or any multiple of 4) results in the same orientation as the original image.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param number The number of times to rotate the image by 90 degrees clockwise (can be negative).
+ * @return A new image as a 2D vector of Pixels, rotated accordingly.
+ */
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int number)
+{
+    // process_5: Rotate image clockwise by (number * 90) degrees
+    int height = image.size();
+    if (height == 0)
+        return {};
+
+    // The turns are folded into one matrix, so the image is copied once however many there are
+    geometry::Transform transform = geometry::identity(image[0].size(), height);
+    geometry::rotate_quarter_turns(transform, number);
+    return geometry::resample(image, transform);
+}
+
+/**
+ * Enlarges the input image by the specified x and y scaling factors.
+ *
+ * Each pixel in the original image is multiplied into a block of size
+ * x_scale by y_scale in the resulting image, producing a "pixelated"
+ * enlargement effect.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param x_scale The scale factor for the width (columns); must be > 0.
+ * @param y_scale The scale factor for the height (rows); must be > 0.
+ * @return A new image as a 2D vector of Pixels with enlarged dimensions, or an
+ *         empty vector if the scale factors or input are invalid.
+ */
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+
+    // Each output pixel copies the input pixel whose enlarged block contains it
+    geometry::Transform transform = geometry::identity(image[0].size(), height);
+    if (!geometry::enlarge(transform, x_scale, y_scale))
+        return {};
+    return geometry::resample(image, transform);
+}
+
+/**
+ * Runs the high contrast kernel for a compile-time weighting through the dithering driver.
+ * Helper for process_7_in_place().
+ */
+template <luma::Weighting Weighting> void high_contrast_in_place(vector<vector<Pixel>> &image, int threshold,
+                                                                   dither::Mode mode)
+{
+    // A full-scale pattern, since black and white are 255 levels apart
+    dither::quantize_in_place(image, kernels::HighContrastKernel<Weighting>(threshold), mode, 255);
+}
+
+/**
+ * Converts the image to high contrast (pure black and white), overwriting it.
+ * With the default threshold this produces the same pixels as process_7() without
+ * allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param threshold The brightness at and above which a pixel becomes white.
+ * @param weighting How to weight the channels (the plain average by default).
+ * @param mode How to dither the black/white decision (hard threshold by default).
+ */
+void process_7_in_place(vector<vector<Pixel>> &image, int threshold = 128,
+                        luma::Weighting weighting = luma::LUMA_AVERAGE, dither::Mode mode = dither::DITHER_NONE)
+{
+    switch (weighting)
+    {
+    case luma::LUMA_REC601:
+        high_contrast_in_place<luma::LUMA_REC601>(image, threshold, mode);
+        break;
+    case luma::LUMA_REC709:
+        high_contrast_in_place<luma::LUMA_REC709>(image, threshold, mode);
+        break;
+    default:
+        high_contrast_in_place<luma::LUMA_AVERAGE>(image, threshold, mode);
+    }
+}
+
+/**
+ * Converts the input image to high contrast (pure black and white).
+ *
+ * This function processes each pixel and sets it to either black (0,0,0)
+ * or white (255,255,255), depending on whether the average brightness of
+ * the pixel is below or above a threshold (128). With dithering, the decision
+ * also depends on the pixel position (Bayer) or the neighbours' rounding error
+ * (Floyd-Steinberg), so gradients come out as a mix of black and white.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param weighting How to weight the channels (the plain average by default).
+ * @param mode How to dither the black/white decision (hard threshold by default).
+ * @return A new image as a 2D vector of Pixels in high contrast (black and white).
+ */
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image, luma::Weighting weighting = luma::LUMA_AVERAGE,
+                                dither::Mode mode = dither::DITHER_NONE)
+{
+    // process_7: Convert image to high contrast (black and white only)
+    if (mode == dither::DITHER_NONE)
+    {
+        switch (weighting)
+        {
+        case luma::LUMA_REC601:
+            return kernels::map(image, kernels::HighContrastKernel<luma::LUMA_REC601>());
+        case luma::LUMA_REC709:
+            return kernels::map(image, kernels::HighContrastKernel<luma::LUMA_REC709>());
+        default:
+            return kernels::map(image, kernels::HighContrastKernel<luma::LUMA_AVERAGE>());
+        }
+    }
+
+    // Dithering reads neighbouring results, so it runs on a copy
+    int height = image.size();
+    if (height == 0)
+        return {};
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, image[0].size());
+    for (int row = 0; row < height; ++row)
+        copy(image[row].begin(), image[row].end(), new_image[row].begin());
+    process_7_in_place(new_image, 128, weighting, mode);
+    return new_image;
+}
+
+/**
+ * Builds the per-channel table for lightening: 255 - (255 - value) * scaling_factor, clamped.
+ * Helper for process_8() and process_8_in_place().
+ */
+kernels::ToneLutKernel lighten_kernel(double scaling_factor)
+{
+    kernels::ToneLutKernel kernel;
+    kernels::fill_channel_lut(kernel.lut,
+                              [&](int value) { return static_cast<int>(255 - (255 - value) * scaling_factor); });
+    return kernel;
+}
+
+/**
+ * Lightens the input image by a given scaling factor.
+ *
+ * For each pixel, this function increases the brightness by moving each color channel
+ * (red, green, blue) toward 255 (white) according to the provided scaling_factor.
+ * The scaling_factor should be >= 0, where:
+ *   - Values closer to 1.0 result in a lighter image (values approach 255)
+ *   - Values closer to 0.0 result in less lightening (values stay closer to original)
+ *
+ * The formula for each new color channel is:
+ *   new_value = 255 - (255 - original_value) * scaling_factor
+ *
+ * This operation moves pixel values toward white, producing a lighter image.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param scaling_factor Value >= 0 that controls how much to lighten each pixel.
+ * @return A new image as a 2D vector of Pixels lightened by the scaling factor.
+ */
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    // process_8: Lighten by a scaling factor
+    return kernels::map(image, lighten_kernel(scaling_factor));
+}
+
+/**
+ * Lightens the image by a given scaling factor, overwriting it.
+ * Produces the same pixels as process_8() without allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param scaling_factor Value >= 0 that controls how much to lighten each pixel.
+ */
+void process_8_in_place(vector<vector<Pixel>> &image, double scaling_factor)
+{
+    kernels::map_in_place(image, lighten_kernel(scaling_factor));
+}
+
+/**
+ * Builds the per-channel table for darkening: value * scaling_factor, clamped.
+ * Helper for process_9() and process_9_in_place().
+ */
+kernels::ToneLutKernel darken_kernel(double scaling_factor)
+{
+    kernels::ToneLutKernel kernel;
+    kernels::fill_channel_lut(kernel.lut, [&](int value) { return static_cast<int>(value * scaling_factor); });
+    return kernel;
+}
+
+/**
+ * Darkens the input image by a given scaling factor.
+ *
+ * For each pixel, this function reduces the brightness by multiplying each color channel
+ * (red, green, blue) by the provided scaling_factor.
+ * The scaling_factor should be >= 0, where:
+ *   - Values < 1.0 result in a darker image (values approach 0)
+ *   - Values closer to 1.0 result in less darkening (values stay closer to original)
+ *   - Value = 1.0 keeps the original brightness
+ *
+ * The formula for each new color channel is:
+ *   new_value = original_value * scaling_factor
+ *
+ * This operation uniformly decreases the intensity of all color channels when factor < 1,
+ * producing a darker image.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param scaling_factor Value >= 0 that controls how much to darken each pixel.
+ * @return A new image as a 2D vector of Pixels darkened by the scaling factor.
+ */
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    // process_9: Darken by a scaling factor
+    return kernels::map(image, darken_kernel(scaling_factor));
+}
+
+/**
+ * Darkens the image by a given scaling factor, overwriting it.
+ * Produces the same pixels as process_9() without allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param scaling_factor Value >= 0 that controls how much to darken each pixel.
+ */
+void process_9_in_place(vector<vector<Pixel>> &image, double scaling_factor)
+{
+    kernels::map_in_place(image, darken_kernel(scaling_factor));
+}
+
+/**
+ * The posterize kernel: black at a channel sum of 150 or less, white from 550 on.
+ */
+typedef kernels::PrimaryColorKernel<150, 550> PrimaryColorKernel;
+
+/**
+ * Applies a filter that reduces each pixel's color to one of five options: pure red, pure green,
+ * pure blue, white, or black.
+ *
+ * For each pixel:
+ *   - If the sum of RGB channels is >= 550, the pixel is set to white (255,255,255).
+ *   - If the sum of RGB channels is <= 150, the pixel is set to black (0,0,0).
+ *   - Otherwise, the pixel is set to the primary color channel (red, green, or blue) with the
+ *     highest value, as follows:
+ *       - If red is the highest, the pixel becomes pure red (255,0,0).
+ *       - If green is the highest, the pixel becomes pure green (0,255,0).
+ *       - Otherwise, the pixel becomes pure blue (0,0,255).
+ *
+ * This creates a posterized, high-contrast effect that simplifies the original image into
+ * a small set of bold color regions.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param mode How to dither the color decision (hard thresholds by default).
+ * @return A new image as a 2D vector of Pixels with the filter applied.
+ */
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image, dither::Mode mode = dither::DITHER_NONE)
+{
+    // process_10: Filter to limited color channels: Red, Blue, Green, White, Black
+    if (mode == dither::DITHER_NONE)
+        return kernels::map(image, PrimaryColorKernel());
+
+    // Dithering reads neighbouring results, so it runs on a copy
+    int height = image.size();
+    if (height == 0)
+        return {};
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, image[0].size());
+    for (int row = 0; row < height; ++row)
+        copy(image[row].begin(), image[row].end(), new_image[row].begin());
+    // Half-scale pattern: the black, color and white bands are roughly 130 levels apart
+    dither::quantize_in_place(new_image, PrimaryColorKernel(), mode, 128);
+    return new_image;
+}
+
+/**
+ * Reduces every pixel to pure red, green, blue, white, or black, overwriting the image.
+ * Produces the same pixels as process_10() without allocating an output image.
+ *
+ * @param image The image to modify (row-major order).
+ * @param mode How to dither the color decision (hard thresholds by default).
+ */
+void process_10_in_place(vector<vector<Pixel>> &image, dither::Mode mode = dither::DITHER_NONE)
+{
+    dither::quantize_in_place(image, PrimaryColorKernel(), mode, 128);
+}
+
+/**
+ * Rotates the input image by an arbitrary angle (1-359 degrees) clockwise.
+ *
+ * This function rotates the image around its center by the specified angle.
+ * The output image will have dimensions large enough to contain the entire
+ * rotated image (bounding box). Pixels in the output image that don't map
+ * to valid source pixels are set to black (0,0,0).
+ *
+ * By default the rotation uses bilinear interpolation to determine pixel values when
+ * the inverse rotation maps to non-integer coordinates in the source image. The shear
+ * method resamples with three one-dimensional shears instead (see geometry::rotate_three_shear()).
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param degrees The angle in degrees (1-359) to rotate clockwise.
+ * @param method How to resample the rotated image.
+ * @return A new image as a 2D vector of Pixels, rotated by the specified angle.
+ */
+vector<vector<Pixel>> process_11(const vector<vector<Pixel>> &image, int degrees,
+                                 geometry::RotationMethod method = geometry::ROTATE_BILINEAR)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    if (method == geometry::ROTATE_SHEAR)
+        return geometry::rotate_three_shear(image, degrees);
+
+    geometry::Transform transform = geometry::identity(image[0].size(), height);
+    geometry::rotate_degrees(transform, degrees);
+    return geometry::resample(image, transform);
+}
+
+/**
+ * Stretches each color channel so that it spans the full 0-255 range (auto levels).
+ *
+ * The image statistics are computed first; for every channel the value at the clip_percent
+ * percentile becomes 0 and the value at the (100 - clip_percent) percentile becomes 255, with
+ * everything in between scaled linearly. Clipping a small percentage keeps a handful of
+ * extreme pixels from defeating the stretch. Channels that are already flat are left alone.
+ *
+ * @param image The image to analyze (row-major order).
+ * @param clip_percent Percentage of pixels clipped at each end of every channel, in [0, 50).
+ * @return The per-channel lookup tables that perform the stretch.
+ */
+kernels::ChannelLutKernel auto_levels_kernel(const vector<vector<Pixel>> &image, double clip_percent)
+{
+    image_stats::ImageStats stats = image_stats::compute_stats(image);
+
+    // One lookup table per channel, so the pass over the pixels is a plain table lookup
+    kernels::ChannelLutKernel kernel;
+    for (int channel = image_stats::RED; channel <= image_stats::BLUE; ++channel)
+    {
+        const image_stats::ChannelStats &channel_stats = stats.channels[channel];
+        int low = channel_stats.percentile(clip_percent);
+        int high = channel_stats.percentile(100.0 - clip_percent);
+        kernels::fill_channel_lut(kernel.lut[channel], [&](int value) {
+            return high <= low ? value : static_cast<int>((value - low) * 255.0 / (high - low) + 0.5);
+        });
+    }
+    return kernel;
+}
+
+/**
+ * Stretches each color channel of the image to the full 0-255 range, overwriting it.
+ * See auto_levels_kernel() for details.
+ *
+ * @param image The image to modify (row-major order).
+ * @param clip_percent Percentage of pixels clipped at each end of every channel, in [0, 50).
+ */
+void process_12_in_place(vector<vector<Pixel>> &image, double clip_percent = 0.5)
+{
+    if (image.empty())
+        return;
+    kernels::map_in_place(image, auto_levels_kernel(image, clip_percent));
+}
+
+/**
+ * Applies auto levels to the input image. See auto_levels_kernel() for details.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param clip_percent Percentage of pixels clipped at each end of every channel, in [0, 50).
+ * @return A new image as a 2D vector of Pixels with each channel stretched to 0-255.
+ */
+vector<vector<Pixel>> process_12(const vector<vector<Pixel>> &image, double clip_percent = 0.5)
+{
+    if (image.empty())
+        return {};
+    return kernels::map(image, auto_levels_kernel(image, clip_percent));
+}
+
+/**
+ * Strategies for choosing the global high contrast cutoff from the image itself.
+ */
+enum ThresholdMethod
+{
+    THRESHOLD_MEAN = 1, // Mean brightness of the image
+    THRESHOLD_OTSU = 2  // Otsu's method on the brightness histogram
+};
+
+/**
+ * Picks the black/white cutoff for the high contrast filter from the image itself.
+ *
+ * Either method adapts to the image, so dark (low-key) images are not turned almost
+ * entirely black the way process_7's fixed cutoff of 128 does.
+ *
+ * @param image The image to analyze (row-major order).
+ * @param method How to derive the cutoff from the brightness histogram.
+ * @return The brightness threshold in [1, 255].
+ */
+int auto_threshold(const vector<vector<Pixel>> &image, ThresholdMethod method)
+{
+    image_stats::ImageStats stats = image_stats::compute_stats(image);
+    const image_stats::ChannelStats &luma = stats.channels[image_stats::LUMA];
+    int cutoff = method == THRESHOLD_OTSU ? threshold::otsu_threshold(luma.histogram)
+                                          : static_cast<int>(luma.mean + 0.5);
+    return max(1, min(255, cutoff));
+}
+
+/**
+ * Converts the image to high contrast using an automatically chosen threshold, overwriting it.
+ *
+ * @param image The image to modify (row-major order).
+ * @param method How to derive the cutoff (mean brightness or Otsu).
+ */
+void process_13_in_place(vector<vector<Pixel>> &image, ThresholdMethod method = THRESHOLD_MEAN)
+{
+    if (image.empty())
+        return;
+    process_7_in_place(image, auto_threshold(image, method));
+}
+
+/**
+ * Converts the input image to high contrast (pure black and white) using a threshold chosen
+ * from the image statistics instead of process_7's fixed 128.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param method How to derive the cutoff (mean brightness or Otsu).
+ * @return A new image as a 2D vector of Pixels in high contrast (black and white).
+ */
+vector<vector<Pixel>> process_13(const vector<vector<Pixel>> &image, ThresholdMethod method = THRESHOLD_MEAN)
+{
+    if (image.empty())
+        return {};
+    return kernels::map(image, kernels::HighContrastKernel<luma::LUMA_AVERAGE>(auto_threshold(image, method)));
+}
+
+/**
+ * Converts the image to high contrast using a local adaptive threshold, overwriting it.
+ * See threshold::adaptive_threshold_in_place() for details.
+ *
+ * @param image  The image to modify (row-major order).
+ * @param radius Half the window size in pixels; must be >= 1.
+ * @param offset Amount subtracted from the local mean brightness.
+ */
+void process_14_in_place(vector<vector<Pixel>> &image, int radius, int offset)
+{
+    threshold::adaptive_threshold_in_place(image, radius, offset);
+}
+
+/**
+ * Converts the input image to high contrast (pure black and white) by comparing every pixel
+ * with the mean brightness of the window around it, which keeps detail in unevenly lit scans.
+ *
+ * @param image  The input image as a 2D vector of Pixels (row-major order).
+ * @param radius Half the window size in pixels; must be >= 1.
+ * @param offset Amount subtracted from the local mean brightness.
+ * @return A new image as a 2D vector of Pixels in high contrast, or an empty vector if the
+ *         radius is invalid.
+ */
+vector<vector<Pixel>> process_14(const vector<vector<Pixel>> &image, int radius, int offset)
+{
+    int height = image.size();
+    if (height == 0 || radius < 1)
+        return {};
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, image[0].size());
+    for (int row = 0; row < height; ++row)
+        copy(image[row].begin(), image[row].end(), new_image[row].begin());
+    process_14_in_place(new_image, radius, offset);
+    return new_image;
+}
+
+/**
+ * Applies a Gaussian blur to the input image.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param sigma The blur strength (standard deviation in pixels); must be > 0.
+ * @return A new, blurred image, or an empty vector if sigma is invalid.
+ */
+vector<vector<Pixel>> process_15(const vector<vector<Pixel>> &image, double sigma)
+{
+    if (image.empty() || sigma <= 0.0)
+        return {};
+    convolution::PlanarImage planar = convolution::to_planar(image);
+    convolution::gaussian_blur(planar, sigma);
+    return convolution::from_planar(planar);
+}
+
+/**
+ * Sharpens the input image with an unsharp mask.
+ *
+ * @param image  The input image as a 2D vector of Pixels (row-major order).
+ * @param sigma  Size of the detail to boost (standard deviation in pixels); must be > 0.
+ * @param amount How strongly to boost the detail; must be >= 0.
+ * @return A new, sharpened image, or an empty vector if the parameters are invalid.
+ */
+vector<vector<Pixel>> process_16(const vector<vector<Pixel>> &image, double sigma, double amount)
+{
+    if (image.empty() || sigma <= 0.0 || amount < 0.0)
+        return {};
+    return convolution::unsharp_mask(image, sigma, amount);
+}
+
+/**
+ * Detects edges in the input image with the Sobel operator.
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @return A new grayscale image where brighter pixels mark stronger edges.
+ */
+vector<vector<Pixel>> process_17(const vector<vector<Pixel>> &image)
+{
+    if (image.empty())
+        return {};
+    return convolution::sobel_edges(image);
+}
+
+/**
+ * Applies a box blur (average over a square window) to the input image.
+ * The cost per pixel does not depend on the radius.
+ *
+ * @param image  The input image as a 2D vector of Pixels (row-major order).
+ * @param radius Half the window size in pixels; must be >= 1.
+ * @return A new, blurred image, or an empty vector if the radius is invalid.
+ */
+vector<vector<Pixel>> process_18(const vector<vector<Pixel>> &image, int radius)
+{
+    if (image.empty() || radius < 1)
+        return {};
+    convolution::PlanarImage planar = convolution::to_planar(image);
+    convolution::box_blur(planar, radius);
+    return convolution::from_planar(planar);
+}
+
+/**
+ * Applies a combined hue, saturation and exposure adjustment in one pass, overwriting the image.
+ * See color::adjust_in_place() for details.
+ *
+ * @param image      The image to modify (row-major order).
+ * @param adjustment The adjustment to apply.
+ */
+void adjust_colors_in_place(vector<vector<Pixel>> &image, const color::Adjustment &adjustment)
+{
+    color::adjust_in_place(image, adjustment);
+}
+
+/**
+ * Applies a combined hue, saturation and exposure adjustment to the input image.
+ *
+ * @param image      The input image as a 2D vector of Pixels (row-major order).
+ * @param adjustment The adjustment to apply.
+ * @return A new, adjusted image.
+ */
+vector<vector<Pixel>> adjust_colors(const vector<vector<Pixel>> &image, const color::Adjustment &adjustment)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, image[0].size());
+    for (int row = 0; row < height; ++row)
+        copy(image[row].begin(), image[row].end(), new_image[row].begin());
+    color::adjust_in_place(new_image, adjustment);
+    return new_image;
+}
+
+/**
+ * Scales the saturation of every pixel, overwriting the image.
+ *
+ * @param image  The image to modify (row-major order).
+ * @param factor Saturation multiplier (0 = grayscale, 1 = unchanged, > 1 = more vivid).
+ */
+void process_19_in_place(vector<vector<Pixel>> &image, double factor)
+{
+    color::Adjustment adjustment;
+    adjustment.saturation = factor;
+    adjust_colors_in_place(image, adjustment);
+}
+
+/**
+ * Scales the saturation of every pixel of the input image.
+ *
+ * @param image  The input image as a 2D vector of Pixels (row-major order).
+ * @param factor Saturation multiplier (0 = grayscale, 1 = unchanged, > 1 = more vivid).
+ * @return A new image with the saturation adjusted.
+ */
+vector<vector<Pixel>> process_19(const vector<vector<Pixel>> &image, double factor)
+{
+    color::Adjustment adjustment;
+    adjustment.saturation = factor;
+    return adjust_colors(image, adjustment);
+}
+
+/**
+ * Rotates the hue of every pixel around the color wheel, overwriting the image.
+ *
+ * @param image   The image to modify (row-major order).
+ * @param degrees Hue rotation in degrees (120 turns red into green).
+ */
+void process_20_in_place(vector<vector<Pixel>> &image, double degrees)
+{
+    color::Adjustment adjustment;
+    adjustment.hue_degrees = degrees;
+    adjust_colors_in_place(image, adjustment);
+}
+
+/**
+ * Rotates the hue of every pixel of the input image around the color wheel.
+ *
+ * @param image   The input image as a 2D vector of Pixels (row-major order).
+ * @param degrees Hue rotation in degrees (120 turns red into green).
+ * @return A new image with the hue rotated.
+ */
+vector<vector<Pixel>> process_20(const vector<vector<Pixel>> &image, double degrees)
+{
+    color::Adjustment adjustment;
+    adjustment.hue_degrees = degrees;
+    return adjust_colors(image, adjustment);
+}
+
+/**
+ * Changes the exposure of every pixel, overwriting the image. Unlike lighten (8), this keeps
+ * hue and saturation and scales brightness multiplicatively, like a camera's exposure setting.
+ *
+ * @param image The image to modify (row-major order).
+ * @param stops Exposure change in stops; each stop doubles (or halves) the brightness.
+ */
+void process_21_in_place(vector<vector<Pixel>> &image, double stops)
+{
+    color::Adjustment adjustment;
+    adjustment.exposure_stops = stops;
+    adjust_colors_in_place(image, adjustment);
+}
+
+/**
+ * Changes the exposure of every pixel of the input image. See process_21_in_place().
+ *
+ * @param image The input image as a 2D vector of Pixels (row-major order).
+ * @param stops Exposure change in stops; each stop doubles (or halves) the brightness.
+ * @return A new image with the exposure adjusted.
+ */
+vector<vector<Pixel>> process_21(const vector<vector<Pixel>> &image, double stops)
+{
+    color::Adjustment adjustment;
+    adjustment.exposure_stops = stops;
+    return adjust_colors(image, adjustment);
+}
+
+/**
+ * Composites a layer (e.g. a watermark) over the image, overwriting it.
+ * See blend::composite_in_place() for details.
+ *
+ * @param image   The image to modify (row-major order).
+ * @param layer   The layer to composite, with optional per-pixel alpha.
+ * @param mode    How the layer's colors combine with the image's.
+ * @param opacity Constant opacity in [0.0, 1.0], multiplied with the layer's own alpha.
+ * @param x       Column where the layer's left edge goes.
+ * @param y       Row where the layer's top edge goes.
+ */
+void process_22_in_place(vector<vector<Pixel>> &image, const blend::Layer &layer, blend::Mode mode, double opacity,
+                         int x = 0, int y = 0)
+{
+    blend::composite_in_place(image, layer, mode, static_cast<int>(opacity * 255.0 + 0.5), x, y);
+}
+
+/**
+ * Composites a layer (e.g. a watermark) over the input image. See process_22_in_place().
+ *
+ * @param image   The input image as a 2D vector of Pixels (row-major order).
+ * @param layer   The layer to composite, with optional per-pixel alpha.
+ * @param mode    How the layer's colors combine with the image's.
+ * @param opacity Constant opacity in [0.0, 1.0], multiplied with the layer's own alpha.
+ * @param x       Column where the layer's left edge goes.
+ * @param y       Row where the layer's top edge goes.
+ * @return A new image with the layer composited.
+ */
+vector<vector<Pixel>> process_22(const vector<vector<Pixel>> &image, const blend::Layer &layer, blend::Mode mode,
+                                 double opacity, int x = 0, int y = 0)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    vector<vector<Pixel>> new_image = buffer_pool::acquire_image(height, image[0].size());
+    for (int row = 0; row < height; ++row)
+        copy(image[row].begin(), image[row].end(), new_image[row].begin());
+    process_22_in_place(new_image, layer, mode, opacity, x, y);
+    return new_image;
+}
+
+/**
+ * Downscales the input image by a power of two, averaging 2x2 blocks once per level.
+ * Produces the same pixels as level `levels` of pyramid::build().
+ *
+ * @param image  The input image as a 2D vector of Pixels (row-major order).
+ * @param levels How many times to halve the size; must be >= 1.
+ * @return A new, smaller image, or an empty vector if levels is invalid.
+ */
+vector<vector<Pixel>> process_23(const vector<vector<Pixel>> &image, int levels)
+{
+    if (image.empty() || levels < 1)
+        return {};
+    vector<vector<Pixel>> result = pyramid::downscale_2x(image);
+    for (int level = 2; level <= levels && (result.size() > 1 || result[0].size() > 1); ++level)
+    {
+        vector<vector<Pixel>> next = pyramid::downscale_2x(result);
+        buffer_pool::release_image(result);
+        result.swap(next);
+    }
+    return result;
+}
+
+} // namespace image_processing
+
+/**
+ * @namespace result_cache
+ * @brief Content-addressed cache of encoded results for repeated (image, operations) requests.
+ *
+ * The key is a fast 64-bit hash of the input file's bytes combined with a hash of the operation
+ * chain (operation numbers and every parameter). Hashing the raw file means a repeated request
+ * is recognized before the image is decoded, and the cached value is the encoded BMP output,
+ * so a hit skips decode, compute and encode entirely.
+ *
+ * There are two tiers, each bounded in bytes with least-recently-used eviction:
+ *   - memory: encoded results kept in this process
+ *   - disk: one <key>.bmp file per result in a cache directory, shared between runs
+ */
+namespace result_cache
+{
+
+/**
+ * Hashes a block of bytes, eight bytes at a time, into 64 bits.
+ *
+ * @param data   The bytes to hash.
+ * @param size   The number of bytes.
+ * @param seed   Starting value, to derive independent hashes.
+ * @return The 64-bit hash.
+ */
+unsigned long long hash_bytes(const char *data, size_t size, unsigned long long seed = 0)
+{
+    const unsigned long long multiplier = 0x9E3779B97F4A7C15ULL;
+    unsigned long long hash = seed ^ (size * multiplier);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        word *= 0xBF58476D1CE4E5B9ULL;
+        word ^= word >> 31;
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    unsigned long long tail = 0;
+    memcpy(&tail, data + i, size - i);
+    hash = (hash ^ (tail * 0x94D049BB133111EBULL)) * multiplier;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Formats a 64-bit value as 16 lowercase hexadecimal digits.
+ */
+string to_hex(unsigned long long value)
+{
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", value);
+    return text;
+}
+
+/**
+ * Reads a whole file into memory.
+ *
+ * @param filename The file to read.
+ * @param contents Receives the bytes.
+ * @return True if the file could be read.
+ */
+bool read_file(const string &filename, string &contents)
+{
+    ifstream stream(filename.c_str(), ios::in | ios::binary);
+    if (!stream.is_open())
+        return false;
+    stream.seekg(0, ios::end);
+    streamoff size = stream.tellg();
+    if (size < 0)
+        return false;
+    contents.resize(static_cast<size_t>(size));
+    stream.seekg(0, ios::beg);
+    stream.read(&contents[0], size);
+    return static_cast<bool>(stream);
+}
+
+/**
+ * Writes bytes to a file, replacing it.
+ *
+ * @param filename The file to write.
+ * @param contents The bytes to write.
+ * @return True if every byte was written.
+ */
+bool write_file(const string &filename, const string &contents)
+{
+    ofstream stream(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!stream.is_open())
+        return false;
+    stream.write(contents.data(), contents.size());
+    return static_cast<bool>(stream);
+}
+
+/**
+ * Hit, miss and eviction counters for both tiers.
+ */
+struct CacheStats
+{
+    unsigned long long memory_hits = 0;
+    unsigned long long disk_hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long memory_evictions = 0;
+    unsigned long long disk_evictions = 0;
+    size_t memory_bytes = 0;
+    size_t disk_bytes = 0;
+
+    /**
+     * @return The fraction of lookups answered by either tier, in [0, 1].
+     */
+    double hit_rate() const
+    {
+        unsigned long long lookups = memory_hits + disk_hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(memory_hits + disk_hits) / lookups;
+    }
+};
+
+/**
+ * A size-bounded LRU index of keys to byte sizes, shared by both tiers.
+ * The most recently used key is at the front of the list.
+ */
+class LruIndex
+{
+  public:
+    LruIndex() : bytes_(0)
+    {
+    }
+
+    /**
+     * Moves an existing key to the front.
+     * @return True if the key was present.
+     */
+    bool touch(const string &key)
+    {
+        map<string, list<Entry>::iterator>::iterator it = positions_.find(key);
+        if (it == positions_.end())
+            return false;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return true;
+    }
+
+    /**
+     * Adds (or refreshes) a key with the given size at the front.
+     */
+    void insert(const string &key, size_t size)
+    {
+        erase(key);
+        entries_.push_front(Entry{key, size});
+        positions_[key] = entries_.begin();
+        bytes_ += size;
+    }
+
+    /**
+     * Removes a key if present.
+     */
+    void erase(const string &key)
+    {
+        map<string, list<Entry>::iterator>::iterator it = positions_.find(key);
+        if (it == positions_.end())
+            return;
+        bytes_ -= it->second->size;
+        entries_.erase(it->second);
+        positions_.erase(it);
+    }
+
+    /**
+     * Removes and returns the least recently used key (empty string if the index is empty).
+     */
+    string pop_oldest()
+    {
+        if (entries_.empty())
+            return "";
+        string key = entries_.back().key;
+        erase(key);
+        return key;
+    }
+
+    size_t bytes() const
+    {
+        return bytes_;
+    }
+
+  private:
+    struct Entry
+    {
+        string key;
+        size_t size;
+    };
+    list<Entry> entries_;
+    map<string, list<Entry>::iterator> positions_;
+    size_t bytes_;
+};
+
+/**
+ * The two-tier result cache. All methods are thread-safe.
+ */
+class ResultCache
+{
+  public:
+    /**
+     * @param memory_limit Maximum bytes of results kept in memory (0 disables the tier).
+     * @param directory    Directory for the disk tier (empty disables the tier).
+     * @param disk_limit   Maximum bytes of results kept on disk.
+     */
+    ResultCache(size_t memory_limit, const string &directory, size_t disk_limit)
+        : memory_limit_(memory_limit), directory_(directory), disk_limit_(disk_limit)
+    {
+        if (!directory_.empty())
+            load_disk_index();
+    }
+
+    /**
+     * Builds the cache key for an input file's bytes and an operation chain description.
+     *
+     * @param input_bytes The raw bytes of the input file.
+     * @param chain       The operation chain, e.g. "2:0.3 3".
+     * @return The key, also used as the disk file name.
+     */
+    static string make_key(const string &input_bytes, const string &chain)
+    {
+        return to_hex(hash_bytes(input_bytes.data(), input_bytes.size())) + "-" +
+               to_hex(hash_bytes(chain.data(), chain.size(), 0x5851F42D4C957F2DULL));
+    }
+
+    /**
+     * Looks a key up in memory, then on disk (promoting disk hits to memory).
+     *
+     * @param key    The key from make_key().
+     * @param result Receives the encoded result on a hit.
+     * @return True on a hit.
+     */
+    bool lookup(const string &key, string &result)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (memory_index_.touch(key))
+            {
+                result = memory_[key];
+                ++stats_.memory_hits;
+                return true;
+            }
+            if (directory_.empty() || !disk_index_.touch(key))
+            {
+                ++stats_.misses;
+                return false;
+            }
+        }
+
+        if (!read_file(disk_path(key), result))
+        {
+            // The file disappeared underneath us; forget it and treat this as a miss
+            lock_guard<mutex> lock(mutex_);
+            disk_index_.erase(key);
+            ++stats_.misses;
+            return false;
+        }
+        lock_guard<mutex> lock(mutex_);
+        ++stats_.disk_hits;
+        store_in_memory(key, result);
+        return true;
+    }
+
+    /**
+     * Stores an encoded result in both tiers, evicting old entries as needed.
+     *
+     * @param key    The key from make_key().
+     * @param result The encoded result.
+     */
+    void store(const string &key, const string &result)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            store_in_memory(key, result);
+        }
+        if (directory_.empty() || result.size() > disk_limit_)
+            return;
+
+        // Write under a temporary name so readers never see a partial file
+        string path = disk_path(key);
+        string temporary = path + ".tmp" + to_hex(hash<thread::id>()(this_thread::get_id()));
+        if (!write_file(temporary, result) || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            remove(temporary.c_str());
+            return;
+        }
+
+        lock_guard<mutex> lock(mutex_);
+        disk_index_.insert(key, result.size());
+        while (disk_index_.bytes() > disk_limit_)
+        {
+            string oldest = disk_index_.pop_oldest();
+            remove(disk_path(oldest).c_str());
+            ++stats_.disk_evictions;
+        }
+    }
+
+    /**
+     * @return A snapshot of the counters.
+     */
+    CacheStats stats() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        CacheStats snapshot = stats_;
+        snapshot.memory_bytes = memory_index_.bytes();
+        snapshot.disk_bytes = disk_index_.bytes();
+        return snapshot;
+    }
+
+  private:
+    string disk_path(const string &key) const
+    {
+        return directory_ + "/" + key + ".bmp";
+    }
+
+    // Caller holds mutex_
+    void store_in_memory(const string &key, const string &result)
+    {
+        if (result.size() > memory_limit_)
+            return;
+        memory_index_.insert(key, result.size());
+        memory_[key] = result;
+        while (memory_index_.bytes() > memory_limit_)
+        {
+            memory_.erase(memory_index_.pop_oldest());
+            ++stats_.memory_evictions;
+        }
+    }
+
+    /**
+     * Indexes the results already in the cache directory, oldest modification time first,
+     * so entries from earlier runs are evicted before new ones.
+     */
+    void load_disk_index()
+    {
+        mkdir(directory_.c_str(), 0755);
+        DIR *dir = opendir(directory_.c_str());
+        if (!dir)
+            return;
+        vector<pair<time_t, pair<string, size_t>>> found;
+        while (dirent *entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            // Keys are 33 characters ("<16 hex>-<16 hex>") followed by ".bmp"
+            if (name.size() != 37 || name.substr(33) != ".bmp")
+                continue;
+            struct stat info;
+            if (stat((directory_ + "/" + name).c_str(), &info) == 0)
+                found.push_back(make_pair(info.st_mtime, make_pair(name.substr(0, 33), static_cast<size_t>(info.st_size))));
+        }
+        closedir(dir);
+        sort(found.begin(), found.end());
+        for (size_t i = 0; i < found.size(); ++i)
+            disk_index_.insert(found[i].second.first, found[i].second.second);
+    }
+
+    size_t memory_limit_;
+    string directory_;
+    size_t disk_limit_;
+    LruIndex memory_index_;
+    map<string, string> memory_;
+    LruIndex disk_index_;
+    CacheStats stats_;
+    mutable mutex mutex_;
+};
+
+/**
+ * Cache settings collected from the command line.
+ */
+struct CacheOptions
+{
+    bool enabled = false;
+    string directory;         // Disk tier location; empty keeps results in memory only
+    size_t memory_mb = 256;   // Memory tier budget
+    size_t disk_mb = 1024;    // Disk tier budget
+};
+
+/**
+ * Recognizes the cache flags (--cache, --cache-dir <dir>, --cache-mb <n>, --cache-disk-mb <n>).
+ *
+ * @param argc    Argument count from main().
+ * @param argv    Argument values from main().
+ * @param index   Index of the argument to inspect.
+ * @param options Updated with the flag's value.
+ * @param error   Receives a message describing the problem on failure.
+ * @return The number of arguments consumed: 0 if this is not a cache flag, -1 on error.
+ */
+int parse_option(int argc, char *argv[], int index, CacheOptions &options, string &error)
+{
+    string arg = argv[index];
+    if (arg == "--cache")
+    {
+        options.enabled = true;
+        return 1;
+    }
+    if (arg != "--cache-dir" && arg != "--cache-mb" && arg != "--cache-disk-mb")
+        return 0;
+    if (index + 1 >= argc)
+    {
+        error = "Missing value for " + arg;
+        return -1;
+    }
+    string value = argv[index + 1];
+    options.enabled = true;
+    if (arg == "--cache-dir")
+    {
+        options.directory = value;
+        return 2;
+    }
+    char *end = nullptr;
+    unsigned long megabytes = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0')
+    {
+        error = arg + " expects a size in megabytes";
+        return -1;
+    }
+    (arg == "--cache-mb" ? options.memory_mb : options.disk_mb) = megabytes;
+    return 2;
+}
+
+/**
+ * Creates a cache from the parsed options.
+ *
+ * @param options The cache settings.
+ * @return The cache, or nullptr if caching was not requested.
+ */
+unique_ptr<ResultCache> create(const CacheOptions &options)
+{
+    if (!options.enabled)
+        return unique_ptr<ResultCache>();
+    return unique_ptr<ResultCache>(
+        new ResultCache(options.memory_mb << 20, options.directory, options.disk_mb << 20));
+}
+
+/**
+ * Prints the cache counters to standard output.
+ *
+ * @param stats The counters to print.
+ */
+void print_stats(const CacheStats &stats)
+{
+    cout << "RESULT CACHE STATISTICS" << endl;
+    cout << "Memory hits:      " << stats.memory_hits << endl;
+    cout << "Disk hits:        " << stats.disk_hits << endl;
+    cout << "Misses:           " << stats.misses << endl;
+    cout << "Hit rate:         " << stats.hit_rate() * 100.0 << "%" << endl;
+    cout << "Memory evictions: " << stats.memory_evictions << " (" << stats.memory_bytes << " bytes held)" << endl;
+    cout << "Disk evictions:   " << stats.disk_evictions << " (" << stats.disk_bytes << " bytes held)" << endl;
+}
+
+} // namespace result_cache
+
+/**
+ * @namespace history
+ * @brief In-memory edit history for the interactive menu, stored as shared copy-on-write tiles.
+ *
+ * Each version of the image is a grid of 64x64 tiles held by reference-counted pointers. The
+ * tiles are immutable once captured, so versions share them freely:
+ *   - A tile equal to the previous version's tile at the same place (a step that only touched
+ *     part of the image) reuses it.
+ *   - A tile equal to any other live tile (flat borders, repeated backgrounds) reuses that one;
+ *     tiles are found by a content hash and confirmed byte for byte.
+ * Memory therefore grows only with the tiles a step really changed. Tiles store packed 8-bit
+ * RGB, a quarter of a Pixel's size; every filter output is clamped to [0, 255], and the menu
+ * used to round-trip each step through a BMP file anyway.
+ *
+ * Undo and redo only move the current position. A new step after an undo drops the undone
+ * versions, and their tiles are freed once nothing else shares them.
+ */
+namespace history
+{
+
+const int TILE_SIZE = 64;
+
+/**
+ * The packed pixels of one tile (rows of the tile's own width) and their content hash.
+ */
+struct Tile
+{
+    vector<unsigned char> bytes;
+    unsigned long long hash = 0;
+};
+
+typedef shared_ptr<const Tile> TilePtr;
+
+/**
+ * One version of the image: its size, a label and the tiles in row-major order.
+ */
+struct Snapshot
+{
+    string label;
+    int width = 0;
+    int height = 0;
+    vector<TilePtr> tiles;
+
+    int tiles_across() const
+    {
+        return (width + TILE_SIZE - 1) / TILE_SIZE;
+    }
+};
+
+/**
+ * The versions of one image and the position of the current one.
+ */
+class History
+{
+  public:
+    /**
+     * Records a new version after the current one, dropping any undone versions.
+     *
+     * @param image The image after the step.
+     * @param label What the step did, shown by print().
+     */
+    void record(const vector<vector<Pixel>> &image, const string &label)
+    {
+        if (image.empty() || image[0].empty())
+            return;
+        if (!versions_.empty())
+            versions_.resize(current_ + 1);
+        const Snapshot *previous = versions_.empty() ? nullptr : versions_.back().get();
+
+        shared_ptr<Snapshot> snapshot = make_shared<Snapshot>();
+        snapshot->label = label;
+        snapshot->width = image[0].size();
+        snapshot->height = image.size();
+        int across = snapshot->tiles_across();
+        int down = (snapshot->height + TILE_SIZE - 1) / TILE_SIZE;
+        bool same_grid = previous && previous->width == snapshot->width && previous->height == snapshot->height;
+
+        // Pack and hash the tiles in parallel; sharing needs the index, so it happens afterwards
+        vector<shared_ptr<Tile>> packed(static_cast<size_t>(across) * down);
+        parallel_utils::parallel_for(0, down, [&](int band_begin, int band_end, int) {
+            for (int band = band_begin; band < band_end; ++band)
+                for (int tile_col = 0; tile_col < across; ++tile_col)
+                    packed[band * across + tile_col] = pack(image, tile_col * TILE_SIZE, band * TILE_SIZE);
+        }, 1);
+
+        snapshot->tiles.resize(packed.size());
+        for (size_t i = 0; i < packed.size(); ++i)
+        {
+            const TilePtr &before = same_grid ? previous->tiles[i] : TilePtr();
+            if (before && same(*before, *packed[i]))
+                snapshot->tiles[i] = before;
+            else
+                snapshot->tiles[i] = share(packed[i]);
+        }
+        versions_.push_back(snapshot);
+        current_ = versions_.size() - 1;
+    }
+
+    /**
+     * Moves back one version.
+     *
+     * @return False if the current version is the first one.
+     */
+    bool undo()
+    {
+        if (current_ == 0 || versions_.empty())
+            return false;
+        --current_;
+        return true;
+    }
+
+    /**
+     * Moves forward one version.
+     *
+     * @return False if there is no undone version to return to.
+     */
+    bool redo()
+    {
+        if (current_ + 1 >= versions_.size())
+            return false;
+        ++current_;
+        return true;
+    }
+
+    /**
+     * Forgets every version, e.g. when another image is selected.
+     */
+    void clear()
+    {
+        versions_.clear();
+        index_.clear();
+        current_ = 0;
+    }
+
+    bool empty() const
+    {
+        return versions_.empty();
+    }
+
+    /**
+     * @return The current version (the history must not be empty).
+     */
+    const Snapshot &current() const
+    {
+        return *versions_[current_];
+    }
+
+    /**
+     * Copies the current version out into an image.
+     *
+     * @return The image, drawn from the buffer pool (empty if there is no version).
+     */
+    vector<vector<Pixel>> restore() const
+    {
+        if (versions_.empty())
+            return {};
+        const Snapshot &snapshot = current();
+        vector<vector<Pixel>> image = buffer_pool::acquire_image(snapshot.height, snapshot.width);
+        int across = snapshot.tiles_across();
+        parallel_utils::parallel_for(0, snapshot.height, [&](int row_begin, int row_end, int) {
+            for (int row = row_begin; row < row_end; ++row)
+            {
+                Pixel *target = image[row].data();
+                for (int tile_col = 0; tile_col < across; ++tile_col)
+                {
+                    int x = tile_col * TILE_SIZE;
+                    int tile_width = min(TILE_SIZE, snapshot.width - x);
+                    const Tile &tile = *snapshot.tiles[(row / TILE_SIZE) * across + tile_col];
+                    const unsigned char *source = &tile.bytes[static_cast<size_t>(row % TILE_SIZE) * tile_width * 3];
+                    for (int col = 0; col < tile_width; ++col)
+                        target[x + col] = kernels::Rgb8::load(source + 3 * col);
+                }
+            }
+        });
+        return image;
+    }
+
+    /**
+     * @return The bytes held by the distinct tiles of every version.
+     */
+    size_t stored_bytes() const
+    {
+        size_t bytes = 0, tiles = 0;
+        count_tiles(bytes, tiles);
+        return bytes;
+    }
+
+    /**
+     * Lists the versions, marking the current one, with the memory the tiles take.
+     */
+    void print() const
+    {
+        if (versions_.empty())
+        {
+            cout << "No edits yet." << endl;
+            return;
+        }
+        cout << "EDIT HISTORY" << endl;
+        for (size_t i = 0; i < versions_.size(); ++i)
+            cout << (i == current_ ? "-> " : "   ") << i << ") " << versions_[i]->label << " ("
+                 << versions_[i]->width << "x" << versions_[i]->height << ")" << endl;
+        size_t bytes = 0, tiles = 0, references = 0;
+        count_tiles(bytes, tiles);
+        for (size_t i = 0; i < versions_.size(); ++i)
+            references += versions_[i]->tiles.size();
+        cout << fixed << setprecision(1) << "Stored: " << tiles << " distinct tiles of " << references << " ("
+             << bytes / (1024.0 * 1024.0) << " MB)" << endl;
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6);
+    }
+
+  private:
+    /**
+     * Copies the tile whose top left corner is (x, y) into packed bytes and hashes them.
+     */
+    static shared_ptr<Tile> pack(const vector<vector<Pixel>> &image, int x, int y)
+    {
+        int tile_width = min(TILE_SIZE, static_cast<int>(image[0].size()) - x);
+        int tile_height = min(TILE_SIZE, static_cast<int>(image.size()) - y);
+        shared_ptr<Tile> tile = make_shared<Tile>();
+        tile->bytes.resize(static_cast<size_t>(tile_width) * tile_height * 3);
+        unsigned char *target = tile->bytes.data();
+        for (int row = 0; row < tile_height; ++row)
+        {
+            const Pixel *source = &image[y + row][x];
+            for (int col = 0; col < tile_width; ++col, target += 3)
+                kernels::Rgb8::store(target, source[col]);
+        }
+        tile->hash = result_cache::hash_bytes(reinterpret_cast<const char *>(tile->bytes.data()), tile->bytes.size());
+        return tile;
+    }
+
+    static bool same(const Tile &a, const Tile &b)
+    {
+        return a.hash == b.hash && a.bytes == b.bytes;
+    }
+
+    /**
+     * @return A live tile with the same content, or the new tile after adding it to the index.
+     */
+    TilePtr share(const shared_ptr<Tile> &tile)
+    {
+        vector<weak_ptr<const Tile>> &candidates = index_[tile->hash];
+        for (size_t i = 0; i < candidates.size();)
+        {
+            TilePtr existing = candidates[i].lock();
+            if (!existing)
+            {
+                candidates.erase(candidates.begin() + i); // Freed along with an undone version
+                continue;
+            }
+            if (same(*existing, *tile))
+                return existing;
+            ++i;
+        }
+        candidates.push_back(tile);
+        return tile;
+    }
+
+    void count_tiles(size_t &bytes, size_t &tiles) const
+    {
+        set<const Tile *> seen;
+        for (size_t i = 0; i < versions_.size(); ++i)
+            for (size_t j = 0; j < versions_[i]->tiles.size(); ++j)
+                if (seen.insert(versions_[i]->tiles[j].get()).second)
+                    bytes += versions_[i]->tiles[j]->bytes.size();
+        tiles = seen.size();
+    }
+
+    vector<shared_ptr<const Snapshot>> versions_;
+    size_t current_ = 0;
+    map<unsigned long long, vector<weak_ptr<const Tile>>> index_;
+};
+
+} // namespace history
+
+/**
+ * @namespace batch
+ * @brief Non-interactive command line mode that applies a chain of operations to one image.
+ *
+ * Operations are written as "<name>[:<param>[,<param>...]]", where the name is the number of the
+ * matching process_N function, e.g. "2:0.3" (Clarendon with scaling factor 0.3) or "6:2,3"
+ * (enlarge 2x horizontally and 3x vertically). The operations run left to right, each one
+ * consuming the output of the previous one.
+ */
+namespace batch
+{
+
+/**
+ * A single parsed operation from the command line.
+ */
+struct Operation
+{
+    string name;               // Operation name, e.g. "2"
+    vector<string> params;     // Raw parameter strings, e.g. {"0.3"}
+    bool has_region = false;   // Whether the operation only applies to a rectangle
+    region::Rect region;       // The rectangle, from an "@x,y,w,h" suffix
+};
+
+/**
+ * Options collected from the command line for a batch run.
+ */
+struct BatchOptions
+{
+    bool in_place = true;       // Run point filters in place instead of allocating a new output
+    bool tiled = false;         // Evaluate the chain lazily, tile by tile
+    size_t memory_budget = 0;   // Peak memory allowed for the chain in bytes (0 for no limit)
+    bool memory_report = false; // Print estimated and actual peak memory
+    string input;
+    string output;
+    vector<Operation> operations;
+    result_cache::CacheOptions cache;
+};
+
+/**
+ * Formats an operation back into its command line form (e.g. "6:2,3").
+ *
+ * @param op The operation to format.
+ * @return The textual operation spec.
+ */
+string to_string(const Operation &op)
+{
+    string spec = op.name;
+    for (size_t i = 0; i < op.params.size(); ++i)
+    {
+        spec += (i == 0 ? ":" : ",");
+        spec += op.params[i];
+    }
+    if (op.has_region)
+    {
+        spec += "@" + std::to_string(op.region.x) + "," + std::to_string(op.region.y) + "," +
+                std::to_string(op.region.width) + "," + std::to_string(op.region.height);
+    }
+    return spec;
+}
+
+/**
+ * Splits a comma separated list.
+ *
+ * @param text  The list text.
+ * @param items Receives the items.
+ * @return False if any item is empty, true otherwise.
+ */
+bool split_list(const string &text, vector<string> &items)
+{
+    size_t start = 0;
+    while (true)
+    {
+        size_t comma = text.find(',', start);
+        string item = text.substr(start, comma == string::npos ? string::npos : comma - start);
+        if (item.empty())
+            return false;
+        items.push_back(item);
+        if (comma == string::npos)
+            return true;
+        start = comma + 1;
+    }
+}
+
+/**
+ * Parses an operation spec of the form "<name>[:<param>[,<param>...]][@<x>,<y>,<width>,<height>]".
+ *
+ * @param spec The text to parse.
+ * @param op   Receives the parsed operation.
+ * @return True if the spec was well formed, false otherwise.
+ */
+bool parse_operation(const string &spec, Operation &op)
+{
+    op = Operation();
+    size_t at = spec.find('@');
+    string body = spec.substr(0, at);
+    size_t colon = body.find(':');
+    op.name = body.substr(0, colon);
+    if (op.name.empty())
+        return false;
+    if (colon != string::npos && !split_list(body.substr(colon + 1), op.params))
+        return false;
+    if (at == string::npos)
+        return true;
+
+    vector<string> bounds;
+    if (!split_list(spec.substr(at + 1), bounds) || bounds.size() != 4)
+        return false;
+    int values[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        try
+        {
+            size_t used = 0;
+            values[i] = stoi(bounds[i], &used);
+            if (used != bounds[i].size())
+                return false;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+    op.has_region = true;
+    op.region.x = values[0];
+    op.region.y = values[1];
+    op.region.width = values[2];
+    op.region.height = values[3];
+    return !op.region.empty();
+}
+
+/**
+ * Reports whether an operation only depends on each pixel's own value, which means it
+ * can overwrite its input instead of producing a separate output image.
+ *
+ * @param op The operation to check.
+ * @return True for the filters that can overwrite their input (2, 3, 7, 8, 9, 10, 12, 13, 14, 19-22 and gray).
+ */
+bool is_point_operation(const Operation &op)
+{
+    return op.name == "2" || op.name == "3" || op.name == "7" || op.name == "8" || op.name == "9" ||
+           op.name == "10" || op.name == "12" || op.name == "13" || op.name == "14" || op.name == "gray" ||
+           op.name == "19" || op.name == "20" || op.name == "21" || op.name == "22";
+}
+
+/**
+ * Reports whether an operation is a whole-image color adjustment (saturation, hue, exposure);
+ * consecutive runs of these are fused into a single pass.
+ */
+bool is_color_adjustment(const Operation &op)
+{
+    return (op.name == "19" || op.name == "20" || op.name == "21") && !op.has_region;
+}
+
+/**
+ * Reads a floating point parameter and checks that it lies in [min_value, max_value].
+ *
+ * @param op        The operation holding the parameter.
+ * @param index     Index of the parameter to read.
+ * @param min_value The minimum allowed value (inclusive).
+ * @param max_value The maximum allowed value (inclusive).
+ * @param value     Receives the parsed value.
+ * @param error     Receives a message describing the problem on failure.
+ * @return True if the parameter exists, is numeric and is within range.
+ */
+bool param_double(const Operation &op, size_t index, double min_value, double max_value, double &value,
+                  string &error)
+{
+    if (index >= op.params.size())
+    {
+        error = "Operation " + op.name + " is missing parameter " + std::to_string(index + 1);
+        return false;
+    }
+    try
+    {
+        size_t used = 0;
+        value = stod(op.params[index], &used);
+        if (used == op.params[index].size() && value >= min_value && value <= max_value)
+            return true;
+    }
+    catch (...)
+    {
+    }
+    ostringstream message;
+    message << "Operation " << op.name << " parameter " << index + 1 << " must be a number between " << min_value
+            << " and " << max_value;
+    error = message.str();
+    return false;
+}
+
+/**
+ * Reads an integer parameter and checks that it lies in [min_value, max_value].
+ *
+ * @param op        The operation holding the parameter.
+ * @param index     Index of the parameter to read.
+ * @param min_value The minimum allowed value (inclusive).
+ * @param max_value The maximum allowed value (inclusive).
+ * @param value     Receives the parsed value.
+ * @param error     Receives a message describing the problem on failure.
+ * @return True if the parameter exists, is an integer and is within range.
+ */
+bool param_int(const Operation &op, size_t index, int min_value, int max_value, int &value, string &error)
+{
+    if (index >= op.params.size())
+    {
+        error = "Operation " + op.name + " is missing parameter " + std::to_string(index + 1);
+        return false;
+    }
+    try
+    {
+        size_t used = 0;
+        value = stoi(op.params[index], &used);
+        if (used == op.params[index].size() && value >= min_value && value <= max_value)
+            return true;
+    }
+    catch (...)
+    {
+    }
+    error = "Operation " + op.name + " parameter " + std::to_string(index + 1) + " must be an integer between " +
+            std::to_string(min_value) + " and " + std::to_string(max_value);
+    return false;
+}
+
+/**
+ * Reads the optional luma weighting parameter of the grayscale and high contrast operations.
+ *
+ * @param op        The operation holding the parameter.
+ * @param weighting Receives the weighting; left unchanged (the plain average) when omitted.
+ * @param error     Receives a message describing the problem on failure.
+ * @return True if the parameter is absent or names a known weighting.
+ */
+bool param_weighting(const Operation &op, luma::Weighting &weighting, string &error)
+{
+    if (op.params.empty() || luma::parse_weighting(op.params[0], weighting))
+        return true;
+    error = "Operation " + op.name + " parameter 1 must be 'average', '601' or '709'";
+    return false;
+}
+
+/**
+ * Reads the optional parameters of the quantizing operations: a dithering mode and, for
+ * operations that take one, a luma weighting, in any order.
+ *
+ * @param op        The operation holding the parameters.
+ * @param weighting Receives the weighting, or nullptr if the operation takes none.
+ * @param mode      Receives the dithering mode; left unchanged (none) when omitted.
+ * @param error     Receives a message describing the problem on failure.
+ * @return True if every parameter names a known weighting or dithering mode.
+ */
+bool param_quantize(const Operation &op, luma::Weighting *weighting, dither::Mode &mode, string &error)
+{
+    for (size_t i = 0; i < op.params.size(); ++i)
+    {
+        if (dither::parse_mode(op.params[i], mode) || (weighting && luma::parse_weighting(op.params[i], *weighting)))
+            continue;
+        error = "Operation " + op.name + " parameter " + std::to_string(i + 1) + " must be " +
+                (weighting ? "'average', '601', '709', " : "") + "'none', 'bayer' or 'fs'";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reads the parameter of a color adjustment operation and folds it into an adjustment.
+ *
+ * @param op         A saturation (19), hue (20) or exposure (21) operation.
+ * @param adjustment The adjustment to add to.
+ * @param error      Receives a message describing the problem on failure.
+ * @return True if the parameter is valid.
+ */
+bool add_color_adjustment(const Operation &op, color::Adjustment &adjustment, string &error)
+{
+    double value = 0.0;
+    color::Adjustment step;
+    if (op.name == "19")
+    {
+        if (!param_double(op, 0, 0.0, 10.0, value, error))
+            return false;
+        step.saturation = value;
+    }
+    else if (op.name == "20")
+    {
+        if (!param_double(op, 0, -360.0, 360.0, value, error))
+            return false;
+        step.hue_degrees = value;
+    }
+    else
+    {
+        if (!param_double(op, 0, -10.0, 10.0, value, error))
+            return false;
+        step.exposure_stops = value;
+    }
+    adjustment.compose(step);
+    return true;
+}
+
+/**
+ * Reads the parameters of an arbitrary rotation: the angle and an optional resampling method.
+ */
+bool param_rotation(const Operation &op, int &degrees, geometry::RotationMethod &method, string &error)
+{
+    if (!param_int(op, 0, 1, 359, degrees, error))
+        return false;
+    method = geometry::ROTATE_BILINEAR;
+    if (op.params.size() < 2 || geometry::parse_rotation_method(op.params[1], method))
+        return true;
+    error = "Operation " + op.name + " parameter 2 must be 'bilinear' or 'shear'";
+    return false;
+}
+
+/**
+ * Returns true for the operations that only move pixels around (4, 5, 6 and bilinear 11), which
+ * can be folded into one resample. Operations limited to a region are applied on their own.
+ */
+bool is_geometric_operation(const Operation &op)
+{
+    if (op.has_region)
+        return false;
+    if (op.name == "11")
+        return op.params.size() < 2 || op.params[1] == "bilinear";
+    return op.name == "4" || op.name == "5" || op.name == "6";
+}
+
+/**
+ * Reads the parameters of a geometric operation and appends it to a transform.
+ *
+ * @param op        A rotate (4, 5, 11) or enlarge (6) operation.
+ * @param transform The chain to extend.
+ * @param error     Receives a message describing the problem on failure.
+ * @return True if the parameters are valid.
+ */
+bool add_geometric_operation(const Operation &op, geometry::Transform &transform, string &error)
+{
+    int first = 0, second = 0;
+    if (op.name == "4")
+        geometry::rotate_quarter_turns(transform, 1);
+    else if (op.name == "5")
+    {
+        if (!param_int(op, 0, numeric_limits<int>::min() / 90, numeric_limits<int>::max() / 90, first, error))
+            return false;
+        geometry::rotate_quarter_turns(transform, first);
+    }
+    else if (op.name == "6")
+    {
+        if (!param_int(op, 0, 1, 1000, first, error) || !param_int(op, 1, 1, 1000, second, error))
+            return false;
+        if (!geometry::enlarge(transform, first, second))
+        {
+            error = "Operation " + to_string(op) + " makes the image too large";
+            return false;
+        }
+    }
+    else
+    {
+        if (!param_int(op, 0, 1, 359, first, error))
+            return false;
+        geometry::rotate_degrees(transform, first);
+    }
+    return true;
+}
+
+/**
+ * Returns how far outside a region an operation reads, so applying it to a region gives the
+ * same pixels there as applying it to the whole image.
+ *
+ * @param op The operation (its parameters are validated later, when it is applied).
+ * @return The halo width in pixels.
+ */
+int region_halo(const Operation &op)
+{
+    double first = op.params.empty() ? 0.0 : atof(op.params[0].c_str());
+    if (op.name == "14" || op.name == "18")
+        return max(0, static_cast<int>(first));
+    if (op.name == "15" || op.name == "16")
+        return max(1, static_cast<int>(ceil(3.0 * min(first, 500.0))));
+    if (op.name == "17")
+        return 1;
+    return 0;
+}
+
+/**
+ * Applies one operation to the image, replacing the image with the result.
+ *
+ * Point filters are run with their process_N_in_place variant when in_place is set; every
+ * other operation produces a new image and the old buffer is handed back to the buffer pool.
+ * An operation with a region only changes that rectangle (see region::apply_in_region()).
+ *
+ * @param image    The image to process; replaced by the result on success.
+ * @param op       The operation to apply.
+ * @param in_place Whether point filters may overwrite the image directly.
+ * @param error    Receives a message describing the problem on failure.
+ * @return True if the operation was applied, false otherwise.
+ */
+bool apply_operation(vector<vector<Pixel>> &image, const Operation &op, bool in_place, string &error)
+{
+    double factor = 0.0;
+    int first = 0, second = 0;
+    luma::Weighting weighting = luma::LUMA_AVERAGE;
+    dither::Mode mode = dither::DITHER_NONE;
+    vector<vector<Pixel>> result;
+
+    if (op.has_region && op.name == "compare")
+    {
+        error = "Operation compare works on the whole image and takes no region";
+        return false;
+    }
+    if (op.has_region && op.name != "crop")
+    {
+        Operation whole = op;
+        whole.has_region = false;
+        return region::apply_in_region(
+            image, op.region, region_halo(op),
+            [&](vector<vector<Pixel>> &patch) { return apply_operation(patch, whole, true, error); }, error);
+    }
+
+    if (op.name == "1")
+        result = image_processing::process_1(image);
+    else if (op.name == "2")
+    {
+        if (!param_double(op, 0, 0.0, 1.0, factor, error))
+            return false;
+        if (in_place)
+            image_processing::process_2_in_place(image, factor);
+        else
+            result = image_processing::process_2(image, factor);
+    }
+    else if (op.name == "3" || op.name == "gray")
+    {
+        if (!param_weighting(op, weighting, error))
+            return false;
+        if (in_place)
+            image_processing::process_3_in_place(image, weighting);
+        else
+            result = image_processing::process_3(image, weighting);
+    }
+    else if (op.name == "4")
+        result = image_processing::process_4(image);
+    else if (op.name == "5")
+    {
+        if (!param_int(op, 0, numeric_limits<int>::min() / 90, numeric_limits<int>::max() / 90, first, error))
+            return false;
+        result = image_processing::process_5(image, first);
+    }
+    else if (op.name == "6")
+    {
+        if (!param_int(op, 0, 1, 1000, first, error) || !param_int(op, 1, 1, 1000, second, error))
+            return false;
+        result = image_processing::process_6(image, first, second);
+    }
+    else if (op.name == "7")
+    {
+        if (!param_quantize(op, &weighting, mode, error))
+            return false;
+        if (in_place)
+            image_processing::process_7_in_place(image, 128, weighting, mode);
+        else
+            result = image_processing::process_7(image, weighting, mode);
+    }
+    else if (op.name == "8" || op.name == "9")
+    {
+        if (!param_double(op, 0, 0.0, 10.0, factor, error))
+            return false;
+        if (in_place)
+        {
+            if (op.name == "8")
+                image_processing::process_8_in_place(image, factor);
+            else
+                image_processing::process_9_in_place(image, factor);
+        }
+        else
+        {
+            result = op.name == "8" ? image_processing::process_8(image, factor)
+                                    : image_processing::process_9(image, factor);
+        }
+    }
+    else if (op.name == "10")
+    {
+        if (!param_quantize(op, nullptr, mode, error))
+            return false;
+        if (in_place)
+            image_processing::process_10_in_place(image, mode);
+        else
+            result = image_processing::process_10(image, mode);
+    }
+    else if (op.name == "11")
+    {
+        geometry::RotationMethod method;
+        if (!param_rotation(op, first, method, error))
+            return false;
+        result = image_processing::process_11(image, first, method);
+    }
+    else if (op.name == "12")
+    {
+        factor = 0.5;
+        if (!op.params.empty() && !param_double(op, 0, 0.0, 49.9, factor, error))
+            return false;
+        if (in_place)
+            image_processing::process_12_in_place(image, factor);
+        else
+            result = image_processing::process_12(image, factor);
+    }
+    else if (op.name == "13")
+    {
+        image_processing::ThresholdMethod method = image_processing::THRESHOLD_MEAN;
+        if (!op.params.empty())
+        {
+            if (op.params[0] == "otsu")
+                method = image_processing::THRESHOLD_OTSU;
+            else if (op.params[0] != "mean")
+            {
+                error = "Operation 13 parameter 1 must be 'mean' or 'otsu'";
+                return false;
+            }
+        }
+        if (in_place)
+            image_processing::process_13_in_place(image, method);
+        else
+            result = image_processing::process_13(image, method);
+    }
+    else if (op.name == "14")
+    {
+        if (!param_int(op, 0, 1, 10000, first, error))
+            return false;
+        second = 0;
+        if (op.params.size() > 1 && !param_int(op, 1, -255, 255, second, error))
+            return false;
+        if (in_place)
+            image_processing::process_14_in_place(image, first, second);
+        else
+            result = image_processing::process_14(image, first, second);
+    }
+    else if (op.name == "15")
+    {
+        if (!param_double(op, 0, 0.1, 500.0, factor, error))
+            return false;
+        result = image_processing::process_15(image, factor);
+    }
+    else if (op.name == "16")
+    {
+        double amount = 1.0;
+        if (!param_double(op, 0, 0.1, 500.0, factor, error) ||
+            (op.params.size() > 1 && !param_double(op, 1, 0.0, 10.0, amount, error)))
+            return false;
+        result = image_processing::process_16(image, factor, amount);
+    }
+    else if (op.name == "17")
+        result = image_processing::process_17(image);
+    else if (op.name == "18")
+    {
+        if (!param_int(op, 0, 1, 10000, first, error))
+            return false;
+        result = image_processing::process_18(image, first);
+    }
+    else if (is_color_adjustment(op))
+    {
+        color::Adjustment adjustment;
+        if (!add_color_adjustment(op, adjustment, error))
+            return false;
+        if (in_place)
+            image_processing::adjust_colors_in_place(image, adjustment);
+        else
+            result = image_processing::adjust_colors(image, adjustment);
+    }
+    else if (op.name == "22")
+    {
+        blend::Layer layer;
+        blend::Mode blend_mode = blend::BLEND_NORMAL;
+        factor = 1.0;
+        if (op.params.size() != 2 && op.params.size() != 3 && op.params.size() != 5)
+        {
+            error = "Operation 22 takes <layer.bmp>,<mode>[,<opacity>[,<x>,<y>]]";
+            return false;
+        }
+        if (!blend::parse_mode(op.params[1], blend_mode))
+        {
+            error = "Operation 22 parameter 2 must be 'normal', 'multiply', 'screen' or 'overlay'";
+            return false;
+        }
+        if ((op.params.size() > 2 && !param_double(op, 2, 0.0, 1.0, factor, error)) ||
+            (op.params.size() > 3 && (!param_int(op, 3, -100000, 100000, first, error) ||
+                                      !param_int(op, 4, -100000, 100000, second, error))))
+            return false;
+        if (!blend::load_layer(op.params[0], layer))
+        {
+            error = "Failed to open or read the image file: " + op.params[0];
+            return false;
+        }
+        if (in_place)
+            image_processing::process_22_in_place(image, layer, blend_mode, factor, first, second);
+        else
+            result = image_processing::process_22(image, layer, blend_mode, factor, first, second);
+        buffer_pool::release_image(layer.pixels);
+    }
+    else if (op.name == "23")
+    {
+        if (!param_int(op, 0, 1, 30, first, error))
+            return false;
+        result = image_processing::process_23(image, first);
+    }
+    else if (op.name == "crop")
+    {
+        // Keeps the rows in place; only the region's own pixels move
+        if (!op.has_region || !op.params.empty())
+        {
+            error = "Operation crop takes a region: crop@<x>,<y>,<width>,<height>";
+            return false;
+        }
+        if (!region::crop_in_place(image, op.region))
+        {
+            error = "The region lies outside the image";
+            return false;
+        }
+        return true;
+    }
+    else if (op.name == "stats")
+    {
+        // Analysis only; the image passes through unchanged
+        image_stats::print_stats(image_stats::compute_stats(image));
+        return true;
+    }
+    else if (op.name == "compare")
+    {
+        // Analysis only as well; the heatmap goes to its own file
+        if (op.params.empty() || op.params.size() > 2 || op.params[0].empty())
+        {
+            error = "Operation compare takes a reference image and an optional heatmap file: "
+                    "compare:<reference>[,<heatmap>]";
+            return false;
+        }
+        vector<vector<Pixel>> reference = image_io::read(op.params[0], error);
+        metrics::Report report;
+        bool ok = !reference.empty() &&
+                  metrics::compare(image, reference, metrics::DEFAULT_SSIM_RADIUS, report, error);
+        if (ok)
+            metrics::print_report(report);
+        if (ok && op.params.size() == 2)
+        {
+            vector<vector<Pixel>> heatmap = metrics::heatmap(image, reference, report.max_diff);
+            ok = image_io::write(op.params[1], heatmap);
+            if (!ok)
+                error = "Failed to write output image: " + op.params[1];
+            buffer_pool::release_image(heatmap);
+        }
+        buffer_pool::release_image(reference);
+        return ok;
+    }
+    else
+    {
+        error = "Unknown operation: " + op.name;
+        return false;
+    }
+
+    if (in_place && is_point_operation(op))
+        return true;
+    if (result.empty())
+    {
+        error = "Operation " + to_string(op) + " produced an empty image";
+        return false;
+    }
+    buffer_pool::release_image(image);
+    image.swap(result);
+    return true;
+}
+
+/**
+ * Applies operations [begin, end) in order. Consecutive color adjustments (19, 20, 21) are
+ * combined and applied in one pass instead of one conversion round trip each, and consecutive
+ * geometric operations (4, 5, 6, 11) are folded into one matrix and resampled once.
+ *
+ * @param image      The image to process; replaced by the result on success.
+ * @param operations The operation chain.
+ * @param begin      Index of the first operation to apply.
+ * @param end        One past the index of the last operation to apply.
+ * @param in_place   Whether point filters may overwrite the image directly.
+ * @param error      Receives a message describing the problem on failure.
+ * @return True if every operation was applied, false otherwise.
+ */
+bool apply_operations(vector<vector<Pixel>> &image, const vector<Operation> &operations, size_t begin, size_t end,
+                      bool in_place, string &error)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (!image.empty() && is_geometric_operation(operations[i]) && i + 1 < end &&
+            is_geometric_operation(operations[i + 1]))
+        {
+            geometry::Transform transform = geometry::identity(image[0].size(), image.size());
+            for (; i < end && is_geometric_operation(operations[i]); ++i)
+            {
+                if (!add_geometric_operation(operations[i], transform, error))
+                    return false;
+            }
+            --i;
+            vector<vector<Pixel>> result = geometry::resample(image, transform);
+            buffer_pool::release_image(image);
+            image.swap(result);
+            continue;
+        }
+        if (!is_color_adjustment(operations[i]))
+        {
+            if (!apply_operation(image, operations[i], in_place, error))
+                return false;
+            continue;
+        }
+
+        color::Adjustment adjustment;
+        for (; i < end && is_color_adjustment(operations[i]); ++i)
+        {
+            if (!add_color_adjustment(operations[i], adjustment, error))
+                return false;
+        }
+        --i;
+        if (in_place)
+            image_processing::adjust_colors_in_place(image, adjustment);
+        else
+        {
+            vector<vector<Pixel>> result = image_processing::adjust_colors(image, adjustment);
+            buffer_pool::release_image(image);
+            image.swap(result);
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns true for operations that can be evaluated tile by tile: each output pixel depends only
+ * on the input pixels within a fixed distance of it (see tiles::Graph). Operations that read the
+ * whole image (vignette, auto levels, automatic threshold, error diffusion), that depend on the
+ * absolute position (ordered dithering, layers) or that change the size are not.
+ *
+ * @param op   The operation.
+ * @param halo Receives the distance in pixels (0 for point filters).
+ */
+bool is_tile_local(const Operation &op, int &halo)
+{
+    halo = 0;
+    if (op.has_region)
+        return false;
+    if (op.name == "2" || op.name == "3" || op.name == "gray" || op.name == "8" || op.name == "9")
+        return true;
+    if (op.name == "7" || op.name == "10")
+    {
+        luma::Weighting weighting = luma::LUMA_AVERAGE;
+        dither::Mode mode = dither::DITHER_NONE;
+        string error;
+        return param_quantize(op, op.name == "7" ? &weighting : nullptr, mode, error) && mode == dither::DITHER_NONE;
+    }
+    if (op.name == "14" || op.name == "15" || op.name == "16" || op.name == "17" || op.name == "18")
+    {
+        halo = region_halo(op);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Returns true for the operations a tile graph can evaluate: geometric operations, color
+ * adjustments and tile-local filters.
+ */
+bool is_graph_operation(const Operation &op)
+{
+    int halo = 0;
+    return is_geometric_operation(op) || is_color_adjustment(op) || is_tile_local(op, halo);
+}
+
+/**
+ * Adds the run of graph operations starting at operations[i] to a tile graph, folding
+ * consecutive geometric operations into one transform and color adjustments into one filter.
+ *
+ * @param graph      The graph to extend.
+ * @param operations The operation chain.
+ * @param i          The first operation to add; advanced past the last one added.
+ * @param end        One past the index of the last operation that may be added.
+ * @param error      Receives a message describing the problem on failure.
+ * @return True if every operation added had valid parameters.
+ */
+bool add_tile_run(tiles::Graph &graph, const vector<Operation> &operations, size_t &i, size_t end, string &error)
+{
+    int halo = 0;
+    while (i < end)
+    {
+        const Operation &op = operations[i];
+        if (is_geometric_operation(op))
+        {
+            geometry::Transform transform = geometry::identity(graph.width(), graph.height());
+            for (; i < end && is_geometric_operation(operations[i]); ++i)
+            {
+                if (!add_geometric_operation(operations[i], transform, error))
+                    return false;
+            }
+            graph.add_geometry(transform);
+        }
+        else if (is_color_adjustment(op))
+        {
+            color::Adjustment adjustment;
+            for (; i < end && is_color_adjustment(operations[i]); ++i)
+            {
+                if (!add_color_adjustment(operations[i], adjustment, error))
+                    return false;
+            }
+            graph.add_filter(
+                [adjustment](vector<vector<Pixel>> &patch, string &) {
+                    image_processing::adjust_colors_in_place(patch, adjustment);
+                    return true;
+                },
+                0);
+        }
+        else if (is_tile_local(op, halo))
+        {
+            graph.add_filter(
+                [op](vector<vector<Pixel>> &patch, string &message) {
+                    return apply_operation(patch, op, true, message);
+                },
+                halo);
+            ++i;
+        }
+        else
+            break;
+    }
+    return true;
+}
+
+/**
+ * Applies operations [begin, end) like apply_operations(), but evaluates every run of tile-local
+ * operations lazily through a tiles::Graph instead of producing each intermediate image.
+ * Geometric and color adjustment runs are folded the same way, so the result is identical;
+ * operations that need the whole image are applied in between as usual.
+ *
+ * @param image      The image to process; replaced by the result on success.
+ * @param operations The operation chain.
+ * @param begin      Index of the first operation to apply.
+ * @param end        One past the index of the last operation to apply.
+ * @param error      Receives a message describing the problem on failure.
+ * @return True if every operation was applied, false otherwise.
+ */
+bool apply_operations_tiled(vector<vector<Pixel>> &image, const vector<Operation> &operations, size_t begin,
+                            size_t end, string &error)
+{
+    size_t i = begin;
+    while (i < end)
+    {
+        tiles::Graph graph(image);
+        if (!image.empty() && !add_tile_run(graph, operations, i, end, error))
+            return false;
+
+        if (graph.size() > 0)
+        {
+            vector<vector<Pixel>> result;
+            if (!graph.render(result, error))
+                return false;
+            buffer_pool::release_image(image);
+            image.swap(result);
+        }
+        // The operation that stopped the run needs the whole image
+        if (i < end)
+        {
+            if (!apply_operation(image, operations[i], true, error))
+                return false;
+            ++i;
+        }
+    }
+    return true;
+}
+
+/**
+ * Formats an operation chain the way it is written on the command line (e.g. "2:0.3 3").
+ *
+ * @param operations The operations, in order.
+ * @return The chain description, also used as part of the result cache key.
+ */
+string chain_to_string(const vector<Operation> &operations)
+{
+    string chain;
+    for (size_t i = 0; i < operations.size(); ++i)
+        chain += (i == 0 ? "" : " ") + to_string(operations[i]);
+    return chain;
+}
+
+/**
+ * Reads a 24-bit BMP, an 8-bit grayscale BMP expanded to three equal channels, or any of the
+ * other formats of image_io. A more specific reason than "could not be read" is printed here.
+ *
+ * @param filename The image file to read, or "-" for standard input.
+ * @return The image, or an empty image if the file could not be read.
+ */
+vector<vector<Pixel>> load_image(const string &filename)
+{
+    string error;
+    vector<vector<Pixel>> image = image_io::read(filename, error);
+    if (image.empty() && !error.empty())
+        cli_utils::print_error(error);
+    return image;
+}
+
+/**
+ * Size and format of an input file, read from its header without decoding the pixels.
+ */
+struct BmpHeader
+{
+    int width = 0;
+    int height = 0;
+    int bits_per_pixel = 0;
+};
+
+/**
+ * Reads the header fields of a BMP file. PPM, PGM and raw files report their size with 24 bits
+ * per pixel, since they decode straight into the image without a gray plane in between.
+ *
+ * @param filename The image file.
+ * @param header   Receives the size and bit depth.
+ * @return True if the file starts with a header describing a non-empty image.
+ */
+bool read_bmp_header(const string &filename, BmpHeader &header)
+{
+    if (image_io::read_size(filename, header.width, header.height))
+    {
+        header.bits_per_pixel = 24;
+        return true;
+    }
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open() || get_int(stream, 0, 2) != ('B' | 'M' << 8))
+        return false;
+    header.width = get_int(stream, 18, 4);
+    header.height = get_int(stream, 22, 4);
+    header.bits_per_pixel = get_int(stream, 28, 2);
+    return stream.good() && header.width > 0 && header.height > 0;
+}
+
+/**
+ * Updates an image size to the size an operation produces from it. Parameters are read
+ * leniently; invalid ones are reported when the operation runs.
+ */
+void operation_size(const Operation &op, long long &width, long long &height)
+{
+    int first = op.params.empty() ? 0 : atoi(op.params[0].c_str());
+    int second = op.params.size() < 2 ? 0 : atoi(op.params[1].c_str());
+    if (op.name == "crop")
+    {
+        region::Rect rect = region::clip(op.region, static_cast<int>(min(width, 2147483647LL)),
+                                         static_cast<int>(min(height, 2147483647LL)));
+        width = rect.width;
+        height = rect.height;
+    }
+    else if (op.has_region)
+        return;
+    else if (op.name == "4" || (op.name == "5" && first % 2 != 0))
+        swap(width, height);
+    else if (op.name == "6" && first > 0 && second > 0)
+    {
+        width *= first;
+        height *= second;
+    }
+    else if (op.name == "11" && first >= 1 && first <= 359 && max(width, height) <= numeric_limits<int>::max() / 2)
+    {
+        geometry::Transform transform = geometry::identity(width, height);
+        geometry::rotate_degrees(transform, first);
+        width = transform.width;
+        height = transform.height;
+    }
+    else if (op.name == "23")
+    {
+        for (int level = 0; level < first && (width > 1 || height > 1); ++level)
+        {
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+}
+
+/**
+ * @return Bytes per pixel of working memory an operation allocates besides its output: float
+ *         planes for the convolution filters, integral images for the adaptive threshold,
+ *         a gray copy for the thresholds and the reference image plus gray copies for compare.
+ */
+size_t scratch_per_pixel(const Operation &op)
+{
+    if (op.name == "compare")
+        return 14;
+    if (op.name == "14")
+        return 16;
+    if (op.name == "15" || op.name == "18")
+        return 12;
+    if (op.name == "16" || op.name == "17")
+        return 24;
+    if (op.name == "7" || op.name == "10" || op.name == "13" || op.name == "gray")
+        return 1;
+    return 0;
+}
+
+/**
+ * The estimated peak memory of a chain, worked out from the input's header and the operation
+ * parameters before anything is decoded.
+ */
+struct MemoryPlan
+{
+    long long output_width = 0;
+    long long output_height = 0;
+    size_t eager_bytes = 0;    // Peak when every step produces a whole image
+    size_t streamed_bytes = 0; // Peak when the trailing run of graph operations streams to the file
+    size_t stream_from = 0;    // First operation of that run (the chain length if there is none)
+    size_t stream_end = 0;     // One past its last operation (a trailing gray is written, not run)
+    bool streamed = false;     // Whether process_file() chose to stream
+    size_t baseline_bytes = 0; // Peak resident memory of the process before the image was read
+};
+
+/**
+ * @return How many tile rows render_streamed() computes per band: enough for every thread.
+ */
+int stream_band_tile_rows()
+{
+    return max(4, static_cast<int>(parallel_utils::thread_count()));
+}
+
+/**
+ * Estimates the peak memory of running a chain, both with whole intermediate images and with
+ * the trailing run of graph operations streamed into the output file.
+ *
+ * The model follows the images the chain holds at each step (input, output and scratch) plus
+ * the released rows the buffer pool may still be holding (up to its cap). Decoded input rows are
+ * not reserved at a size class, so the pool does not keep them.
+ *
+ * @param header     The input's header.
+ * @param operations The operations to apply, in order.
+ * @param in_place   Whether point filters overwrite the image directly.
+ * @param tiled      Whether runs of graph operations are evaluated in tiles.
+ * @param plan       Receives the estimates.
+ * @param error      Receives a message if the chain cannot run at all.
+ * @return False if some step, or the output file, would be too large to represent.
+ */
+bool plan_memory(const BmpHeader &header, const vector<Operation> &operations, bool in_place, bool tiled,
+                 MemoryPlan &plan, string &error)
+{
+    size_t count = operations.size();
+    bool gray_output = count > 0 && operations[count - 1].name == "gray";
+    size_t last = count - (gray_output ? 1 : 0);
+    plan.stream_end = last;
+    plan.stream_from = last;
+    while (plan.stream_from > 0 && is_graph_operation(operations[plan.stream_from - 1]))
+        --plan.stream_from;
+    if (plan.stream_from == last)
+        plan.stream_from = count;
+
+    long long width = header.width, height = header.height;
+    size_t image = buffer_pool::image_bytes(height, width);
+    bool image_pooled = false;
+    size_t peak = image + (header.bits_per_pixel == 8 ? width * height : 0);
+    size_t pooled = 0;
+    size_t stream_prefix_peak = peak, stream_image = image, stream_pooled = 0;
+    int stream_halo = 0;
+
+    for (size_t i = 0; i < last;)
+    {
+        if (i == plan.stream_from)
+        {
+            stream_prefix_peak = peak;
+            stream_image = image;
+            stream_pooled = pooled;
+        }
+        // One step is one operation, or a run that is applied as one (see apply_operations())
+        const Operation &op = operations[i];
+        size_t end = i + 1;
+        bool graph_run = tiled && is_graph_operation(op);
+        if (graph_run)
+            while (end < last && end != plan.stream_from && is_graph_operation(operations[end]))
+                ++end;
+        else if (is_geometric_operation(op))
+            while (end < last && is_geometric_operation(operations[end]))
+                ++end;
+        else if (is_color_adjustment(op))
+            while (end < last && is_color_adjustment(operations[end]))
+                ++end;
+
+        long long new_width = width, new_height = height;
+        size_t scratch = 0;
+        for (size_t j = i; j < end; ++j)
+        {
+            int halo = 0;
+            if (j >= plan.stream_from && is_tile_local(operations[j], halo))
+                stream_halo = max(stream_halo, halo);
+            const Operation &step = operations[j];
+            if (step.has_region && step.name != "crop")
+                scratch = max(scratch, 2 * buffer_pool::image_bytes(step.region.height, step.region.width) +
+                                           scratch_per_pixel(step) * step.region.width * step.region.height);
+            else
+                scratch = max(scratch, scratch_per_pixel(step) * static_cast<size_t>(new_width * new_height));
+            long long old_width = new_width, old_height = new_height;
+            operation_size(step, new_width, new_height);
+            if (new_width > numeric_limits<int>::max() || new_height > numeric_limits<int>::max() ||
+                new_width * new_height > numeric_limits<int>::max())
+            {
+                error = "Operation " + to_string(step) + " makes the image too large (" + std::to_string(new_width) +
+                        "x" + std::to_string(new_height) + ")";
+                return false;
+            }
+            // The three-shear rotation holds a turned copy of its input and two sheared images
+            // about the size of its output, the second one alongside the output
+            if (step.name == "11" && !step.has_region && !is_geometric_operation(step))
+                scratch = max(scratch, buffer_pool::image_bytes(old_height, old_width) +
+                                           buffer_pool::image_bytes(new_height, new_width));
+        }
+        if (graph_run)
+            scratch = 0; // Tiles are a small, fixed working set
+
+        bool overwrites = !graph_run && in_place && (is_color_adjustment(op) || (end == i + 1 && is_point_operation(op)) ||
+                                                     (op.has_region && op.name != "crop"));
+        size_t output = overwrites ? 0 : buffer_pool::image_bytes(new_height, new_width);
+        peak = max(peak, image + output + scratch + pooled);
+        if (!overwrites)
+        {
+            pooled = min(buffer_pool::MAX_POOLED_BYTES, pooled - min(pooled, output) + (image_pooled ? image : 0));
+            image = output;
+            image_pooled = true;
+        }
+        width = new_width;
+        height = new_height;
+        i = end;
+    }
+    if (gray_output)
+        peak = max(peak, image + pooled + static_cast<size_t>(width * height));
+    plan.eager_bytes = peak;
+    plan.output_width = width;
+    plan.output_height = height;
+
+    // The output file has to fit the 32-bit sizes of the BMP header
+    long long stride = gray_output ? (width + 3) / 4 * 4 : (width * 3 + 3) / 4 * 4;
+    if (54 + (gray_output ? 1024 : 0) + stride * height > numeric_limits<int>::max())
+    {
+        error = "The output image (" + std::to_string(width) + "x" + std::to_string(height) +
+                ") is too large for a BMP file";
+        return false;
+    }
+
+    // Streaming holds the run's input, one band of output rows and each thread's tile caches
+    if (plan.stream_from < count)
+    {
+        size_t tile = tiles::TILE_SIZE * max(1, (4 * stream_halo + tiles::TILE_SIZE - 1) / tiles::TILE_SIZE);
+        size_t band = buffer_pool::image_bytes(min<long long>(height, stream_band_tile_rows() * tile), width);
+        size_t caches = parallel_utils::thread_count() * (plan.stream_end - plan.stream_from + 1) *
+                        (tiles::STRIP_TILES + 3) * 4 * buffer_pool::image_bytes(tile, tile);
+        plan.streamed_bytes = max(stream_prefix_peak, stream_image + stream_pooled + band + caches);
+    }
+    return true;
+}
+
+/**
+ * @return The peak resident memory of the process so far, in bytes.
+ */
+size_t peak_resident_bytes()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return static_cast<size_t>(usage.ru_maxrss) * 1024; // Kilobytes on Linux
+}
+
+/**
+ * Writes a BMP file whose rows arrive in bands, top to bottom, so the image is never held in
+ * full. The header is written first and each band goes straight to its place in the file (BMP
+ * files store rows bottom to top). Gray output is an 8-bit BMP with the identity gray palette
+ * of luma::write_gray_bmp().
+ */
+class StreamedBmp
+{
+  public:
+    /**
+     * Creates the file and writes its header.
+     *
+     * @param filename  The BMP file to write.
+     * @param width     Image width in pixels.
+     * @param height    Image height in pixels.
+     * @param gray      Whether to write an 8-bit gray image instead of a 24-bit one.
+     * @param weighting The luma weighting for gray output.
+     */
+    StreamedBmp(const string &filename, int width, int height, bool gray, luma::Weighting weighting)
+        : width_(width), height_(height), gray_(gray), weights_(luma::fixed_point_weights(weighting)),
+          stride_(gray ? (width + 3) & ~3 : (width * 3 + 3) & ~3), start_(54 + (gray ? 1024 : 0))
+    {
+        stream_.open(filename, ios::out | ios::binary);
+        if (!stream_.is_open())
+            return;
+        vector<unsigned char> header = bmp_io::make_header(width, height, gray);
+        stream_.write(reinterpret_cast<char *>(header.data()), header.size());
+    }
+
+    /**
+     * Writes rows [first_row, first_row + rows) of the image, taken from the top of band.
+     *
+     * @return True if the rows were written.
+     */
+    bool write_rows(const vector<vector<Pixel>> &band, int first_row, int rows)
+    {
+        // The band's bottom row comes first in the file, so the band is one contiguous write
+        buffer_.assign(static_cast<size_t>(stride_) * rows, 0);
+        parallel_utils::parallel_for(0, rows, [&](int row_begin, int row_end, int) {
+            for (int row = row_begin; row < row_end; ++row)
+            {
+                const Pixel *source = band[row].data();
+                unsigned char *target = &buffer_[static_cast<size_t>(rows - 1 - row) * stride_];
+                for (int col = 0; col < width_; ++col)
+                {
+                    if (gray_)
+                        target[col] = static_cast<unsigned char>(luma::weighted_value(source[col], weights_));
+                    else
+                    {
+                        target[3 * col] = source[col].blue;
+                        target[3 * col + 1] = source[col].green;
+                        target[3 * col + 2] = source[col].red;
+                    }
+                }
+            }
+        });
+        stream_.seekp(start_ + static_cast<streamoff>(height_ - first_row - rows) * stride_);
+        stream_.write(reinterpret_cast<char *>(buffer_.data()), buffer_.size());
+        return stream_.good();
+    }
+
+    /**
+     * Closes the file.
+     *
+     * @return True if every write succeeded.
+     */
+    bool close()
+    {
+        if (!stream_.is_open())
+            return false;
+        stream_.close();
+        return !stream_.fail();
+    }
+
+    bool is_open() const
+    {
+        return stream_.is_open();
+    }
+
+  private:
+    int width_;
+    int height_;
+    bool gray_;
+    luma::Weights weights_;
+    int stride_;
+    int start_;
+    fstream stream_;
+    vector<unsigned char> buffer_;
+};
+
+/**
+ * Applies a run of graph operations to the image and streams the result into a BMP file band
+ * by band (see tiles::Graph::render_streamed()), so the output is never held in full.
+ *
+ * @param image      The run's input.
+ * @param operations The operation chain.
+ * @param begin      Index of the first operation of the run.
+ * @param end        One past the index of its last operation; all must be graph operations.
+ * @param output     The BMP file to write.
+ * @param gray       Whether to write an 8-bit gray image (a trailing "gray" operation).
+ * @param weighting  The luma weighting for gray output.
+ * @param error      Receives a message describing the problem on failure.
+ * @return True if the output image was written.
+ */
+bool stream_operations(const vector<vector<Pixel>> &image, const vector<Operation> &operations, size_t begin,
+                       size_t end, const string &output, bool gray, luma::Weighting weighting, string &error)
+{
+    tiles::Graph graph(image);
+    size_t i = begin;
+    if (!add_tile_run(graph, operations, i, end, error))
+        return false;
+    if (i != end)
+    {
+        error = "Operation " + to_string(operations[i]) + " cannot be streamed";
+        return false;
+    }
+    StreamedBmp file(output, graph.width(), graph.height(), gray, weighting);
+    if (!file.is_open())
+    {
+        error = "Failed to write output image: " + output;
+        return false;
+    }
+    bool written = true;
+    bool ok = graph.render_streamed(
+        stream_band_tile_rows(),
+        [&](const vector<vector<Pixel>> &band, int first_row, int rows) {
+            written = file.write_rows(band, first_row, rows);
+            return written;
+        },
+        error);
+    if (!file.close() || !written)
+    {
+        error = "Failed to write output image: " + output;
+        return false;
+    }
+    return ok;
+}
+
+/**
+ * Reads an image, applies a chain of operations to it and writes the result.
+ *
+ * When a cache is given, the input file's bytes and the chain are looked up first and a hit
+ * is written straight to the output without decoding or processing anything.
+ *
+ * A chain ending in "gray" writes an 8-bit single-channel BMP instead of a 24-bit one (or gray
+ * levels in the other output formats, see image_io::write()).
+ *
+ * With a memory budget, the peak memory is estimated from the input's header first (see
+ * plan_memory()). A chain that would exceed the budget streams its trailing run of graph
+ * operations straight into the output file if that fits, and is rejected otherwise.
+ *
+ * @param input         The image file to read ("-" for standard input).
+ * @param output        The image file to write ("-" for standard output).
+ * @param operations    The operations to apply, in order.
+ * @param in_place      Whether point filters may overwrite the image directly.
+ * @param error         Receives a message describing the problem on failure.
+ * @param cache         Optional result cache (nullptr to always compute); never used with
+ *                      standard input or output.
+ * @param tiled         Whether to evaluate the chain lazily in tiles (see apply_operations_tiled()).
+ * @param memory_budget Peak memory allowed for the chain in bytes (0 for no limit).
+ * @param plan          Optional; receives the memory estimate (computed whenever this is given).
+ * @return True if the output image was written, false otherwise.
+ */
+bool process_file(const string &input, const string &output, const vector<Operation> &operations, bool in_place,
+                  string &error, result_cache::ResultCache *cache = nullptr, bool tiled = false,
+                  size_t memory_budget = 0, MemoryPlan *plan = nullptr)
+{
+    // Analysis operations print as a side effect, so their chains are never served from cache
+    bool cacheable = cache != nullptr && input != "-" && output != "-";
+    for (size_t i = 0; i < operations.size(); ++i)
+        cacheable = cacheable && operations[i].name != "stats" && operations[i].name != "compare";
+
+    string key;
+    if (cacheable)
+    {
+        string input_bytes, cached;
+        if (!result_cache::read_file(input, input_bytes))
+        {
+            error = "Failed to open or read the image file: " + input;
+            return false;
+        }
+        // Blend layers are files too, so their contents are part of the key, not just their names
+        string chain = chain_to_string(operations);
+        for (size_t i = 0; i < operations.size(); ++i)
+        {
+            string layer_bytes;
+            if (operations[i].name == "22" && !operations[i].params.empty() &&
+                result_cache::read_file(operations[i].params[0], layer_bytes))
+                chain += " " + result_cache::to_hex(result_cache::hash_bytes(layer_bytes.data(), layer_bytes.size()));
+        }
+        // The same pixels are encoded differently per output format, and raw input bytes only
+        // become an image through the size given with --raw-size
+        chain += " format=" + std::to_string(static_cast<int>(image_io::output_format(output))) +
+                 " raw=" + std::to_string(image_io::settings().raw_width) + "x" +
+                 std::to_string(image_io::settings().raw_height);
+        key = result_cache::ResultCache::make_key(input_bytes, chain);
+        if (cache->lookup(key, cached))
+        {
+            if (result_cache::write_file(output, cached))
+                return true;
+            error = "Failed to write output image: " + output;
+            return false;
+        }
+    }
+
+    MemoryPlan local_plan;
+    if (!plan)
+        plan = &local_plan;
+    plan->baseline_bytes = peak_resident_bytes();
+    if (memory_budget > 0 || plan != &local_plan)
+    {
+        BmpHeader header;
+        if (input == "-")
+        {
+            error = "The memory plan needs the input's size up front, which standard input cannot provide";
+            return false;
+        }
+        if (!read_bmp_header(input, header))
+        {
+            error = "Failed to open or read the image file: " + input;
+            return false;
+        }
+        if (!plan_memory(header, operations, in_place, tiled, *plan, error))
+            return false;
+        if (memory_budget > 0 && plan->eager_bytes > memory_budget)
+        {
+            double mb = 1024.0 * 1024.0;
+            ostringstream message;
+            message << fixed << setprecision(1) << "Estimated peak memory " << plan->eager_bytes / mb
+                    << " MB exceeds the budget of " << memory_budget / mb << " MB";
+            if (plan->stream_from >= operations.size())
+                message << " and the chain does not end in operations that can be streamed";
+            else if (output == "-" || image_io::output_format(output) != image_io::FORMAT_BMP)
+                message << " and only BMP files can be written in bands";
+            else if (plan->streamed_bytes > memory_budget)
+                message << " (" << plan->streamed_bytes / mb << " MB when streamed)";
+            else
+                plan->streamed = true;
+            if (!plan->streamed)
+            {
+                error = message.str();
+                return false;
+            }
+        }
+    }
+
+    vector<vector<Pixel>> image = load_image(input);
+    if (image.empty())
+    {
+        error = "Failed to open or read the image file: " + input;
+        return false;
+    }
+
+    // A trailing gray conversion goes straight to the single-channel image that gets written
+    size_t count = operations.size();
+    luma::Weighting gray_weighting = luma::LUMA_AVERAGE;
+    bool gray_output = count > 0 && operations[count - 1].name == "gray";
+    if (gray_output && !param_weighting(operations[count - 1], gray_weighting, error))
+        return false;
+
+    size_t last = count - (gray_output ? 1 : 0);
+    size_t whole_end = plan->streamed ? plan->stream_from : last;
+    bool ok = tiled ? apply_operations_tiled(image, operations, 0, whole_end, error)
+                    : apply_operations(image, operations, 0, whole_end, in_place, error);
+    if (ok && plan->streamed)
+        ok = stream_operations(image, operations, whole_end, last, output, gray_output, gray_weighting, error);
+    else if (ok && !image_io::write(output, image, gray_output, gray_weighting))
+    {
+        error = "Failed to write output image: " + output;
+        ok = false;
+    }
+    buffer_pool::release_image(image);
+
+    string encoded;
+    if (ok && cacheable && result_cache::read_file(output, encoded))
+        cache->store(key, encoded);
+    return ok;
+}
+
+/**
+ * Reads the value of a --memory-budget option (in MB).
+ *
+ * @param argc   Argument count from main().
+ * @param argv   Argument values from main().
+ * @param i      Index of the option; advanced past its value.
+ * @param budget Receives the budget in bytes.
+ * @param error  Receives a message describing the problem on failure.
+ * @return True if a positive number of megabytes followed the option.
+ */
+bool parse_memory_budget(int argc, char *argv[], int &i, size_t &budget, string &error)
+{
+    double megabytes = i + 1 < argc ? atof(argv[i + 1]) : 0.0;
+    if (megabytes <= 0.0)
+    {
+        error = "--memory-budget expects a size in MB";
+        return false;
+    }
+    budget = static_cast<size_t>(megabytes * 1024 * 1024);
+    ++i;
+    return true;
+}
+
+/**
+ * Prints the memory estimate of a run next to the peak the process actually reached.
+ *
+ * @param plan   The estimate from process_file().
+ * @param budget The budget in bytes (0 if none was set).
+ */
+void print_memory_report(const MemoryPlan &plan, size_t budget)
+{
+    double mb = 1024.0 * 1024.0;
+    size_t estimate = plan.streamed ? plan.streamed_bytes : plan.eager_bytes;
+    cout << fixed << setprecision(1);
+    cout << "MEMORY PLAN" << endl;
+    cout << "Output size:        " << plan.output_width << "x" << plan.output_height << endl;
+    cout << "Execution:          " << (plan.streamed ? "streamed into the output file" : "whole images") << endl;
+    cout << "Estimated (images): " << plan.eager_bytes / mb << " MB whole";
+    if (plan.streamed_bytes > 0)
+        cout << ", " << plan.streamed_bytes / mb << " MB streamed";
+    cout << endl;
+    if (budget > 0)
+        cout << "Budget:             " << budget / mb << " MB" << endl;
+    cout << "Estimated peak:     " << (plan.baseline_bytes + estimate) / mb << " MB (" << plan.baseline_bytes / mb
+         << " MB before reading)" << endl;
+    cout << "Actual peak:        " << peak_resident_bytes() / mb << " MB" << endl;
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+/**
+ * Parses the command line arguments for a batch run.
+ *
+ * @param argc    Argument count from main().
+ * @param argv    Argument values from main().
+ * @param options Receives the parsed options.
+ * @param error   Receives a message describing the problem on failure.
+ * @return True if the arguments were valid, false otherwise.
+ */
+bool parse_arguments(int argc, char *argv[], BatchOptions &options, string &error)
+{
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        int consumed = result_cache::parse_option(argc, argv, i, options.cache, error);
+        if (consumed < 0)
+            return false;
+        if (consumed > 0)
+            i += consumed - 1;
+        else if (arg == "--copy")
+            options.in_place = false;
+        else if (arg == "--tiled")
+            options.tiled = true;
+        else if (arg == "--memory-budget")
+        {
+            if (!parse_memory_budget(argc, argv, i, options.memory_budget, error))
+                return false;
+        }
+        else if (arg == "--memory-report")
+            options.memory_report = true;
+        else if (arg == "--raw-size")
+        {
+            image_io::Settings &io = image_io::settings();
+            if (i + 1 >= argc || !image_io::parse_size(argv[++i], io.raw_width, io.raw_height))
+            {
+                error = "--raw-size expects <width>x<height>";
+                return false;
+            }
+        }
+        else if (arg == "--output-format")
+        {
+            image_io::Settings &io = image_io::settings();
+            if (i + 1 >= argc || !image_io::parse_format(argv[++i], io.output_format))
+            {
+                error = "--output-format expects bmp, ppm, pgm or raw";
+                return false;
+            }
+            io.has_output_format = true;
+        }
+        else if (arg.size() > 2 && arg.substr(0, 2) == "--")
+        {
+            error = "Unknown option: " + arg;
+            return false;
+        }
+        else
+            positional.push_back(arg);
+    }
+
+    if (positional.size() < 3)
+    {
+        error = "Expected an input file, an output file and at least one operation";
+        return false;
+    }
+    options.input = positional[0];
+    options.output = positional[1];
+    for (size_t i = 2; i < positional.size(); ++i)
+    {
+        Operation op;
+        if (!parse_operation(positional[i], op))
+        {
+            error = "Malformed operation: " + positional[i];
+            return false;
+        }
+        options.operations.push_back(op);
+    }
+    return true;
+}
+
+/**
+ * Entry point for the non-interactive mode.
+ *
+ * @param argc Argument count from main().
+ * @param argv Argument values from main().
+ * @return The process exit code (0 on success).
+ */
+int run(int argc, char *argv[])
+{
+    string first = argv[1];
+    if (first == "--help" || first == "-h")
+    {
+        cli_utils::print_usage();
+        return 0;
+    }
+    if (first == "--stats")
+    {
+        if (argc != 3)
+        {
+            cli_utils::print_usage();
+            return 1;
+        }
+        vector<vector<Pixel>> image = load_image(argv[2]);
+        if (image.empty())
+        {
+            cli_utils::print_error("Failed to open or read the image file: " + string(argv[2]));
+            return 1;
+        }
+        image_stats::print_stats(image_stats::compute_stats(image));
+        return 0;
+    }
+    if (first == "--pyramid")
+    {
+        int levels = argc == 5 ? atoi(argv[4]) : 0;
+        if (levels < 1)
+        {
+            cli_utils::print_usage();
+            return 1;
+        }
+        vector<vector<Pixel>> image = load_image(argv[2]);
+        if (image.empty())
+        {
+            cli_utils::print_error("Failed to open or read the image file: " + string(argv[2]));
+            return 1;
+        }
+        vector<vector<vector<Pixel>>> levels_built = pyramid::build(image, levels);
+        string error;
+        if (!pyramid::write_levels(levels_built, argv[3], error))
+        {
+            cli_utils::print_error(error);
+            return 1;
+        }
+        for (size_t level = 0; level < levels_built.size(); ++level)
+            cli_utils::print_success("output image written: " + pyramid::level_filename(argv[3], level + 1));
+        return 0;
+    }
+
+    BatchOptions options;
+    string error;
+    if (!parse_arguments(argc, argv, options, error))
+    {
+        cli_utils::print_error(error);
+        cli_utils::print_usage();
+        return 1;
+    }
+
+    // With the image going to standard output, every message (including the stats operation's
+    // report) goes to standard error instead
+    streambuf *console = cout.rdbuf();
+    if (options.output == "-")
+        cout.rdbuf(cerr.rdbuf());
+    struct RestoreConsole
+    {
+        streambuf *console;
+        ~RestoreConsole()
+        {
+            cout.rdbuf(console);
+        }
+    } restore{console};
+
+    unique_ptr<result_cache::ResultCache> cache = result_cache::create(options.cache);
+    MemoryPlan plan;
+    bool report = options.memory_report || options.memory_budget > 0;
+    if (!process_file(options.input, options.output, options.operations, options.in_place, error, cache.get(),
+                      options.tiled, options.memory_budget, report ? &plan : nullptr))
+    {
+        cli_utils::print_error(error);
+        return 1;
+    }
+    if (options.output != "-")
+        cli_utils::print_success("output image written: " + options.output);
+    if (report)
+        print_memory_report(plan, options.memory_budget);
+    if (cache)
+        result_cache::print_stats(cache->stats());
+    return 0;
+}
+
+} // namespace batch
+
+/**
+ * @namespace fan_out
+ * @brief Renders several point filters from one decode and one pass over the pixels.
+ *
+ * Previewing every effect of an image used to cost one read_image() and one full pass per
+ * filter. Here the input is decoded once and every source row is read once: each requested
+ * filter writes its own output row while that source row is still in cache. The outputs are
+ * then encoded in parallel, one file per filter.
+ *
+ * Only filters whose result depends on the pixel alone (and, for the vignette, its position)
+ * can share the pass: 1, 2, 3, 7, 8, 9 and 10, the last two without dithering.
+ */
+namespace fan_out
+{
+
+/**
+ * Computes one output row from one source row.
+ */
+typedef function<void(const Pixel *source, Pixel *target, int row, int width)> RowFilter;
+
+/**
+ * Wraps a point-filter kernel (see the kernels namespace) as a row filter.
+ */
+template <typename Kernel> RowFilter row_filter(const Kernel &kernel)
+{
+    return [kernel](const Pixel *source, Pixel *target, int, int width) {
+        for (int col = 0; col < width; ++col)
+            target[col] = kernel(source[col]);
+    };
+}
+
+/**
+ * Builds the row filter for one operation.
+ *
+ * @param op     The operation, e.g. "2:0.3".
+ * @param height Rows in the image (the vignette depends on it).
+ * @param filter Receives the filter.
+ * @param error  Receives a message if the operation cannot share the pass.
+ * @return True if the operation is a supported point filter with valid parameters.
+ */
+bool make_filter(const batch::Operation &op, int height, RowFilter &filter, string &error)
+{
+    double factor = 0.0;
+    luma::Weighting weighting = luma::LUMA_AVERAGE;
+    dither::Mode mode = dither::DITHER_NONE;
+    if (op.has_region)
+    {
+        error = "Operation " + batch::to_string(op) + " cannot be fanned out with a region";
+        return false;
+    }
+    if (op.name == "1")
+    {
+        filter = [height](const Pixel *source, Pixel *target, int row, int width) {
+            image_processing::vignette_row(source, target, row, width, height);
+        };
+        return true;
+    }
+    if (op.name == "2")
+    {
+        if (!batch::param_double(op, 0, 0.0, 1.0, factor, error))
+            return false;
+        filter = row_filter(kernels::ClarendonKernel<90, 170>(factor));
+        return true;
+    }
+    if (op.name == "8" || op.name == "9")
+    {
+        if (!batch::param_double(op, 0, 0.0, 10.0, factor, error))
+            return false;
+        filter = row_filter(op.name == "8" ? image_processing::lighten_kernel(factor)
+                                           : image_processing::darken_kernel(factor));
+        return true;
+    }
+    if (op.name == "3" || op.name == "7")
+    {
+        if (op.name == "3" ? !batch::param_weighting(op, weighting, error)
+                           : !batch::param_quantize(op, &weighting, mode, error))
+            return false;
+        if (mode == dither::DITHER_NONE)
+        {
+            bool gray = op.name == "3";
+            switch (weighting)
+            {
+            case luma::LUMA_REC601:
+                filter = gray ? row_filter(kernels::GrayscaleKernel<luma::LUMA_REC601>())
+                              : row_filter(kernels::HighContrastKernel<luma::LUMA_REC601>());
+                break;
+            case luma::LUMA_REC709:
+                filter = gray ? row_filter(kernels::GrayscaleKernel<luma::LUMA_REC709>())
+                              : row_filter(kernels::HighContrastKernel<luma::LUMA_REC709>());
+                break;
+            default:
+                filter = gray ? row_filter(kernels::GrayscaleKernel<luma::LUMA_AVERAGE>())
+                              : row_filter(kernels::HighContrastKernel<luma::LUMA_AVERAGE>());
+            }
+            return true;
+        }
+    }
+    if (op.name == "10")
+    {
+        if (!batch::param_quantize(op, nullptr, mode, error))
+            return false;
+        if (mode == dither::DITHER_NONE)
+        {
+            filter = row_filter(image_processing::PrimaryColorKernel());
+            return true;
+        }
+    }
+    if (mode != dither::DITHER_NONE)
+        error = "Operation " + batch::to_string(op) + " cannot be fanned out with dithering";
+    else
+        error = "Operation " + batch::to_string(op) + " is not a point filter that can be fanned out "
+                "(use 1, 2, 3, 7, 8, 9 or 10)";
+    return false;
+}
+
+/**
+ * Runs every filter over the image in one pass: the rows are split across threads, and for each
+ * source row every filter writes its output row before the next source row is read.
+ *
+ * @param image   The input image.
+ * @param filters The filters to apply.
+ * @return One output image per filter, drawn from the buffer pool.
+ */
+vector<vector<vector<Pixel>>> render(const vector<vector<Pixel>> &image, const vector<RowFilter> &filters)
+{
+    int height = image.size();
+    if (height == 0)
+        return {};
+    int width = image[0].size();
+    vector<vector<vector<Pixel>>> outputs;
+    for (size_t i = 0; i < filters.size(); ++i)
+        outputs.push_back(buffer_pool::acquire_image(height, width));
+    parallel_utils::parallel_for(0, height, [&](int row_begin, int row_end, int) {
+        for (int row = row_begin; row < row_end; ++row)
+            for (size_t i = 0; i < filters.size(); ++i)
+                filters[i](image[row].data(), outputs[i][row].data(), row, width);
+    });
+    return outputs;
+}
+
+/**
+ * Entry point for "main --fan-out <input.bmp> <output prefix> <op> [<op> ...]", which writes
+ * the result of the n-th operation to "<prefix>_<n>.bmp", numbered like the pyramid levels.
+ *
+ * @param argc Argument count from main().
+ * @param argv Argument values from main().
+ * @return The process exit code (0 on success).
+ */
+int run(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        cli_utils::print_usage();
+        return 1;
+    }
+    vector<batch::Operation> operations;
+    for (int i = 4; i < argc; ++i)
+    {
+        batch::Operation op;
+        if (!batch::parse_operation(argv[i], op))
+        {
+            cli_utils::print_error("Malformed operation: " + string(argv[i]));
+            return 1;
+        }
+        operations.push_back(op);
+    }
+
+    vector<vector<Pixel>> image = batch::load_image(argv[2]);
+    if (image.empty())
+    {
+        cli_utils::print_error("Failed to open or read the image file: " + string(argv[2]));
+        return 1;
+    }
+    string error;
+    vector<RowFilter> filters(operations.size());
+    for (size_t i = 0; i < operations.size(); ++i)
+    {
+        if (!make_filter(operations[i], image.size(), filters[i], error))
+        {
+            cli_utils::print_error(error);
+            return 1;
+        }
+    }
+
+    vector<vector<vector<Pixel>>> outputs = render(image, filters);
+    buffer_pool::release_image(image);
+    bool written = pyramid::write_levels(outputs, argv[3], error);
+    for (size_t i = 0; i < outputs.size(); ++i)
+        buffer_pool::release_image(outputs[i]);
+    if (!written)
+    {
+        cli_utils::print_error(error);
+        return 1;
+    }
+    for (size_t i = 0; i < operations.size(); ++i)
+        cli_utils::print_success("output image written: " + pyramid::level_filename(argv[3], i + 1) + " (" +
+                                 batch::to_string(operations[i]) + ")");
+    return 0;
+}
+
+} // namespace fan_out
+
+/**
+ * @namespace json
+ * @brief A minimal JSON reader and string escaper for the request protocol of the server.
+ *
+ * Only what the protocol needs is supported: objects, arrays, strings (with the standard
+ * escapes), numbers, booleans and null.
+ */
+namespace json
+{
+
+/**
+ * A parsed JSON value.
+ */
+struct Value
+{
+    enum Type
+    {
+        NULL_VALUE,
+        BOOLEAN,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    Type type = NULL_VALUE;
+    bool boolean = false;
+    double number = 0.0;
+    string text;
+    vector<Value> items;
+    map<string, Value> members;
+
+    /**
+     * @return The member with the given key, or nullptr if this is not an object or has no such key.
+     */
+    const Value *find(const string &key) const
+    {
+        map<string, Value>::const_iterator it = members.find(key);
+        return it == members.end() ? nullptr : &it->second;
+    }
+};
+
+/**
+ * Recursive descent parser over a string.
+ */
+class Parser
+{
+  public:
+    explicit Parser(const string &text) : text_(text), pos_(0)
+    {
+    }
+
+    /**
+     * Parses the whole text as a single value.
+     *
+     * @param value Receives the parsed value.
+     * @return True if the text was valid JSON with nothing but whitespace after it.
+     */
+    bool parse(Value &value)
+    {
+        if (!parse_value(value))
+            return false;
+        skip_whitespace();
+        return pos_ == text_.size();
+    }
+
+  private:
+    void skip_whitespace()
+    {
+        while (pos_ < text_.size() && isspace(static_cast<unsigned char>(text_[pos_])))
+            ++pos_;
+    }
+
+    bool consume(char expected)
+    {
+        skip_whitespace();
+        if (pos_ < text_.size() && text_[pos_] == expected)
+        {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_literal(const string &literal)
+    {
+        if (text_.compare(pos_, literal.size(), literal) != 0)
+            return false;
+        pos_ += literal.size();
+        return true;
+    }
+
+    bool parse_string(string &out)
+    {
+        if (!consume('"'))
+            return false;
+        out.clear();
+        while (pos_ < text_.size())
+        {
+            char c = text_[pos_++];
+            if (c == '"')
+                return true;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos_ >= text_.size())
+                return false;
+            char escape = text_[pos_++];
+            switch (escape)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                out += escape;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u': {
+                if (pos_ + 4 > text_.size())
+                    return false;
+                // Exactly four hex digits; stoul alone would also take a sign, "0x" or a shorter number
+                string digits = text_.substr(pos_, 4);
+                for (size_t i = 0; i < digits.size(); ++i)
+                    if (!isxdigit(static_cast<unsigned char>(digits[i])))
+                        return false;
+                size_t used = 0;
+                unsigned code = static_cast<unsigned>(stoul(digits, &used, 16));
+                // A NUL would silently cut file names short when they reach the C file APIs
+                if (used != 4 || code == 0)
+                    return false;
+                pos_ += 4;
+                // Encode the code point as UTF-8 (surrogate pairs are not combined)
+                if (code < 0x80)
+                    out += static_cast<char>(code);
+                else if (code < 0x800)
+                {
+                    out += static_cast<char>(0xC0 | (code >> 6));
+                    out += static_cast<char>(0x80 | (code & 0x3F));
+                }
+                else
+                {
+                    out += static_cast<char>(0xE0 | (code >> 12));
+                    out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                    out += static_cast<char>(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool parse_value(Value &value)
+    {
+        skip_whitespace();
+        if (pos_ >= text_.size())
+            return false;
+        char c = text_[pos_];
+        if (c == '{')
+        {
+            value.type = Value::OBJECT;
+            ++pos_;
+            if (consume('}'))
+                return true;
+            do
+            {
+                string key;
+                Value member;
+                if (!parse_string(key) || !consume(':') || !parse_value(member))
+                    return false;
+                value.members[key] = member;
+            } while (consume(','));
+            return consume('}');
+        }
+        if (c == '[')
+        {
+            value.type = Value::ARRAY;
+            ++pos_;
+            if (consume(']'))
+                return true;
+            do
+            {
+                Value item;
+                if (!parse_value(item))
+                    return false;
+                value.items.push_back(item);
+            } while (consume(','));
+            return consume(']');
+        }
+        if (c == '"')
+        {
+            value.type = Value::STRING;
+            return parse_string(value.text);
+        }
+        if (c == 't' || c == 'f')
+        {
+            value.type = Value::BOOLEAN;
+            value.boolean = c == 't';
+            return parse_literal(c == 't' ? "true" : "false");
+        }
+        if (c == 'n')
+        {
+            value.type = Value::NULL_VALUE;
+            return parse_literal("null");
+        }
+        try
+        {
+            size_t used = 0;
+            value.type = Value::NUMBER;
+            value.number = stod(text_.substr(pos_), &used);
+            pos_ += used;
+            return used > 0;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+
+    const string &text_;
+    size_t pos_;
+};
+
+/**
+ * Quotes and escapes a string for inclusion in a JSON document.
+ *
+ * @param text The raw text.
+ * @return The quoted JSON string.
+ */
+string quote(const string &text)
+{
+    string out = "\"";
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c == '\n')
+            out += "\\n";
+        else if (c == '\t')
+            out += "\\t";
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+            out += static_cast<char>(c);
+    }
+    return out + "\"";
+}
+
+} // namespace json
+
+/**
+ * @namespace server
+ * @brief Long-running processing daemon that accepts requests over a Unix domain socket.
+ *
+ * Starting the binary once and keeping it warm avoids paying process start-up for every image:
+ * the worker threads, the buffer pool and the page cache all stay hot between requests.
+ *
+ * Protocol: clients connect to the socket and send one JSON object per line. Each line gets
+ * exactly one JSON line back, in the order the requests finish. Supported requests:
+ *   {"input": "in.bmp", "ops": ["2:0.3", "3"], "output": "out.bmp"}
+ *       -> {"status": "ok", "output": "out.bmp", "latency_ms": 4.2}
+ *   {"metrics": true}
+ *       -> {"status": "ok", "requests": ..., "queue_depth": ..., "p50_ms": ..., "p99_ms": ...}
+ *   {"shutdown": true}
+ *       -> stops accepting connections once the current requests finish
+ * Operations use the same syntax as the command line batch mode.
+ */
+namespace server
+{
+
+/**
+ * A fixed set of worker threads pulling tasks from a shared queue.
+ */
+class ThreadPool
+{
+  public:
+    /**
+     * Starts the worker threads.
+     *
+     * @param workers The number of threads to start (at least 1).
+     */
+    explicit ThreadPool(unsigned workers) : stopping_(false), max_depth_(0)
+    {
+        for (unsigned i = 0; i < max(1u, workers); ++i)
+            threads_.push_back(thread(&ThreadPool::worker_loop, this));
+    }
+
+    /**
+     * Finishes every queued task, then joins the workers.
+     */
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (size_t i = 0; i < threads_.size(); ++i)
+            threads_[i].join();
+    }
+
+    /**
+     * Queues a task for the next free worker.
+     *
+     * @param task The work to run.
+     */
+    void submit(function<void()> task)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            tasks_.push(task);
+            max_depth_ = max(max_depth_, tasks_.size());
+        }
+        ready_.notify_one();
+    }
+
+    /**
+     * @return The number of tasks waiting for a worker.
+     */
+    size_t queue_depth() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return tasks_.size();
+    }
+
+    /**
+     * @return The largest queue depth seen so far.
+     */
+    size_t max_queue_depth() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return max_depth_;
+    }
+
+    /**
+     * @return The number of worker threads.
+     */
+    size_t size() const
+    {
+        return threads_.size();
+    }
+
+  private:
+    void worker_loop()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(mutex_);
+                while (!stopping_ && tasks_.empty())
+                    ready_.wait(lock);
+                if (tasks_.empty())
+                    return;
+                task = tasks_.front();
+                tasks_.pop();
+            }
+            task();
+        }
+    }
+
+    vector<thread> threads_;
+    queue<function<void()>> tasks_;
+    bool stopping_;
+    size_t max_depth_;
+    mutable mutex mutex_;
+    condition_variable ready_;
+};
+
+/**
+ * Request counters and a window of recent latencies for percentile reporting.
+ */
+class Metrics
+{
+  public:
+    Metrics() : requests_(0), failures_(0), next_(0)
+    {
+    }
+
+    /**
+     * Records a finished request.
+     *
+     * @param latency_ms Time from arrival to response, in milliseconds.
+     * @param ok         Whether the request succeeded.
+     */
+    void record(double latency_ms, bool ok)
+    {
+        lock_guard<mutex> lock(mutex_);
+        ++requests_;
+        if (!ok)
+            ++failures_;
+        if (latencies_.size() < WINDOW)
+            latencies_.push_back(latency_ms);
+        else
+            latencies_[next_] = latency_ms;
+        next_ = (next_ + 1) % WINDOW;
+    }
+
+    /**
+     * Formats the counters as a JSON object.
+     *
+     * @param pool  The worker pool, for the queue depth figures.
+     * @param cache The result cache, if enabled, for the hit rate figures.
+     * @return The metrics response line (without trailing newline).
+     */
+    string to_json(const ThreadPool &pool, const result_cache::ResultCache *cache) const
+    {
+        vector<double> sorted;
+        unsigned long long requests, failures;
+        {
+            lock_guard<mutex> lock(mutex_);
+            sorted = latencies_;
+            requests = requests_;
+            failures = failures_;
+        }
+        sort(sorted.begin(), sorted.end());
+        ostringstream out;
+        out << "{\"status\": \"ok\", \"requests\": " << requests << ", \"failures\": " << failures
+            << ", \"workers\": " << pool.size() << ", \"queue_depth\": " << pool.queue_depth()
+            << ", \"max_queue_depth\": " << pool.max_queue_depth() << ", \"p50_ms\": " << percentile(sorted, 50)
+            << ", \"p99_ms\": " << percentile(sorted, 99) << ", \"pooled_bytes\": " << buffer_pool::global_pool().pooled_bytes()
+            << ", \"allocations_avoided\": " << buffer_pool::global_pool().stats().rows_reused;
+        if (cache)
+        {
+            result_cache::CacheStats stats = cache->stats();
+            out << ", \"cache_memory_hits\": " << stats.memory_hits << ", \"cache_disk_hits\": " << stats.disk_hits
+                << ", \"cache_misses\": " << stats.misses << ", \"cache_hit_rate\": " << stats.hit_rate();
+        }
+        out << "}";
+        return out.str();
+    }
+
+  private:
+    static double percentile(const vector<double> &sorted, double percent)
+    {
+        if (sorted.empty())
+            return 0.0;
+        size_t index = static_cast<size_t>(ceil(percent / 100.0 * sorted.size()));
+        return sorted[min(sorted.size() - 1, index == 0 ? 0 : index - 1)];
+    }
+
+    static const size_t WINDOW = 4096;
+    unsigned long long requests_;
+    unsigned long long failures_;
+    vector<double> latencies_;
+    size_t next_;
+    mutable mutex mutex_;
+};
+
+/**
+ * One client connection. The socket is closed when the last reference goes away, so workers
+ * still answering a request keep it open after the client stops sending.
+ */
+struct Connection
+{
+    explicit Connection(int socket_fd) : fd(socket_fd)
+    {
+    }
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    /**
+     * Sends one response line; concurrent responses on the same connection do not interleave.
+     */
+    void send_line(const string &line)
+    {
+        lock_guard<mutex> lock(write_mutex);
+        string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            ssize_t written = ::send(fd, data.data() + sent, data.size() - sent, SEND_FLAGS);
+            if (written <= 0)
+                return; // Client went away; nothing left to do
+            sent += written;
+        }
+    }
+
+    int fd;
+    string pending; // Bytes received but not yet terminated by a newline
+    mutex write_mutex;
+
+#ifdef MSG_NOSIGNAL
+    static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static const int SEND_FLAGS = 0;
+#endif
+};
+
+/**
+ * Milliseconds elapsed since the given time.
+ */
+double elapsed_ms(chrono::steady_clock::time_point since)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+}
+
+/**
+ * Builds the response for a failed image request and records it in the metrics.
+ */
+string error_response(const string &message, chrono::steady_clock::time_point arrived, Metrics &metrics)
+{
+    metrics.record(elapsed_ms(arrived), false);
+    return "{\"status\": \"error\", \"error\": " + json::quote(message) + "}";
+}
+
+/**
+ * Handles one request line and returns the response line.
+ *
+ * @param line     The JSON request.
+ * @param arrived  When the request was received, for latency measurements.
+ * @param metrics  Counters updated for image requests and reported for metrics requests.
+ * @param pool     The worker pool, for the metrics response.
+ * @param cache    Optional result cache shared by all workers.
+ * @param budget   Memory budget of each request in bytes (0 for none).
+ * @param shutdown Set to true when the client asks the server to stop.
+ * @return The JSON response.
+ */
+string handle_request(const string &line, chrono::steady_clock::time_point arrived, Metrics &metrics,
+                      const ThreadPool &pool, result_cache::ResultCache *cache, size_t budget,
+                      atomic<bool> &shutdown)
+{
+    json::Value request;
+    json::Parser parser(line);
+    bool parsed = false;
+    try
+    {
+        parsed = parser.parse(request);
+    }
+    catch (...)
+    {
+        parsed = false; // e.g. an invalid \u escape
+    }
+    if (!parsed || request.type != json::Value::OBJECT)
+        return error_response("Malformed JSON request", arrived, metrics);
+
+    const json::Value *metrics_flag = request.find("metrics");
+    if (metrics_flag && metrics_flag->boolean)
+        return metrics.to_json(pool, cache);
+    const json::Value *shutdown_flag = request.find("shutdown");
+    if (shutdown_flag && shutdown_flag->boolean)
+    {
+        shutdown = true;
+        return "{\"status\": \"ok\", \"shutdown\": true}";
+    }
+
+    const json::Value *input = request.find("input");
+    const json::Value *output = request.find("output");
+    const json::Value *ops = request.find("ops");
+    if (!input || input->type != json::Value::STRING || !output || output->type != json::Value::STRING || !ops ||
+        ops->type != json::Value::ARRAY)
+        return error_response("Expected string 'input', string 'output' and array 'ops'", arrived, metrics);
+    // "-" means the process's own standard input/output, which belong to the daemon, not the client
+    if (input->text == "-" || output->text == "-")
+        return error_response("'input' and 'output' must be files; \"-\" (standard input/output) is not "
+                              "available to daemon requests",
+                              arrived, metrics);
+
+    vector<batch::Operation> operations;
+    for (size_t i = 0; i < ops->items.size(); ++i)
+    {
+        batch::Operation op;
+        if (ops->items[i].type != json::Value::STRING || !batch::parse_operation(ops->items[i].text, op))
+            return error_response("Malformed operation in 'ops'", arrived, metrics);
+        operations.push_back(op);
+    }
+
+    string error;
+    if (!batch::process_file(input->text, output->text, operations, true, error, cache, false, budget))
+        return error_response(error, arrived, metrics);
+
+    double latency_ms = elapsed_ms(arrived);
+    metrics.record(latency_ms, true);
+    ostringstream response;
+    response << "{\"status\": \"ok\", \"output\": " << json::quote(output->text) << ", \"latency_ms\": " << latency_ms
+             << "}";
+    return response.str();
+}
+
+/**
+ * Creates a listening Unix domain socket at the given path, replacing a stale socket file.
+ *
+ * @param path The socket path.
+ * @param error Receives a message describing the problem on failure.
+ * @return The listening socket, or -1 on failure.
+ */
+int listen_on(const string &path, string &error)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        error = "Socket path is too long: " + path;
+        return -1;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        error = string("socket() failed: ") + strerror(errno);
+        return -1;
+    }
+    unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0)
+    {
+        error = "Could not listen on " + path + ": " + strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Runs the server until a shutdown request arrives.
+ *
+ * @param socket_path Where to create the Unix domain socket.
+ * @param workers     Number of requests processed concurrently.
+ * @param cache       Optional result cache shared by all workers.
+ * @param budget      Memory budget of each request in bytes (0 for none).
+ * @return The process exit code (0 on a clean shutdown).
+ */
+int serve(const string &socket_path, unsigned workers, result_cache::ResultCache *cache, size_t budget)
+{
+    signal(SIGPIPE, SIG_IGN);
+    string error;
+    int listen_fd = listen_on(socket_path, error);
+    if (listen_fd < 0)
+    {
+        cli_utils::print_error(error);
+        return 1;
+    }
+
+    // Share the cores between concurrent requests instead of oversubscribing them
+    parallel_utils::set_thread_count(max(1u, parallel_utils::thread_count() / max(1u, workers)));
+
+    Metrics metrics;
+    atomic<bool> shutdown(false);
+    map<int, shared_ptr<Connection>> connections;
+    {
+        ThreadPool pool(workers);
+        cout << "Listening on " << socket_path << " with " << pool.size() << " workers" << endl;
+
+        while (!shutdown)
+        {
+            vector<pollfd> fds;
+            pollfd listener = {listen_fd, POLLIN, 0};
+            fds.push_back(listener);
+            for (map<int, shared_ptr<Connection>>::iterator it = connections.begin(); it != connections.end(); ++it)
+            {
+                pollfd client = {it->first, POLLIN, 0};
+                fds.push_back(client);
+            }
+
+            // Wake up regularly so a shutdown request is noticed even when no client is sending
+            if (poll(fds.data(), fds.size(), 200) <= 0)
+                continue;
+
+            if (fds[0].revents & POLLIN)
+            {
+                int client_fd = accept(listen_fd, nullptr, nullptr);
+                if (client_fd >= 0)
+                    connections[client_fd] = make_shared<Connection>(client_fd);
+            }
+
+            for (size_t i = 1; i < fds.size(); ++i)
+            {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                shared_ptr<Connection> connection = connections[fds[i].fd];
+                char buffer[4096];
+                ssize_t received = recv(connection->fd, buffer, sizeof(buffer), 0);
+                if (received <= 0)
+                {
+                    connections.erase(fds[i].fd);
+                    continue;
+                }
+                connection->pending.append(buffer, received);
+
+                // Queue every complete line as its own request
+                size_t newline;
+                while ((newline = connection->pending.find('\n')) != string::npos)
+                {
+                    string line = connection->pending.substr(0, newline);
+                    connection->pending.erase(0, newline + 1);
+                    if (line.find_first_not_of(" \t\r") == string::npos)
+                        continue;
+                    chrono::steady_clock::time_point arrived = chrono::steady_clock::now();
+                    ThreadPool *pool_ptr = &pool;
+                    pool.submit([connection, line, arrived, pool_ptr, cache, budget, &metrics, &shutdown]() {
+                        connection->send_line(
+                            handle_request(line, arrived, metrics, *pool_ptr, cache, budget, shutdown));
+                    });
+                }
+            }
+        }
+        // Leaving this scope drains the queue and joins the workers
+    }
+
+    connections.clear();
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    cout << "Server stopped" << endl;
+    return 0;
+}
+
+/**
+ * Entry point for "main --serve <socket> [--workers <n>] [--memory-budget <mb>] [cache options]".
+ *
+ * @param argc Argument count from main().
+ * @param argv Argument values from main().
+ * @return The process exit code.
+ */
+int run(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cli_utils::print_usage();
+        return 1;
+    }
+    unsigned workers = parallel_utils::thread_count();
+    size_t budget = 0;
+    result_cache::CacheOptions cache_options;
+    string error;
+    for (int i = 3; i < argc; ++i)
+    {
+        int consumed = result_cache::parse_option(argc, argv, i, cache_options, error);
+        if (consumed > 0)
+        {
+            i += consumed - 1;
+            continue;
+        }
+        if (consumed == 0 && string(argv[i]) == "--workers" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            workers = atoi(argv[++i]);
+            continue;
+        }
+        if (consumed == 0 && string(argv[i]) == "--memory-budget")
+        {
+            if (batch::parse_memory_budget(argc, argv, i, budget, error))
+                continue;
+            consumed = -1;
+        }
+        cli_utils::print_error(consumed < 0 ? error : "Unknown server option: " + string(argv[i]));
+        return 1;
+    }
+    unique_ptr<result_cache::ResultCache> cache = result_cache::create(cache_options);
+    return serve(argv[2], workers, cache.get(), budget);
+}
+
+/**
+ * Sends a single request line to a running server and prints the response.
+ *
+ * @param socket_path The server's socket path.
+ * @param request     The JSON request to send.
+ * @return The process exit code (0 if the server answered with status ok).
+ */
+int send_request(const string &socket_path, const string &request)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        cli_utils::print_error("Could not connect to " + socket_path + ": " + strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    string data = request + "\n";
+    if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+    {
+        cli_utils::print_error("Could not send the request");
+        close(fd);
+        return 1;
+    }
+
+    string response;
+    char buffer[4096];
+    ssize_t received;
+    while (response.find('\n') == string::npos && (received = read(fd, buffer, sizeof(buffer))) > 0)
+        response.append(buffer, received);
+    close(fd);
+
+    cout << response;
+    return response.find("\"status\": \"ok\"") != string::npos ? 0 : 1;
+}
+
+} // namespace server
+
+/**
+ * @namespace profiler
+ * @brief Hardware performance counters around every step of a batch chain.
+ *
+ * "main --profile" reads the input, applies each operation on its own (the process_N call
+ * behind it, without the run folding of the batch mode) and writes the output. Around each
+ * step it reads cycles, instructions, last-level cache misses and branch misses from
+ * perf_event_open. Instructions per cycle tell a step that waits on memory from one that is
+ * bound by arithmetic, and misses per pixel make steps on differently sized images comparable.
+ *
+ * The counters only count user space and are inherited by the threads parallel_for starts, so a
+ * step's numbers include its workers. When the kernel refuses a counter (perf_event_paranoid,
+ * containers, virtual machines without a PMU) it is reported as unavailable and the steps are
+ * still timed.
+ */
+namespace profiler
+{
+
+enum Counter
+{
+    CYCLES,
+    INSTRUCTIONS,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+const char *const COUNTER_NAMES[COUNTER_COUNT] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+/**
+ * Counter deltas and wall time of one step.
+ */
+struct Sample
+{
+    double values[COUNTER_COUNT];
+    bool valid[COUNTER_COUNT];
+    double ms = 0.0;
+};
+
+/**
+ * The four counters, opened once for the calling thread and the threads it starts afterwards.
+ * They run from construction on; start() and stop() take the difference around a step.
+ */
+class CounterSet
+{
+  public:
+    CounterSet()
+    {
+        const unsigned long long configs[COUNTER_COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                           PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[counter];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[counter] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds_[counter] < 0 && error_.empty())
+                error_ = describe_failure(errno);
+        }
+    }
+
+    ~CounterSet()
+    {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+            if (fds_[counter] >= 0)
+                close(fds_[counter]);
+    }
+
+    CounterSet(const CounterSet &) = delete;
+    CounterSet &operator=(const CounterSet &) = delete;
+
+    /**
+     * @return True if at least one counter could be opened.
+     */
+    bool any_available() const
+    {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+            if (fds_[counter] >= 0)
+                return true;
+        return false;
+    }
+
+    /**
+     * @return Why the first unavailable counter could not be opened (empty if all are open).
+     */
+    const string &error() const
+    {
+        return error_;
+    }
+
+    /**
+     * Records the counters and the clock at the start of a step.
+     */
+    void start()
+    {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+            start_valid_[counter] = read_counter(counter, start_[counter]);
+        started_ = chrono::steady_clock::now();
+    }
+
+    /**
+     * @return What the counters and the clock advanced by since start(). Counts are scaled up
+     *         when the kernel had to share the hardware counters with other events.
+     */
+    Sample stop() const
+    {
+        Sample sample;
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - started_;
+        sample.ms = elapsed.count();
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+        {
+            Reading end;
+            sample.values[counter] = 0.0;
+            sample.valid[counter] = start_valid_[counter] && read_counter(counter, end);
+            if (!sample.valid[counter])
+                continue;
+            double value = static_cast<double>(end.value - start_[counter].value);
+            unsigned long long enabled = end.enabled - start_[counter].enabled;
+            unsigned long long running = end.running - start_[counter].running;
+            if (running > 0 && running < enabled)
+                value *= static_cast<double>(enabled) / running;
+            sample.values[counter] = value;
+        }
+        return sample;
+    }
+
+  private:
+    struct Reading
+    {
+        unsigned long long value;
+        unsigned long long enabled;
+        unsigned long long running;
+    };
+
+    bool read_counter(int counter, Reading &reading) const
+    {
+        unsigned long long data[3];
+        if (fds_[counter] < 0 || read(fds_[counter], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)))
+            return false;
+        reading.value = data[0];
+        reading.enabled = data[1];
+        reading.running = data[2];
+        return true;
+    }
+
+    static string describe_failure(int error_number)
+    {
+        if (error_number == EACCES || error_number == EPERM)
+        {
+            string message = "not permitted";
+            ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+            int level = 0;
+            if (paranoid >> level)
+                message += " (kernel.perf_event_paranoid is " + std::to_string(level) + ")";
+            return message;
+        }
+        if (error_number == ENOENT || error_number == ENODEV || error_number == EOPNOTSUPP || error_number == ENOSYS)
+            return "not supported on this machine";
+        return strerror(error_number);
+    }
+
+    int fds_[COUNTER_COUNT];
+    Reading start_[COUNTER_COUNT];
+    bool start_valid_[COUNTER_COUNT] = {false, false, false, false};
+    chrono::steady_clock::time_point started_;
+    string error_;
+};
+
+/**
+ * One row of the profile: a step and the image size it produced.
+ */
+struct StepProfile
+{
+    string step;
+    long long pixels = 0;
+    Sample sample;
+
+    /**
+     * @return Instructions per cycle, or a negative value if either counter is unavailable.
+     */
+    double ipc() const
+    {
+        if (!sample.valid[CYCLES] || !sample.valid[INSTRUCTIONS] || sample.values[CYCLES] <= 0)
+            return -1.0;
+        return sample.values[INSTRUCTIONS] / sample.values[CYCLES];
+    }
+
+    /**
+     * @return Events of a counter per output pixel, or a negative value if it is unavailable.
+     */
+    double per_pixel(Counter counter) const
+    {
+        if (!sample.valid[counter] || pixels <= 0)
+            return -1.0;
+        return sample.values[counter] / pixels;
+    }
+};
+
+/**
+ * Prints the profile as a table; unavailable values are shown as "-".
+ *
+ * @param steps The profiled steps, in order.
+ * @param error Why counters are unavailable (empty if they all are).
+ */
+void print_table(const vector<StepProfile> &steps, const string &error)
+{
+    cout << left << setw(16) << "Step" << right << setw(10) << "Mpixels" << setw(10) << "ms" << setw(11)
+         << "Mcycles" << setw(11) << "Minstr" << setw(7) << "IPC" << setw(13) << "LLC miss/px" << setw(13)
+         << "Br miss/px" << endl;
+    cout << fixed;
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const StepProfile &step = steps[i];
+        cout << left << setw(16) << step.step << right << setprecision(2) << setw(10) << step.pixels / 1e6
+             << setw(10) << step.sample.ms;
+        for (int counter = CYCLES; counter <= INSTRUCTIONS; ++counter)
+        {
+            if (step.sample.valid[counter])
+                cout << setprecision(1) << setw(11) << step.sample.values[counter] / 1e6;
+            else
+                cout << setw(11) << "-";
+        }
+        if (step.ipc() >= 0)
+            cout << setprecision(2) << setw(7) << step.ipc();
+        else
+            cout << setw(7) << "-";
+        for (int counter = LLC_MISSES; counter <= BRANCH_MISSES; ++counter)
+        {
+            if (step.per_pixel(static_cast<Counter>(counter)) >= 0)
+                cout << setprecision(4) << setw(13) << step.per_pixel(static_cast<Counter>(counter));
+            else
+                cout << setw(13) << "-";
+        }
+        cout << endl;
+    }
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+    if (!error.empty())
+        cout << "Hardware counters unavailable: " << error << endl;
+}
+
+/**
+ * Formats a number for JSON, or null if it is unavailable.
+ */
+string json_number(double value, bool valid)
+{
+    if (!valid)
+        return "null";
+    ostringstream out;
+    out << setprecision(10) << value;
+    return out.str();
+}
+
+/**
+ * Formats the profile as one JSON object; unavailable values are null.
+ *
+ * @param input   The input file.
+ * @param steps   The profiled steps, in order.
+ * @param error   Why counters are unavailable (empty if they all are).
+ * @return The JSON document.
+ */
+string to_json(const string &input, const vector<StepProfile> &steps, const string &error)
+{
+    ostringstream out;
+    out << "{\"input\": " << json::quote(input) << ", \"threads\": " << parallel_utils::thread_count()
+        << ", \"counter_error\": " << (error.empty() ? string("null") : json::quote(error)) << ", \"steps\": [";
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const StepProfile &step = steps[i];
+        out << (i > 0 ? ", " : "") << "{\"step\": " << json::quote(step.step) << ", \"pixels\": " << step.pixels
+            << ", \"ms\": " << json_number(step.sample.ms, true);
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+            out << ", \"" << COUNTER_NAMES[counter]
+                << "\": " << json_number(step.sample.values[counter], step.sample.valid[counter]);
+        out << ", \"ipc\": " << json_number(step.ipc(), step.ipc() >= 0)
+            << ", \"llc_misses_per_pixel\": " << json_number(step.per_pixel(LLC_MISSES), step.per_pixel(LLC_MISSES) >= 0)
+            << ", \"branch_misses_per_pixel\": "
+            << json_number(step.per_pixel(BRANCH_MISSES), step.per_pixel(BRANCH_MISSES) >= 0) << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+/**
+ * Entry point for "main --profile [--copy] [--json <file>] <input.bmp> <output.bmp> <op> ...".
+ * "--json -" prints the JSON to standard output instead of the table.
+ *
+ * @param argc Argument count from main().
+ * @param argv Argument values from main().
+ * @return The process exit code (0 on success).
+ */
+int run(int argc, char *argv[])
+{
+    bool in_place = true;
+    string json_path;
+    vector<string> positional;
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--copy")
+            in_place = false;
+        else if (arg == "--json" && i + 1 < argc)
+            json_path = argv[++i];
+        else if (arg.size() > 2 && arg.substr(0, 2) == "--")
+        {
+            cli_utils::print_error("Unknown profile option: " + arg);
+            return 1;
+        }
+        else
+            positional.push_back(arg);
+    }
+    if (positional.size() < 3)
+    {
+        cli_utils::print_usage();
+        return 1;
+    }
+    if (positional[1] == "-")
+    {
+        cli_utils::print_error("The profile report goes to standard output; give a file for the output image");
+        return 1;
+    }
+    vector<batch::Operation> operations;
+    for (size_t i = 2; i < positional.size(); ++i)
+    {
+        batch::Operation op;
+        if (!batch::parse_operation(positional[i], op))
+        {
+            cli_utils::print_error("Malformed operation: " + positional[i]);
+            return 1;
+        }
+        operations.push_back(op);
+    }
+
+    // A trailing gray conversion is part of writing the output, as in the batch mode
+    size_t count = operations.size();
+    bool gray_output = operations[count - 1].name == "gray";
+    luma::Weighting gray_weighting = luma::LUMA_AVERAGE;
+    string error;
+    if (gray_output && !batch::param_weighting(operations[count - 1], gray_weighting, error))
+    {
+        cli_utils::print_error(error);
+        return 1;
+    }
+
+    CounterSet counters;
+    vector<StepProfile> steps;
+    StepProfile step;
+    step.step = "read";
+    counters.start();
+    vector<vector<Pixel>> image = batch::load_image(positional[0]);
+    step.sample = counters.stop();
+    if (image.empty())
+    {
+        cli_utils::print_error("Failed to open or read the image file: " + positional[0]);
+        return 1;
+    }
+    step.pixels = static_cast<long long>(image.size()) * image[0].size();
+    steps.push_back(step);
+
+    for (size_t i = 0; i < count - (gray_output ? 1 : 0); ++i)
+    {
+        step.step = batch::to_string(operations[i]);
+        counters.start();
+        bool ok = batch::apply_operation(image, operations[i], in_place, error);
+        step.sample = counters.stop();
+        if (!ok)
+        {
+            cli_utils::print_error(error);
+            return 1;
+        }
+        step.pixels = image.empty() ? 0 : static_cast<long long>(image.size()) * image[0].size();
+        steps.push_back(step);
+    }
+
+    step.step = gray_output ? "write gray" : "write";
+    counters.start();
+    bool written = image_io::write(positional[1], image, gray_output, gray_weighting);
+    step.sample = counters.stop();
+    buffer_pool::release_image(image);
+    if (!written)
+    {
+        cli_utils::print_error("Failed to write output image: " + positional[1]);
+        return 1;
+    }
+    steps.push_back(step);
+
+    string json = to_json(positional[0], steps, counters.error());
+    if (json_path == "-")
+    {
+        cout << json << endl;
+        return 0;
+    }
+    print_table(steps, counters.error());
+    if (!json_path.empty() && !result_cache::write_file(json_path, json + "\n"))
+    {
+        cli_utils::print_error("Failed to write " + json_path);
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace profiler
+
+/**
+ * @namespace regression
+ * @brief Golden-output regression and timing checks for the filters.
+ *
+ * Each check runs one operation on a known input and compares the result with a reference
+ * image, allowing a per-filter tolerance: the largest channel difference that still counts as a
+ * match, and the fraction of pixels that may exceed it. Threshold filters (7, 10) flip a few
+ * pixels that sit exactly on a boundary, so they get a small mismatch allowance instead of a
+ * larger channel tolerance.
+ *
+ * Two suites run:
+ *   - the 3x4 test image from docs/Test_Debug.md against the values listed there, and
+ *   - sample_images/sample.bmp against sample_images/process1.bmp - process10.bmp.
+ * The sample suite also times every filter (best of several runs) against a budget in
+ * milliseconds per megapixel. A wrong result fails the run; a correct but slow one is flagged
+ * as SLOW and only fails the run with --fail-slow.
+ */
+namespace regression
+{
+
+/**
+ * Tolerance and time budget for one filter.
+ */
+struct Tolerance
+{
+    int max_channel_diff;    // Largest per-channel difference that still counts as equal
+    double mismatch_percent; // Percent of pixels allowed to exceed max_channel_diff
+    double budget_ms_per_mp; // Time budget per megapixel of input
+};
+
+/**
+ * Outcome of comparing one result with its reference.
+ */
+struct Comparison
+{
+    bool same_size = false;
+    int max_diff = 0;
+    double mismatch_percent = 0.0;
+};
+
+/**
+ * One row of the results table.
+ */
+struct CaseResult
+{
+    string suite;
+    string operation;
+    Comparison comparison;
+    Tolerance tolerance;
+    bool passed = false;
+    bool timed = false;
+    double best_ms = 0.0;
+    double budget_ms = 0.0;
+    bool slow = false;
+};
+
+/**
+ * Options for a self-test run.
+ */
+struct Options
+{
+    string sample_dir = "sample_images";
+    string timings_file; // Optional CSV output
+    int runs = 5;
+    double budget_scale = 1.0;
+    bool fail_slow = false;
+};
+
+/**
+ * @return The tolerance for the given operation name (defaults to an exact match).
+ */
+Tolerance tolerance_for(const string &name)
+{
+    // Budgets are roughly ten times the measured single-threaded time, so only real regressions trip them
+    if (name == "3")
+        return {1, 0.0, 40.0}; // Reference rounds the average differently
+    if (name == "7")
+        return {0, 0.5, 40.0}; // Pixels exactly at the threshold may flip
+    if (name == "10")
+        return {0, 1.5, 40.0}; // Pixels exactly at a color boundary may flip
+    if (name == "1" || name == "6")
+        return {0, 0.0, 150.0};
+    if (name == "4" || name == "5")
+        return {0, 0.0, 80.0};
+    return {0, 0.0, 40.0};
+}
+
+/**
+ * Compares two images pixel by pixel.
+ *
+ * @param actual   The produced image.
+ * @param expected The reference image.
+ * @param max_channel_diff Channel difference above which a pixel counts as a mismatch.
+ * @return The size check, the largest channel difference and the mismatching pixel percentage.
+ */
+Comparison compare(const vector<vector<Pixel>> &actual, const vector<vector<Pixel>> &expected, int max_channel_diff)
+{
+    Comparison result;
+    if (actual.size() != expected.size() || actual.empty() || actual[0].size() != expected[0].size())
+        return result;
+    result.same_size = true;
+
+    size_t mismatches = 0;
+    for (size_t row = 0; row < actual.size(); ++row)
+    {
+        for (size_t col = 0; col < actual[row].size(); ++col)
+        {
+            const Pixel &a = actual[row][col];
+            const Pixel &e = expected[row][col];
+            int diff = max(abs(a.red - e.red), max(abs(a.green - e.green), abs(a.blue - e.blue)));
+            result.max_diff = max(result.max_diff, diff);
+            if (diff > max_channel_diff)
+                ++mismatches;
+        }
+    }
+    result.mismatch_percent = 100.0 * mismatches / (actual.size() * actual[0].size());
+    return result;
+}
+
+/**
+ * @return True if the comparison is within the tolerance.
+ */
+bool within(const Comparison &comparison, const Tolerance &tolerance)
+{
+    return comparison.same_size && comparison.mismatch_percent <= tolerance.mismatch_percent;
+}
+
+/**
+ * Builds an image from a flat list of red, green, blue values, row by row.
+ */
+vector<vector<Pixel>> from_values(int height, int width, const vector<int> &values)
+{
+    vector<vector<Pixel>> image(height, vector<Pixel>(width));
+    for (int row = 0; row < height; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            const int *rgb = &values[(row * width + col) * 3];
+            image[row][col].red = rgb[0];
+            image[row][col].green = rgb[1];
+            image[row][col].blue = rgb[2];
+        }
+    }
+    return image;
+}
+
+/**
+ * @return The 3x4 test image from docs/Test_Debug.md.
+ */
+vector<vector<Pixel>> tiny_image()
+{
+    return from_values(3, 4, {0,   5,   10,  15,  20,  25,  30,  35,  40,  45,  50,  55,
+                              60,  65,  70,  75,  80,  85,  90,  95,  100, 105, 110, 115,
+                              120, 125, 130, 135, 140, 145, 150, 155, 160, 165, 170, 175});
+}
+
+/**
+ * A tiny image check: an operation spec and the expected output from docs/Test_Debug.md.
+ */
+struct TinyCase
+{
+    string spec;
+    int height;
+    int width;
+    vector<int> expected;
+};
+
+/**
+ * @return The expected outputs for the 3x4 test image, as documented in docs/Test_Debug.md.
+ */
+vector<TinyCase> tiny_cases()
+{
+    vector<TinyCase> cases;
+    cases.push_back({"1", 3, 4, {0,  0,  1,  5,  7,  9,  15,  17,  20,  17,  19,  21,
+                                 18, 20, 21, 47, 50, 53, 75,  79,  83,  65,  69,  72,
+                                 37, 39, 40, 84, 87, 90, 125, 129, 133, 103, 106, 109}});
+    cases.push_back({"2:0.3", 3, 4, {0,   1,   3,   4,   6,   7,   9,   10,  12,  13,  15,  16,
+                                     18,  19,  21,  22,  24,  25,  90,  95,  100, 105, 110, 115,
+                                     120, 125, 130, 135, 140, 145, 150, 155, 160, 228, 229, 231}});
+    cases.push_back({"3", 3, 4, {5,   5,   5,   20,  20,  20,  35,  35,  35,  50,  50,  50,
+                                 65,  65,  65,  80,  80,  80,  95,  95,  95,  110, 110, 110,
+                                 125, 125, 125, 140, 140, 140, 155, 155, 155, 170, 170, 170}});
+    cases.push_back({"4", 4, 3, {120, 125, 130, 60,  65,  70,  0,  5,  10,
+                                 135, 140, 145, 75,  80,  85,  15, 20, 25,
+                                 150, 155, 160, 90,  95,  100, 30, 35, 40,
+                                 165, 170, 175, 105, 110, 115, 45, 50, 55}});
+    cases.push_back({"5:2", 3, 4, {165, 170, 175, 150, 155, 160, 135, 140, 145, 120, 125, 130,
+                                   105, 110, 115, 90,  95,  100, 75,  80,  85,  60,  65,  70,
+                                   45,  50,  55,  30,  35,  40,  15,  20,  25,  0,   5,   10}});
+
+    // Enlarge by 2 x 3: every pixel becomes a 2 wide, 3 tall block
+    vector<int> enlarged;
+    vector<vector<Pixel>> tiny = tiny_image();
+    for (int row = 0; row < 9; ++row)
+    {
+        for (int col = 0; col < 8; ++col)
+        {
+            const Pixel &p = tiny[row / 3][col / 2];
+            enlarged.push_back(p.red);
+            enlarged.push_back(p.green);
+            enlarged.push_back(p.blue);
+        }
+    }
+    cases.push_back({"6:2,3", 9, 8, enlarged});
+
+    cases.push_back({"7", 3, 4, {0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,
+                                 0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,
+                                 0, 0, 0, 255, 255, 255, 255, 255, 255, 255, 255, 255}});
+    cases.push_back({"8:0.5", 3, 4, {127, 130, 132, 135, 137, 140, 142, 145, 147, 150, 152, 155,
+                                     157, 160, 162, 165, 167, 170, 172, 175, 177, 180, 182, 185,
+                                     187, 190, 192, 195, 197, 200, 202, 205, 207, 210, 212, 215}});
+    cases.push_back({"9:0.5", 3, 4, {0,  2,  5,  7,  10, 12, 15, 17, 20, 22, 25, 27,
+                                     30, 32, 35, 37, 40, 42, 45, 47, 50, 52, 55, 57,
+                                     60, 62, 65, 67, 70, 72, 75, 77, 80, 82, 85, 87}});
+    cases.push_back({"10", 3, 4, {0, 0, 0,   0, 0, 0,   0, 0, 0,   0, 0, 0,
+                                  0, 0, 255, 0, 0, 255, 0, 0, 255, 0, 0, 255,
+                                  0, 0, 255, 0, 0, 255, 0, 0, 255, 0, 0, 255}});
+    return cases;
+}
+
+/**
+ * @return The operation specs checked against sample_images/process<N>.bmp, with the
+ *         parameters the reference images were generated with.
+ */
+vector<string> sample_specs()
+{
+    return {"1", "2:0.3", "3", "4", "5:2", "6:2,3", "7", "8:0.5", "9:0.5", "10"};
+}
+
+/**
+ * Runs one operation on a copy of the input, both out of place and (where supported) in
+ * place, and compares each result with the reference.
+ *
+ * A point filter whose in-place variant disagrees with its copying variant fails even if
+ * one of them matches the reference.
+ *
+ * @param input    The input image (not modified).
+ * @param expected The reference output.
+ * @param op       The operation to run.
+ * @param result   Receives the comparison and pass/fail outcome.
+ * @param error    Receives a message if the operation itself failed.
+ * @return True if the operation ran, false otherwise.
+ */
+bool check(const vector<vector<Pixel>> &input, const vector<vector<Pixel>> &expected, const batch::Operation &op,
+           CaseResult &result, string &error)
+{
+    result.operation = batch::to_string(op);
+    result.tolerance = tolerance_for(op.name);
+
+    vector<vector<Pixel>> copied = input;
+    if (!batch::apply_operation(copied, op, false, error))
+        return false;
+    result.comparison = compare(copied, expected, result.tolerance.max_channel_diff);
+    result.passed = within(result.comparison, result.tolerance);
+
+    if (batch::is_point_operation(op))
+    {
+        vector<vector<Pixel>> in_place = input;
+        if (!batch::apply_operation(in_place, op, true, error))
+            return false;
+        Comparison agreement = compare(in_place, copied, 0);
+        result.passed = result.passed && agreement.same_size && agreement.max_diff == 0;
+        buffer_pool::release_image(in_place);
+    }
+    buffer_pool::release_image(copied);
+    return true;
+}
+
+/**
+ * Runs a kernel over a packed copy of the input (rows padded to 4 bytes, as in a BMP) and
+ * compares the unpacked result with the Pixel driver, so both paths stay interchangeable.
+ *
+ * @param input  The source image.
+ * @param kernel The kernel to run.
+ * @param label  The name shown in the results table.
+ * @return The outcome; it passes only if every channel matches.
+ */
+template <typename Format, typename Kernel>
+CaseResult check_packed(const vector<vector<Pixel>> &input, const Kernel &kernel, const string &label)
+{
+    CaseResult result;
+    result.suite = "packed";
+    result.operation = label;
+    result.tolerance = Tolerance{0, 0.0, 0.0};
+    int height = input.size();
+    int width = height > 0 ? input[0].size() : 0;
+    size_t stride = (width * Format::BYTES_PER_PIXEL + 3) / 4 * 4;
+    vector<unsigned char> packed(stride * height, 0);
+    for (int row = 0; row < height; ++row)
+        for (int col = 0; col < width; ++col)
+            Format::store(&packed[row * stride + col * Format::BYTES_PER_PIXEL], input[row][col]);
+
+    kernels::map_packed<Format>(packed.data(), width, height, stride, kernel);
+    vector<vector<Pixel>> unpacked(height, vector<Pixel>(width));
+    for (int row = 0; row < height; ++row)
+        for (int col = 0; col < width; ++col)
+            unpacked[row][col] = Format::load(&packed[row * stride + col * Format::BYTES_PER_PIXEL]);
+
+    vector<vector<Pixel>> expected = kernels::map(input, kernel);
+    result.comparison = compare(unpacked, expected, 0);
+    result.passed = within(result.comparison, result.tolerance);
+    buffer_pool::release_image(expected);
+    return result;
+}
+
+typedef void (*ToPlanes)(const Pixel *, int, float *, float *, float *);
+typedef void (*FromPlanes)(const float *, const float *, const float *, int, Pixel *);
+
+/**
+ * Converts every 8-bit RGB value into a color space and back (one row of 256 blue values per
+ * red and green pair) and compares the result with the original.
+ *
+ * @param forward  Converts a row of pixels to the three planes of the color space.
+ * @param backward Converts the planes back to pixels.
+ * @param label    The name shown in the results table.
+ * @return The outcome; it passes only if every value comes back exactly.
+ */
+CaseResult check_round_trip(ToPlanes forward, FromPlanes backward, const string &label)
+{
+    CaseResult result;
+    result.suite = "color";
+    result.operation = label;
+    result.tolerance = Tolerance{0, 0.0, 0.0};
+
+    int chunks = parallel_utils::chunk_count(256, 1);
+    vector<int> max_diff(chunks, 0);
+    vector<unsigned long long> mismatches(chunks, 0);
+    parallel_utils::parallel_for(
+        0, 256,
+        [&](int red_begin, int red_end, int chunk) {
+            Pixel source[256], target[256];
+            float first[256], second[256], third[256];
+            for (int red = red_begin; red < red_end; ++red)
+                for (int green = 0; green < 256; ++green)
+                {
+                    for (int blue = 0; blue < 256; ++blue)
+                        source[blue] = Pixel{red, green, blue};
+                    forward(source, 256, first, second, third);
+                    backward(first, second, third, 256, target);
+                    for (int blue = 0; blue < 256; ++blue)
+                    {
+                        int diff = max(abs(target[blue].red - red),
+                                       max(abs(target[blue].green - green), abs(target[blue].blue - blue)));
+                        max_diff[chunk] = max(max_diff[chunk], diff);
+                        mismatches[chunk] += diff > 0;
+                    }
+                }
+        },
+        1);
+
+    unsigned long long total = 0;
+    result.comparison.same_size = true;
+    for (int chunk = 0; chunk < chunks; ++chunk)
+    {
+        result.comparison.max_diff = max(result.comparison.max_diff, max_diff[chunk]);
+        total += mismatches[chunk];
+    }
+    result.comparison.mismatch_percent = 100.0 * total / (256.0 * 256.0 * 256.0);
+    result.passed = within(result.comparison, result.tolerance);
+    return result;
+}
+
+/**
+ * Times an operation on the input, keeping the best of several runs so scheduler noise does
+ * not cause false alarms.
+ *
+ * @return The fastest run in milliseconds.
+ */
+double time_operation(const vector<vector<Pixel>> &input, const batch::Operation &op, int runs)
+{
+    bool in_place = batch::is_point_operation(op);
+    double best = numeric_limits<double>::max();
+    string error;
+    for (int run = 0; run < runs; ++run)
+    {
+        vector<vector<Pixel>> image = input;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        batch::apply_operation(image, op, in_place, error);
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+        buffer_pool::release_image(image);
+    }
+    return best;
+}
+
+/**
+ * Prints the results table.
+ */
+void print_results(const vector<CaseResult> &results)
+{
+    cout << left << setw(8) << "Suite" << setw(10) << "Op" << right << setw(10) << "Max diff" << setw(12)
+         << "Mismatch %" << setw(11) << "Allowed %" << setw(11) << "Best ms" << setw(11) << "Budget ms" << "  Result"
+         << endl;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const CaseResult &r = results[i];
+        cout << left << setw(8) << r.suite << setw(10) << r.operation << right << fixed << setprecision(3);
+        if (r.comparison.same_size)
+            cout << setw(10) << r.comparison.max_diff << setw(12) << r.comparison.mismatch_percent;
+        else
+            cout << setw(10) << "size" << setw(12) << "-";
+        cout << setw(11) << r.tolerance.mismatch_percent;
+        if (r.timed)
+            cout << setw(11) << r.best_ms << setw(11) << r.budget_ms;
+        else
+            cout << setw(11) << "-" << setw(11) << "-";
+        cout << "  " << (r.passed ? (r.slow ? "SLOW" : "PASS") : "FAIL") << endl;
+    }
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+}
+
+/**
+ * Writes the results as CSV so timings can be tracked across runs.
+ *
+ * @return True if the file was written, false otherwise.
+ */
+bool write_timings(const string &filename, const vector<CaseResult> &results)
+{
+    ofstream file(filename);
+    if (!file)
+        return false;
+    file << "suite,operation,max_diff,mismatch_percent,allowed_percent,best_ms,budget_ms,passed,slow\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const CaseResult &r = results[i];
+        file << r.suite << ",\"" << r.operation << "\"," << r.comparison.max_diff << "," << r.comparison.mismatch_percent
+             << "," << r.tolerance.mismatch_percent << "," << r.best_ms << "," << r.budget_ms << ","
+             << (r.passed ? 1 : 0) << "," << (r.slow ? 1 : 0) << "\n";
+    }
+    return bool(file);
+}
+
+/**
+ * Runs both suites.
+ *
+ * @param options The self-test options.
+ * @return The process exit code: 0 if everything passed, 1 otherwise.
+ */
+int run_suites(const Options &options)
+{
+    vector<CaseResult> results;
+    bool ok = true;
+    string error;
+
+    // Tiny image from the debugging notes
+    vector<vector<Pixel>> tiny = tiny_image();
+    vector<TinyCase> cases = tiny_cases();
+    for (size_t i = 0; i < cases.size(); ++i)
+    {
+        batch::Operation op;
+        batch::parse_operation(cases[i].spec, op);
+        CaseResult result;
+        result.suite = "tiny";
+        if (!check(tiny, from_values(cases[i].height, cases[i].width, cases[i].expected), op, result, error))
+            cli_utils::print_error(error);
+        // The documented values leave no room for boundary flips
+        result.tolerance.mismatch_percent = 0.0;
+        result.passed = result.passed && result.comparison.mismatch_percent == 0.0;
+        ok = ok && result.passed;
+        results.push_back(result);
+    }
+
+    // Channels outside 0..255 are clamped before the table lookups of the 2 and 10 kernels, so
+    // they stay in bounds and act like the nearest valid value (pixels Clarendon leaves alone
+    // pass through as they are, hence the clamped comparison)
+    vector<vector<Pixel>> out_of_range = from_values(1, 4, {300, 300, 300, -20, -5, -1, 400, -50, 100, 256, 0, 0});
+    auto clamp_pixels = [](vector<vector<Pixel>> &image) {
+        for (size_t col = 0; col < image[0].size(); ++col)
+            image[0][col] = Pixel{kernels::clamp_index(image[0][col].red), kernels::clamp_index(image[0][col].green),
+                                  kernels::clamp_index(image[0][col].blue)};
+    };
+    vector<vector<Pixel>> clamped = out_of_range;
+    clamp_pixels(clamped);
+    for (int filter = 0; filter < 2; ++filter)
+    {
+        vector<vector<Pixel>> actual = filter == 0 ? image_processing::process_2(out_of_range, 0.5)
+                                                   : image_processing::process_10(out_of_range);
+        clamp_pixels(actual);
+        vector<vector<Pixel>> expected = filter == 0 ? image_processing::process_2(clamped, 0.5)
+                                                     : image_processing::process_10(clamped);
+        CaseResult range_result;
+        range_result.suite = "tiny";
+        range_result.operation = filter == 0 ? "2:0.5 range" : "10 range";
+        range_result.tolerance = Tolerance{0, 0.0, 0.0};
+        range_result.comparison = compare(actual, expected, 0);
+        range_result.passed = within(range_result.comparison, range_result.tolerance);
+        ok = ok && range_result.passed;
+        results.push_back(range_result);
+        buffer_pool::release_image(actual);
+        buffer_pool::release_image(expected);
+    }
 
-    for (int row = 0; row < height; ++row)
+    // A folded chain of exact geometric operations must match running them one at a time
+    const char *chain_specs[] = {"6:2,3", "4", "5:3", "6:1,2"};
+    vector<batch::Operation> chain(4);
+    for (size_t i = 0; i < chain.size(); ++i)
+        batch::parse_operation(chain_specs[i], chain[i]);
+    vector<vector<Pixel>> folded = tiny, sequential = tiny;
+    CaseResult fold_result;
+    fold_result.suite = "fold";
+    fold_result.operation = "4-6 chain";
+    fold_result.tolerance = Tolerance{0, 0.0, 0.0};
+    bool folded_ok = batch::apply_operations(folded, chain, 0, chain.size(), false, error);
+    for (size_t i = 0; folded_ok && i < chain.size(); ++i)
+        folded_ok = batch::apply_operation(sequential, chain[i], false, error);
+    if (!folded_ok)
+        cli_utils::print_error(error);
+    fold_result.comparison = compare(folded, sequential, 0);
+    fold_result.passed = folded_ok && within(fold_result.comparison, fold_result.tolerance);
+    ok = ok && fold_result.passed;
+    results.push_back(fold_result);
+
+    // The shear rotation only turns right angles, so it must match the bilinear path exactly
+    for (int degrees = 90; degrees < 360; degrees += 90)
     {
-        for (int col = 0; col < width; ++col)
+        vector<vector<Pixel>> sheared = image_processing::process_11(tiny, degrees, geometry::ROTATE_SHEAR);
+        vector<vector<Pixel>> bilinear = image_processing::process_11(tiny, degrees);
+        CaseResult shear_result;
+        shear_result.suite = "shear";
+        shear_result.operation = "11:" + to_string(degrees) + ",shear";
+        shear_result.tolerance = Tolerance{0, 0.0, 0.0};
+        shear_result.comparison = compare(sheared, bilinear, 0);
+        shear_result.passed = within(shear_result.comparison, shear_result.tolerance);
+        ok = ok && shear_result.passed;
+        results.push_back(shear_result);
+        buffer_pool::release_image(sheared);
+        buffer_pool::release_image(bilinear);
+    }
+
+    // Reference images
+    string dir = options.sample_dir;
+    vector<vector<Pixel>> sample = read_image(dir + "/sample.bmp");
+    if (sample.empty())
+    {
+        cli_utils::print_error("Failed to open or read the image file: " + dir + "/sample.bmp");
+        ok = false;
+    }
+    else
+    {
+        double megapixels = sample.size() * sample[0].size() / 1e6;
+        vector<string> specs = sample_specs();
+        for (size_t i = 0; i < specs.size(); ++i)
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
+            batch::Operation op;
+            batch::parse_operation(specs[i], op);
+            CaseResult result;
+            result.suite = "sample";
+            string reference = dir + "/process" + op.name + ".bmp";
+            vector<vector<Pixel>> expected = read_image(reference);
+            if (expected.empty())
+                cli_utils::print_error("Failed to open or read the image file: " + reference);
+            else if (!check(sample, expected, op, result, error))
+                cli_utils::print_error(error);
+            else
+            {
+                result.timed = true;
+                result.best_ms = time_operation(sample, op, options.runs);
+                result.budget_ms = result.tolerance.budget_ms_per_mp * megapixels * options.budget_scale;
+                result.slow = result.best_ms > result.budget_ms;
+            }
+            ok = ok && result.passed && !(options.fail_slow && result.slow);
+            results.push_back(result);
+        }
 
-            // Lighten: use formula 255 - (255 - value) * scaling_factor
-            int newred = static_cast<int>(255 - (255 - red_value) * scaling_factor);
-            int newgreen = static_cast<int>(255 - (255 - green_value) * scaling_factor);
-            int newblue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
+        // The same kernels over packed 8-bit layouts
+        results.push_back(check_packed<kernels::Bgr8>(sample, kernels::ClarendonKernel<90, 170>(0.5), "2/bgr8"));
+        results.push_back(check_packed<kernels::Bgra8>(sample, kernels::GrayscaleKernel<luma::LUMA_REC709>(), "3/bgra8"));
+        results.push_back(check_packed<kernels::Rgb8>(sample, image_processing::PrimaryColorKernel(), "10/rgb8"));
 
-            // Clamp values to [0, 255]
-            newred = max(0, min(255, newred));
-            newgreen = max(0, min(255, newgreen));
-            newblue = max(0, min(255, newblue));
+        // The color space conversions must give back every 8-bit RGB value unchanged
+        results.push_back(check_round_trip(color::rgb_to_hsl_row, color::hsl_to_rgb_row, "hsl"));
+        results.push_back(check_round_trip(color::rgb_to_ycbcr_row, color::ycbcr_to_rgb_row, "ycbcr"));
+        results.push_back(check_round_trip(color::rgb_to_hsv_row, color::hsv_to_rgb_row, "hsv"));
+        for (size_t i = results.size() - 6; i < results.size(); ++i)
+            ok = ok && results[i].passed;
 
-            new_image[row][col] = Pixel{newred, newgreen, newblue};
-        }
+        // Lazy tile evaluation must reproduce the eager chain exactly
+        // (18 and a large-sigma 15 use running sums, whose rounding must not depend on the tile)
+        const char *tiled_specs[] = {"2:0.3", "15:1.5", "20:30", "11:30", "17", "12", "6:2,2", "18:40", "15:12", "3"};
+        vector<batch::Operation> tiled_chain(10);
+        for (size_t i = 0; i < tiled_chain.size(); ++i)
+            batch::parse_operation(tiled_specs[i], tiled_chain[i]);
+        vector<vector<Pixel>> eager = sample, tiled = sample;
+        CaseResult tiled_result;
+        tiled_result.suite = "tiled";
+        tiled_result.operation = "10-op chain";
+        tiled_result.tolerance = Tolerance{0, 0.0, 0.0};
+        bool tiled_ok = batch::apply_operations(eager, tiled_chain, 0, tiled_chain.size(), true, error) &&
+                        batch::apply_operations_tiled(tiled, tiled_chain, 0, tiled_chain.size(), error);
+        if (!tiled_ok)
+            cli_utils::print_error(error);
+        tiled_result.comparison = compare(tiled, eager, 0);
+        tiled_result.passed = tiled_ok && within(tiled_result.comparison, tiled_result.tolerance);
+        ok = ok && tiled_result.passed;
+        results.push_back(tiled_result);
+        buffer_pool::release_image(eager);
+        buffer_pool::release_image(tiled);
+
+        // The threaded BMP codec must write the same bytes as write_image() and read them back
+        string reference_file = "/tmp/tillman_self_test_" + to_string(getpid()) + "_reference.bmp";
+        string threaded_file = "/tmp/tillman_self_test_" + to_string(getpid()) + "_threaded.bmp";
+        string reference_bytes, threaded_bytes;
+        bool codec_ok = write_image(reference_file, sample) && bmp_io::write(threaded_file, sample) &&
+                        result_cache::read_file(reference_file, reference_bytes) &&
+                        result_cache::read_file(threaded_file, threaded_bytes) && reference_bytes == threaded_bytes;
+        vector<vector<Pixel>> decoded = bmp_io::read(threaded_file);
+        unlink(reference_file.c_str());
+        unlink(threaded_file.c_str());
+        CaseResult codec_result;
+        codec_result.suite = "bmp_io";
+        codec_result.operation = "write/read";
+        codec_result.tolerance = Tolerance{0, 0.0, 0.0};
+        codec_result.comparison = compare(decoded, sample, 0);
+        codec_result.passed = codec_ok && within(codec_result.comparison, codec_result.tolerance);
+        ok = ok && codec_result.passed;
+        results.push_back(codec_result);
+        buffer_pool::release_image(decoded);
+
+        // PPM output must read back exactly, through the memory-mapped decoder
+        string ppm_file = "/tmp/tillman_self_test_" + to_string(getpid()) + ".ppm";
+        string ppm_error;
+        bool ppm_ok = image_io::write(ppm_file, sample);
+        vector<vector<Pixel>> ppm = image_io::read(ppm_file, ppm_error);
+        unlink(ppm_file.c_str());
+        CaseResult ppm_result;
+        ppm_result.suite = "netpbm";
+        ppm_result.operation = "write/read";
+        ppm_result.tolerance = Tolerance{0, 0.0, 0.0};
+        ppm_result.comparison = compare(ppm, sample, 0);
+        ppm_result.passed = ppm_ok && within(ppm_result.comparison, ppm_result.tolerance);
+        ok = ok && ppm_result.passed;
+        results.push_back(ppm_result);
+        buffer_pool::release_image(ppm);
+
+        // An edit confined to one corner may only add the tiles it touched, and undo must restore exactly
+        history::History edits;
+        edits.record(sample, "original");
+        size_t original_bytes = edits.stored_bytes();
+        vector<vector<Pixel>> edited = sample;
+        for (size_t row = 0; row < min<size_t>(edited.size(), 100); ++row)
+            for (size_t col = 0; col < min<size_t>(edited[row].size(), 100); ++col)
+                edited[row][col] = Pixel{255 - edited[row][col].red, 255 - edited[row][col].green,
+                                         255 - edited[row][col].blue};
+        edits.record(edited, "corner");
+        size_t corner_tiles = (100 + history::TILE_SIZE - 1) / history::TILE_SIZE;
+        bool history_ok = edits.stored_bytes() <= original_bytes + corner_tiles * corner_tiles *
+                                                                       history::TILE_SIZE * history::TILE_SIZE * 3;
+        history_ok = history_ok && edits.undo() && !edits.undo() && edits.redo() && !edits.redo() && edits.undo();
+        vector<vector<Pixel>> restored = edits.restore();
+        CaseResult history_result;
+        history_result.suite = "history";
+        history_result.operation = "undo";
+        history_result.tolerance = Tolerance{0, 0.0, 0.0};
+        history_result.comparison = compare(restored, sample, 0);
+        history_result.passed = history_ok && within(history_result.comparison, history_result.tolerance);
+        ok = ok && history_result.passed;
+        results.push_back(history_result);
+        buffer_pool::release_image(restored);
+
+        // The metrics must see no difference between equal images and agree with compare() otherwise
+        metrics::Report same_report, edited_report;
+        string metrics_error;
+        bool metrics_ok = metrics::compare(sample, sample, metrics::DEFAULT_SSIM_RADIUS, same_report, metrics_error) &&
+                          metrics::compare(edited, sample, metrics::DEFAULT_SSIM_RADIUS, edited_report, metrics_error);
+        // The row shows the edited comparison; the edit is meant to differ, so any mismatch is allowed
+        CaseResult metrics_result;
+        metrics_result.suite = "metrics";
+        metrics_result.operation = "compare";
+        metrics_result.tolerance = Tolerance{0, 100.0, 0.0};
+        metrics_result.comparison = compare(edited, sample, 0);
+        double differing_percent =
+            100.0 * edited_report.differing_pixels / (static_cast<double>(edited_report.width) * edited_report.height);
+        metrics_result.passed = metrics_ok && within(metrics_result.comparison, metrics_result.tolerance) &&
+                                std::isinf(same_report.psnr) && same_report.ssim == 1.0 &&
+                                edited_report.max_diff == metrics_result.comparison.max_diff &&
+                                fabs(differing_percent - metrics_result.comparison.mismatch_percent) < 1e-9 &&
+                                edited_report.ssim < 1.0 && edited_report.psnr > 0.0;
+        ok = ok && metrics_result.passed;
+        results.push_back(metrics_result);
     }
-    return new_image;
+
+    print_results(results);
+    if (!options.timings_file.empty() && !write_timings(options.timings_file, results))
+    {
+        cli_utils::print_error("Failed to write timings file: " + options.timings_file);
+        ok = false;
+    }
+    if (ok)
+        cli_utils::print_success("ran all regression checks");
+    else
+        cli_utils::print_error("regression checks failed");
+    return ok ? 0 : 1;
 }
 
 /**
- * Darkens the input image by a given scaling factor.
- *
- * For each pixel, this function reduces the brightness by multiplying each color channel
- * (red, green, blue) by the provided scaling_factor.
- * The scaling_factor should be >= 0, where:
- *   - Values < 1.0 result in a darker image (values approach 0)
- *   - Values closer to 1.0 result in less darkening (values stay closer to original)
- *   - Value = 1.0 keeps the original brightness
+ * Entry point for --self-test.
  *
- * The formula for each new color channel is:
- *   new_value = original_value * scaling_factor
- *
- * This operation uniformly decreases the intensity of all color channels when factor < 1,
- * producing a darker image.
- *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param scaling_factor Value >= 0 that controls how much to darken each pixel.
- * @return A new image as a 2D vector of Pixels darkened by the scaling factor.
+ * @param argc Argument count from main().
+ * @param argv Argument values from main().
+ * @return The process exit code (0 if every check passed).
  */
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
+int run(int argc, char *argv[])
 {
-    // process_9: Darken by a scaling factor
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
-
-    for (int row = 0; row < height; ++row)
+    Options options;
+    for (int i = 2; i < argc; ++i)
     {
-        for (int col = 0; col < width; ++col)
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--samples" && has_value)
+            options.sample_dir = argv[++i];
+        else if (arg == "--timings" && has_value)
+            options.timings_file = argv[++i];
+        else if (arg == "--runs" && has_value && atoi(argv[i + 1]) > 0)
+            options.runs = atoi(argv[++i]);
+        else if (arg == "--budget-scale" && has_value && atof(argv[i + 1]) > 0.0)
+            options.budget_scale = atof(argv[++i]);
+        else if (arg == "--fail-slow")
+            options.fail_slow = true;
+        else
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-
-            // Darken: multiply by scaling_factor
-            int newred = static_cast<int>(red_value * scaling_factor);
-            int newgreen = static_cast<int>(green_value * scaling_factor);
-            int newblue = static_cast<int>(blue_value * scaling_factor);
-
-            // Clamp values to [0, 255]
-            newred = max(0, min(255, newred));
-            newgreen = max(0, min(255, newgreen));
-            newblue = max(0, min(255, newblue));
-
-            new_image[row][col] = Pixel{newred, newgreen, newblue};
+            cli_utils::print_error("Invalid self-test option: " + arg);
+            cli_utils::print_usage();
+            return 1;
         }
     }
-    return new_image;
+    return run_suites(options);
 }
 
 /**
- * Applies a filter that reduces each pixel's color to one of five options: pure red, pure green,
- * pure blue, white, or black.
- *
- * For each pixel:
- *   - If the sum of RGB channels is >= 550, the pixel is set to white (255,255,255).
- *   - If the sum of RGB channels is <= 150, the pixel is set to black (0,0,0).
- *   - Otherwise, the pixel is set to the primary color channel (red, green, or blue) with the
- *     highest value, as follows:
- *       - If red is the highest, the pixel becomes pure red (255,0,0).
- *       - If green is the highest, the pixel becomes pure green (0,255,0).
- *       - Otherwise, the pixel becomes pure blue (0,0,255).
- *
- * This creates a posterized, high-contrast effect that simplifies the original image into
- * a small set of bold color regions.
+ * Test pattern for the rotation benchmark: a sum of sinusoids (wavelengths of 6.5 to 17 pixels in
+ * several directions) that can be evaluated exactly anywhere, so a rotated image can be
+ * compared with the true rotation instead of with another resampler.
  *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @return A new image as a 2D vector of Pixels with the filter applied.
+ * @param x Column in pixel-index coordinates (may be fractional).
+ * @param y Row in pixel-index coordinates.
+ * @param channel 0 (red), 1 (green) or 2 (blue).
  */
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image)
+double rotation_pattern(double x, double y, int channel)
 {
-    // process_10: Filter to limited color channels: Red, Blue, Green, White, Black
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+    const double two_pi = 2 * M_PI;
+    if (channel == 0)
+        return 128 + 100 * sin(two_pi * (x / 11 + y / 17));
+    if (channel == 1)
+        return 128 + 100 * sin(two_pi * (0.13 * x - 0.07 * y));
+    return 128 + 60 * sin(two_pi * x / 6.5) + 40 * cos(two_pi * y / 8);
+}
 
-    for (int row = 0; row < height; ++row)
+/**
+ * Measures how closely a rotated pattern matches the exact rotation.
+ *
+ * @param rotated The pattern rotated by process_11.
+ * @param width   Width of the pattern before rotating.
+ * @param height  Height of the pattern before rotating.
+ * @param degrees The angle it was rotated by.
+ * @return The peak signal-to-noise ratio in dB over the output pixels that map at least two
+ *         pixels inside the pattern (edges are treated differently by design, so they are left out).
+ */
+double rotation_psnr(const vector<vector<Pixel>> &rotated, int width, int height, int degrees)
+{
+    geometry::Transform transform = geometry::identity(width, height);
+    geometry::rotate_degrees(transform, degrees);
+    const geometry::Affine &m = transform.inverse;
+    double squared = 0.0;
+    size_t count = 0;
+    for (int row = 0; row < transform.height; ++row)
     {
-        for (int col = 0; col < width; ++col)
+        for (int col = 0; col < transform.width; ++col)
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-            int sum = red_value + green_value + blue_value;
-            int max_color = max({red_value, green_value, blue_value});
-
-            int newred = 0, newgreen = 0, newblue = 0;
-
-            if (sum >= 550)
-            { // White
-                newred = 255;
-                newgreen = 255;
-                newblue = 255;
-            }
-            else if (sum <= 150)
-            { // Black
-                newred = 0;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if (max_color == red_value)
-            { // Red
-                newred = 255;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if (max_color == green_value)
-            { // Green
-                newred = 0;
-                newgreen = 255;
-                newblue = 0;
-            }
-            else
-            { // Blue
-                newred = 0;
-                newgreen = 0;
-                newblue = 255;
+            double x = m.xx * (col + 0.5) + m.xy * (row + 0.5) + m.x0 - 0.5;
+            double y = m.yx * (col + 0.5) + m.yy * (row + 0.5) + m.y0 - 0.5;
+            if (x < 2 || y < 2 || x > width - 3 || y > height - 3)
+                continue;
+            const Pixel &p = rotated[row][col];
+            int values[3] = {p.red, p.green, p.blue};
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                double diff = values[channel] - rotation_pattern(x, y, channel);
+                squared += diff * diff;
             }
-
-            new_image[row][col] = Pixel{newred, newgreen, newblue};
+            count += 3;
         }
     }
-    return new_image;
+    return count == 0 ? 0.0 : 10 * log10(255.0 * 255.0 * count / max(squared, 1e-12));
 }
 
 /**
- * Rotates the input image by an arbitrary angle (1-359 degrees) clockwise.
- *
- * This function rotates the image around its center by the specified angle.
- * The output image will have dimensions large enough to contain the entire
- * rotated image (bounding box). Pixels in the output image that don't map
- * to valid source pixels are set to black (0,0,0).
+ * Entry point for --rotation-benchmark: times both process_11 resampling methods on square test
+ * patterns of several sizes and angles (best of several runs) and reports each one's accuracy
+ * against the exact rotation.
  *
- * The rotation uses bilinear interpolation to determine pixel values when
- * the inverse rotation maps to non-integer coordinates in the source image.
- *
- * @param image The input image as a 2D vector of Pixels (row-major order).
- * @param degrees The angle in degrees (1-359) to rotate clockwise.
- * @return A new image as a 2D vector of Pixels, rotated by the specified angle.
+ * @param argc Argument count from main().
+ * @param argv Argument values from main(): [--runs <n>] [<size> ...].
+ * @return The process exit code.
  */
-vector<vector<Pixel>> process_11(const vector<vector<Pixel>> &image, int degrees)
+int run_rotation_benchmark(int argc, char *argv[])
 {
-    int height = image.size();
-    if (height == 0)
-        return {};
-    int width = image[0].size();
-
-    // Convert degrees to radians (clockwise rotation, so use negative)
-    double angle_rad = -degrees * M_PI / 180.0;
-    double cos_angle = cos(angle_rad);
-    double sin_angle = sin(angle_rad);
-
-    // Calculate the center of the original image
-    double center_x = width / 2.0;
-    double center_y = height / 2.0;
-
-    // Calculate bounding box dimensions for rotated image
-    // Corners of the original image
-    double corners[4][2] = {
-        {0 - center_x, 0 - center_y},          // top-left
-        {width - center_x, 0 - center_y},      // top-right
-        {width - center_x, height - center_y}, // bottom-right
-        {0 - center_x, height - center_y}      // bottom-left
-    };
-
-    // Rotate corners and find min/max
-    double min_x = 0, max_x = 0, min_y = 0, max_y = 0;
-    for (int i = 0; i < 4; i++)
-    {
-        double x = corners[i][0];
-        double y = corners[i][1];
-        double rot_x = x * cos_angle - y * sin_angle;
-        double rot_y = x * sin_angle + y * cos_angle;
-        if (i == 0 || rot_x < min_x)
-            min_x = rot_x;
-        if (i == 0 || rot_x > max_x)
-            max_x = rot_x;
-        if (i == 0 || rot_y < min_y)
-            min_y = rot_y;
-        if (i == 0 || rot_y > max_y)
-            max_y = rot_y;
-    }
-
-    // Calculate new image dimensions
-    // Add 1 to ensure we have enough pixels to cover the entire rotated image
-    int new_width = static_cast<int>(ceil(max_x - min_x)) + 1;
-    int new_height = static_cast<int>(ceil(max_y - min_y)) + 1;
-    double new_center_x = new_width / 2.0;
-    double new_center_y = new_height / 2.0;
-
-    // Create output image
-    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
-
-    // Inverse rotation matrix (to map output pixels back to input)
-    // For clockwise rotation by θ, inverse is counterclockwise by θ
-    double inv_cos = cos(-angle_rad);
-    double inv_sin = sin(-angle_rad);
-
-    // For each pixel in the output image
-    for (int row = 0; row < new_height; ++row)
+    int runs = 3;
+    vector<int> sizes;
+    for (int i = 2; i < argc; ++i)
     {
-        for (int col = 0; col < new_width; ++col)
+        string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            runs = atoi(argv[++i]);
+        else if (atoi(arg.c_str()) >= 16 && atoi(arg.c_str()) <= 16384)
+            sizes.push_back(atoi(arg.c_str()));
+        else
         {
-            // Convert to coordinates relative to new center
-            double x = col - new_center_x;
-            double y = row - new_center_y;
-
-            // Apply inverse rotation to get coordinates in original image
-            double orig_x = x * inv_cos - y * inv_sin + center_x;
-            double orig_y = x * inv_sin + y * inv_cos + center_y;
+            cli_utils::print_error("Invalid rotation benchmark option: " + arg);
+            cli_utils::print_usage();
+            return 1;
+        }
+    }
+    if (sizes.empty())
+        sizes = {512, 1024, 2048};
+    const int angles[] = {3, 30, 45, 60, 137, 250};
+    const geometry::RotationMethod methods[] = {geometry::ROTATE_BILINEAR, geometry::ROTATE_SHEAR};
 
-            // Bilinear interpolation
-            int x0 = static_cast<int>(floor(orig_x));
-            int y0 = static_cast<int>(floor(orig_y));
-            int x1 = x0 + 1;
-            int y1 = y0 + 1;
+    cout << right << setw(7) << "Size" << setw(7) << "Angle" << setw(14) << "Bilinear ms" << setw(11) << "Shear ms"
+         << setw(9) << "Speedup" << setw(14) << "Bilinear dB" << setw(10) << "Shear dB" << endl;
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        int size = sizes[s];
+        vector<vector<Pixel>> pattern = buffer_pool::acquire_image(size, size);
+        for (int row = 0; row < size; ++row)
+            for (int col = 0; col < size; ++col)
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    int value = static_cast<int>(round(rotation_pattern(col, row, channel)));
+                    int &target = channel == 0 ? pattern[row][col].red
+                                               : (channel == 1 ? pattern[row][col].green : pattern[row][col].blue);
+                    target = max(0, min(255, value));
+                }
 
-            // Check bounds
-            if (x0 < 0 || y0 < 0 || x1 >= width || y1 >= height)
+        for (size_t a = 0; a < sizeof(angles) / sizeof(angles[0]); ++a)
+        {
+            double best_ms[2], psnr[2];
+            for (int method = 0; method < 2; ++method)
             {
-                // Out of bounds - set to black
-                new_image[row][col] = Pixel{0, 0, 0};
-                continue;
+                best_ms[method] = numeric_limits<double>::max();
+                for (int run = 0; run < runs; ++run)
+                {
+                    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                    vector<vector<Pixel>> rotated = image_processing::process_11(pattern, angles[a], methods[method]);
+                    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+                    best_ms[method] = min(best_ms[method], elapsed.count());
+                    if (run == 0)
+                        psnr[method] = rotation_psnr(rotated, size, size, angles[a]);
+                    buffer_pool::release_image(rotated);
+                }
             }
-
-            // Calculate interpolation weights
-            double dx = orig_x - x0;
-            double dy = orig_y - y0;
-
-            // Get pixel values at four corners
-            Pixel p00 = image[y0][x0];
-            Pixel p10 = image[y0][x1];
-            Pixel p01 = image[y1][x0];
-            Pixel p11 = image[y1][x1];
-
-            // Bilinear interpolation for each color channel
-            double red =
-                (1 - dx) * (1 - dy) * p00.red + dx * (1 - dy) * p10.red + (1 - dx) * dy * p01.red + dx * dy * p11.red;
-
-            double green = (1 - dx) * (1 - dy) * p00.green + dx * (1 - dy) * p10.green + (1 - dx) * dy * p01.green +
-                           dx * dy * p11.green;
-
-            double blue = (1 - dx) * (1 - dy) * p00.blue + dx * (1 - dy) * p10.blue + (1 - dx) * dy * p01.blue +
-                          dx * dy * p11.blue;
-
-            // Round and clamp values
-            int new_red = max(0, min(255, static_cast<int>(round(red))));
-            int new_green = max(0, min(255, static_cast<int>(round(green))));
-            int new_blue = max(0, min(255, static_cast<int>(round(blue))));
-
-            new_image[row][col] = Pixel{new_red, new_green, new_blue};
+            cout << setw(7) << size << setw(7) << angles[a] << fixed << setprecision(1) << setw(14) << best_ms[0]
+                 << setw(11) << best_ms[1] << setprecision(2) << setw(8) << best_ms[0] / best_ms[1] << "x"
+                 << setw(14) << psnr[0] << setw(10) << psnr[1] << endl;
+            cout.unsetf(ios::fixed);
         }
+        buffer_pool::release_image(pattern);
     }
-
-    return new_image;
+    cout << setprecision(6);
+    return 0;
 }
 
-} // namespace image_processing
+} // namespace regression
 
 //***************************************************************************************************//
 //                                MAIN FUNCTION                                                      //
 //***************************************************************************************************//
 
-int main()
+int main(int argc, char *argv[])
 {
+    // Any command line arguments switch to one of the non-interactive modes
+    if (argc > 1)
+    {
+        string mode = argv[1];
+        if (mode == "--serve")
+        {
+            return server::run(argc, argv);
+        }
+        if (mode == "--self-test")
+        {
+            return regression::run(argc, argv);
+        }
+        if (mode == "--rotation-benchmark")
+        {
+            return regression::run_rotation_benchmark(argc, argv);
+        }
+        if (mode == "--fan-out")
+        {
+            return fan_out::run(argc, argv);
+        }
+        if (mode == "--profile")
+        {
+            return profiler::run(argc, argv);
+        }
+        if (mode == "--compare")
+        {
+            return metrics::run(argc, argv);
+        }
+        if (mode == "--request" && argc == 4)
+        {
+            return server::send_request(argv[2], argv[3]);
+        }
+        return batch::run(argc, argv);
+    }
+
     string current_filename = "";
+    history::History edits;
+
+    // The image the next step works on: the current version, or the file itself before the first step
+    auto working_image = [&]() -> vector<vector<Pixel>> {
+        if (!edits.empty())
+            return edits.restore();
+        vector<vector<Pixel>> image = batch::load_image(current_filename);
+        if (!image.empty())
+            edits.record(image, "original " + current_filename);
+        return image;
+    };
+
     bool running = true;
     while (running)
     {
@@ -1159,6 +11089,75 @@ int main()
             break;
         }
 
+        // Handle image statistics (accepts lowercase and uppercase S)
+        if (selection == "S" || selection == "s")
+        {
+            if (current_filename.empty())
+            {
+                cli_utils::print_error("No input image selected. Please select an image first.");
+            }
+            else
+            {
+                auto image = working_image();
+                if (image.empty())
+                    cli_utils::print_error("Failed to open or read the image file: " + current_filename);
+                else
+                    image_stats::print_stats(image_stats::compute_stats(image));
+                buffer_pool::release_image(image);
+            }
+            cli_utils::wait_for_user();
+            continue;
+        }
+
+        // Handle undo and redo (accepts lowercase and uppercase U and R)
+        if (selection == "U" || selection == "u" || selection == "R" || selection == "r")
+        {
+            bool undo = selection == "U" || selection == "u";
+            if (undo ? edits.undo() : edits.redo())
+                cli_utils::print_success(string(undo ? "undid" : "redid") + " a step, now at: " + edits.current().label);
+            else
+                cli_utils::print_error(undo ? "Nothing to undo." : "Nothing to redo.");
+            cli_utils::wait_for_user();
+            continue;
+        }
+
+        // Handle the edit history listing (accepts lowercase and uppercase H)
+        if (selection == "H" || selection == "h")
+        {
+            edits.print();
+            cli_utils::wait_for_user();
+            continue;
+        }
+
+        // Handle writing the current version (accepts lowercase and uppercase W)
+        if (selection == "W" || selection == "w")
+        {
+            if (edits.empty())
+            {
+                cli_utils::print_error("No edits yet. Apply a processing option first.");
+            }
+            else
+            {
+                auto image = edits.restore();
+                string out_filename = cli_utils::prompt_filename("Enter output filename for the current version: ");
+                if (!out_filename.empty() && image_io::write(out_filename, image))
+                    cli_utils::print_success("output image written: " + out_filename);
+                else
+                    cli_utils::print_error("Failed to write output image: " + out_filename);
+                buffer_pool::release_image(image);
+            }
+            cli_utils::wait_for_user();
+            continue;
+        }
+
+        // Handle buffer pool statistics (accepts lowercase and uppercase P)
+        if (selection == "P" || selection == "p")
+        {
+            buffer_pool::print_stats();
+            cli_utils::wait_for_user();
+            continue;
+        }
+
         // Handle Menu Selection and Actions
         try
         {
@@ -1178,11 +11177,12 @@ int main()
                     filename += ".bmp";
                 }
                 current_filename = filename;
+                edits.clear();
                 cli_utils::print_success("changed input image");
             }
 
-            // Handle 1-11 (image processing and output)
-            else if (sel_num >= 1 && sel_num <= 11)
+            // Handle 1-24 (image processing and output)
+            else if (sel_num >= 1 && sel_num <= 24)
             {
                 if (current_filename.empty())
                 {
@@ -1190,7 +11190,7 @@ int main()
                 }
                 else
                 {
-                    auto image = read_image(current_filename);
+                    auto image = working_image();
                     if (image.empty())
                     {
                         cli_utils::print_error("Failed to open or read the image file: " + current_filename);
@@ -1199,6 +11199,8 @@ int main()
                     }
                     else
                     {
+                        // The working copy is not needed afterwards, so the point filters
+                        // (2, 3, 7, 8, 9, 10, 12, 13, 14, 19-22) overwrite it and hand it over as the result
                         vector<vector<Pixel>> result;
                         switch (sel_num)
                         {
@@ -1210,13 +11212,22 @@ int main()
                             // Clarendon; ask for scaling factor
                             double scaling_factor = cli_utils::prompt_double(
                                 "Enter a scaling factor (0.0 - 1.0) for Clarendon: ", 0.0, 1.0);
-                            result = image_processing::process_2(image, scaling_factor);
+                            image_processing::process_2_in_place(image, scaling_factor);
+                            result.swap(image);
                             break;
                         }
-                        case 3:
-                            // Grayscale; no extra input
-                            result = image_processing::process_3(image);
+                        case 3: {
+                            // Grayscale; prompt for the channel weighting
+                            int weighting = 0;
+                            while (weighting < luma::LUMA_AVERAGE || weighting > luma::LUMA_REC709)
+                            {
+                                weighting = cli_utils::prompt_int(
+                                    "Enter luma weighting (1 = average, 2 = Rec.601, 3 = Rec.709): ");
+                            }
+                            image_processing::process_3_in_place(image, static_cast<luma::Weighting>(weighting));
+                            result.swap(image);
                             break;
+                        }
                         case 4:
                             // Rotate 90 degrees clockwise; no extra input
                             result = image_processing::process_4(image);
@@ -1235,28 +11246,53 @@ int main()
                             result = image_processing::process_6(image, x_scale, y_scale);
                             break;
                         }
-                        case 7:
-                            // High contrast (black and white)
-                            result = image_processing::process_7(image);
+                        case 7: {
+                            // High contrast (black and white); prompt for the channel weighting
+                            int weighting = 0;
+                            while (weighting < luma::LUMA_AVERAGE || weighting > luma::LUMA_REC709)
+                            {
+                                weighting = cli_utils::prompt_int(
+                                    "Enter luma weighting (1 = average, 2 = Rec.601, 3 = Rec.709): ");
+                            }
+                            int mode = -1;
+                            while (mode < dither::DITHER_NONE || mode > dither::DITHER_FLOYD_STEINBERG)
+                            {
+                                mode = cli_utils::prompt_int(
+                                    "Enter dithering (0 = none, 1 = Bayer, 2 = Floyd-Steinberg): ");
+                            }
+                            image_processing::process_7_in_place(image, 128, static_cast<luma::Weighting>(weighting),
+                                                                 static_cast<dither::Mode>(mode));
+                            result.swap(image);
                             break;
+                        }
                         case 8: {
                             // Lighten; prompt for scaling factor
                             double scaling_factor =
                                 cli_utils::prompt_double("Enter a scaling factor (>= 0.0) for lightening: ", 0.0, 10.0);
-                            result = image_processing::process_8(image, scaling_factor);
+                            image_processing::process_8_in_place(image, scaling_factor);
+                            result.swap(image);
                             break;
                         }
                         case 9: {
                             // Darken; prompt for scaling factor
                             double scaling_factor =
                                 cli_utils::prompt_double("Enter a scaling factor (>= 0.0) for darkening: ", 0.0, 10.0);
-                            result = image_processing::process_9(image, scaling_factor);
+                            image_processing::process_9_in_place(image, scaling_factor);
+                            result.swap(image);
                             break;
                         }
-                        case 10:
-                            // Primary channel/posterize (red/green/blue/white/black)
-                            result = image_processing::process_10(image);
+                        case 10: {
+                            // Primary channel/posterize (red/green/blue/white/black); prompt for dithering
+                            int mode = -1;
+                            while (mode < dither::DITHER_NONE || mode > dither::DITHER_FLOYD_STEINBERG)
+                            {
+                                mode = cli_utils::prompt_int(
+                                    "Enter dithering (0 = none, 1 = Bayer, 2 = Floyd-Steinberg): ");
+                            }
+                            image_processing::process_10_in_place(image, static_cast<dither::Mode>(mode));
+                            result.swap(image);
                             break;
+                        }
                         case 11: {
                             // Rotate by arbitrary angle (1-359 degrees)
                             int degrees;
@@ -1272,7 +11308,167 @@ int main()
                                     cli_utils::print_error("Angle must be between 1 and 359 degrees.");
                                 }
                             }
-                            result = image_processing::process_11(image, degrees);
+                            int method = 0;
+                            while (method < geometry::ROTATE_BILINEAR || method > geometry::ROTATE_SHEAR)
+                            {
+                                method = cli_utils::prompt_int(
+                                    "Enter resampling method (1 = bilinear, 2 = three-shear): ");
+                            }
+                            result = image_processing::process_11(image, degrees,
+                                                                  static_cast<geometry::RotationMethod>(method));
+                            break;
+                        }
+                        case 12:
+                            // Auto levels; no extra input
+                            image_processing::process_12_in_place(image);
+                            result.swap(image);
+                            break;
+                        case 13: {
+                            // High contrast with a threshold picked from the image statistics
+                            int method = 0;
+                            while (method != image_processing::THRESHOLD_MEAN &&
+                                   method != image_processing::THRESHOLD_OTSU)
+                            {
+                                method = cli_utils::prompt_int("Enter threshold method (1 = mean, 2 = Otsu): ");
+                            }
+                            image_processing::process_13_in_place(
+                                image, static_cast<image_processing::ThresholdMethod>(method));
+                            result.swap(image);
+                            break;
+                        }
+                        case 14: {
+                            // High contrast against the local mean; prompt for window and offset
+                            int radius = 0;
+                            while (radius < 1)
+                            {
+                                radius = cli_utils::prompt_int("Enter window radius in pixels (>= 1): ");
+                            }
+                            int offset = cli_utils::prompt_int("Enter offset subtracted from the local mean: ");
+                            image_processing::process_14_in_place(image, radius, offset);
+                            result.swap(image);
+                            break;
+                        }
+                        case 15: {
+                            // Gaussian blur; prompt for strength
+                            double sigma = cli_utils::prompt_double("Enter blur sigma in pixels (0.1 - 500): ", 0.1, 500.0);
+                            result = image_processing::process_15(image, sigma);
+                            break;
+                        }
+                        case 16: {
+                            // Unsharp mask; prompt for radius and strength
+                            double sigma = cli_utils::prompt_double("Enter detail sigma in pixels (0.1 - 500): ", 0.1, 500.0);
+                            double amount = cli_utils::prompt_double("Enter sharpening amount (0.0 - 10.0): ", 0.0, 10.0);
+                            result = image_processing::process_16(image, sigma, amount);
+                            break;
+                        }
+                        case 17:
+                            // Sobel edges; no extra input
+                            result = image_processing::process_17(image);
+                            break;
+                        case 18: {
+                            // Box blur; prompt for radius
+                            int radius = 0;
+                            while (radius < 1)
+                            {
+                                radius = cli_utils::prompt_int("Enter blur radius in pixels (>= 1): ");
+                            }
+                            result = image_processing::process_18(image, radius);
+                            break;
+                        }
+                        case 19: {
+                            // Saturation; prompt for the multiplier
+                            double factor = cli_utils::prompt_double(
+                                "Enter saturation factor (0.0 = gray, 1.0 = unchanged, up to 10.0): ", 0.0, 10.0);
+                            image_processing::process_19_in_place(image, factor);
+                            result.swap(image);
+                            break;
+                        }
+                        case 20: {
+                            // Hue rotation; prompt for the angle
+                            double degrees =
+                                cli_utils::prompt_double("Enter hue rotation in degrees (-360 - 360): ", -360.0, 360.0);
+                            image_processing::process_20_in_place(image, degrees);
+                            result.swap(image);
+                            break;
+                        }
+                        case 21: {
+                            // Exposure; prompt for the number of stops
+                            double stops =
+                                cli_utils::prompt_double("Enter exposure change in stops (-10 - 10): ", -10.0, 10.0);
+                            image_processing::process_21_in_place(image, stops);
+                            result.swap(image);
+                            break;
+                        }
+                        case 22: {
+                            // Blend; prompt for the layer, mode, opacity and placement
+                            blend::Layer layer;
+                            string layer_filename = cli_utils::prompt_filename("Enter the layer BMP filename: ");
+                            if (!blend::load_layer(layer_filename, layer))
+                            {
+                                cli_utils::print_error("Failed to open or read the image file: " + layer_filename);
+                                break;
+                            }
+                            int blend_mode = 0;
+                            while (blend_mode < blend::BLEND_NORMAL || blend_mode > blend::BLEND_OVERLAY)
+                            {
+                                blend_mode = cli_utils::prompt_int(
+                                    "Enter blend mode (1 = normal, 2 = multiply, 3 = screen, 4 = overlay): ");
+                            }
+                            double opacity = cli_utils::prompt_double("Enter opacity (0.0 - 1.0): ", 0.0, 1.0);
+                            int x = cli_utils::prompt_int("Enter the column for the layer's left edge: ");
+                            int y = cli_utils::prompt_int("Enter the row for the layer's top edge: ");
+                            image_processing::process_22_in_place(image, layer, static_cast<blend::Mode>(blend_mode),
+                                                                  opacity, x, y);
+                            buffer_pool::release_image(layer.pixels);
+                            result.swap(image);
+                            break;
+                        }
+                        case 23: {
+                            // Pyramid; every level is written here, so no single result is left to save
+                            int levels = 0;
+                            while (levels < 1 || levels > 30)
+                            {
+                                levels = cli_utils::prompt_int("Enter number of levels (1 - 30): ");
+                            }
+                            vector<vector<vector<Pixel>>> levels_built = pyramid::build(image, levels);
+                            string prefix = cli_utils::prompt_filename("Enter output filename prefix for the levels: ");
+                            string error;
+                            if (pyramid::write_levels(levels_built, prefix, error))
+                                cli_utils::print_success("wrote " + std::to_string(levels_built.size()) +
+                                                         " levels: " + pyramid::level_filename(prefix, 1) + " ...");
+                            else
+                                cli_utils::print_error(error);
+                            for (size_t level = 0; level < levels_built.size(); ++level)
+                                buffer_pool::release_image(levels_built[level]);
+                            break;
+                        }
+                        case 24: {
+                            // Compare; analysis only, so nothing is recorded or saved
+                            string reference_filename =
+                                cli_utils::prompt_filename("Enter the reference image filename: ");
+                            string error;
+                            vector<vector<Pixel>> reference = image_io::read(reference_filename, error);
+                            metrics::Report report;
+                            if (reference.empty() ||
+                                !metrics::compare(image, reference, metrics::DEFAULT_SSIM_RADIUS, report, error))
+                            {
+                                cli_utils::print_error(error);
+                                buffer_pool::release_image(reference);
+                                break;
+                            }
+                            metrics::print_report(report);
+                            string heatmap_filename = cli_utils::prompt_filename(
+                                "Enter output filename for the difference heatmap (blank to skip): ");
+                            if (!heatmap_filename.empty())
+                            {
+                                vector<vector<Pixel>> heatmap = metrics::heatmap(image, reference, report.max_diff);
+                                if (image_io::write(heatmap_filename, heatmap))
+                                    cli_utils::print_success("wrote the heatmap: " + heatmap_filename);
+                                else
+                                    cli_utils::print_error("Failed to write output image: " + heatmap_filename);
+                                buffer_pool::release_image(heatmap);
+                            }
+                            buffer_pool::release_image(reference);
                             break;
                         }
                         default:
@@ -1280,28 +11476,40 @@ int main()
                             break;
                         }
 
-                        // Save the processed image if a result was generated
+                        // Record the result as a new version, then save it if the user names a file
                         if (!result.empty())
                         {
-                            string out_filename =
-                                cli_utils::prompt_filename("Enter output filename for the processed BMP image: ");
-                            // Ensure the filename ends with .bmp (case-insensitive)
-                            if (out_filename.length() < 4 ||
-                                !(out_filename.size() >= 4 &&
-                                  ((out_filename.substr(out_filename.size() - 4) == ".bmp") ||
-                                   (out_filename.substr(out_filename.size() - 4) == ".BMP"))))
-                            {
-                                out_filename += ".bmp";
-                            }
-                            if (write_image(out_filename, result))
+                            edits.record(result, "operation " + std::to_string(sel_num));
+                            string out_filename = cli_utils::prompt_filename(
+                                "Enter output filename for the processed BMP image (blank to skip): ");
+                            if (out_filename.empty())
                             {
-                                cli_utils::print_success("output image written: " + out_filename);
+                                cli_utils::print_success("recorded the step without saving it");
                             }
                             else
                             {
-                                cli_utils::print_error("Failed to write output image: " + out_filename);
+                                // Ensure the filename ends with .bmp (case-insensitive)
+                                if (out_filename.length() < 4 ||
+                                    !(out_filename.size() >= 4 &&
+                                      ((out_filename.substr(out_filename.size() - 4) == ".bmp") ||
+                                       (out_filename.substr(out_filename.size() - 4) == ".BMP"))))
+                                {
+                                    out_filename += ".bmp";
+                                }
+                                if (bmp_io::write(out_filename, result))
+                                {
+                                    cli_utils::print_success("output image written: " + out_filename);
+                                }
+                                else
+                                {
+                                    cli_utils::print_error("Failed to write output image: " + out_filename);
+                                }
                             }
                         }
+
+                        // Recycle both buffers so the next operation can draw its output from the pool
+                        buffer_pool::release_image(result);
+                        buffer_pool::release_image(image);
                     }
                 }
             }